@@ -0,0 +1,150 @@
+/*
+#### Heap allocations per proxied request
+- Global operator new is replaced by a counting one; the counters live in a
+  shared mapping and only the forked proxy counts, so the client and the stub
+  agent in this process don't show up
+- One keep-alive client sends --requests requests one after the other, after a
+  warm-up (pools, buffers and thread-locals already in place); the report is
+  the proxy's allocations and allocated bytes per request
+- handler: the data handler builds a small response; integrated: set_tunnel(),
+  a stub agent echoes every request. The proxy's stdout (request logging) is
+  discarded but still counted
+
+  ./bench/alloc_count [--mode handler|integrated] [--requests 20000] [--port 3940]
+                      [--agent-port 9940]
+*/
+#include "../conn/proxy.hpp"
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::vector<std::string> modes = {"handler", "integrated"};
+  long requests = 20000;
+  int port = 3940;
+  int agent_port = 9940;
+};
+
+struct Counters {
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> bytes{0};
+};
+
+static Counters* counters = nullptr; // shared with the proxy child
+static bool counting = false;        // set in the child only
+
+// Every replaceable form is defined here so that each delete frees what the
+// matching new returned: array and aligned allocations count too
+static void* allocate(size_t size, size_t alignment = 0) {
+  if (counting) {
+    counters->allocations.fetch_add(1, std::memory_order_relaxed);
+    counters->bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  if (size == 0) size = 1;
+  void* p = alignment ? aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate(size, (size_t)alignment); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { free(p); }
+
+static pid_t start_proxy(const std::string& mode, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  counting = true;
+  ApiProxy proxy({options.port});
+  if (mode == "integrated") {
+    WebSocketServer tunnel(options.agent_port, 0);
+    proxy.set_tunnel(tunnel);
+    proxy.run();
+    _exit(0);
+  }
+  proxy.set_data_handler([](const std::string&, int) -> http_pck {
+    http_pck response(200);
+    response.set_content("Content-Type", "text/plain");
+    response.add_header("Cache-Control", "no-store");
+    response.set_body("ok");
+    return response;
+  });
+  proxy.run();
+  _exit(0);
+}
+
+static void run_mode(const std::string& mode, const Options& options) {
+  pid_t pid = start_proxy(mode, options);
+  std::atomic<bool> stop_agent{false};
+  std::thread agent;
+  if (mode == "integrated") agent = std::thread([&]() { stub_agent(options.agent_port, stop_agent); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300)); // proxy up, agent upgraded
+
+  const std::string request = "GET /bench HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n";
+  int fd = connect_to(options.port);
+  std::string buffer;
+  long failed = 0;
+  auto run = [&](long count) {
+    for (long i = 0; i < count && fd >= 0; ++i) {
+      if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 || read_response(fd, buffer) != 200) ++failed;
+    }
+  };
+  run(1000); // warm-up
+  uint64_t allocations = counters->allocations.load(), bytes = counters->bytes.load();
+  run(options.requests);
+  allocations = counters->allocations.load() - allocations;
+  bytes = counters->bytes.load() - bytes;
+  if (fd >= 0) close(fd);
+
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  stop_agent = true;
+  if (agent.joinable()) agent.join();
+
+  printf("%-10s requests=%-7ld allocs/req=%-6.2f bytes/req=%-8.0f failed=%ld\n", mode.c_str(), options.requests,
+    (double)allocations / options.requests, (double)bytes / options.requests, failed + (fd < 0 ? 1 : 0));
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--mode") options.modes = {argv[i + 1]};
+    else if (flag == "--requests") options.requests = std::max(1L, std::stol(argv[i + 1]));
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-port") options.agent_port = std::stoi(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  void* shared = mmap(nullptr, sizeof(Counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) return 1;
+  counters = new (shared) Counters();
+  for (const auto& mode : options.modes) run_mode(mode, options);
+  return 0;
+}
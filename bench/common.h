@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*
+#### Helpers shared by the benchmarks
+- Loopback clients, the HTTP/1.1 response reader the load generators use
+  (Content-Length framed only, which is all the proxy sends them) and the
+  stub tunnel agent that answers in the bench process
+- Header-only: every bench is one translation unit
+*/
+
+// Loopback TCP connection with Nagle off, -1 if refused
+inline int connect_to(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// connect_to() for up to 2 s while a forked server comes up
+inline int connect_retry(int port, const std::atomic<bool>* stop = nullptr) {
+  int fd = -1;
+  for (int i = 0; i < 100 && fd < 0 && !(stop && *stop); ++i) {
+    fd = connect_to(port);
+    if (fd < 0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  return fd;
+}
+
+// Status code of the next response, 0 on EOF/error. bytes gets its size on the wire
+inline int read_response(int fd, std::string& buffer, size_t& bytes) {
+  char chunk[65536];
+  while (true) {
+    size_t header_end = buffer.find("\r\n\r\n");
+    if (header_end != std::string::npos) {
+      size_t pos = buffer.find("Content-Length: ");
+      size_t body = pos < header_end ? std::stoul(buffer.substr(pos + 16)) : 0;
+      if (buffer.size() >= header_end + 4 + body) {
+        int status = std::atoi(buffer.c_str() + 9);
+        bytes = header_end + 4 + body;
+        buffer.erase(0, bytes);
+        return status;
+      }
+    }
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) return 0;
+    buffer.append(chunk, n);
+  }
+}
+
+inline int read_response(int fd, std::string& buffer) {
+  size_t bytes = 0;
+  return read_response(fd, buffer, bytes);
+}
+
+inline double percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t index = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+  return sorted[index];
+}
+
+// Text frame masked with a zero key, as a client must send it
+inline void append_text_frame(std::string& out, std::string_view payload) {
+  size_t length = payload.size();
+  out += (char)0x81;
+  if (length < 126) {
+    out += (char)(0x80 | length);
+  } else if (length <= 0xFFFF) {
+    out += (char)(0x80 | 126);
+    out += (char)(length >> 8);
+    out += (char)(length & 0xFF);
+  } else {
+    out += (char)(0x80 | 127);
+    for (int i = 7; i >= 0; --i) out += (char)(length >> (8 * i));
+  }
+  out.append(4, '\0');
+  out.append(payload);
+}
+
+// Reply payload for one request frame, false sends nothing back
+using agent_answer = std::function<bool(std::string_view request, std::string& reply)>;
+
+/*
+#### Stub tunnel agent
+- Upgrades fd and answers every text frame until stop or EOF, then closes it.
+  Without answer a frame is echoed back
+- batch: the replies to the frames of one recv() go out in one send(), as an
+  agent coalescing its writes would; otherwise each is sent on its own
+- reads: counts the recv() calls that returned frame bytes
+*/
+inline void serve_agent(int fd, std::atomic<bool>& stop, const agent_answer& answer = nullptr, bool batch = false,
+                        std::atomic<long>* reads = nullptr) {
+  std::string handshake = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                          "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n\r\n";
+  send(fd, handshake.data(), handshake.size(), MSG_NOSIGNAL);
+
+  std::string buffer, reply, replies;
+  char chunk[65536];
+  bool upgraded = false;
+  timeval timeout = {0, 200000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  while (!stop) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) break;
+    if (n > 0) buffer.append(chunk, n);
+    if (!upgraded) {
+      size_t end = buffer.find("\r\n\r\n");
+      if (end == std::string::npos) continue;
+      buffer.erase(0, end + 4);
+      upgraded = true;
+      if (buffer.empty()) continue;
+    }
+    if (n > 0 && reads) reads->fetch_add(1, std::memory_order_relaxed);
+    size_t at = 0;
+    while (buffer.size() - at >= 2) {
+      const unsigned char* data = (const unsigned char*)buffer.data() + at;
+      size_t length = data[1] & 0x7F, offset = 2;
+      if (length == 126) {
+        if (buffer.size() - at < 4) break;
+        length = data[2] << 8 | data[3];
+        offset = 4;
+      } else if (length == 127) {
+        if (buffer.size() - at < 10) break;
+        length = 0;
+        for (int i = 0; i < 8; ++i) length = length << 8 | data[2 + i];
+        offset = 10;
+      }
+      if (buffer.size() - at < offset + length) break;
+      uint8_t opcode = data[0] & 0x0F;
+      std::string_view payload(buffer.data() + at + offset, length);
+      at += offset + length;
+      if (opcode != 0x1) continue;
+
+      if (answer) {
+        reply.clear();
+        if (!answer(payload, reply)) continue;
+        append_text_frame(replies, reply);
+      } else {
+        append_text_frame(replies, payload);
+      }
+      if (!batch) {
+        send(fd, replies.data(), replies.size(), MSG_NOSIGNAL);
+        replies.clear();
+      }
+    }
+    buffer.erase(0, at);
+    if (!replies.empty()) {
+      send(fd, replies.data(), replies.size(), MSG_NOSIGNAL);
+      replies.clear();
+    }
+  }
+  close(fd);
+}
+
+// serve_agent() on a loopback connection to the tunnel's port
+inline void stub_agent(int port, std::atomic<bool>& stop, const agent_answer& answer = nullptr, bool batch = false,
+                       std::atomic<long>* reads = nullptr) {
+  int fd = connect_retry(port, &stop);
+  if (fd >= 0) serve_agent(fd, stop, answer, batch, reads);
+}
@@ -0,0 +1,166 @@
+/*
+#### Response compression: egress bytes and throughput per encoding
+- Poll loop with a handler answering --size bytes of JSON-like text, one of
+  --distinct different bodies (the cache holds them all unless --cache 0)
+- Runs: compression off, then each --encodings entry as the client's
+  Accept-Encoding with ApiProxy::set_compression()
+- Reported: requests/s, bytes on the wire per response (headers included),
+  ratio against the uncompressed run, and p50/p99 latency
+
+  ./bench/compression [--encodings gzip,br] [--size 16384] [--distinct 16]
+                      [--cache 1] [--threads 2] [--connections 16]
+                      [--seconds 3] [--port 3960]
+*/
+#include "../conn/proxy.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::vector<std::string> encodings = {"gzip", "br"};
+  size_t size = 16384;
+  int distinct = 16;
+  bool cache = true;
+  int threads = 2;
+  int connections = 16;
+  int seconds = 3;
+  int port = 3960;
+};
+
+static std::vector<std::string> parse_names(const std::string& list) {
+  std::vector<std::string> values;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+    if (end > start) values.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  return values;
+}
+
+// Repetitive like real JSON, but each of the distinct bodies differs
+static std::string make_body(size_t size, int variant) {
+  std::string body = "{\"variant\":" + std::to_string(variant) + ",\"items\":[";
+  for (int i = 0; body.size() < size; ++i) {
+    body += "{\"id\":" + std::to_string(i * 7919 + variant) + ",\"name\":\"item-" + std::to_string(i) +
+            "\",\"tags\":[\"alpha\",\"beta\"],\"price\":" + std::to_string((i * 37 + variant) % 1000) + "},";
+  }
+  body.resize(size);
+  return body;
+}
+
+static pid_t start_proxy(bool compress, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  std::vector<std::string> bodies;
+  for (int i = 0; i < options.distinct; ++i) bodies.push_back(make_body(options.size, i));
+  ApiProxy proxy({options.port});
+  if (compress) {
+    compression_config config;
+    config.threads = options.threads;
+    config.cache_bytes = options.cache ? config.cache_bytes : 0;
+    proxy.set_compression(config);
+  }
+  std::atomic<size_t> next{0};
+  proxy.set_data_handler([&](const std::string&, int) -> http_pck {
+    http_pck response(200);
+    response.set_content("Content-Type", "application/json");
+    response.set_body(bodies[next++ % bodies.size()]);
+    return response;
+  });
+  proxy.run();
+  _exit(0);
+}
+
+// Bytes per response of the run
+static double run_encoding(const std::string& encoding, double baseline, const Options& options) {
+  pid_t pid = start_proxy(!encoding.empty(), options);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  std::string request = "GET /bench HTTP/1.1\r\nHost: localhost\r\n";
+  if (!encoding.empty()) request += "Accept-Encoding: " + encoding + "\r\n";
+  request += "\r\n";
+  std::atomic<bool> stop{false};
+  std::atomic<long> failed{0};
+  std::atomic<long> responses{0};
+  std::atomic<size_t> received{0};
+  std::vector<std::vector<double>> samples(options.connections);
+  std::vector<std::thread> clients;
+  for (int c = 0; c < options.connections; ++c) {
+    clients.emplace_back([&, c]() {
+      int fd = connect_to(options.port);
+      if (fd < 0) {
+        ++failed;
+        return;
+      }
+      std::string buffer;
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = 0;
+        int status = send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 ? 0 : read_response(fd, buffer, bytes);
+        if (status != 200) {
+          ++failed;
+          break;
+        }
+        samples[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        received += bytes;
+        ++responses;
+      }
+      close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  stop = true;
+  for (auto& t : clients) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+
+  std::vector<double> all;
+  for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  double per_response = responses ? (double)received / responses : 0;
+  printf("%-9s req/s=%-8.0f bytes/resp=%-8.0f ratio=%-5.2f p50=%-7.0f p99=%-7.0f us failed=%ld\n",
+    encoding.empty() ? "off" : encoding.c_str(), responses / elapsed, per_response,
+    baseline > 0 ? per_response / baseline : 1.0, percentile(all, 50), percentile(all, 99), failed.load());
+  fflush(stdout);
+  return per_response;
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--encodings") options.encodings = parse_names(argv[i + 1]);
+    else if (flag == "--size") options.size = std::stoul(argv[i + 1]);
+    else if (flag == "--distinct") options.distinct = std::max(1, std::stoi(argv[i + 1]));
+    else if (flag == "--cache") options.cache = std::stoi(argv[i + 1]) != 0;
+    else if (flag == "--threads") options.threads = std::stoi(argv[i + 1]);
+    else if (flag == "--connections") options.connections = std::stoi(argv[i + 1]);
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  double baseline = run_encoding("", 0, options);
+  for (const auto& encoding : options.encodings) run_encoding(encoding, baseline, options);
+  return 0;
+}
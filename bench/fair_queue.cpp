@@ -0,0 +1,153 @@
+/*
+#### Fair queueing: light client latency next to a heavy burst
+- Integrated loop (ApiProxy::set_tunnel()) with one stub agent in this
+  process that answers requests one at a time: --heavy-us of work for
+  "/heavy", --light-us for anything else
+- --heavy-connections keep-alive clients send "/heavy" with Host: heavy,
+  --light-clients clients send "/light" with Host: light-N, each keeping one
+  request in flight
+- Two runs: FIFO (every request forwarded on arrival) and deficit round robin
+  per Host (set_fair_queueing(), --window requests in flight at the agent).
+  Reported per class: requests/s and p50/p99 latency
+
+  ./bench/fair_queue [--heavy-connections 32] [--light-clients 4]
+                     [--heavy-us 500] [--light-us 50] [--window 2]
+                     [--seconds 3] [--port 3980] [--agent-port 9980]
+*/
+#include "../conn/proxy.hpp"
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct Options {
+  int heavy_connections = 32;
+  int light_clients = 4;
+  int heavy_us = 500;
+  int light_us = 50;
+  int window = 2;
+  int seconds = 3;
+  int port = 3980;
+  int agent_port = 9980;
+};
+
+static void spin_for(int us) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+  while (std::chrono::steady_clock::now() < until) {}
+}
+
+static pid_t start_proxy(bool fair, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  ApiProxy proxy({options.port});
+  WebSocketServer tunnel(options.agent_port, 0);
+  proxy.set_tunnel(tunnel);
+  if (fair) {
+    fair_queue_config config;
+    config.by_host = true;
+    config.inflight_per_agent = options.window;
+    proxy.set_fair_queueing(config);
+  }
+  ApiProxy::Timeouts timeouts;
+  timeouts.tunnel_ms = 60000;
+  proxy.set_timeouts(timeouts);
+  proxy.run();
+  _exit(0);
+}
+
+static void run_mode(bool fair, const Options& options) {
+  pid_t pid = start_proxy(fair, options);
+  std::atomic<bool> stop_agent{false};
+  std::thread agent([&]() {
+    stub_agent(options.agent_port, stop_agent, [&](std::string_view request, std::string& reply) {
+      spin_for(request.compare(0, 10, "GET /heavy") == 0 ? options.heavy_us : options.light_us);
+      reply = "ok";
+      return true;
+    });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300)); // proxy up, agent upgraded
+
+  int total = options.heavy_connections + options.light_clients;
+  std::atomic<bool> stop{false};
+  std::atomic<long> failed{0};
+  std::vector<std::vector<double>> samples(total);
+  std::vector<std::thread> clients;
+  for (int c = 0; c < total; ++c) {
+    clients.emplace_back([&, c]() {
+      bool heavy = c < options.heavy_connections;
+      std::string request = heavy ? "GET /heavy HTTP/1.1\r\nHost: heavy\r\n\r\n"
+        : "GET /light HTTP/1.1\r\nHost: light-" + std::to_string(c) + "\r\n\r\n";
+      int fd = connect_to(options.port);
+      if (fd < 0) {
+        ++failed;
+        return;
+      }
+      std::string buffer;
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        int status = send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 ? 0 : read_response(fd, buffer);
+        if (status != 200) {
+          if (!stop) ++failed;
+          break;
+        }
+        samples[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+      }
+      close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  stop = true;
+  kill(pid, SIGKILL); // heavy clients may be queued behind a lot of work
+  waitpid(pid, nullptr, 0);
+  for (auto& t : clients) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  stop_agent = true;
+  agent.join();
+
+  for (int heavy = 1; heavy >= 0; --heavy) {
+    std::vector<double> all;
+    int from = heavy ? 0 : options.heavy_connections, to = heavy ? options.heavy_connections : total;
+    for (int c = from; c < to; ++c) all.insert(all.end(), samples[c].begin(), samples[c].end());
+    std::sort(all.begin(), all.end());
+    printf("%-5s %-6s req/s=%-8.0f p50=%-8.0f p99=%-8.0f us failed=%ld\n", fair ? "drr" : "fifo",
+      heavy ? "heavy" : "light", all.size() / elapsed, percentile(all, 50), percentile(all, 99), failed.load());
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--heavy-connections") options.heavy_connections = std::stoi(argv[i + 1]);
+    else if (flag == "--light-clients") options.light_clients = std::stoi(argv[i + 1]);
+    else if (flag == "--heavy-us") options.heavy_us = std::stoi(argv[i + 1]);
+    else if (flag == "--light-us") options.light_us = std::stoi(argv[i + 1]);
+    else if (flag == "--window") options.window = std::max(1, std::stoi(argv[i + 1]));
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-port") options.agent_port = std::stoi(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  run_mode(false, options);
+  run_mode(true, options);
+  return 0;
+}
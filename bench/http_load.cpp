@@ -0,0 +1,139 @@
+/*
+#### HTTP load benchmark for ApiProxy
+- Forks a proxy on --port with the selected backend (stdout discarded), then
+  drives it with --connections keep-alive clients for --seconds
+- Reports requests/sec and the proxy's CPU time per request (from wait4 rusage)
+- Without --backend both backends are measured back to back
+- --shards takes a comma separated list and runs every backend once per shard
+  count (0 = classic single loop), to show how the sharded runtime scales
+
+  ./bench/http_load [--backend epoll|io_uring] [--connections 32] [--seconds 5] [--port 3900]
+                    [--shards 0,1,2,4]
+*/
+#include "../conn/proxy.hpp"
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::vector<std::string> backends = {"epoll", "io_uring"};
+  int connections = 32;
+  int seconds = 5;
+  int port = 3900;
+  std::vector<int> shards = {0};
+};
+
+static std::vector<int> parse_list(const std::string& list) {
+  std::vector<int> values;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+    if (end > start) values.push_back(std::stoi(list.substr(start, end - start)));
+    start = end + 1;
+  }
+  return values;
+}
+
+static pid_t start_proxy(const std::string& backend, int port, int shards) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  ApiProxy proxy({port});
+  if (backend == "io_uring") proxy.set_io_backend(io_backend::uring);
+  if (shards > 0) proxy.set_shards(shards);
+  proxy.set_data_handler([](const std::string&, int) -> http_pck {
+    http_pck response(200);
+    response.set_content("Content-Type", "text/plain");
+    response.set_body("ok");
+    return response;
+  });
+  proxy.run();
+  _exit(0);
+}
+
+static void run_backend(const std::string& backend, int shards, const Options& options) {
+  pid_t pid = start_proxy(backend, options.port, shards);
+  for (int i = 0; i < 100; ++i) {
+    int fd = connect_to(options.port);
+    if (fd >= 0) {
+      close(fd);
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  const std::string request = "GET /bench HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::atomic<bool> stop{false};
+  std::atomic<long> completed{0};
+  std::atomic<long> failed{0};
+  std::vector<std::thread> clients;
+  for (int c = 0; c < options.connections; ++c) {
+    clients.emplace_back([&]() {
+      int fd = connect_to(options.port);
+      if (fd < 0) {
+        ++failed;
+        return;
+      }
+      std::string buffer;
+      long local = 0;
+      while (!stop) {
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 || !read_response(fd, buffer)) {
+          ++failed;
+          break;
+        }
+        ++local;
+      }
+      completed += local;
+      close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  stop = true;
+  for (auto& t : clients) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  kill(pid, SIGKILL);
+  int status = 0;
+  struct rusage usage = {};
+  wait4(pid, &status, 0, &usage);
+  double cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+  long requests = completed.load();
+
+  printf("%-9s shards=%-3d conns=%-4d requests=%-9ld req/s=%-10.0f cpu_us/req=%-7.2f failed=%ld\n",
+    backend.c_str(), shards, options.connections, requests, requests / elapsed,
+    requests ? cpu_us / requests : 0.0, failed.load());
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--backend") options.backends = {argv[i + 1]};
+    else if (flag == "--connections") options.connections = std::stoi(argv[i + 1]);
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--shards") options.shards = parse_list(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  for (int shards : options.shards)
+    for (const auto& backend : options.backends) run_backend(backend, shards, options);
+  return 0;
+}
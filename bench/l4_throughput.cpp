@@ -0,0 +1,203 @@
+/*
+#### Raw TCP (L4) passthrough throughput
+- direct: client -> sink over loopback, the baseline
+- spliced: client -> proxy -> sink, set_passthrough(port, "127.0.0.1:sink"),
+  bytes move socket -> pipe -> socket with splice()
+- tunnel: client -> proxy -> stub agent, set_passthrough(port) + set_tunnel(),
+  bytes are read into user space and framed as binary DATA frames
+- One connection pushes --megabytes and half-closes; the clock stops when the
+  sink (or the agent) has seen every byte and the end of the stream
+
+  ./bench/l4_throughput [--mode direct|spliced|tunnel] [--megabytes 2048]
+                        [--port 3920] [--sink-port 3921] [--agent-port 9920]
+*/
+#include "../conn/proxy.hpp"
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::vector<std::string> modes = {"direct", "spliced", "tunnel"};
+  size_t megabytes = 2048;
+  int port = 3920;
+  int sink_port = 3921;
+  int agent_port = 9920;
+};
+
+using steady = std::chrono::steady_clock;
+
+static int listen_on(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Accepts one connection and reads it to EOF
+static void sink(int server_fd, std::atomic<size_t>& received, steady::time_point& done) {
+  int fd = accept(server_fd, nullptr, nullptr);
+  if (fd < 0) return;
+  std::vector<char> buffer(1 << 20);
+  ssize_t n;
+  while ((n = recv(fd, buffer.data(), buffer.size(), 0)) > 0) received += n;
+  done = steady::now();
+  close(fd);
+}
+
+// Upgrades, then counts DATA bytes until the first stream ends
+static void counting_agent(int port, std::atomic<size_t>& received, steady::time_point& done) {
+  int fd = connect_retry(port);
+  if (fd < 0) return;
+  std::string handshake = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                          "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n\r\n";
+  send(fd, handshake.data(), handshake.size(), MSG_NOSIGNAL);
+
+  std::vector<unsigned char> buffer(4 << 20);
+  size_t begin = 0, end = 0;
+  bool upgraded = false;
+  while (true) {
+    if (begin > 0 && buffer.size() - end < (1 << 20)) {
+      memmove(buffer.data(), buffer.data() + begin, end - begin);
+      end -= begin;
+      begin = 0;
+    }
+    ssize_t n = recv(fd, buffer.data() + end, buffer.size() - end, 0);
+    if (n <= 0) break;
+    end += n;
+    if (!upgraded) {
+      std::string head((char*)buffer.data() + begin, end - begin);
+      size_t header_end = head.find("\r\n\r\n");
+      if (header_end == std::string::npos) continue;
+      begin += header_end + 4;
+      upgraded = true;
+    }
+    while (end - begin >= 2) {
+      const unsigned char* data = buffer.data() + begin;
+      size_t length = data[1] & 0x7F, offset = 2;
+      if (length == 126) {
+        if (end - begin < 4) break;
+        length = data[2] << 8 | data[3];
+        offset = 4;
+      } else if (length == 127) {
+        if (end - begin < 10) break;
+        length = 0;
+        for (int i = 0; i < 8; ++i) length = length << 8 | data[2 + i];
+        offset = 10;
+      }
+      if (end - begin < offset + length) break;
+      if ((data[0] & 0x0F) == 0x2 && length >= 5) {
+        uint8_t kind = data[offset];
+        if (kind == 2) received += length - 5;
+        if (kind == 3) {
+          done = steady::now();
+          close(fd);
+          return;
+        }
+      }
+      begin += offset + length;
+    }
+  }
+  close(fd);
+}
+
+static pid_t start_proxy(const std::string& mode, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  ApiProxy proxy({options.port});
+  if (mode == "tunnel") {
+    WebSocketServer tunnel(options.agent_port, 0);
+    proxy.set_tunnel(tunnel);
+    proxy.set_passthrough(options.port);
+    proxy.run();
+    _exit(0);
+  }
+  proxy.set_passthrough(options.port, "127.0.0.1:" + std::to_string(options.sink_port));
+  proxy.run();
+  _exit(0);
+}
+
+static void run_mode(const std::string& mode, const Options& options) {
+  std::atomic<size_t> received{0};
+  steady::time_point done;
+  std::thread receiver;
+  int sink_fd = -1;
+  pid_t pid = 0;
+
+  if (mode == "tunnel") {
+    pid = start_proxy(mode, options);
+    receiver = std::thread(counting_agent, options.agent_port, std::ref(received), std::ref(done));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300)); // agent upgraded
+  } else {
+    sink_fd = listen_on(options.sink_port);
+    if (sink_fd < 0) {
+      printf("%-8s sink port %d unavailable\n", mode.c_str(), options.sink_port);
+      return;
+    }
+    receiver = std::thread(sink, sink_fd, std::ref(received), std::ref(done));
+    if (mode == "spliced") pid = start_proxy(mode, options);
+  }
+
+  int fd = connect_retry(mode == "direct" ? options.sink_port : options.port);
+  size_t total = options.megabytes << 20;
+  size_t sent = 0;
+  auto start = steady::now();
+  if (fd >= 0) {
+    std::vector<char> chunk(1 << 20, 'x');
+    while (sent < total) {
+      ssize_t n = send(fd, chunk.data(), std::min(chunk.size(), total - sent), MSG_NOSIGNAL);
+      if (n <= 0) break;
+      sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+  }
+  receiver.join();
+  if (fd >= 0) close(fd);
+  if (sink_fd >= 0) close(sink_fd);
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+  }
+
+  double seconds = std::chrono::duration<double>(done - start).count();
+  printf("%-8s bytes=%-12zu seconds=%-8.3f GB/s=%-6.2f %s\n", mode.c_str(), received.load(),
+    seconds, seconds > 0 ? received.load() / seconds / 1e9 : 0.0, received.load() == total ? "ok" : "INCOMPLETE");
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--mode") options.modes = {argv[i + 1]};
+    else if (flag == "--megabytes") options.megabytes = std::stoul(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--sink-port") options.sink_port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-port") options.agent_port = std::stoi(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  for (const auto& mode : options.modes) run_mode(mode, options);
+  return 0;
+}
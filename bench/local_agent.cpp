@@ -0,0 +1,112 @@
+/*
+#### Same-host agent round trip: loopback WebSocket vs shared memory rings
+- WebSocketServer in this process, one agent thread echoing every message;
+  the bench thread does broadcast() + receive_response() one message at a time
+- websocket: the agent is a WebSocket client over TCP loopback (frames, masking,
+  worker pool); shm: the agent uses shm::agent on set_local_agents()
+- Reported: round trips per second and p50/p99/p99.9 of a round trip
+
+  ./bench/local_agent [--mode websocket|shm] [--messages 50000] [--size 64]
+                      [--port 9970] [--path /tmp/symm-bench.sock]
+*/
+#include "../websocket/ws.hpp"
+#include "../util/shm_ring.h"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+struct Options {
+  std::vector<std::string> modes = {"websocket", "shm"};
+  long messages = 50000;
+  size_t size = 64;
+  int port = 9970;
+  std::string path = "/tmp/symm-bench.sock";
+};
+
+static void shm_agent(const std::string& path, std::atomic<bool>& stop) {
+  shm::agent agent;
+  for (int i = 0; i < 100 && !stop && !agent.connect(path); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  std::string message;
+  while (!stop) {
+    if (agent.receive(message, 200)) agent.send(message);
+  }
+}
+
+static void run_mode(const std::string& mode, const Options& options) {
+  int null_fd = open("/dev/null", O_WRONLY);
+  int saved_stdout = dup(STDOUT_FILENO);
+  dup2(null_fd, STDOUT_FILENO); // request logging
+
+  WebSocketServer tunnel(options.port, 2);
+  tunnel.set_ping_interval(0);
+  if (mode == "shm") tunnel.set_local_agents(options.path);
+  std::thread server([&]() { tunnel.run(); });
+  std::atomic<bool> stop{false};
+  std::thread agent = mode == "shm" ? std::thread(shm_agent, options.path, std::ref(stop))
+                                    : std::thread([&]() { stub_agent(options.port, stop); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300)); // agent connected
+
+  std::string message(options.size, 'x');
+  std::vector<double> samples;
+  samples.reserve(options.messages);
+  long failed = 0;
+  auto round_trip = [&]() {
+    auto start = std::chrono::steady_clock::now();
+    tunnel.broadcast(message);
+    if (tunnel.receive_response(1000).size() != message.size()) {
+      ++failed;
+      return;
+    }
+    samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+  };
+  for (int i = 0; i < 1000; ++i) round_trip(); // warm-up
+  samples.clear();
+  failed = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < options.messages; ++i) round_trip();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  stop = true;
+  agent.join();
+  tunnel.stop();
+  server.join();
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  close(null_fd);
+
+  std::sort(samples.begin(), samples.end());
+  printf("%-10s size=%-6zu round trips/s=%-8.0f p50=%-6.1f p99=%-6.1f p99.9=%-6.1f us failed=%ld\n",
+    mode.c_str(), options.size, samples.size() / elapsed,
+    percentile(samples, 50), percentile(samples, 99), percentile(samples, 99.9), failed);
+  fflush(stdout); // before the next mode points stdout at /dev/null again
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--mode") options.modes = {argv[i + 1]};
+    else if (flag == "--messages") options.messages = std::max(1L, std::stol(argv[i + 1]));
+    else if (flag == "--size") options.size = std::max(1UL, std::stoul(argv[i + 1]));
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--path") options.path = argv[i + 1];
+  }
+  signal(SIGPIPE, SIG_IGN);
+  for (const auto& mode : options.modes) run_mode(mode, options);
+  return 0;
+}
@@ -0,0 +1,171 @@
+/*
+#### Replays a capture file (ApiProxy::set_capture()) against a proxy
+- The file is read through mmap (capture_reader). Every captured connection
+  gets its own keep-alive connection and sends its requests in order, at the
+  captured time divided by --speed
+- By default a proxy in integrated tunnel mode and a stub echo agent run in
+  this process; --external 1 replays against whatever listens on --port (the
+  stub agent still connects to --agent-port unless --agent 0)
+- Latency counts from the scheduled send time, so a proxy that falls behind
+  shows in the tail instead of slowing the replay down. A worker serves its
+  connections one request at a time: use at least as many workers as the
+  capture had concurrent connections
+
+  ./bench/replay --capture requests.cap [--speed 1] [--workers 8] [--port 3930]
+                 [--agent-port 9930] [--agent-delay-us 0] [--external 0] [--agent 1]
+*/
+#include "../conn/proxy.hpp"
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::string capture;
+  double speed = 1;
+  int workers = 8;
+  int port = 3930;
+  int agent_port = 9930;
+  int agent_delay_us = 0;
+  bool external = false;
+  bool agent = true;
+};
+
+using steady = std::chrono::steady_clock;
+
+static pid_t start_proxy(const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  ApiProxy proxy({options.port});
+  WebSocketServer tunnel(options.agent_port, 0);
+  proxy.set_tunnel(tunnel);
+  proxy.run();
+  _exit(0);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--capture") options.capture = argv[i + 1];
+    else if (flag == "--speed") options.speed = std::stod(argv[i + 1]);
+    else if (flag == "--workers") options.workers = std::max(1, std::stoi(argv[i + 1]));
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-port") options.agent_port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-delay-us") options.agent_delay_us = std::stoi(argv[i + 1]);
+    else if (flag == "--external") options.external = std::stoi(argv[i + 1]) != 0;
+    else if (flag == "--agent") options.agent = std::stoi(argv[i + 1]) != 0;
+  }
+  if (options.capture.empty() || options.speed <= 0) {
+    fprintf(stderr, "usage: %s --capture file [--speed 1] [--workers 8] [--port 3930] [--agent-port 9930]\n"
+                    "          [--agent-delay-us 0] [--external 0] [--agent 1]\n", argv[0]);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  capture_reader reader;
+  if (!reader.open(options.capture)) return 1;
+  std::vector<capture_reader::record> requests;
+  capture_reader::record record;
+  while (reader.next(record)) requests.push_back(record);
+  if (requests.empty()) {
+    fprintf(stderr, "%s has no requests\n", options.capture.c_str());
+    return 1;
+  }
+  // Loops wrote their buffers one after the other, put the requests back in time order
+  std::stable_sort(requests.begin(), requests.end(),
+    [](const capture_reader::record& a, const capture_reader::record& b) { return a.time_us < b.time_us; });
+  uint64_t first_us = requests.front().time_us;
+  double captured = (requests.back().time_us - first_us) / 1e6;
+
+  std::vector<std::vector<const capture_reader::record*>> plans(options.workers);
+  for (const auto& request : requests) plans[request.connection % options.workers].push_back(&request);
+
+  pid_t pid = options.external ? 0 : start_proxy(options);
+  std::atomic<bool> stop_agent{false};
+  std::thread agent;
+  if (options.agent) agent = std::thread([&]() {
+    stub_agent(options.agent_port, stop_agent, [&](std::string_view request, std::string& reply) {
+      if (options.agent_delay_us) std::this_thread::sleep_for(std::chrono::microseconds(options.agent_delay_us));
+      reply = request;
+      return true;
+    });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300)); // proxy up, agent upgraded
+
+  std::vector<std::vector<double>> samples(options.workers);
+  std::atomic<long> errors{0};
+  std::atomic<long> failed{0};
+  auto start = steady::now();
+  std::vector<std::thread> workers;
+  for (int w = 0; w < options.workers; ++w) {
+    workers.emplace_back([&, w]() {
+      std::unordered_map<uint32_t, int> connections;
+      std::string buffer;
+      for (const auto* request : plans[w]) {
+        auto due = start + std::chrono::microseconds((uint64_t)((request->time_us - first_us) / options.speed));
+        std::this_thread::sleep_until(due);
+
+        int status = 0;
+        for (int attempt = 0; attempt < 2 && status == 0; ++attempt) {
+          int& fd = connections.try_emplace(request->connection, -1).first->second;
+          if (fd < 0) fd = connect_to(options.port);
+          if (fd < 0) break;
+          buffer.clear();
+          if (send(fd, request->request.data(), request->request.size(), MSG_NOSIGNAL) == (ssize_t)request->request.size())
+            status = read_response(fd, buffer);
+          if (status == 0) {
+            // Closed by the proxy since the last request: once more on a new connection
+            close(fd);
+            fd = -1;
+          }
+        }
+        if (status == 0) {
+          ++failed;
+          continue;
+        }
+        if (status >= 400) ++errors;
+        samples[w].push_back(std::chrono::duration<double, std::micro>(steady::now() - due).count());
+      }
+      for (const auto& connection : connections) {
+        if (connection.second >= 0) close(connection.second);
+      }
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  double elapsed = std::chrono::duration<double>(steady::now() - start).count();
+
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+  }
+  stop_agent = true;
+  if (agent.joinable()) agent.join();
+
+  std::vector<double> all;
+  for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  printf("requests=%zu speed=%.2fx captured=%.2fs replayed=%.2fs req/s=%.0f\n",
+    requests.size(), options.speed, captured, elapsed, all.size() / elapsed);
+  printf("latency p50=%.0f p90=%.0f p99=%.0f p99.9=%.0f max=%.0f us errors(4xx/5xx)=%ld failed=%ld\n",
+    percentile(all, 50), percentile(all, 90), percentile(all, 99), percentile(all, 99.9),
+    all.empty() ? 0.0 : all.back(), errors.load(), failed.load());
+  return 0;
+}
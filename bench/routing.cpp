@@ -0,0 +1,136 @@
+/*
+#### Routing cost: compile time route table against a handler lambda
+- In process, no sockets: the same requests go through router::table::dispatch
+  (perfect hash, inlined handlers and middleware) and through a
+  std::function DataHandler that tells endpoints apart with find() calls, the
+  way main.cpp's lambda would have to
+- Six endpoints (exact, prefix, method, bearer auth and header middleware);
+  --miss-percent of the requests match none of them (the fall through case)
+- Reported: ns per request, and how many requests each one answered. The
+  table only pays off with inlining: build it optimized, e.g.
+  make -B CXXFLAGS="-O2 -std=c++17" bench/routing
+
+  ./bench/routing [--requests 2000000] [--miss-percent 50]
+*/
+#include "../util/router.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct Options {
+  long requests = 2000000;
+  int miss_percent = 50;
+};
+
+static constexpr char health[] = "/health";
+static constexpr char status[] = "/status";
+static constexpr char metrics[] = "/metrics";
+static constexpr char version[] = "/version";
+static constexpr char login[] = "/login";
+static constexpr char legacy[] = "/legacy/*";
+static constexpr char home[] = "/";
+static constexpr char token[] = "bench";
+static constexpr char server_header[] = "Server";
+static constexpr char server_name[] = "symm";
+
+static http_pck text(const char* body) {
+  http_pck response(200);
+  response.set_content("Content-Type", "text/plain");
+  response.set_body(body);
+  return response;
+}
+
+static http_pck health_page(const router::request&) { return text("ok"); }
+static http_pck status_page(const router::request&) { return text("{\"up\":true}"); }
+static http_pck metrics_page(const router::request&) { return text("requests 1"); }
+static http_pck version_page(const router::request&) { return text("1.0"); }
+static http_pck login_page(const router::request&) { return text("welcome"); }
+
+using routes = router::table<
+  router::route<router::method::get, health, health_page, router::add_header<server_header, server_name>>,
+  router::route<router::method::get, status, status_page, router::cache_control<5>>,
+  router::route<router::method::get, metrics, metrics_page, router::bearer_auth<token>>,
+  router::route<router::method::get, version, version_page>,
+  router::route<router::method::post, login, login_page>,
+  router::route<router::method::any, legacy, router::redirect<home, 301>>>;
+
+// What main.cpp's DataHandler would look like with the same endpoints
+static std::function<bool(const std::string&, int, http_pck&)> lambda_router() {
+  return [](const std::string& request, int, http_pck& out) -> bool {
+    size_t eol = request.find("\r\n");
+    std::string line = request.substr(0, eol);
+    if (line.find("GET /health ") == 0) {
+      out = text("ok");
+      out.add_header("Server", "symm");
+    } else if (line.find("GET /status ") == 0 || line.find("GET /status?") == 0) {
+      out = text("{\"up\":true}");
+      out.add_header("Cache-Control", "max-age=5");
+    } else if (line.find("GET /metrics ") == 0) {
+      if (request.find("Authorization: Bearer bench\r\n") == std::string::npos) {
+        out = http_pck(401);
+        out.set_body("Unauthorized");
+      } else {
+        out = text("requests 1");
+      }
+    } else if (line.find("GET /version ") == 0) {
+      out = text("1.0");
+    } else if (line.find("POST /login ") == 0) {
+      out = text("welcome");
+    } else if (line.find(" /legacy/") != std::string::npos) {
+      out = http_pck(301);
+      out.add_header("Location", "/");
+    } else {
+      return false;
+    }
+    return true;
+  };
+}
+
+template <typename Dispatch>
+static void run(const char* name, Dispatch dispatch, const std::vector<std::string>& requests, long count) {
+  long answered = 0;
+  size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < count; ++i) {
+    http_pck response;
+    if (dispatch(requests[i % requests.size()], 7, response)) {
+      ++answered;
+      sink += response.content_data.size() + response.headers.size();
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  printf("%-7s ns/request=%-7.1f answered=%ld (%zu bytes)\n", name, ns / count, answered, sink);
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--requests") options.requests = std::stol(argv[i + 1]);
+    else if (flag == "--miss-percent") options.miss_percent = std::stoi(argv[i + 1]);
+  }
+
+  const char* hits[] = {
+    "GET /health HTTP/1.1", "GET /status?verbose=1 HTTP/1.1", "GET /metrics HTTP/1.1",
+    "GET /version HTTP/1.1", "POST /login HTTP/1.1", "GET /legacy/index.html HTTP/1.1"};
+  const char* misses[] = {
+    "GET /api/users/42 HTTP/1.1", "POST /api/orders HTTP/1.1", "GET /static/app.js HTTP/1.1",
+    "GET /healthz HTTP/1.1", "PUT /status HTTP/1.1", "GET /api/search?q=symm HTTP/1.1"};
+  std::vector<std::string> requests;
+  for (int i = 0; i < 100; ++i) {
+    const char* line = i < options.miss_percent ? misses[i % 6] : hits[i % 6];
+    requests.push_back(std::string(line) + "\r\nHost: localhost\r\nUser-Agent: bench\r\n"
+                       "Authorization: Bearer bench\r\nAccept: */*\r\n\r\n");
+  }
+
+  auto lambda = lambda_router();
+  for (int round = 0; round < 2; ++round) { // the first round warms caches and branch predictors
+    run("table", routes::dispatch, requests, options.requests);
+    run("lambda", lambda, requests, options.requests);
+  }
+  return 0;
+}
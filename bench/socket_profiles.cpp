@@ -0,0 +1,168 @@
+/*
+#### Listener socket profiles: latency and throughput per profile
+- Poll loop with ApiProxy::set_socket_profile() on its port, one run per
+  --profiles entry (';' separated socket_profile::parse() specs)
+- Three workloads per run, --seconds each:
+  small: --connections keep-alive clients, 64 byte responses, p50/p99
+  connect: a new connection per request (accept path, TCP_DEFER_ACCEPT), p50/p99
+  bulk: --bulk-connections clients fetching --bulk-size byte responses, MB/s
+- Options a profile sets on the listener are inherited by accepted sockets;
+  a refused one (SO_BUSY_POLL without CAP_NET_ADMIN ...) is logged by the proxy
+
+  ./bench/socket_profiles [--profiles "default;latency;bulk"] [--connections 8]
+                          [--bulk-connections 4] [--bulk-size 1048576]
+                          [--seconds 2] [--port 3990]
+*/
+#include "../conn/proxy.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::vector<std::string> profiles = {"default", "latency", "bulk"};
+  int connections = 8;
+  int bulk_connections = 4;
+  size_t bulk_size = 1 << 20;
+  int seconds = 2;
+  int port = 3990;
+};
+
+static std::vector<std::string> parse_list(const std::string& list, char separator) {
+  std::vector<std::string> values;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(separator, start);
+    if (end == std::string::npos) end = list.size();
+    if (end > start) values.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  return values;
+}
+
+static pid_t start_proxy(const socket_profile& profile, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  std::string small(64, 's');
+  std::string bulk(options.bulk_size, 'b');
+  ApiProxy proxy({options.port});
+  proxy.set_socket_profile(options.port, profile);
+  proxy.set_data_handler([&](const std::string& request, int) -> http_pck {
+    http_pck response(200);
+    response.set_content("Content-Type", "application/octet-stream");
+    response.set_body(request.compare(0, 10, "GET /bulk ") == 0 ? bulk : small);
+    return response;
+  });
+  proxy.run();
+  _exit(0);
+}
+
+struct Result {
+  std::vector<double> latency_us;
+  size_t bytes = 0;
+  double seconds = 0;
+  long failed = 0;
+};
+
+// count clients for options.seconds; reconnect: one connection per request
+static Result run_load(const std::string& path, int count, bool reconnect, const Options& options) {
+  std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::atomic<bool> stop{false};
+  std::atomic<long> failed{0};
+  std::atomic<size_t> received{0};
+  std::vector<std::vector<double>> samples(count);
+  std::vector<std::thread> clients;
+  for (int c = 0; c < count; ++c) {
+    clients.emplace_back([&, c]() {
+      int fd = -1;
+      std::string buffer;
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        if (fd < 0) {
+          fd = connect_to(options.port);
+          buffer.clear();
+        }
+        size_t bytes = 0;
+        int status = fd < 0 || send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 ? 0 : read_response(fd, buffer, bytes);
+        if (status != 200) {
+          ++failed;
+          break;
+        }
+        samples[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        received += bytes;
+        if (reconnect) {
+          close(fd);
+          fd = -1;
+        }
+      }
+      if (fd >= 0) close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  stop = true;
+  for (auto& t : clients) t.join();
+
+  Result result;
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (const auto& s : samples) result.latency_us.insert(result.latency_us.end(), s.begin(), s.end());
+  std::sort(result.latency_us.begin(), result.latency_us.end());
+  result.bytes = received;
+  result.failed = failed;
+  return result;
+}
+
+static void run_profile(const std::string& spec, const Options& options) {
+  socket_profile profile;
+  if (!socket_profile::parse(spec, profile)) {
+    printf("%-24s bad profile\n", spec.c_str());
+    fflush(stdout);
+    return;
+  }
+  pid_t pid = start_proxy(profile, options);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  Result small = run_load("/small", options.connections, false, options);
+  Result connect = run_load("/small", options.connections, true, options);
+  Result bulk = run_load("/bulk", options.bulk_connections, false, options);
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+
+  printf("%-24s small req/s=%-7.0f p50=%-5.0f p99=%-6.0f | connect req/s=%-6.0f p50=%-5.0f p99=%-6.0f | bulk MB/s=%-7.1f p50=%-6.0f us failed=%ld\n",
+    spec.c_str(), small.latency_us.size() / small.seconds, percentile(small.latency_us, 50), percentile(small.latency_us, 99),
+    connect.latency_us.size() / connect.seconds, percentile(connect.latency_us, 50), percentile(connect.latency_us, 99),
+    bulk.bytes / bulk.seconds / 1e6, percentile(bulk.latency_us, 50), small.failed + connect.failed + bulk.failed);
+  fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--profiles") options.profiles = parse_list(argv[i + 1], ';');
+    else if (flag == "--connections") options.connections = std::stoi(argv[i + 1]);
+    else if (flag == "--bulk-connections") options.bulk_connections = std::stoi(argv[i + 1]);
+    else if (flag == "--bulk-size") options.bulk_size = std::stoul(argv[i + 1]);
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  for (const auto& spec : options.profiles) run_profile(spec, options);
+  return 0;
+}
@@ -0,0 +1,152 @@
+/*
+#### Tunnel request batching: frames/sec and added latency per batch budget
+- Integrated loop (ApiProxy::set_tunnel()), --connections keep-alive clients
+  each keep one request in flight, a stub agent (in this process) echoes them
+- One run per --delays entry: -1 = unbatched (a send() per frame, max_bytes 0),
+  0 = one write per loop iteration, N = a batch may wait up to N microseconds
+  for company (up to --max-bytes)
+- Reported: frames/s through the tunnel, frames per agent read (how many
+  frames shared a write), and end to end p50/p99 of the requests
+
+  ./bench/tunnel_batching [--delays -1,0,50,200,1000] [--max-bytes 65536]
+                          [--connections 32] [--seconds 3] [--port 3950]
+                          [--agent-port 9950]
+*/
+#include "../conn/proxy.hpp"
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::vector<int> delays = {-1, 0, 50, 200, 1000};
+  size_t max_bytes = 64 << 10;
+  int connections = 32;
+  int seconds = 3;
+  int port = 3950;
+  int agent_port = 9950;
+};
+
+struct AgentStats {
+  std::atomic<long> frames{0};
+  std::atomic<long> reads{0}; // recv() calls that returned frame bytes
+};
+
+static std::vector<int> parse_list(const std::string& list) {
+  std::vector<int> values;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+    if (end > start) values.push_back(std::stoi(list.substr(start, end - start)));
+    start = end + 1;
+  }
+  return values;
+}
+
+static pid_t start_proxy(int delay_us, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  ApiProxy proxy({options.port});
+  WebSocketServer tunnel(options.agent_port, 0);
+  batch_config batch;
+  batch.max_bytes = delay_us < 0 ? 0 : options.max_bytes;
+  batch.max_delay_us = std::max(0, delay_us);
+  tunnel.set_write_batching(batch);
+  proxy.set_tunnel(tunnel);
+  proxy.run();
+  _exit(0);
+}
+
+static void run_budget(int delay_us, const Options& options) {
+  pid_t pid = start_proxy(delay_us, options);
+  AgentStats stats;
+  std::atomic<bool> stop_agent{false};
+  std::thread agent([&]() {
+    stub_agent(options.agent_port, stop_agent, [&](std::string_view request, std::string& reply) {
+      stats.frames.fetch_add(1, std::memory_order_relaxed);
+      reply = request;
+      return true;
+    }, true, &stats.reads);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300)); // proxy up, agent upgraded
+
+  const std::string request = "GET /bench HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::atomic<bool> stop{false};
+  std::atomic<long> failed{0};
+  std::vector<std::vector<double>> samples(options.connections);
+  std::vector<std::thread> clients;
+  for (int c = 0; c < options.connections; ++c) {
+    clients.emplace_back([&, c]() {
+      int fd = connect_to(options.port);
+      if (fd < 0) {
+        ++failed;
+        return;
+      }
+      std::string buffer;
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        int status = send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 ? 0 : read_response(fd, buffer);
+        if (status != 200) {
+          ++failed;
+          break;
+        }
+        samples[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+      }
+      close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  long frames_before = stats.frames.load(), reads_before = stats.reads.load();
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  stop = true;
+  for (auto& t : clients) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  long frames = stats.frames.load() - frames_before, reads = stats.reads.load() - reads_before;
+
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  stop_agent = true;
+  agent.join();
+
+  std::vector<double> all;
+  for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  std::string budget = delay_us < 0 ? "unbatched" : delay_us == 0 ? "iteration" : std::to_string(delay_us) + "us";
+  printf("%-10s conns=%-4d frames/s=%-8.0f frames/read=%-6.2f p50=%-7.0f p99=%-7.0f us failed=%ld\n",
+    budget.c_str(), options.connections, frames / elapsed, reads ? (double)frames / reads : 0.0,
+    percentile(all, 50), percentile(all, 99), failed.load());
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--delays") options.delays = parse_list(argv[i + 1]);
+    else if (flag == "--max-bytes") options.max_bytes = std::stoul(argv[i + 1]);
+    else if (flag == "--connections") options.connections = std::stoi(argv[i + 1]);
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-port") options.agent_port = std::stoi(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  for (int delay_us : options.delays) run_budget(delay_us, options);
+  return 0;
+}
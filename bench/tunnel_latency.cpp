@@ -0,0 +1,199 @@
+/*
+#### Tunnel round trip latency: threaded design vs integrated loop
+- threaded: ApiProxy's handler broadcasts to WebSocketServer and blocks in
+  receive_response() (worker pool + response_cv_), as in the main.cpp example
+- integrated: ApiProxy::set_tunnel(), the proxy loop owns both sockets
+- sharded: the threaded handler on 2 proxy shards and 2 tunnel shards, so
+  broadcast() / receive_response() go through the shards' SPSC queues
+- A stub agent (in this process) echoes every request; --connections keep-alive
+  clients each time every request end to end, reported as p50/p90/p99/p99.9
+  of the 200s. Shed requests (429/503) are counted, not timed
+- Overload: --agent-delay-us makes the agent slower than the offered load,
+  --max-inflight / --target-ms turn on admission control in the proxy
+- --trace file.json samples --trace-rate of the requests and writes a Chrome /
+  Perfetto trace per mode (file.threaded.json ...), --slow-ms turns on the slow log
+- --lock-stats file.txt writes WebSocketServer's lock and queue statistics per
+  mode (file.threaded.txt ...), the bench must be built with make LOCK_STATS=1
+
+  ./bench/tunnel_latency [--mode threaded|integrated|sharded] [--connections 8] [--seconds 5]
+                         [--port 3910] [--agent-port 9910] [--agent-delay-us 0]
+                         [--max-inflight 0] [--target-ms 0]
+                         [--trace file.json] [--trace-rate 0.01] [--slow-ms 0]
+                         [--lock-stats file.txt]
+*/
+#include "../conn/proxy.hpp"
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct Options {
+  std::vector<std::string> modes = {"threaded", "integrated"};
+  int connections = 8;
+  int seconds = 5;
+  int port = 3910;
+  int agent_port = 9910;
+  int agent_delay_us = 0;
+  admission_config admission;
+  std::string trace;
+  trace_config tracing;
+  std::string lock_stats;
+};
+
+// file.json -> file.<mode>.json
+static std::string mode_path(std::string path, const std::string& mode) {
+  size_t dot = path.rfind('.');
+  path.insert(dot == std::string::npos || path.find('/', dot) != std::string::npos ? path.size() : dot, "." + mode);
+  return path;
+}
+
+// SIGTERM: write the trace and lock statistics, then exit (the proxy threads never return)
+static void export_on_sigterm(const Options& options, const std::string& mode) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  int signal_number = 0;
+  sigwait(&set, &signal_number);
+  if (!options.trace.empty()) ApiProxy::export_trace(mode_path(options.trace, mode));
+  if (!options.lock_stats.empty()) WebSocketServer::dump_lock_stats(mode_path(options.lock_stats, mode));
+  _exit(0);
+}
+
+static pid_t start_proxy(const std::string& mode, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr); // inherited by every proxy thread
+  ApiProxy proxy({options.port});
+  if (!options.trace.empty() || options.tracing.slow_ms > 0) proxy.set_tracing(options.tracing);
+  std::thread exporter(export_on_sigterm, std::cref(options), mode);
+  if (mode == "integrated") {
+    WebSocketServer tunnel(options.agent_port, 0);
+    proxy.set_tunnel(tunnel);
+    proxy.set_admission(options.admission);
+    proxy.run();
+    _exit(0);
+  }
+
+  WebSocketServer tunnel(options.agent_port, 4);
+  if (mode == "sharded") {
+    proxy.set_shards(2, false);
+    tunnel.set_shards(2, false, 2); // a producer per proxy shard
+  }
+  proxy.set_data_handler([&](const std::string& request, int) -> http_pck {
+    tunnel.broadcast(request);
+    std::string reply = tunnel.receive_response(10000);
+    http_pck response(reply.empty() ? 500 : 200);
+    response.set_content("Content-Type", "text/plain");
+    response.set_body(reply);
+    return response;
+  });
+  std::thread tunnel_thread([&]() { tunnel.run(); });
+  proxy.run();
+  _exit(0);
+}
+
+static void run_mode(const std::string& mode, const Options& options) {
+  pid_t pid = start_proxy(mode, options);
+  std::atomic<bool> stop_agent{false};
+  std::thread agent([&]() {
+    stub_agent(options.agent_port, stop_agent, [&](std::string_view request, std::string& reply) {
+      if (options.agent_delay_us) std::this_thread::sleep_for(std::chrono::microseconds(options.agent_delay_us));
+      reply = request;
+      return true;
+    });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(300)); // proxy up, agent upgraded
+
+  const std::string request = "GET /bench HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::atomic<bool> stop{false};
+  std::atomic<long> failed{0};
+  std::atomic<long> shed{0};
+  std::vector<std::vector<double>> samples(options.connections);
+  std::vector<std::thread> clients;
+  for (int c = 0; c < options.connections; ++c) {
+    clients.emplace_back([&, c]() {
+      int fd = connect_to(options.port);
+      if (fd < 0) {
+        ++failed;
+        return;
+      }
+      std::string buffer;
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        int status = send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 ? 0 : read_response(fd, buffer);
+        if (status == 429 || status == 503) {
+          ++shed;
+          std::this_thread::sleep_for(std::chrono::milliseconds(1)); // a client backing off, not spinning
+          continue;
+        }
+        if (status != 200) {
+          ++failed;
+          break;
+        }
+        samples[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+      }
+      close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  stop = true;
+  for (auto& t : clients) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  kill(pid, options.trace.empty() && options.lock_stats.empty() ? SIGKILL : SIGTERM);
+  waitpid(pid, nullptr, 0);
+  stop_agent = true;
+  agent.join();
+
+  std::vector<double> all;
+  for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  printf("%-10s conns=%-4d requests=%-8zu req/s=%-8.0f p50=%-7.0f p90=%-7.0f p99=%-7.0f p99.9=%-7.0f us shed=%ld failed=%ld\n",
+    mode.c_str(), options.connections, all.size(), all.size() / elapsed,
+    percentile(all, 50), percentile(all, 90), percentile(all, 99), percentile(all, 99.9), shed.load(), failed.load());
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--mode") options.modes = {argv[i + 1]};
+    else if (flag == "--connections") options.connections = std::stoi(argv[i + 1]);
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-port") options.agent_port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-delay-us") options.agent_delay_us = std::stoi(argv[i + 1]);
+    else if (flag == "--max-inflight") options.admission.max_inflight_per_listener = std::stoi(argv[i + 1]);
+    else if (flag == "--target-ms") options.admission.target_delay_ms = std::stoi(argv[i + 1]);
+    else if (flag == "--trace") options.trace = argv[i + 1];
+    else if (flag == "--trace-rate") options.tracing.sample_rate = std::stod(argv[i + 1]);
+    else if (flag == "--slow-ms") options.tracing.slow_ms = std::stoi(argv[i + 1]);
+    else if (flag == "--lock-stats") options.lock_stats = argv[i + 1];
+  }
+  if (!options.trace.empty() && options.tracing.sample_rate <= 0) options.tracing.sample_rate = 0.01;
+  signal(SIGPIPE, SIG_IGN);
+  for (const auto& mode : options.modes) run_mode(mode, options);
+  return 0;
+}
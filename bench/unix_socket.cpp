@@ -0,0 +1,188 @@
+/*
+#### AF_UNIX against TCP loopback: ingress and tunnel agents
+- tcp: clients on --port, agents on --agent-port. unix: clients on --path
+  (ApiProxy::add_unix_listener()), agents on --agent-path
+  (WebSocketServer::set_unix_listener()). "@name" paths are abstract
+- Per transport, --seconds each:
+  small: --connections keep-alive clients, 64 byte handler responses
+  bulk: --bulk-connections clients fetching --bulk-size byte responses
+  tunnel: integrated loop (set_tunnel()) with a stub agent in this process
+  that answers every request, --connections keep-alive clients
+- --profile: socket_profile::parse() spec for both client listeners, e.g.
+  "sndbuf=4194304" (AF_UNIX buffers don't autotune like TCP's)
+- Reported: requests/s and p50/p99 latency, MB/s for bulk
+
+  ./bench/unix_socket [--connections 8] [--bulk-connections 4]
+                      [--bulk-size 1048576] [--seconds 2] [--profile spec]
+                      [--port 3995] [--agent-port 9995]
+                      [--path @symm-bench] [--agent-path @symm-bench-agents]
+*/
+#include "../conn/proxy.hpp"
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+struct Options {
+  int connections = 8;
+  int bulk_connections = 4;
+  size_t bulk_size = 1 << 20;
+  int seconds = 2;
+  int port = 3995;
+  int agent_port = 9995;
+  std::string path = "@symm-bench";
+  std::string agent_path = "@symm-bench-agents";
+  socket_profile profile;
+};
+
+static int connect_unix(const std::string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr;
+  socklen_t len;
+  if (!unix_socket::address(path, addr, len) || connect(fd, (sockaddr*)&addr, len) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Answers every text frame with "ok" until stop
+static void ok_agent(bool unix_agent, const Options& options, std::atomic<bool>& stop) {
+  int fd = -1;
+  for (int i = 0; i < 100 && fd < 0 && !stop; ++i) {
+    fd = unix_agent ? connect_unix(options.agent_path) : connect_to(options.agent_port);
+    if (fd < 0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  if (fd < 0) return;
+  serve_agent(fd, stop, [](std::string_view, std::string& reply) {
+    reply = "ok";
+    return true;
+  }, true);
+}
+
+static pid_t start_proxy(bool unix_listener, bool tunneled, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  std::string small(64, 's');
+  std::string bulk(options.bulk_size, 'b');
+  ApiProxy proxy(unix_listener ? std::vector<int>{} : std::vector<int>{options.port});
+  if (unix_listener) proxy.add_unix_listener(options.path, options.profile);
+  else proxy.set_socket_profile(options.port, options.profile);
+  WebSocketServer tunnel(options.agent_port, 0);
+  if (tunneled) {
+    if (unix_listener) tunnel.set_unix_listener(options.agent_path);
+    proxy.set_tunnel(tunnel);
+  }
+  proxy.set_data_handler([&](const std::string& request, int) -> http_pck {
+    http_pck response(200);
+    response.set_content("Content-Type", "application/octet-stream");
+    response.set_body(request.compare(0, 10, "GET /bulk ") == 0 ? bulk : small);
+    return response;
+  });
+  proxy.run();
+  _exit(0);
+}
+
+static void run_load(const char* transport, const char* name, const std::string& path, int count, bool unix_client, const Options& options) {
+  std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::atomic<bool> stop{false};
+  std::atomic<long> failed{0};
+  std::atomic<size_t> received{0};
+  std::vector<std::vector<double>> samples(count);
+  std::vector<std::thread> clients;
+  for (int c = 0; c < count; ++c) {
+    clients.emplace_back([&, c]() {
+      int fd = unix_client ? connect_unix(options.path) : connect_to(options.port);
+      if (fd < 0) {
+        ++failed;
+        return;
+      }
+      std::string buffer;
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = 0;
+        int status = send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 ? 0 : read_response(fd, buffer, bytes);
+        if (status != 200) {
+          ++failed;
+          break;
+        }
+        samples[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        received += bytes;
+      }
+      close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+  stop = true;
+  for (auto& t : clients) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  printf("%-4s %-6s req/s=%-8.0f MB/s=%-8.1f p50=%-6.0f p99=%-6.0f us failed=%ld\n", transport, name,
+    all.size() / elapsed, received / elapsed / 1e6, percentile(all, 50), percentile(all, 99), failed.load());
+  fflush(stdout);
+}
+
+static void run_transport(bool unix_transport, const Options& options) {
+  const char* transport = unix_transport ? "unix" : "tcp";
+  pid_t pid = start_proxy(unix_transport, false, options);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  run_load(transport, "small", "/small", options.connections, unix_transport, options);
+  run_load(transport, "bulk", "/bulk", options.bulk_connections, unix_transport, options);
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+
+  pid = start_proxy(unix_transport, true, options);
+  std::atomic<bool> stop_agent{false};
+  std::thread agent(ok_agent, unix_transport, std::cref(options), std::ref(stop_agent));
+  std::this_thread::sleep_for(std::chrono::milliseconds(300)); // proxy up, agent upgraded
+  run_load(transport, "tunnel", "/tunnel", options.connections, unix_transport, options);
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  stop_agent = true;
+  agent.join();
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--connections") options.connections = std::stoi(argv[i + 1]);
+    else if (flag == "--bulk-connections") options.bulk_connections = std::stoi(argv[i + 1]);
+    else if (flag == "--bulk-size") options.bulk_size = std::stoul(argv[i + 1]);
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+    else if (flag == "--agent-port") options.agent_port = std::stoi(argv[i + 1]);
+    else if (flag == "--path") options.path = argv[i + 1];
+    else if (flag == "--agent-path") options.agent_path = argv[i + 1];
+    else if (flag == "--profile" && !socket_profile::parse(argv[i + 1], options.profile)) {
+      fprintf(stderr, "bad profile: %s\n", argv[i + 1]);
+      return 1;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+  run_transport(false, options);
+  run_transport(true, options);
+  return 0;
+}
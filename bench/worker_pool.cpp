@@ -0,0 +1,184 @@
+/*
+#### Worker pool: fixed against auto-scaling through a load spike
+- A WebSocketServer (epoll backend) whose message handler blocks for
+  --work-ms (a downstream call) before answering each text frame
+- Three phases: --quiet-clients for --quiet-seconds, --spike-clients for
+  --seconds, then the quiet clients again for --quiet-seconds. Every client
+  keeps one message in flight
+- Two runs: a fixed pool of --fixed workers, and set_worker_pool() from
+  --min to --max workers (--idle-ms shrink window)
+- Reported per phase: messages/s and p50/p99 latency, and the server's
+  WorkerPoolStats sampled every --sample-ms (threads, busy, queued)
+
+  ./bench/worker_pool [--fixed 4] [--min 2] [--max 32] [--idle-ms 500]
+                      [--work-ms 2] [--quiet-clients 2] [--spike-clients 64]
+                      [--quiet-seconds 2] [--seconds 3] [--sample-ms 250]
+                      [--port 9990]
+*/
+#include "../websocket/ws.hpp"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+struct Options {
+  int fixed = 4;
+  int min = 2;
+  int max = 32;
+  int idle_ms = 500;
+  int work_ms = 2;
+  int quiet_clients = 2;
+  int spike_clients = 64;
+  int quiet_seconds = 2;
+  int seconds = 3;
+  int sample_ms = 250;
+  int port = 9990;
+};
+
+// Upgraded connection, -1 on failure
+static int open_client(int port) {
+  int fd = connect_to(port);
+  if (fd < 0) return -1;
+  std::string handshake = "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                          "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n\r\n";
+  send(fd, handshake.data(), handshake.size(), MSG_NOSIGNAL);
+  std::string buffer;
+  char chunk[1024];
+  while (buffer.find("\r\n\r\n") == std::string::npos) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      close(fd);
+      return -1;
+    }
+    buffer.append(chunk, n);
+  }
+  return fd;
+}
+
+// Waits for the next (small, unmasked) frame from the server
+static bool read_frame(int fd) {
+  unsigned char header[2];
+  if (recv(fd, header, 2, MSG_WAITALL) != 2) return false;
+  char payload[125];
+  size_t length = header[1] & 0x7F;
+  return length == 0 || recv(fd, payload, length, MSG_WAITALL) == (ssize_t)length;
+}
+
+static pid_t start_server(bool scaling, const Options& options) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  WebSocketServer server(options.port, scaling ? options.min : options.fixed);
+  if (scaling) {
+    WebSocketServer::WorkerPool pool;
+    pool.min_threads = options.min;
+    pool.max_threads = options.max;
+    pool.idle_ms = options.idle_ms;
+    server.set_worker_pool(pool);
+  }
+  server.set_ping_interval(0);
+  server.set_message_handler([&](int fd, const std::string&) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(options.work_ms));
+    const char reply[] = {(char)0x81, 2, 'o', 'k'};
+    send(fd, reply, sizeof(reply), MSG_NOSIGNAL);
+  });
+  std::thread([&]() { server.run(); }).detach();
+
+  auto start = std::chrono::steady_clock::now();
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(options.sample_ms));
+    auto stats = server.worker_pool_stats();
+    double at = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(out, "  t=%-5.2f threads=%-3d busy=%-3d queued=%-4zu grown=%llu shrunk=%llu\n", at, stats.threads,
+      stats.busy, stats.queued, (unsigned long long)stats.grown, (unsigned long long)stats.shrunk);
+    fflush(out);
+  }
+}
+
+static void run_phase(const char* mode, const char* phase, int count, int seconds, const Options& options) {
+  std::atomic<bool> stop{false};
+  std::atomic<long> failed{0};
+  std::vector<std::vector<double>> samples(count);
+  std::vector<std::thread> clients;
+  for (int c = 0; c < count; ++c) {
+    clients.emplace_back([&, c]() {
+      int fd = open_client(options.port);
+      if (fd < 0) {
+        ++failed;
+        return;
+      }
+      const char message[] = {(char)0x81, (char)(0x80 | 4), 0, 0, 0, 0, 'p', 'i', 'n', 'g'}; // zero mask
+      while (!stop) {
+        auto start = std::chrono::steady_clock::now();
+        if (send(fd, message, sizeof(message), MSG_NOSIGNAL) < 0 || !read_frame(fd)) {
+          if (!stop) ++failed;
+          break;
+        }
+        samples[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+      }
+      close(fd);
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (auto& t : clients) t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (const auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+  std::sort(all.begin(), all.end());
+  printf("%-5s %-6s clients=%-3d msg/s=%-7.0f p50=%-7.0f p99=%-7.0f us failed=%ld\n", mode, phase, count,
+    all.size() / elapsed, percentile(all, 50), percentile(all, 99), failed.load());
+  fflush(stdout);
+}
+
+static void run_mode(bool scaling, const Options& options) {
+  const char* mode = scaling ? "auto" : "fixed";
+  pid_t pid = start_server(scaling, options);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  run_phase(mode, "quiet", options.quiet_clients, options.quiet_seconds, options);
+  run_phase(mode, "spike", options.spike_clients, options.seconds, options);
+  run_phase(mode, "quiet", options.quiet_clients, options.quiet_seconds, options);
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if (flag == "--fixed") options.fixed = std::max(1, std::stoi(argv[i + 1]));
+    else if (flag == "--min") options.min = std::max(1, std::stoi(argv[i + 1]));
+    else if (flag == "--max") options.max = std::stoi(argv[i + 1]);
+    else if (flag == "--idle-ms") options.idle_ms = std::stoi(argv[i + 1]);
+    else if (flag == "--work-ms") options.work_ms = std::stoi(argv[i + 1]);
+    else if (flag == "--quiet-clients") options.quiet_clients = std::stoi(argv[i + 1]);
+    else if (flag == "--spike-clients") options.spike_clients = std::stoi(argv[i + 1]);
+    else if (flag == "--quiet-seconds") options.quiet_seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--seconds") options.seconds = std::stoi(argv[i + 1]);
+    else if (flag == "--sample-ms") options.sample_ms = std::max(10, std::stoi(argv[i + 1]));
+    else if (flag == "--port") options.port = std::stoi(argv[i + 1]);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  run_mode(false, options);
+  run_mode(true, options);
+  return 0;
+}
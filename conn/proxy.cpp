@@ -1,9 +1,25 @@
 #include "proxy.hpp"
 #include "../util/logger.h"
 #include "../util/pck.h"
+#include "../util/timer_wheel.h"
+#include "../util/uring.h"
+#include "../util/tls.h"
+#include "../util/affinity.h"
+#include "../websocket/ws.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <string_view>
+#include <unordered_set>
 #include <unistd.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 
 ApiProxy::ApiProxy(const std::vector<int>& ports) {
   for (int port : ports) {
@@ -18,6 +34,7 @@ ApiProxy::~ApiProxy() {
   }
   for (auto& p : ports_) {
     if (p.sfd >= 0) close(p.sfd);
+    unix_socket::remove(p.unix_path);
   }
 }
 
@@ -26,14 +43,65 @@ void ApiProxy::set_data_handler(DataHandler handler) {
 }
 
 void ApiProxy::run() {
-  for (const auto& port_info : ports_) {
-    threads_.emplace_back(&ApiProxy::listen_on_port, this, port_info);
+  if (sharded_) {
+    run_shards();
+    return;
+  }
+  if (tunnel_) {
+    // One loop owns every port and the agents, like a single shard
+    listen_on_port(ports_);
+    return;
+  }
+  for (size_t i = 0; i < ports_.size(); ++i) {
+    threads_.emplace_back([this, i]() {
+      WebSocketServer::bind_producer((int)i); // a sharded tunnel's producer, see WebSocketServer::set_shards()
+      listen_on_port({ports_[i]});
+    });
   }
   for (auto& t : threads_) {
     if (t.joinable()) t.join();
   }
 }
 
+namespace {
+  thread_local int shard_index = -1;
+  thread_local uint64_t compress_tickets = 0;
+}
+
+int ApiProxy::current_shard() {
+  return shard_index;
+}
+
+void ApiProxy::set_shards(int count, bool pin_threads) {
+  sharded_ = true;
+  shards_ = count > 0 ? count : (int)affinity::usable_cpus().size();
+  pin_shards_ = pin_threads;
+}
+
+// Shared nothing: every shard accepts on its own sockets (the kernel spreads
+// connections across them) and keeps its own clients and timers.
+void ApiProxy::run_shards() {
+  std::vector<int> cpus = affinity::usable_cpus();
+  for (int shard = 0; shard < shards_; ++shard) {
+    std::vector<PortInfo> listeners;
+    for (const auto& port_info : ports_) {
+      PortInfo listener = port_info; // same TLS, admission and passthrough settings
+      if (shard > 0 && port_info.unix_path.empty()) listener.sfd = setup_port(port_info.port).sfd;
+      if (listener.sfd >= 0) listeners.push_back(listener);
+    }
+    threads_.emplace_back([this, shard, listeners]() {
+      shard_index = shard;
+      WebSocketServer::bind_producer(shard);
+      listen_on_port(listeners);
+    });
+    if (pin_shards_) affinity::pin_thread(threads_.back(), cpus[shard % cpus.size()]);
+  }
+  logger::info("Running " + std::to_string(shards_) + " proxy shards", __func__);
+  for (auto& t : threads_) {
+    if (t.joinable()) t.join();
+  }
+}
+
 ApiProxy::PortInfo ApiProxy::setup_port(int port) {
   int sfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sfd < 0) {
@@ -42,7 +110,8 @@ ApiProxy::PortInfo ApiProxy::setup_port(int port) {
   }
 
   int opt = 1;
-  setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt));
+  setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)); // shards bind the same port
   fcntl(sfd, F_SETFL, O_NONBLOCK);
 
   struct sockaddr_in addr = {};
@@ -59,80 +128,2086 @@ ApiProxy::PortInfo ApiProxy::setup_port(int port) {
   return PortInfo(port, sfd, addr);
 }
 
-struct ClientState {
+struct ApiProxy::ClientState {
+  // tunnel: forwarded, waiting for the agent. compressing: response body on the compression pool
+  enum class Phase { headers, body, writing, idle, tunnel, compressing };
+
   std::string read_buffer;
   std::string write_buffer;
+  std::string request; // the one being handled, see dispatch_request()
+  Phase phase = Phase::headers;
+  bool keep_alive = false;
   bool closed = false;
+  timer_wheel::timer deadline;
+
+  // TLS listeners only, see recv_some() / send_some()
+  SSL* ssl = nullptr;
+  short tls_wants = 0;    // poll events OpenSSL is waiting for
+  bool tls_ready = false;
+  bool ktls_send = false; // kernel encrypts, plaintext goes straight to send()
+
+  // io_uring backend only: operations still referencing this state
+  int inflight = 0;
+  int send_slot = -1;
+  bool shut = false;
+
+  // Integrated tunnel mode only
+  bool agent = false;           // WebSocket agent rather than an HTTP client
+  bool upgraded = false;        // agent finished its handshake
+  uint64_t tunnel_request = 0;  // client: request waiting for an agent reply
+  std::deque<std::pair<int, uint64_t>> waiting; // agent: (client fd, request), oldest first
+  uint32_t events = 0;          // registered epoll events
+  uint64_t batch_since_us = 0;  // agent: oldest request held back for a batch, 0 = none
+
+  // Fair queueing, see set_fair_queueing()
+  std::string flow;                         // client: its address, once looked up
+  fair_queue_stats::flow* flow_stats = nullptr; // client: flow of the queued or forwarded request
+  uint64_t queued_us = 0;                   // client: when that request was queued
+
+  // Raw streams over the tunnel, see set_passthrough()
+  uint32_t stream = 0;          // client: stream id, 0 = HTTP
+  int stream_agent = -1;        // client: agent carrying the stream
+  bool read_eof = false;        // client: end of data sent to the agent
+  bool peer_eof = false;        // client: agent ended its side, shut down once flushed
+  bool paused = false;          // client: not read while its agent is backed up
+  std::unordered_set<uint32_t> streams; // agent: streams it carries
+  bool throttled = false;       // agent: some of its streams are paused
+  bool holding = false;         // client: too much from its agent unsent, the agent isn't read
+  int held = 0;                 // agent: holding clients, read again once none is left
+
+  // Direct upstreams, see set_upstreams()
+  upstream_group* upstreams = nullptr; // client: its listener's upstreams
+  int upstream_fd = -1;                // client: connection carrying its request
+  std::string forwarded;               // client: request in flight, resent once if a pooled connection was stale
+  upstream_target* target = nullptr;   // upstream connection or health probe
+  int upstream_client = -1;            // upstream connection: client served, -1 = pooled
+  bool connecting = false;
+  bool reused = false;                 // taken from the pool
+  bool head = false;                   // HEAD request, the response has no body
+  bool probe = false;
+
+  // Admission control, see set_admission()
+  admission_gate* gate = nullptr;
+  uint64_t peer = 0;             // token bucket key
+  uint64_t request_start_ms = 0; // admission of the current request
+  bool admitted = false;         // counted by gate until the response is written
+
+  // HTTP/2 cleartext, see set_h2c()
+  bool h2c = false;                 // poll loop listener: prior knowledge and Upgrade accepted
+  std::unique_ptr<h2_session> h2;   // once the connection speaks HTTP/2
+
+  // Response compression, see set_compression()
+  uint64_t compress_ticket = 0; // response on the pool, 0 = none
+  http_pck compressing;         // that response, its body is with the pool
+
+  // Capture and tracing, see set_capture() / set_tracing()
+  uint32_t capture_id = 0;
+  uint16_t port = 0;
+  request_trace trace;
+
+  ClientState() = default;
+  ClientState(const ClientState&) = delete;
+  ClientState& operator=(const ClientState&) = delete;
+  ~ClientState() {
+    finish_request();
+    if (ssl) SSL_free(ssl);
+  }
+
+  void finish_request() {
+    if (!admitted) return;
+    admitted = false;
+    gate->leave();
+  }
+
+  ssize_t recv_some(int fd, char* buffer, size_t len) {
+    if (!ssl) return recv(fd, buffer, len, 0);
+    return tls_result(SSL_read(ssl, buffer, (int)len));
+  }
+
+  // Decrypted bytes OpenSSL holds, epoll won't report them
+  bool tls_pending() const { return ssl && SSL_pending(ssl) > 0; }
+
+  ssize_t send_some(int fd, const char* data, size_t len) {
+    if (!ssl || ktls_send) return send(fd, data, len, MSG_NOSIGNAL);
+    return tls_result(SSL_write(ssl, data, (int)len));
+  }
+
+  // Maps OpenSSL results onto recv()/send() conventions: -1 with EAGAIN while
+  // the session waits for tls_wants, 0 on close_notify.
+  ssize_t tls_result(int result) {
+    if (result > 0) {
+      if (!tls_ready && SSL_is_init_finished(ssl)) {
+        tls_ready = true;
+        ktls_send = tls_context::ktls_send(ssl);
+      }
+      return result;
+    }
+    switch (SSL_get_error(ssl, result)) {
+      case SSL_ERROR_WANT_READ:
+        tls_wants = POLLIN;
+        errno = EAGAIN;
+        return -1;
+      case SSL_ERROR_WANT_WRITE:
+        tls_wants = POLLOUT;
+        errno = EAGAIN;
+        return -1;
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+      default:
+        logger::warn("TLS error: " + tls_context::last_error(), "tls_result");
+        errno = EPROTO;
+        return -1;
+    }
+  }
+
+  void arm(timer_wheel& timers, Phase next, int timeout_ms) {
+    if (next == Phase::headers && !agent) trace.begin(port);
+    phase = next;
+    if (timeout_ms > 0) timers.arm(deadline, timeout_ms);
+    else timers.cancel(deadline);
+  }
 };
 
-void ApiProxy::listen_on_port(PortInfo port_info) {
-  if (listen(port_info.sfd, SOMAXCONN) < 0) {
-    logger::error("Listen failed on port " + std::to_string(port_info.port), __func__);
-    close(port_info.sfd);
+// Reads what is available (and what OpenSSL already decrypted), then tries to dispatch
+void ApiProxy::read_client(int client_fd, ClientState& state, timer_wheel& timers) {
+  char buffer[4096];
+  do {
+    ssize_t n = state.recv_some(client_fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      state.closed = true;
+      return;
+    }
+    if (state.phase == ClientState::Phase::idle)
+      state.arm(timers, ClientState::Phase::headers, timeouts_.header_ms);
+    state.read_buffer.append(buffer, n);
+  } while (state.ssl && SSL_pending(state.ssl) > 0);
+  if (state.h2c && h2_preface(client_fd, state, timers)) return;
+  dispatch_request(state, client_fd, timers);
+}
+
+void ApiProxy::write_client(int client_fd, ClientState& state, timer_wheel& timers) {
+  ssize_t sent = state.send_some(client_fd, state.write_buffer.data(), state.write_buffer.size());
+  if (sent > 0) {
+    state.write_buffer.erase(0, sent);
+  } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    state.closed = true;
+    return;
+  }
+  if (state.write_buffer.empty()) response_sent(state, client_fd, timers);
+}
+
+static bool equals_nocase(std::string_view a, std::string_view b) {
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+    [](char x, char y) { return std::tolower(x) == std::tolower(y); });
+}
+
+// Case insensitive search of a lowercase token
+static bool contains_nocase(std::string_view value, std::string_view token) {
+  for (size_t i = 0; i + token.size() <= value.size(); ++i) {
+    if (equals_nocase(value.substr(i, token.size()), token)) return true;
+  }
+  return false;
+}
+
+// Value of a header inside buffer[0, header_end), case insensitive name. The
+// view points into buffer: valid until it changes
+static std::string_view header_value(std::string_view buffer, size_t header_end, std::string_view name) {
+  size_t pos = buffer.find("\r\n");
+  while (pos != std::string::npos && pos < header_end) {
+    pos += 2;
+    size_t eol = buffer.find("\r\n", pos);
+    if (eol == std::string::npos || eol > header_end) eol = header_end;
+    if (eol - pos > name.size() && buffer[pos + name.size()] == ':' &&
+        equals_nocase(buffer.substr(pos, name.size()), name)) {
+      size_t start = buffer.find_first_not_of(" \t", pos + name.size() + 1);
+      if (start == std::string::npos || start >= eol) return {};
+      return buffer.substr(start, eol - start);
+    }
+    pos = eol;
+  }
+  return {};
+}
+
+static size_t parse_size(std::string_view value, int base = 10) {
+  size_t size = 0;
+  std::from_chars(value.data(), value.data() + value.size(), size, base);
+  return size;
+}
+
+// Body size from Content-Length, or the status rejecting the request when its
+// end is ambiguous: Transfer-Encoding isn't decoded here (an upstream that
+// does would see another request boundary), Content-Length must be one plain
+// number, and folded lines or blanks before the colon are refused (RFC 9112)
+static short body_length(std::string_view buffer, size_t header_end, size_t& body_size) {
+  body_size = 0;
+  bool seen = false;
+  size_t pos = buffer.find("\r\n");
+  while (pos != std::string::npos && pos < header_end) {
+    pos += 2;
+    size_t eol = buffer.find("\r\n", pos);
+    if (eol == std::string::npos || eol > header_end) eol = header_end;
+    std::string_view line = buffer.substr(pos, eol - pos);
+    pos = eol;
+    if (!line.empty() && (line[0] == ' ' || line[0] == '\t')) return 400;
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) continue;
+    std::string_view name = line.substr(0, colon);
+    if (name.find_first_of(" \t") != std::string_view::npos) return 400;
+    if (equals_nocase(name, "Transfer-Encoding")) return 501;
+    if (!equals_nocase(name, "Content-Length")) continue;
+    if (seen) return 400;
+    seen = true;
+    std::string_view value = line.substr(colon + 1);
+    size_t start = value.find_first_not_of(" \t"), end = value.find_last_not_of(" \t");
+    if (start == std::string_view::npos) return 400;
+    value = value.substr(start, end - start + 1);
+    if (value.size() > 15 || value.find_first_not_of("0123456789") != std::string_view::npos) return 400;
+    body_size = parse_size(value);
+  }
+  return 0;
+}
+
+static bool wants_keep_alive(std::string_view request, size_t header_end) {
+  std::string_view connection = header_value(request, header_end, "Connection");
+  bool http10 = request.substr(0, request.find("\r\n")).find("HTTP/1.0") != std::string::npos;
+  if (http10) return contains_nocase(connection, "keep-alive");
+  return !contains_nocase(connection, "close");
+}
+
+static bool wants_h2c(std::string_view request, size_t header_end) {
+  return contains_nocase(header_value(request, header_end, "Upgrade"), "h2c") &&
+    !header_value(request, header_end, "HTTP2-Settings").empty();
+}
+
+void ApiProxy::set_timeouts(const Timeouts& timeouts) {
+  timeouts_ = timeouts;
+}
+
+bool ApiProxy::set_tls(int port, const tls_config& config) {
+  for (auto& port_info : ports_) {
+    if (port_info.port != port) continue;
+    port_info.tls = tls_context::create(config);
+    if (port_info.tls) logger::info("TLS enabled on port " + std::to_string(port), __func__);
+    return port_info.tls != nullptr;
+  }
+  logger::error("No listener on port " + std::to_string(port), __func__);
+  return false;
+}
+
+bool ApiProxy::set_socket_profile(int port, const socket_profile& profile) {
+  for (auto& port_info : ports_) {
+    if (port_info.port != port) continue;
+    port_info.profile = profile;
+    logger::info("Socket profile " + profile.name + " on port " + std::to_string(port), __func__);
+    return true;
+  }
+  logger::error("No listener on port " + std::to_string(port), __func__);
+  return false;
+}
+
+bool ApiProxy::add_unix_listener(const std::string& path, const socket_profile& profile) {
+  int sfd = unix_socket::bind_to(path);
+  if (sfd < 0) return false;
+  PortInfo listener(0, sfd, {});
+  listener.unix_path = path;
+  listener.profile = profile;
+  ports_.push_back(listener);
+  logger::info("Listening on " + path, __func__);
+  return true;
+}
+
+void ApiProxy::set_io_backend(io_backend backend) {
+  if (backend == io_backend::uring && !io_ring::supported()) {
+    logger::warn("io_uring multishot accept/recv not supported by this kernel, using poll", __func__);
+    backend = io_backend::readiness;
+  }
+  io_backend_ = backend;
+}
+
+void ApiProxy::set_tunnel(WebSocketServer& tunnel) {
+  tunnel_ = &tunnel;
+}
+
+void ApiProxy::set_admission(const admission_config& config) {
+  admission_ = config;
+  buckets_.reset(config.ip_rate > 0 ? new token_buckets(config.ip_rate, config.ip_burst) : nullptr);
+  for (auto& port_info : ports_) {
+    port_info.gate = std::make_shared<admission_gate>(port_info.name(),
+      config.max_inflight_per_listener, config.target_delay_ms, config.interval_ms);
+  }
+}
+
+void ApiProxy::set_fair_queueing(const fair_queue_config& config) {
+  fair_config_ = config;
+  fair_stats_ = std::make_unique<fair_queue_stats>();
+}
+
+bool ApiProxy::export_fair_queues(const std::string& path) {
+  if (!fair_stats_) return false;
+  return fair_stats_->dump(path);
+}
+
+bool ApiProxy::set_passthrough(int port, const std::string& upstream) {
+  for (auto& port_info : ports_) {
+    if (port_info.port != port) continue;
+    if (!upstream.empty()) {
+      size_t colon = upstream.rfind(':');
+      struct addrinfo hints = {};
+      hints.ai_family = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      struct addrinfo* result = nullptr;
+      if (colon == std::string::npos ||
+          getaddrinfo(upstream.substr(0, colon).c_str(), upstream.substr(colon + 1).c_str(), &hints, &result) != 0) {
+        logger::error("Can't resolve upstream " + upstream, __func__);
+        return false;
+      }
+      port_info.upstream_addr = *(struct sockaddr_in*)result->ai_addr;
+      freeaddrinfo(result);
+    }
+    if (upstream.empty() && !tunnel_) {
+      logger::error("Passthrough without upstream needs set_tunnel() first", __func__);
+      return false;
+    }
+    port_info.raw = true;
+    port_info.upstream = upstream;
+    logger::info("Port " + std::to_string(port) + " is a raw passthrough to " +
+      (upstream.empty() ? "the tunnel" : upstream), __func__);
+    return true;
+  }
+  logger::error("No listener on port " + std::to_string(port), __func__);
+  return false;
+}
+
+bool ApiProxy::set_upstreams(int port, const std::vector<std::string>& targets, const upstream_config& config) {
+  for (auto& port_info : ports_) {
+    if (port_info.port != port) continue;
+    auto group = std::make_shared<upstream_group>(config);
+    for (const auto& target : targets) {
+      if (!group->add(target)) return false;
+    }
+    if (targets.empty()) {
+      logger::error("No upstream given for port " + std::to_string(port), __func__);
+      return false;
+    }
+    port_info.upstreams = group;
+    std::string names;
+    for (const auto& target : targets) names += " " + target;
+    logger::info("Port " + std::to_string(port) + " forwards to" + names, __func__);
+    return true;
+  }
+  logger::error("No listener on port " + std::to_string(port), __func__);
+  return false;
+}
+
+void ApiProxy::set_tracing(const trace_config& config) {
+  tracing::configure(config);
+  logger::info("Tracing " + std::to_string(config.sample_rate * 100) + "% of requests" +
+    (config.slow_ms > 0 ? ", slow log over " + std::to_string(config.slow_ms) + " ms" : ""), __func__);
+}
+
+bool ApiProxy::export_trace(const std::string& path) {
+  return tracing::export_chrome(path);
+}
+
+bool ApiProxy::set_capture(const std::string& path) {
+  capture_ = capture_writer::open(path);
+  if (capture_) logger::info("Capturing requests to " + path, __func__);
+  return capture_ != nullptr;
+}
+
+void ApiProxy::track_client(ClientState& state, const PortInfo& port_info, int client_fd) {
+  state.gate = port_info.gate.get();
+  state.port = (uint16_t)port_info.port;
+  if (capture_) state.capture_id = capture_->next_connection();
+  if (!buckets_) return;
+  struct sockaddr_storage addr = {};
+  socklen_t len = sizeof(addr);
+  if (getpeername(client_fd, (struct sockaddr*)&addr, &len) < 0) return;
+  if (addr.ss_family == AF_INET) {
+    state.peer = ntohl(((struct sockaddr_in*)&addr)->sin_addr.s_addr);
+  } else if (addr.ss_family == AF_INET6) {
+    const uint8_t* bytes = ((struct sockaddr_in6*)&addr)->sin6_addr.s6_addr;
+    for (int i = 0; i < 8; ++i) state.peer = state.peer << 8 | bytes[i]; // per /64
+    state.peer ^= 1ULL << 62;
+  } else if (addr.ss_family == AF_UNIX) {
+    struct ucred cred = {};
+    len = sizeof(cred);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) state.peer = cred.uid | 1ULL << 61;
+  }
+}
+
+// 0 when admitted (the gate counts it until finish_request()), else 429 or 503
+short ApiProxy::admission_status(ClientState& state) {
+  if (buckets_ && !buckets_->take(state.peer, timer_wheel::now_ms())) return 429;
+  if (state.gate && !state.gate->try_enter()) return 503;
+  return 0;
+}
+
+static http_pck rejection(short status) {
+  http_pck response(status);
+  response.set_content("Content-Type", "text/plain");
+  response.add_header("Retry-After", "1");
+  response.set_body(status == 429 ? "Too many requests" : "Overloaded");
+  return response;
+}
+
+// Rejections skip the handler and the tunnel entirely, and are not counted as admitted
+bool ApiProxy::admit(ClientState& state, timer_wheel& timers) {
+  short status = admission_status(state);
+  if (!status) {
+    // The sojourn time starts here, not while the client is still sending
+    state.admitted = state.gate != nullptr;
+    state.request_start_ms = timer_wheel::now_ms();
+    return true;
+  }
+  http_pck response = rejection(status);
+  queue_response(state, response, timers);
+  return false;
+}
+
+bool ApiProxy::dispatch_request(ClientState& state, int client_fd, timer_wheel& timers) {
+  size_t header_end = state.read_buffer.find("\r\n\r\n");
+  if (header_end == std::string::npos) return false;
+
+  size_t body_size = 0;
+  if (short status = body_length(state.read_buffer, header_end, body_size)) {
+    // Where this request ends is unknown, so is everything after it
+    state.read_buffer.clear();
+    state.request.clear();
+    state.keep_alive = false;
+    http_pck response(status);
+    response.set_content("Content-Type", "text/plain");
+    response.set_body(status == 501 ? "Transfer-Encoding not supported" : "Bad request framing");
+    queue_response(state, response, timers);
+    return true;
+  }
+  size_t request_size = header_end + 4 + body_size;
+  if (state.read_buffer.size() < request_size) {
+    if (state.phase != ClientState::Phase::body)
+      state.arm(timers, ClientState::Phase::body, timeouts_.body_ms);
+    return false;
+  }
+
+  // Into the connection's request buffer: its capacity is kept from one request to the next
+  std::string& request = state.request;
+  request.assign(state.read_buffer, 0, request_size);
+  state.read_buffer.erase(0, request_size);
+  state.keep_alive = wants_keep_alive(request, header_end);
+
+  state.trace.mark(tracing::parsed);
+  logger::info("Received request: " + request, __func__);
+  if (state.capture_id) capture_->record(state.capture_id, state.port, request); // shed ones too
+  if (state.h2c && body_size == 0 && wants_h2c(request, header_end)) return h2_upgrade(state, client_fd, header_end, timers);
+  if (!admit(state, timers)) return true;
+  state.trace.mark(tracing::dispatched);
+  http_pck response;
+  if (routes_ && routes_(request, client_fd, response)) {
+    if (!compress_response(state, client_fd, response, timers)) queue_response(state, response, timers);
+    return true;
+  }
+  if (local_tunnel_ && state.upstreams) return proxy_request(*local_tunnel_, state, client_fd, request, timers);
+  if (local_tunnel_ && tunnel_) return forward_request(*local_tunnel_, state, client_fd, request, timers);
+
+  tracing::current() = &state.trace; // the handler's tunnel calls mark their stages
+  response = custom_handler_ ? custom_handler_(request, client_fd) : process_data(request, client_fd);
+  tracing::current() = nullptr;
+  if (!compress_response(state, client_fd, response, timers)) queue_response(state, response, timers);
+  return true;
+}
+
+// Serialized straight into the write buffer, which is empty between responses.
+// A HEAD request (GET routes answer it too) gets the headers only
+void ApiProxy::queue_response(ClientState& state, http_pck& response, timer_wheel& timers) {
+  if (!state.keep_alive) response.add_header("Connection", "close");
+  start_response(state, timers);
+  response.export_packet(state.write_buffer, state.request.compare(0, 5, "HEAD ") == 0);
+}
+
+// Header of a response, either block, case insensitive name
+static std::string_view response_header(const http_pck& response, std::string_view name) {
+  for (std::string_view block : {std::string_view(response.content_type), std::string_view(response.headers)}) {
+    size_t pos = 0;
+    while (pos < block.size()) {
+      size_t eol = block.find("\r\n", pos);
+      if (eol == std::string::npos) eol = block.size();
+      std::string_view line = block.substr(pos, eol - pos);
+      pos = eol + 2;
+      if (line.size() > name.size() && line[name.size()] == ':' && equals_nocase(line.substr(0, name.size()), name)) {
+        size_t start = line.find_first_not_of(" \t", name.size() + 1);
+        return start == std::string::npos ? std::string_view() : line.substr(start);
+      }
+    }
+  }
+  return {};
+}
+
+void ApiProxy::set_compression(const compression_config& config) {
+  compressor_ = std::make_unique<compression::compressor>(config);
+  logger::info(std::string("Response compression: gzip") + (compression::brotli_available() ? ", br" : "") +
+    ", " + std::to_string(config.threads) + " threads", __func__);
+}
+
+thread_local std::shared_ptr<compression::completions> ApiProxy::local_compressed_;
+
+// Encodes response for the request in state.request when it qualifies: a cached
+// variant inline (false, response ready to queue), otherwise on the pool (true,
+// the connection waits in the compressing phase until take_compressed()). A full
+// pool, or a loop that can't wait for it, sends the body as is
+bool ApiProxy::compress_response(ClientState& state, int client_fd, http_pck& response, timer_wheel& timers) {
+  if (!compressor_ || !compressor_->qualifies(response_header(response, "Content-Type"), response.content_data.size()) ||
+      !response_header(response, "Content-Encoding").empty()) {
+    return false;
+  }
+  response.add_header("Vary", "Accept-Encoding");
+  compression::job job;
+  size_t header_end = state.request.find("\r\n\r\n");
+  if (header_end != std::string::npos) job.encoding = compression::negotiate(header_value(state.request, header_end, "Accept-Encoding"));
+  if (job.encoding == compression::coding::identity) return false;
+
+  if (compressor_->cached(job.encoding, response.content_data)) {
+    if (job.encoding != compression::coding::identity) response.add_header("Content-Encoding", compression::name(job.encoding));
+    return false;
+  }
+  if (!local_compressed_) {
+    job.body = response.content_data; // for the next time
+    compressor_->submit(job, nullptr);
+    return false;
+  }
+  job.fd = client_fd;
+  job.ticket = ++compress_tickets;
+  job.body = std::move(response.content_data);
+  if (!compressor_->submit(job, local_compressed_)) {
+    response.content_data = std::move(job.body);
+    return false;
+  }
+  state.compress_ticket = job.ticket;
+  state.compressing = std::move(response);
+  state.arm(timers, ClientState::Phase::compressing, timeouts_.idle_ms);
+  return true;
+}
+
+// Finished bodies back into their responses; ready gets the clients to write
+void ApiProxy::take_compressed(std::unordered_map<int, ClientState>& clients, std::vector<int>& ready, timer_wheel& timers) {
+  std::vector<compression::job> done;
+  local_compressed_->take(done);
+  for (auto& job : done) {
+    auto it = clients.find(job.fd);
+    if (it == clients.end() || it->second.closed || it->second.compress_ticket != job.ticket) continue; // gone meanwhile
+    ClientState& state = it->second;
+    http_pck response = std::move(state.compressing);
+    state.compressing = http_pck();
+    state.compress_ticket = 0;
+    response.content_data = std::move(job.body);
+    if (job.encoding != compression::coding::identity) response.add_header("Content-Encoding", compression::name(job.encoding));
+    queue_response(state, response, timers);
+    ready.push_back(job.fd);
+  }
+}
+
+void ApiProxy::queue_packet(ClientState& state, std::string packet, timer_wheel& timers) {
+  start_response(state, timers);
+  state.write_buffer = std::move(packet);
+}
+
+void ApiProxy::start_response(ClientState& state, timer_wheel& timers) {
+  if (state.admitted) {
+    uint64_t now = timer_wheel::now_ms();
+    state.gate->observe(now - state.request_start_ms, now);
+  }
+  state.trace.mark(tracing::queued);
+  // A client that stops reading its response is treated as idle
+  state.arm(timers, ClientState::Phase::writing, timeouts_.idle_ms);
+}
+
+bool ApiProxy::response_sent(ClientState& state, int client_fd, timer_wheel& timers) {
+  state.finish_request();
+  state.trace.mark(tracing::written);
+  state.trace.finish();
+  if (!state.keep_alive) {
+    state.closed = true;
+    return false;
+  }
+  if (state.read_buffer.empty()) {
+    state.arm(timers, ClientState::Phase::idle, timeouts_.idle_ms);
+    return false;
+  }
+  // Pipelined request already buffered
+  state.arm(timers, ClientState::Phase::headers, timeouts_.header_ms);
+  return dispatch_request(state, client_fd, timers);
+}
+
+/*
+#### HTTP/2 cleartext (set_h2c())
+- Prior knowledge: a connection starting with the client preface gets an
+  h2_session right away. Upgrade: a body-less request with "Upgrade: h2c" and
+  HTTP2-Settings is answered 101, then becomes stream 1
+- Every complete stream is rewritten as an HTTP/1.1 request and handed to the
+  data handler on the spot; the http_pck it returns is converted back (status,
+  headers lowercased, connection-specific ones dropped). Many streams share
+  the connection, their bodies are interleaved by h2_session::flush()
+- Admission, capture and tracing apply per stream
+*/
+namespace {
+  constexpr size_t h2_high_water = 256 << 10; // output buffered before a connection stops being read
+
+  bool hop_by_hop(std::string_view name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+      name == "transfer-encoding" || name == "upgrade" || name == "content-length";
+  }
+}
+
+void ApiProxy::set_h2c(const h2_config& config) {
+  h2c_ = true;
+  h2c_config_ = config;
+}
+
+bool ApiProxy::h2_preface(int client_fd, ClientState& state, timer_wheel& timers) {
+  if (state.phase != ClientState::Phase::headers || state.read_buffer.empty() || state.read_buffer[0] != 'P') return false;
+  size_t have = std::min(state.read_buffer.size(), h2::preface.size());
+  if (state.read_buffer.compare(0, have, h2::preface.data(), have) != 0) return false;
+  if (have < h2::preface.size()) return true; // rest of the preface still to come
+  state.h2 = std::make_unique<h2_session>(h2c_config_, false);
+  h2_io(client_fd, state, timers);
+  return true;
+}
+
+bool ApiProxy::h2_upgrade(ClientState& state, int client_fd, size_t header_end, timer_wheel& timers) {
+  std::string settings;
+  if (!h2::decode_settings_header(header_value(state.request, header_end, "HTTP2-Settings"), settings)) {
+    state.keep_alive = false;
+    http_pck response(400);
+    queue_response(state, response, timers);
+    return true;
+  }
+  state.write_buffer = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+  state.h2 = std::make_unique<h2_session>(h2c_config_, true);
+  state.h2->apply_settings(settings);
+  bool head = state.request.compare(0, 5, "HEAD ") == 0;
+  h2_respond(state, client_fd, 1, head);
+  h2_io(client_fd, state, timers); // the client preface may already be buffered
+  return true;
+}
+
+// Reads, answers every complete stream, then writes as much as the socket takes
+void ApiProxy::h2_io(int client_fd, ClientState& state, timer_wheel& timers) {
+  h2_session& session = *state.h2;
+  char buffer[16384];
+  while (state.write_buffer.size() < h2_high_water) {
+    ssize_t n = state.recv_some(client_fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      state.closed = true;
+      return;
+    }
+    state.read_buffer.append(buffer, n);
+  }
+
+  std::vector<h2_session::request> ready;
+  session.receive(state.read_buffer, ready);
+  for (auto& request : ready) {
+    // HTTP/1.1 form of the stream's request, as the data handler expects it
+    std::string method, path, authority;
+    std::string& text = state.request;
+    text.clear();
+    bool host = false, length = false;
+    for (const auto& field : request.headers) {
+      if (field.first == ":method") method = field.second;
+      else if (field.first == ":path") path = field.second;
+      else if (field.first == ":authority") authority = field.second;
+      else if (field.first[0] != ':') {
+        host = host || field.first == "host";
+        length = length || field.first == "content-length";
+        text.append(field.first).append(": ").append(field.second).append("\r\n");
+      }
+    }
+    if (method.empty() || path.empty()) {
+      session.respond(request.stream, 400, {}, "");
+      continue;
+    }
+    std::string head = method + " " + path + " HTTP/1.1\r\n";
+    if (!host && !authority.empty()) head += "Host: " + authority + "\r\n";
+    text.insert(0, head);
+    if (!length && !request.body.empty()) text += "Content-Length: " + std::to_string(request.body.size()) + "\r\n";
+    text += "\r\n";
+    text += request.body;
+    h2_respond(state, client_fd, request.stream, method == "HEAD");
+  }
+
+  while (true) {
+    session.flush(state.write_buffer, h2_high_water);
+    if (state.write_buffer.empty()) break;
+    ssize_t sent = state.send_some(client_fd, state.write_buffer.data(), state.write_buffer.size());
+    if (sent <= 0) {
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      state.closed = true;
+      return;
+    }
+    state.write_buffer.erase(0, sent);
+  }
+  if (session.closing() && state.write_buffer.empty()) state.closed = true;
+  state.arm(timers, ClientState::Phase::idle, timeouts_.idle_ms);
+}
+
+// Handles state.request (HTTP/1.1 form) and queues the answer on the stream
+void ApiProxy::h2_respond(ClientState& state, int client_fd, uint32_t stream, bool head) {
+  const std::string& request = state.request;
+  state.trace.begin(state.port);
+  state.trace.mark(tracing::parsed);
+  logger::info("Received request: " + request, __func__);
+  if (state.capture_id) capture_->record(state.capture_id, state.port, request);
+
+  uint64_t start_ms = timer_wheel::now_ms();
+  short status = admission_status(state);
+  state.trace.mark(tracing::dispatched);
+  tracing::current() = &state.trace;
+  http_pck response;
+  if (status) response = rejection(status);
+  else if (!routes_ || !routes_(request, client_fd, response))
+    response = custom_handler_ ? custom_handler_(request, client_fd) : process_data(request, client_fd);
+  tracing::current() = nullptr;
+  if (!status && state.gate) {
+    uint64_t now = timer_wheel::now_ms();
+    state.gate->observe(now - start_ms, now);
+    state.gate->leave();
+  }
+
+  int code = response.status_line.size() > 12 ? std::atoi(response.status_line.c_str() + 9) : 0;
+  if (code < 200 || code > 999) code = 500;
+  std::vector<hpack::header> fields;
+  std::string_view lines[] = {response.content_type, response.headers};
+  for (std::string_view block : lines) {
+    size_t pos = 0;
+    while (pos < block.size()) {
+      size_t eol = block.find("\r\n", pos);
+      if (eol == std::string::npos) eol = block.size();
+      std::string_view line = block.substr(pos, eol - pos);
+      pos = eol + 2;
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) continue;
+      std::string name(line.substr(0, colon));
+      for (auto& c : name) c = std::tolower(c);
+      if (hop_by_hop(name)) continue;
+      size_t value = line.find_first_not_of(" \t", colon + 1);
+      fields.emplace_back(std::move(name), value == std::string::npos ? "" : std::string(line.substr(value)));
+    }
+  }
+  fields.emplace_back("content-length", std::to_string(response.content_data.size()));
+  if (head) response.content_data.clear();
+  state.h2->respond(stream, code, fields, std::move(response.content_data));
+  state.trace.mark(tracing::queued);
+  state.trace.finish();
+}
+
+// One event loop over one or more listeners: a single port in the default
+// thread-per-port mode, every port of the shard in sharded mode.
+void ApiProxy::listen_on_port(std::vector<PortInfo> listeners) {
+  // Spliced passthrough ports run their own epoll loop next to this one
+  auto spliced = std::stable_partition(listeners.begin(), listeners.end(),
+    [](const PortInfo& listener) { return listener.upstream.empty(); });
+  if (spliced != listeners.end()) {
+    std::vector<PortInfo> relays(spliced, listeners.end());
+    listeners.erase(spliced, listeners.end());
+    if (listeners.empty()) {
+      relay_loop(relays);
+      return;
+    }
+    std::thread relay_thread(&ApiProxy::relay_loop, this, relays); // inherits this thread's CPU pinning
+    listen_on_port(listeners);
+    relay_thread.join();
+    return;
+  }
+
+  std::string name = "port";
+  bool any_tls = false;
+  bool any_upstreams = false;
+  for (auto it = listeners.begin(); it != listeners.end();) {
+    if (!it->profile.listen_on(it->sfd)) {
+      logger::error("Listen failed on " + it->name(), __func__);
+      close(it->sfd);
+      it = listeners.erase(it);
+      continue;
+    }
+    name += " " + (it->unix_path.empty() ? std::to_string(it->port) : it->unix_path);
+    any_tls = any_tls || it->tls;
+    any_upstreams = any_upstreams || it->upstreams;
+    ++it;
+  }
+  if (listeners.empty()) return;
+
+  if (tunnel_ || any_upstreams) {
+    listen_tunneled(listeners, name);
     return;
   }
 
-  std::vector<pollfd> fds = { {port_info.sfd, POLLIN, 0} };
+  if (io_backend_ == io_backend::uring && any_tls) {
+    logger::info("TLS listener on " + name + " uses poll", __func__);
+  } else if (io_backend_ == io_backend::uring) {
+    if (listen_on_port_uring(listeners)) return;
+    logger::warn("io_uring unavailable on " + name + ", using poll", __func__);
+  }
+
+  std::vector<pollfd> fds;
+  for (const auto& listener : listeners) fds.push_back({listener.sfd, POLLIN, 0});
+  size_t first_client = fds.size();
+  if (compressor_) {
+    local_compressed_ = std::make_shared<compression::completions>();
+    fds.push_back({local_compressed_->fd(), POLLIN, 0});
+    ++first_client;
+  }
   std::unordered_map<int, ClientState> clients;
+  timer_wheel timers(100);
+  std::vector<int> compressed;
 
   while (running_) {
-    int n = poll(fds.data(), fds.size(), 1000);
+    int n = poll(fds.data(), fds.size(), timers.size() ? timers.tick_ms() : 1000);
     if (n < 0) {
-      logger::error("Poll failed on port " + std::to_string(port_info.port), __func__);
+      if (errno == EINTR) continue;
+      logger::error("Poll failed on " + name, __func__);
       break;
     }
     for (size_t i = 0; i < fds.size(); ++i) {
-      if (fds[i].revents & POLLIN) {
-        if (fds[i].fd == port_info.sfd) {
-          struct sockaddr_in client_addr;
-          socklen_t len = sizeof(client_addr);
-          int client_fd = accept(port_info.sfd, (struct sockaddr*)&client_addr, &len);
-          if (client_fd >= 0) {
-            fcntl(client_fd, F_SETFL, O_NONBLOCK);
-            fds.push_back({client_fd, POLLIN, 0});
-            clients[client_fd] = ClientState();
-          }
+      if (i < listeners.size()) {
+        if (!(fds[i].revents & POLLIN)) continue;
+        const PortInfo& port_info = listeners[i];
+        struct sockaddr_in client_addr;
+        socklen_t len = sizeof(client_addr);
+        int client_fd = accept(port_info.sfd, (struct sockaddr*)&client_addr, &len);
+        if (client_fd >= 0) {
+          fcntl(client_fd, F_SETFL, O_NONBLOCK);
+          fds.push_back({client_fd, POLLIN, 0});
+          auto& state = clients.try_emplace(client_fd).first->second;
+          state.deadline.on_expire = [&state, client_fd]() {
+            logger::warn("Timeout (fd: " + std::to_string(client_fd) + ")", "listen_on_port");
+            state.closed = true;
+          };
+          track_client(state, port_info, client_fd);
+          state.h2c = h2c_ && !port_info.tls;
+          state.arm(timers, ClientState::Phase::headers, timeouts_.header_ms);
+          if (port_info.tls && !(state.ssl = port_info.tls->accept(client_fd))) state.closed = true;
+        }
+        continue;
+      }
+      if (i < first_client) {
+        if (!fds[i].revents) continue;
+        take_compressed(clients, compressed, timers);
+        for (int fd : compressed) write_client(fd, clients[fd], timers); // interest updated below
+        compressed.clear();
+        continue;
+      }
+
+      if (!fds[i].revents) continue;
+      auto& state = clients[fds[i].fd];
+      if (state.h2) {
+        h2_io(fds[i].fd, state, timers); // both directions at once, errors show up as a failed recv()
+      } else if (fds[i].revents & (POLLIN | POLLOUT)) {
+        // With TLS either direction may be needed to make progress on the other one
+        state.tls_wants = 0;
+        if (state.phase == ClientState::Phase::writing) {
+          write_client(fds[i].fd, state, timers);
         } else {
-          char buffer[4096];
-          ssize_t n = recv(fds[i].fd, buffer, sizeof(buffer), 0);
-          if (n <= 0) {
-            close(fds[i].fd);
-            clients.erase(fds[i].fd);
-            fds.erase(fds.begin() + i);
-            --i;
-            continue;
-          }
-          clients[fds[i].fd].read_buffer.append(buffer, n);
-
-          // Simple HTTP: check for end of headers
-          if (clients[fds[i].fd].read_buffer.find("\r\n\r\n") != std::string::npos) {
-            http_pck response;
-            logger::info("Received request: " + clients[fds[i].fd].read_buffer, __func__);
-            if (custom_handler_) {
-              response = custom_handler_(clients[fds[i].fd].read_buffer, fds[i].fd);
-            } else {
-              response = process_data(clients[fds[i].fd].read_buffer, fds[i].fd);
-            }
-            clients[fds[i].fd].write_buffer = response.export_packet();
-            fds[i].events = POLLOUT;
+          read_client(fds[i].fd, state, timers);
+        }
+      } else if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        state.closed = true;
+      }
+    }
+
+    timers.advance();
+
+    for (size_t i = first_client; i < fds.size(); ++i) {
+      auto it = clients.find(fds[i].fd);
+      if (it == clients.end()) continue;
+      ClientState& state = it->second;
+      if (!state.closed) {
+        if (state.phase == ClientState::Phase::compressing) {
+          fds[i].events = 0; // pipelined bytes stay in the kernel until the response is back
+        } else if (state.h2) {
+          // A client that doesn't read its responses isn't read either
+          fds[i].events = (state.write_buffer.size() < h2_high_water ? POLLIN : 0) | (state.write_buffer.empty() ? 0 : POLLOUT);
+        } else {
+          fds[i].events = state.tls_wants ? state.tls_wants
+            : (state.phase == ClientState::Phase::writing ? POLLOUT : POLLIN);
+        }
+        continue;
+      }
+      if (state.ssl) SSL_shutdown(state.ssl); // best effort close_notify
+      close(fds[i].fd);
+      clients.erase(it);
+      fds[i] = fds.back();
+      fds.pop_back();
+      --i;
+    }
+  }
+  for (auto& client : clients) close(client.first);
+  for (const auto& listener : listeners) close(listener.sfd);
+  local_compressed_.reset();
+}
+
+namespace {
+  enum : uint64_t { op_accept = 1, op_recv, op_send, op_cancel };
+  constexpr size_t send_slots = 64;
+  constexpr size_t send_slot_size = 16384;
+
+  uint64_t ring_data(uint64_t op, int fd) { return op << 32 | (uint32_t)fd; }
+}
+
+// Same connection handling as the poll loop, on completions instead of readiness:
+// multishot accept, multishot recv into a provided buffer ring, responses sent
+// from registered buffers, one io_uring_enter per iteration.
+// A connection's fd is only closed once no operation references its state.
+bool ApiProxy::listen_on_port_uring(const std::vector<PortInfo>& listeners) {
+  io_ring ring(256);
+  if (!ring.ok() || !ring.setup_buf_ring(0, 1024, 4096)) return false;
+
+  std::vector<char> send_memory(send_slots * send_slot_size);
+  std::vector<iovec> send_iov;
+  std::vector<int> free_slots;
+  for (size_t i = 0; i < send_slots; ++i) {
+    send_iov.push_back({send_memory.data() + i * send_slot_size, send_slot_size});
+    free_slots.push_back((int)i);
+  }
+  bool fixed_buffers = ring.register_buffers(send_iov);
+
+  std::unordered_map<int, ClientState> clients;
+  std::vector<int> closing;
+  timer_wheel timers(100);
+  bool accept_failed = false;
+
+  auto start_send = [&](int fd, ClientState& state) {
+    size_t len = state.write_buffer.size();
+    if (fixed_buffers && len <= send_slot_size && !free_slots.empty()) {
+      state.send_slot = free_slots.back();
+      free_slots.pop_back();
+      char* slot = send_memory.data() + state.send_slot * send_slot_size;
+      memcpy(slot, state.write_buffer.data(), len);
+      ring.prep_write_fixed(fd, slot, len, (uint16_t)state.send_slot, ring_data(op_send, fd));
+    } else {
+      ring.prep_send(fd, state.write_buffer.data(), len, ring_data(op_send, fd));
+    }
+    ++state.inflight;
+  };
+
+  auto shut_client = [&](int fd, ClientState& state) {
+    if (state.shut) return;
+    state.shut = state.closed = true;
+    timers.cancel(state.deadline);
+    ring.prep_cancel(ring_data(op_recv, fd), ring_data(op_cancel, fd));
+    shutdown(fd, SHUT_RDWR);
+  };
+
+  auto settle = [&](int fd) {
+    auto it = clients.find(fd);
+    if (it == clients.end()) return;
+    if (it->second.closed) shut_client(fd, it->second);
+    if (it->second.shut && it->second.inflight == 0) {
+      close(fd);
+      clients.erase(it);
+    }
+  };
+
+  auto on_completion = [&](const io_uring_cqe& cqe) {
+    uint64_t op = cqe.user_data >> 32;
+    int fd = (int)(uint32_t)cqe.user_data;
+
+    if (op == op_accept) {
+      if (cqe.res >= 0) {
+        int client_fd = cqe.res;
+        auto& state = clients.try_emplace(client_fd).first->second;
+        state.deadline.on_expire = [&state, &closing, client_fd]() {
+          logger::warn("Timeout (fd: " + std::to_string(client_fd) + ")", "listen_on_port_uring");
+          state.closed = true;
+          closing.push_back(client_fd);
+        };
+        for (const auto& listener : listeners)
+          if (listener.sfd == fd) track_client(state, listener, client_fd);
+        state.arm(timers, ClientState::Phase::headers, timeouts_.header_ms);
+        ring.prep_recv_multishot(client_fd, ring_data(op_recv, client_fd));
+        state.inflight = 1;
+      } else if (cqe.res != -ECANCELED && !io_ring::has_more(cqe)) {
+        // The multishot accept is gone (-EINVAL before 6.0): re-arming it would fail forever
+        logger::error("Accept failed (fd: " + std::to_string(fd) + "): " + strerror(-cqe.res), "listen_on_port_uring");
+        accept_failed = true;
+        return;
+      }
+      if (!io_ring::has_more(cqe) && running_) ring.prep_accept_multishot(fd, ring_data(op_accept, fd));
+      return;
+    }
+    if (op == op_cancel) return;
+
+    auto it = clients.find(fd);
+    if (it == clients.end()) {
+      if (io_ring::has_buffer(cqe)) ring.recycle(io_ring::buffer_id(cqe));
+      return;
+    }
+    ClientState& state = it->second;
+
+    if (op == op_recv) {
+      if (io_ring::has_buffer(cqe)) {
+        uint16_t id = io_ring::buffer_id(cqe);
+        if (cqe.res > 0 && !state.closed) {
+          if (state.phase == ClientState::Phase::idle)
+            state.arm(timers, ClientState::Phase::headers, timeouts_.header_ms);
+          state.read_buffer.append((const char*)ring.buffer(id), cqe.res);
+        }
+        ring.recycle(id);
+        // While a response is in flight, pipelined bytes wait for response_sent()
+        if (cqe.res > 0 && !state.closed && state.phase != ClientState::Phase::writing &&
+            dispatch_request(state, fd, timers)) {
+          start_send(fd, state);
+        }
+      }
+      if (!io_ring::has_more(cqe)) {
+        --state.inflight;
+        if (!state.closed && (cqe.res > 0 || cqe.res == -ENOBUFS)) {
+          ring.prep_recv_multishot(fd, ring_data(op_recv, fd));
+          ++state.inflight;
+        } else {
+          state.closed = true;
+        }
+      }
+    } else if (op == op_send) {
+      --state.inflight;
+      if (state.send_slot >= 0) {
+        free_slots.push_back(state.send_slot);
+        state.send_slot = -1;
+      }
+      if (cqe.res < 0) {
+        state.closed = true;
+      } else if (!state.closed) {
+        state.write_buffer.erase(0, cqe.res);
+        if (!state.write_buffer.empty() || response_sent(state, fd, timers)) start_send(fd, state);
+      }
+    }
+    settle(fd);
+  };
+
+  for (const auto& listener : listeners)
+    ring.prep_accept_multishot(listener.sfd, ring_data(op_accept, listener.sfd));
+  while (running_ && !accept_failed) {
+    int ret = ring.submit(1, timers.size() ? timers.tick_ms() : 1000);
+    if (ret < 0) {
+      logger::error("io_uring_enter failed: " + std::string(strerror(-ret)), __func__);
+      break;
+    }
+    ring.for_each_cqe(on_completion);
+
+    timers.advance();
+    std::vector<int> expired;
+    expired.swap(closing);
+    for (int fd : expired) settle(fd);
+  }
+  for (auto& client : clients) close(client.first);
+  if (accept_failed) return false; // the listeners go on in the poll loop
+  for (const auto& listener : listeners) close(listener.sfd);
+  return true;
+}
+
+/*
+#### Integrated tunnel mode
+- One epoll loop owns the HTTP clients and the agents connected to it: a request
+  is framed onto the least loaded agent, and the agent's reply is written to the
+  client from the same thread, no queue, condition variable or worker in between
+- Agents answer in order, every agent keeps a FIFO of the requests it was sent.
+  Request ids let a reply that arrives after its 504 (or after the client left) be dropped
+- In sharded mode every shard has its own SO_REUSEPORT agent listener, so a
+  request only reaches the agents connected to its shard
+*/
+struct ApiProxy::TunnelLoop {
+  int epoll_fd = -1;
+  std::unordered_map<int, ClientState> clients; // HTTP clients and agents
+  std::vector<int> agents;   // upgraded agents
+  std::vector<int> ready;    // clients with a response queued from a timer
+  std::vector<int> closing;
+  uint64_t next_request = 1;
+  std::unordered_map<uint32_t, int> streams; // raw stream id -> client fd
+  uint32_t next_stream = 1;
+  std::unordered_map<upstream_target*, std::vector<int>> idle; // pooled keep-alive upstream connections
+  timer_wheel::timer health;
+  std::string payload; // frame being handled, keeps its capacity
+  std::vector<int> batching; // agents holding requests back, see flush_batches()
+  std::unique_ptr<fair_queue> fair; // requests waiting for an agent, see set_fair_queueing()
+};
+
+thread_local ApiProxy::TunnelLoop* ApiProxy::local_tunnel_ = nullptr;
+
+namespace {
+  // Agent write buffer that pauses raw streams: small, it is compacted on every partial send
+  constexpr size_t stream_high_water = 256 << 10;
+  constexpr size_t stream_low_water = 64 << 10;
+
+  // One complete frame off the front of buffer: 1 when taken, 0 if more bytes
+  // are needed, -1 on a protocol error
+  int take_frame(std::string& buffer, uint8_t& opcode, std::string& payload) {
+    if (buffer.size() < 2) return 0;
+    const unsigned char* data = (const unsigned char*)buffer.data();
+    opcode = data[0] & 0x0F;
+    bool masked = data[1] & 0x80;
+    uint64_t length = data[1] & 0x7F;
+    size_t offset = 2;
+    if (length == 126) {
+      if (buffer.size() < 4) return 0;
+      length = (uint64_t)data[2] << 8 | data[3];
+      offset = 4;
+    } else if (length == 127) {
+      if (buffer.size() < 10) return 0;
+      length = 0;
+      for (int i = 0; i < 8; ++i) length = length << 8 | data[2 + i];
+      offset = 10;
+    }
+    if (length > (64u << 20)) return -1;
+    size_t mask_at = offset;
+    if (masked) offset += 4;
+    if (buffer.size() < offset + length) return 0;
+
+    payload.assign(buffer, offset, length);
+    if (masked) {
+      for (size_t i = 0; i < length; ++i) payload[i] ^= data[mask_at + i % 4];
+    }
+    buffer.erase(0, offset + length);
+    return 1;
+  }
+
+  uint32_t wanted_events(short tls_wants, bool agent, bool writing, bool waiting, bool has_output) {
+    if (tls_wants) return tls_wants; // POLLIN / POLLOUT match EPOLLIN / EPOLLOUT
+    if (agent) return EPOLLIN | (has_output ? EPOLLOUT : 0);
+    if (waiting) return 0;           // pipelined bytes stay in the kernel until the reply
+    return writing ? EPOLLOUT : EPOLLIN;
+  }
+}
+
+void ApiProxy::listen_tunneled(const std::vector<PortInfo>& listeners, const std::string& name) {
+  PortInfo agent_port(0, -1, {}); // only with set_tunnel(), direct upstreams alone need none
+  if (tunnel_) agent_port = setup_port(tunnel_->port_);
+  if (tunnel_ && (agent_port.sfd < 0 || !tunnel_->socket_profile_.listen_on(agent_port.sfd))) {
+    logger::error("Agent listener failed on port " + std::to_string(tunnel_->port_), __func__);
+    if (agent_port.sfd >= 0) close(agent_port.sfd);
+    return;
+  }
+
+  TunnelLoop loop;
+  loop.epoll_fd = epoll_create1(0);
+  if (loop.epoll_fd < 0) {
+    logger::error("Failed to create epoll instance on " + name, __func__);
+    if (agent_port.sfd >= 0) close(agent_port.sfd);
+    return;
+  }
+  local_tunnel_ = &loop;
+
+  std::unordered_map<int, const PortInfo*> accepting;
+  for (const auto& listener : listeners) accepting[listener.sfd] = &listener;
+  if (agent_port.sfd >= 0) accepting[agent_port.sfd] = &agent_port;
+  PortInfo agent_unix(0, tunnel_ ? tunnel_->unix_fd_ : -1, {}); // shared with every other loop, the tunnel closes it
+  if (agent_unix.sfd >= 0 && tunnel_->socket_profile_.listen_on(agent_unix.sfd)) accepting[agent_unix.sfd] = &agent_unix;
+  for (const auto& entry : accepting) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = entry.first;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, entry.first, &event);
+  }
+  if (tunnel_) logger::info("Tunnel on " + name + ", agents on port " + std::to_string(tunnel_->port_), __func__);
+  if (tunnel_ && fair_stats_) loop.fair = std::make_unique<fair_queue>(fair_config_, *fair_stats_);
+  int compressed_fd = -1;
+  if (compressor_) {
+    local_compressed_ = std::make_shared<compression::completions>();
+    compressed_fd = local_compressed_->fd();
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = compressed_fd;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, compressed_fd, &event);
+  }
+
+  timer_wheel timers(100);
+
+  // Health probes of the upstreams, the loop whose timer fires first runs a round
+  std::vector<upstream_group*> groups;
+  int health_ms = 0;
+  for (const auto& listener : listeners) {
+    upstream_group* group = listener.upstreams.get();
+    if (!group || std::find(groups.begin(), groups.end(), group) != groups.end()) continue;
+    groups.push_back(group);
+    int interval = group->config().health_interval_ms;
+    if (interval > 0 && (health_ms == 0 || interval < health_ms)) health_ms = interval;
+  }
+  loop.health.on_expire = [this, &loop, &groups, &timers, health_ms]() {
+    for (upstream_group* group : groups) {
+      if (group->health_round(timer_wheel::now_ms())) probe_upstreams(loop, *group, timers);
+    }
+    timers.arm(loop.health, health_ms);
+  };
+  if (health_ms > 0) timers.arm(loop.health, health_ms);
+
+  auto accept_on = [&](const PortInfo& port_info) {
+    bool agent = &port_info == &agent_port || &port_info == &agent_unix;
+    while (true) {
+      int client_fd = accept(port_info.sfd, nullptr, nullptr);
+      if (client_fd < 0) break;
+      fcntl(client_fd, F_SETFL, O_NONBLOCK);
+      if (agent) {
+        int one = 1; // requests are batched per iteration already, Nagle would only delay them
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      }
+      auto& state = loop.clients.try_emplace(client_fd).first->second;
+      state.agent = agent;
+      state.events = EPOLLIN;
+      state.deadline.on_expire = [this, &loop, &state, &timers, client_fd]() {
+        if (state.phase == ClientState::Phase::tunnel) {
+          state.tunnel_request = 0;
+          auto upstream = loop.clients.find(state.upstream_fd);
+          if (upstream != loop.clients.end()) {
+            // Mid-response, the connection can't go back to the pool
+            upstream->second.closed = true;
+            loop.closing.push_back(upstream->first);
           }
+          state.upstream_fd = -1;
+          http_pck response(504);
+          response.set_content("Content-Type", "text/plain");
+          response.set_body(state.upstreams ? "No response from upstream" : "No response from agent");
+          queue_response(state, response, timers);
+          loop.ready.push_back(client_fd);
+          return;
         }
-      } else if (fds[i].revents & POLLOUT) {
-        auto& state = clients[fds[i].fd];
-        ssize_t sent = send(fds[i].fd, state.write_buffer.c_str(), state.write_buffer.size(), 0);
-        if (sent > 0) {
-          state.write_buffer.erase(0, sent);
+        logger::warn("Timeout (fd: " + std::to_string(client_fd) + ")", "listen_tunneled");
+        state.closed = true;
+        loop.closing.push_back(client_fd);
+      };
+      if (!agent && !port_info.raw) track_client(state, port_info, client_fd);
+      state.upstreams = port_info.upstreams.get();
+      state.arm(timers, ClientState::Phase::headers, port_info.raw ? 0 : timeouts_.header_ms);
+      const auto& tls = agent ? tunnel_->tls_ : port_info.tls;
+      if (tls && !(state.ssl = tls->accept(client_fd))) state.closed = true;
+      if (port_info.raw && !state.closed) open_stream(loop, client_fd, state, port_info.port);
+      if (state.closed) loop.closing.push_back(client_fd);
+
+      struct epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.fd = client_fd;
+      epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+    }
+  };
+
+  struct epoll_event events[64];
+  uint64_t batch_wait_us = 0;
+  while (running_) {
+    int wait_ms = timers.size() ? timers.tick_ms() : 1000;
+    int n;
+    if (batch_wait_us > 0 && batch_wait_us < (uint64_t)wait_ms * 1000)
+      n = epoll_wait_us(loop.epoll_fd, events, 64, batch_wait_us);
+    else
+      n = epoll_wait(loop.epoll_fd, events, 64, wait_ms);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      logger::error("epoll_wait failed on " + name, __func__);
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      auto listener = accepting.find(fd);
+      if (listener != accepting.end()) {
+        accept_on(*listener->second);
+        continue;
+      }
+      if (fd == compressed_fd) {
+        take_compressed(loop.clients, loop.ready, timers); // written with the timer responses below
+        continue;
+      }
+
+      auto it = loop.clients.find(fd);
+      if (it == loop.clients.end() || it->second.closed) continue;
+      ClientState& state = it->second;
+      if (state.target) {
+        upstream_io(loop, fd, state, timers); // errors included, a failed connect is read from SO_ERROR
+      } else if (events[i].events & (EPOLLIN | EPOLLOUT)) {
+        state.tls_wants = 0;
+        if (state.agent) {
+          agent_io(loop, fd, state, timers);
+        } else if (state.stream) {
+          stream_io(loop, fd, state);
+        } else if (state.phase == ClientState::Phase::writing) {
+          write_client(fd, state, timers);
+        } else if (state.phase != ClientState::Phase::tunnel && state.phase != ClientState::Phase::compressing) {
+          read_client(fd, state, timers);
         }
-        if (state.write_buffer.empty()) {
-          close(fds[i].fd);
-          clients.erase(fds[i].fd);
-          fds.erase(fds.begin() + i);
-          --i;
+      } else {
+        state.closed = true;
+      }
+      watch_tunneled(loop, fd, state);
+    }
+
+    timers.advance();
+    std::vector<int> ready;
+    ready.swap(loop.ready);
+    for (int fd : ready) {
+      auto it = loop.clients.find(fd);
+      if (it == loop.clients.end() || it->second.closed) continue;
+      write_client(fd, it->second, timers);
+      watch_tunneled(loop, fd, it->second);
+    }
+    if (loop.fair) schedule_requests(loop, timers);
+    batch_wait_us = flush_batches(loop);
+
+    while (!loop.closing.empty()) {
+      int fd = loop.closing.back();
+      loop.closing.pop_back();
+      close_tunneled(loop, fd, timers);
+    }
+  }
+
+  std::vector<int> remaining;
+  for (const auto& client : loop.clients) remaining.push_back(client.first);
+  for (int fd : remaining) close_tunneled(loop, fd, timers);
+  timers.cancel(loop.health);
+  for (const auto& listener : listeners) close(listener.sfd);
+  if (agent_port.sfd >= 0) close(agent_port.sfd);
+  close(loop.epoll_fd);
+  local_tunnel_ = nullptr;
+  local_compressed_.reset();
+}
+
+// Address of the connection's peer, "" if unknown
+static std::string peer_name(int fd) {
+  struct sockaddr_storage addr = {};
+  socklen_t len = sizeof(addr);
+  char name[INET6_ADDRSTRLEN] = "";
+  if (getpeername(fd, (struct sockaddr*)&addr, &len) < 0) return "";
+  if (addr.ss_family == AF_INET) inet_ntop(AF_INET, &((struct sockaddr_in*)&addr)->sin_addr, name, sizeof(name));
+  else if (addr.ss_family == AF_INET6) inet_ntop(AF_INET6, &((struct sockaddr_in6*)&addr)->sin6_addr, name, sizeof(name));
+  else if (addr.ss_family == AF_UNIX) {
+    struct ucred cred = {}; // same host: the peer's user is all there is to tell clients apart
+    len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) return "uid " + std::to_string(cred.uid);
+  }
+  return name;
+}
+
+static http_pck agents_busy(bool any_agent, std::string_view reason) {
+  http_pck response(503);
+  response.set_content("Content-Type", "text/plain");
+  if (any_agent) response.add_header("Retry-After", "1");
+  response.set_body(std::string(any_agent ? reason : "No agent connected"));
+  return response;
+}
+
+bool ApiProxy::forward_request(TunnelLoop& loop, ClientState& state, int client_fd, const std::string& request, timer_wheel& timers) {
+  if (loop.fair && !loop.agents.empty()) {
+    // Waits in its flow until schedule_requests() finds it an agent
+    if (!fair_config_.by_host && state.flow.empty()) state.flow = peer_name(client_fd);
+    std::string host;
+    if (fair_config_.by_host) host = header_value(request, request.find("\r\n\r\n"), "Host");
+    uint64_t ticket = loop.next_request++;
+    if (!loop.fair->push(fair_config_.by_host ? host : state.flow, client_fd, ticket, request.size(), state.flow_stats)) {
+      state.flow_stats = nullptr;
+      state.finish_request(); // shed, not a queueing delay sample
+      http_pck response = agents_busy(true, "Too many queued requests");
+      queue_response(state, response, timers);
+      return true;
+    }
+    state.tunnel_request = ticket;
+    state.queued_us = frame_batch::now_us();
+    state.arm(timers, ClientState::Phase::tunnel, timeouts_.tunnel_ms); // the queueing time included
+    return false;
+  }
+
+  int agent_fd = pick_agent(loop, admission_.max_inflight_per_agent > 0 ? admission_.max_inflight_per_agent : SIZE_MAX);
+  if (agent_fd < 0) {
+    http_pck response = agents_busy(!loop.agents.empty(), "All agents busy");
+    state.finish_request(); // shed, not a queueing delay sample
+    queue_response(state, response, timers);
+    return true;
+  }
+  state.tunnel_request = loop.next_request++;
+  state.arm(timers, ClientState::Phase::tunnel, timeouts_.tunnel_ms);
+  send_to_agent(loop, agent_fd, client_fd, state);
+  return false;
+}
+
+int ApiProxy::pick_agent(TunnelLoop& loop, size_t limit) {
+  int agent_fd = -1;
+  size_t least = SIZE_MAX;
+  for (int fd : loop.agents) {
+    ClientState& agent = loop.clients[fd];
+    if (!agent.closed && agent.waiting.size() < least && agent.waiting.size() < limit) {
+      agent_fd = fd;
+      least = agent.waiting.size();
+    }
+  }
+  return agent_fd;
+}
+
+void ApiProxy::send_to_agent(TunnelLoop& loop, int agent_fd, int client_fd, ClientState& state) {
+  ClientState& agent = loop.clients[agent_fd];
+  agent.waiting.emplace_back(client_fd, state.tunnel_request);
+
+  bool backed_up = !agent.write_buffer.empty() && !agent.batch_since_us; // already waiting for EPOLLOUT
+  tunnel_->append_frame(agent.write_buffer, tunnel_->process_data(state.request));
+  const batch_config& batch = tunnel_->batch_;
+  if (batch.max_bytes == 0 || agent.write_buffer.size() >= batch.max_bytes || backed_up) {
+    flush_agent(agent_fd, agent);
+  } else if (!agent.batch_since_us) {
+    agent.batch_since_us = frame_batch::now_us();
+    loop.batching.push_back(agent_fd);
+  }
+  state.trace.mark(tracing::sent);
+  watch_tunneled(loop, agent_fd, agent);
+}
+
+// Once per iteration, after every request that arrived in it was queued: the
+// round robin then sees all of the flows competing for the free agent slots
+void ApiProxy::schedule_requests(TunnelLoop& loop, timer_wheel& timers) {
+  size_t limit = fair_config_.inflight_per_agent > 0 ? fair_config_.inflight_per_agent : SIZE_MAX;
+  if (admission_.max_inflight_per_agent > 0) limit = std::min(limit, (size_t)admission_.max_inflight_per_agent);
+  fair_queue::entry next;
+  while (loop.fair->size()) {
+    int agent_fd = pick_agent(loop, limit);
+    if (agent_fd < 0 && !loop.agents.empty()) break; // all busy, the next reply frees a slot
+    if (!loop.fair->pop(next)) break;
+    auto it = loop.clients.find(next.fd);
+    if (it == loop.clients.end() || it->second.closed || it->second.tunnel_request != next.ticket) continue; // timed out or gone
+    ClientState& state = it->second;
+    if (agent_fd < 0) {
+      // The last agent left while this one waited
+      state.tunnel_request = 0;
+      state.flow_stats = nullptr;
+      http_pck response = agents_busy(false, "");
+      queue_response(state, response, timers);
+      write_client(next.fd, state, timers);
+      watch_tunneled(loop, next.fd, state);
+      continue;
+    }
+    next.stats->wait_us.add(frame_batch::now_us() - state.queued_us);
+    send_to_agent(loop, agent_fd, next.fd, state);
+  }
+}
+
+void ApiProxy::watch_tunneled(TunnelLoop& loop, int fd, ClientState& state) {
+  if (state.closed) {
+    loop.closing.push_back(fd);
+    return;
+  }
+  uint32_t events = wanted_events(state.tls_wants, state.agent,
+    state.phase == ClientState::Phase::writing,
+    state.phase == ClientState::Phase::tunnel || state.phase == ClientState::Phase::compressing,
+    !state.write_buffer.empty() && !state.batch_since_us);
+  if (state.target) {
+    events = state.connecting ? EPOLLOUT : EPOLLIN | (state.write_buffer.empty() ? 0 : EPOLLOUT);
+  } else if (state.stream && !state.tls_wants) {
+    events = (state.read_eof || state.paused ? 0 : EPOLLIN) | (state.write_buffer.empty() ? 0 : EPOLLOUT);
+  } else if (state.agent && state.held && !state.tls_wants) {
+    events &= ~EPOLLIN;
+  }
+  if (events == state.events) return;
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.fd = fd;
+  epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  state.events = events;
+}
+
+// Handshake, frames in, frames out. Called on readiness and whenever a request is queued.
+void ApiProxy::agent_io(TunnelLoop& loop, int agent_fd, ClientState& agent, timer_wheel& timers) {
+  char buffer[16384];
+  bool eof = false;  // frames read before it still answer their requests
+  bool more = true;  // stopped reading with bytes possibly left in the socket
+  // At most stream_high_water per round, its frames handled before the next:
+  // a stream client that can't keep up holds the agent before more piles up
+  while (more && !agent.closed) {
+    more = false;
+    size_t read = 0;
+    while (!agent.held || agent.tls_pending()) {
+      if (read >= stream_high_water && !agent.tls_pending()) {
+        more = true;
+        break;
+      }
+      ssize_t n = agent.recv_some(agent_fd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        eof = true;
+        break;
+      }
+      agent.read_buffer.append(buffer, n);
+      read += n;
+    }
+
+    if (!agent.upgraded) {
+      size_t header_end = agent.read_buffer.find("\r\n\r\n");
+      if (header_end == std::string::npos || eof) {
+        agent.closed = eof;
+        return;
+      }
+      std::string request = agent.read_buffer.substr(0, header_end + 4);
+      agent.read_buffer.erase(0, header_end + 4);
+      std::string key = tunnel_->extract_header(request, "Sec-WebSocket-Key");
+      bool valid = tunnel_->custom_handshake_validator_ ? tunnel_->custom_handshake_validator_(request)
+        : tunnel_->validate_handshake(request);
+      if (key.empty() || !valid) {
+        logger::error("Agent handshake rejected (fd: " + std::to_string(agent_fd) + ")", __func__);
+        agent.closed = true;
+        return;
+      }
+      agent.write_buffer = "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: " + tunnel_->compute_accept_key(key) + "\r\n\r\n";
+      agent.upgraded = true;
+      agent.arm(timers, ClientState::Phase::idle, 0);
+      loop.agents.push_back(agent_fd);
+      logger::info("Agent connected (fd: " + std::to_string(agent_fd) + ")", __func__);
+    }
+
+    uint8_t opcode = 0;
+    std::string& payload = loop.payload;
+    int taken = 0;
+    while (!agent.closed && (taken = take_frame(agent.read_buffer, opcode, payload)) > 0) {
+      if (opcode == 0x1) {
+        agent_reply(loop, agent, payload, timers);
+      } else if (opcode == 0x2) {
+        agent_stream(loop, agent_fd, payload);
+      } else if (opcode == 0x9) {
+        std::vector<uint8_t> pong = tunnel_->encode_frame(payload);
+        pong[0] = 0x8A;
+        agent.write_buffer.append(pong.begin(), pong.end());
+      } else if (opcode == 0x8) {
+        agent.closed = true;
+      }
+    }
+    if (taken < 0 || eof) agent.closed = true;
+  }
+  flush_agent(agent_fd, agent);
+
+  // Backed up streams read again once the agent's socket drained
+  if (agent.throttled && agent.write_buffer.size() < stream_low_water) {
+    agent.throttled = false;
+    for (uint32_t stream : agent.streams) {
+      auto it = loop.streams.find(stream);
+      if (it == loop.streams.end()) continue;
+      ClientState& client = loop.clients[it->second];
+      client.paused = false;
+      watch_tunneled(loop, it->second, client);
+    }
+  }
+}
+
+void ApiProxy::flush_agent(int agent_fd, ClientState& agent) {
+  agent.batch_since_us = 0; // anything held back goes along
+  while (!agent.closed && !agent.write_buffer.empty()) {
+    ssize_t sent = agent.send_some(agent_fd, agent.write_buffer.data(), agent.write_buffer.size());
+    if (sent <= 0) {
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      agent.closed = true;
+      break;
+    }
+    agent.write_buffer.erase(0, sent);
+  }
+}
+
+/*
+#### Request batching (WebSocketServer::set_write_batching())
+- forward_request() only appends the frame; agents with requests held back
+  are written once, after every event of the iteration was handled, so the
+  requests of one epoll_wait() share a send() and usually a packet
+- With max_delay_us a batch may wait across iterations (epoll_pwait2() wakes
+  the loop when it is due) unless max_bytes is reached first
+- Returns the microseconds until the next held batch is due, 0 if none is left
+*/
+uint64_t ApiProxy::flush_batches(TunnelLoop& loop) {
+  if (loop.batching.empty()) return 0;
+  const batch_config& batch = tunnel_->batch_;
+  uint64_t now = frame_batch::now_us(), wait_us = 0;
+  size_t kept = 0;
+  for (int agent_fd : loop.batching) {
+    auto it = loop.clients.find(agent_fd);
+    if (it == loop.clients.end() || it->second.closed || !it->second.batch_since_us) continue;
+    ClientState& agent = it->second;
+    uint64_t held = now - agent.batch_since_us;
+    if (batch.max_delay_us > 0 && held < (uint64_t)batch.max_delay_us) {
+      uint64_t due_in = batch.max_delay_us - held;
+      if (wait_us == 0 || due_in < wait_us) wait_us = due_in;
+      loop.batching[kept++] = agent_fd;
+      continue;
+    }
+    flush_agent(agent_fd, agent);
+    watch_tunneled(loop, agent_fd, agent);
+  }
+  loop.batching.resize(kept);
+  return wait_us;
+}
+
+// The reply answers the oldest request sent to this agent, written back right away
+void ApiProxy::agent_reply(TunnelLoop& loop, ClientState& agent, const std::string& reply, timer_wheel& timers) {
+  if (agent.waiting.empty()) {
+    logger::warn("Unsolicited agent message dropped", __func__);
+    return;
+  }
+  auto [client_fd, request] = agent.waiting.front();
+  agent.waiting.pop_front();
+
+  auto it = loop.clients.find(client_fd);
+  if (it == loop.clients.end() || it->second.tunnel_request != request) return; // timed out or gone
+  ClientState& state = it->second;
+  state.tunnel_request = 0;
+  state.trace.mark(tracing::replied);
+  if (state.flow_stats) {
+    state.flow_stats->latency_us.add(frame_batch::now_us() - state.queued_us);
+    state.flow_stats = nullptr;
+  }
+  http_pck response = tunnel_response(reply);
+  if (!compress_response(state, client_fd, response, timers)) {
+    queue_response(state, response, timers);
+    write_client(client_fd, state, timers);
+  }
+  watch_tunneled(loop, client_fd, state);
+}
+
+void ApiProxy::close_tunneled(TunnelLoop& loop, int fd, timer_wheel& timers) {
+  auto it = loop.clients.find(fd);
+  if (it == loop.clients.end()) return;
+  ClientState& state = it->second;
+
+  if (state.target) {
+    auto& idle = loop.idle[state.target];
+    idle.erase(std::remove(idle.begin(), idle.end(), fd), idle.end());
+    if (state.probe) state.target->probing.store(false, std::memory_order_relaxed);
+    if (state.upstream_client >= 0) {
+      state.target->active.fetch_sub(1, std::memory_order_relaxed);
+      auto client = loop.clients.find(state.upstream_client);
+      if (client != loop.clients.end() && client->second.upstream_fd == fd && !client->second.closed) {
+        client->second.upstream_fd = -1;
+        // Nothing answered yet: a pooled connection the upstream had closed goes once more
+        // on a new one, a failed connect (now marked down) on the next healthy upstream
+        upstream_target* next = state.reused ? state.target : state.connecting ? client->second.upstreams->pick() : nullptr;
+        bool retried = next && state.read_buffer.empty() &&
+          send_upstream(loop, client->first, client->second, next, false, timers);
+        if (!retried) upstream_failed(loop, client->first, "Upstream closed the connection", timers);
+      }
+    }
+  }
+  if (state.upstream_fd >= 0) {
+    auto upstream = loop.clients.find(state.upstream_fd);
+    if (upstream != loop.clients.end()) {
+      upstream->second.closed = true;
+      loop.closing.push_back(upstream->first);
+    }
+  }
+
+  if (state.stream) {
+    loop.streams.erase(state.stream);
+    auto agent = loop.clients.find(state.stream_agent);
+    if (agent != loop.clients.end() && !agent->second.closed) {
+      agent->second.streams.erase(state.stream);
+      if (state.holding && --agent->second.held == 0) watch_tunneled(loop, agent->first, agent->second);
+      if (!state.read_eof) {
+        stream_frame(agent->second, 3, state.stream); // client gone: the agent's side ends too
+        flush_agent(agent->first, agent->second);
+        watch_tunneled(loop, agent->first, agent->second);
+      }
+    }
+  }
+
+  if (state.agent) {
+    for (uint32_t stream : state.streams) {
+      auto client = loop.streams.find(stream);
+      if (client == loop.streams.end()) continue;
+      ClientState& stream_state = loop.clients[client->second];
+      stream_state.stream_agent = -1;
+      stream_state.closed = true;
+      loop.closing.push_back(client->second);
+    }
+    loop.agents.erase(std::remove(loop.agents.begin(), loop.agents.end(), fd), loop.agents.end());
+    for (const auto& pending : state.waiting) {
+      auto client = loop.clients.find(pending.first);
+      if (client == loop.clients.end() || client->second.tunnel_request != pending.second) continue;
+      client->second.tunnel_request = 0;
+      http_pck response(502);
+      response.set_content("Content-Type", "text/plain");
+      response.set_body("Agent disconnected");
+      queue_response(client->second, response, timers);
+      write_client(pending.first, client->second, timers);
+      watch_tunneled(loop, pending.first, client->second);
+    }
+    if (state.upgraded) logger::info("Agent disconnected (fd: " + std::to_string(fd) + ")", __func__);
+  }
+
+  epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  if (state.ssl) SSL_shutdown(state.ssl); // best effort close_notify
+  close(fd);
+  loop.clients.erase(fd); // by key: a retry above may have rehashed the map
+}
+
+// A raw connection on a passthrough port becomes a stream on the agent carrying the fewest
+void ApiProxy::open_stream(TunnelLoop& loop, int client_fd, ClientState& state, int port) {
+  int agent_fd = -1;
+  size_t least = SIZE_MAX;
+  for (int fd : loop.agents) {
+    ClientState& agent = loop.clients[fd];
+    if (!agent.closed && agent.streams.size() < least) {
+      agent_fd = fd;
+      least = agent.streams.size();
+    }
+  }
+  if (agent_fd < 0) {
+    logger::warn("No agent for raw connection on port " + std::to_string(port), __func__);
+    state.closed = true;
+    return;
+  }
+
+  uint32_t stream = loop.next_stream++;
+  while (stream == 0 || loop.streams.count(stream)) stream = loop.next_stream++;
+  ClientState& agent = loop.clients[agent_fd];
+  state.stream = stream;
+  state.stream_agent = agent_fd;
+  agent.streams.insert(stream);
+  loop.streams[stream] = client_fd;
+
+  char port_bytes[2] = {(char)(port >> 8), (char)(port & 0xFF)};
+  stream_frame(agent, 1, stream, port_bytes, sizeof(port_bytes));
+  flush_agent(agent_fd, agent);
+  watch_tunneled(loop, agent_fd, agent);
+}
+
+// Client bytes become DATA frames, agent bytes already queued are written back
+void ApiProxy::stream_io(TunnelLoop& loop, int client_fd, ClientState& state) {
+  while (!state.write_buffer.empty()) {
+    ssize_t sent = state.send_some(client_fd, state.write_buffer.data(), state.write_buffer.size());
+    if (sent <= 0) {
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      state.closed = true;
+      return;
+    }
+    state.write_buffer.erase(0, sent);
+  }
+  if (state.peer_eof && state.write_buffer.empty()) shutdown(client_fd, SHUT_WR);
+
+  auto agent_it = loop.clients.find(state.stream_agent);
+  if (agent_it == loop.clients.end()) {
+    state.closed = true;
+    return;
+  }
+  ClientState& agent = agent_it->second;
+  if (state.holding && state.write_buffer.size() < stream_low_water) {
+    state.holding = false;
+    if (--agent.held == 0) watch_tunneled(loop, agent_it->first, agent);
+  }
+  char buffer[65536];
+  while (!state.read_eof && !state.paused) {
+    ssize_t n = state.recv_some(client_fd, buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) state.closed = true;
+      break;
+    }
+    if (n == 0) {
+      state.read_eof = true;
+      stream_frame(agent, 3, state.stream);
+      break;
+    }
+    stream_frame(agent, 2, state.stream, buffer, n);
+    flush_agent(agent_it->first, agent);
+    if (agent.write_buffer.size() >= stream_high_water) {
+      // Stop reading until the agent drains instead of buffering without bound
+      state.paused = true;
+      agent.throttled = true;
+    }
+  }
+  flush_agent(agent_it->first, agent);
+  watch_tunneled(loop, agent_it->first, agent);
+  if (state.read_eof && state.peer_eof && state.write_buffer.empty()) state.closed = true;
+}
+
+// DATA / END frames from an agent, for streams it carries
+void ApiProxy::agent_stream(TunnelLoop& loop, int agent_fd, const std::string& payload) {
+  if (payload.size() < 5) {
+    logger::warn("Short stream frame dropped", __func__);
+    return;
+  }
+  uint8_t kind = payload[0];
+  uint32_t stream = 0;
+  for (int i = 1; i < 5; ++i) stream = stream << 8 | (uint8_t)payload[i];
+  auto it = loop.streams.find(stream);
+  if (it == loop.streams.end()) return; // client already gone
+  int client_fd = it->second;
+  ClientState& state = loop.clients[client_fd];
+  if (state.stream_agent != agent_fd || state.closed) return;
+
+  if (kind == 2) {
+    state.write_buffer.append(payload, 5, std::string::npos);
+  } else if (kind == 3) {
+    state.peer_eof = true;
+  } else {
+    logger::warn("Unknown stream frame kind " + std::to_string(kind), __func__);
+    return;
+  }
+  stream_io(loop, client_fd, state);
+  if (!state.holding && !state.closed && state.write_buffer.size() >= stream_high_water) {
+    // A slow client: stop reading its agent until it drained, instead of
+    // buffering without bound. Other streams of the agent wait too
+    state.holding = true;
+    ++loop.clients[agent_fd].held;
+  }
+  watch_tunneled(loop, client_fd, state);
+}
+
+void ApiProxy::stream_frame(ClientState& agent, uint8_t kind, uint32_t stream, const char* data, size_t len) {
+  // Same framing as WebSocketServer::encode_frame(), written straight into the buffer
+  size_t length = 5 + len;
+  char header[15];
+  size_t at = 0;
+  header[at++] = (char)0x82; // FIN + binary
+  if (length <= 125) {
+    header[at++] = (char)length;
+  } else if (length <= 65535) {
+    header[at++] = 126;
+    header[at++] = (char)(length >> 8);
+    header[at++] = (char)(length & 0xFF);
+  } else {
+    header[at++] = 127;
+    for (int i = 7; i >= 0; --i) header[at++] = (char)(length >> (i * 8));
+  }
+  header[at++] = (char)kind;
+  for (int i = 3; i >= 0; --i) header[at++] = (char)(stream >> (i * 8));
+  agent.write_buffer.append(header, at);
+  if (len) agent.write_buffer.append(data, len);
+}
+
+namespace {
+  // Size of the complete response at the front of buffer, 0 while more bytes
+  // are needed, npos when its chunked framing is broken (the connection can't
+  // be trusted past it). until_close: no length given, the response ends with the connection.
+  size_t response_length(const std::string& buffer, bool head, bool& until_close) {
+    until_close = false;
+    size_t header_end = buffer.find("\r\n\r\n");
+    if (header_end == std::string::npos) return 0;
+    size_t body_start = header_end + 4;
+    int status = buffer.size() > 12 ? std::atoi(buffer.c_str() + 9) : 0;
+    if (head || status / 100 == 1 || status == 204 || status == 304) return body_start;
+
+    if (contains_nocase(header_value(buffer, header_end, "Transfer-Encoding"), "chunked")) {
+      size_t pos = body_start;
+      while (true) {
+        size_t eol = buffer.find("\r\n", pos);
+        if (eol == std::string::npos) return 0;
+        // chunk-size [; chunk-ext], 15 hex digits at most so pos can't wrap
+        size_t digits = 0;
+        while (pos + digits < eol && std::isxdigit((unsigned char)buffer[pos + digits])) ++digits;
+        if (digits == 0 || digits > 15) return std::string::npos;
+        char next = buffer[pos + digits];
+        if (pos + digits < eol && next != ';' && next != ' ' && next != '\t') return std::string::npos;
+        size_t chunk = parse_size(std::string_view(buffer).substr(pos, digits), 16);
+        pos = eol + 2;
+        if (chunk == 0) {
+          // Optional trailers, then an empty line
+          size_t end = buffer.find("\r\n\r\n", pos - 2);
+          return end == std::string::npos ? 0 : end + 4;
         }
+        if (buffer.size() - pos < chunk + 2) return 0;
+        pos += chunk;
+        if (buffer.compare(pos, 2, "\r\n") != 0) return std::string::npos;
+        pos += 2;
       }
     }
+    std::string_view content_length = header_value(buffer, header_end, "Content-Length");
+    if (content_length.empty()) {
+      until_close = true;
+      return 0;
+    }
+    size_t size = body_start + parse_size(content_length);
+    return buffer.size() >= size ? size : 0;
+  }
+}
+
+/*
+#### Direct upstreams (set_upstreams())
+- The request is written to a pooled keep-alive connection of the chosen
+  upstream (or a new non-blocking one), the response is read in the same loop
+  and copied to the client untouched once it is complete
+- A connection goes back to the pool when its response had a length and the
+  upstream didn't ask to close; a pooled one that was closed under us is retried
+  once on a fresh connection. Pools are per loop, nothing is shared between shards
+*/
+bool ApiProxy::proxy_request(TunnelLoop& loop, ClientState& state, int client_fd, const std::string& request, timer_wheel& timers) {
+  upstream_target* target = state.upstreams->pick();
+  state.forwarded = request;
+  state.arm(timers, ClientState::Phase::tunnel, timeouts_.tunnel_ms);
+  if (!target || !send_upstream(loop, client_fd, state, target, true, timers)) {
+    upstream_failed(loop, client_fd, target ? "Upstream unreachable" : "No healthy upstream", timers);
+    return true;
+  }
+  state.trace.mark(tracing::sent); // handed over, the connect (if any) counts as agent time
+  return false;
+}
+
+bool ApiProxy::send_upstream(TunnelLoop& loop, int client_fd, ClientState& state, upstream_target* target, bool reuse, timer_wheel& timers) {
+  auto& idle = loop.idle[target];
+  int fd = -1;
+  if (reuse && !idle.empty()) {
+    fd = idle.back();
+    idle.pop_back();
+  } else {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr*)&target->addr, sizeof(target->addr)) < 0 && errno != EINPROGRESS) {
+      logger::warn("Upstream " + target->name + " unreachable: " + strerror(errno), __func__);
+      target->mark(false);
+      close(fd);
+      return false;
+    }
+    ClientState& upstream = loop.clients.try_emplace(fd).first->second;
+    upstream.target = target;
+    upstream.connecting = true;
+    upstream.events = EPOLLOUT;
+    struct epoll_event event = {};
+    event.events = EPOLLOUT;
+    event.data.fd = fd;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  ClientState& upstream = loop.clients[fd];
+  upstream.reused = reuse && !upstream.connecting;
+  upstream.upstream_client = client_fd;
+  upstream.head = state.forwarded.compare(0, 5, "HEAD ") == 0;
+  upstream.write_buffer = state.forwarded;
+  target->active.fetch_add(1, std::memory_order_relaxed);
+  state.upstream_fd = fd;
+  if (!upstream.connecting) upstream_io(loop, fd, upstream, timers);
+  watch_tunneled(loop, fd, upstream);
+  return true;
+}
+
+// Connect completion, request out, response in. Called on every event of the connection.
+void ApiProxy::upstream_io(TunnelLoop& loop, int fd, ClientState& upstream, timer_wheel& timers) {
+  if (upstream.connecting) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+      logger::warn("Upstream " + upstream.target->name + " connect failed: " + strerror(error), __func__);
+      upstream.target->mark(false);
+      upstream.closed = true;
+      return;
+    }
+    upstream.connecting = false;
+    if (upstream.probe) {
+      upstream.target->mark(true);
+      upstream.closed = true;
+      return;
+    }
+  }
+
+  while (!upstream.write_buffer.empty()) {
+    ssize_t sent = send(fd, upstream.write_buffer.data(), upstream.write_buffer.size(), MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (sent <= 0) {
+      upstream.closed = true;
+      return;
+    }
+    upstream.write_buffer.erase(0, sent);
+  }
+
+  bool eof = false;
+  char buffer[16384];
+  while (true) {
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n > 0) {
+      upstream.read_buffer.append(buffer, n);
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    eof = true;
+    break;
+  }
+  if (upstream.upstream_client < 0) {
+    // Pooled: anything arriving means the connection is no longer usable
+    if (eof || !upstream.read_buffer.empty()) upstream.closed = true;
+    return;
+  }
+
+  bool until_close = false;
+  size_t length = 0;
+  while (true) {
+    length = response_length(upstream.read_buffer, upstream.head, until_close);
+    if (length == std::string::npos) {
+      // Where this response ends is unknown: nothing after it may reach a client
+      logger::warn("Malformed chunked response from upstream", __func__);
+      upstream.closed = true; // close_tunneled() answers 502
+      return;
+    }
+    // Interim 1xx (100 Continue ...) isn't the response
+    int status = length > 12 ? std::atoi(upstream.read_buffer.c_str() + 9) : 0;
+    if (status < 100 || status > 199 || status == 101) break;
+    upstream.read_buffer.erase(0, length);
+  }
+  if (until_close && eof) length = upstream.read_buffer.size();
+  if (length == 0) {
+    if (eof) upstream.closed = true; // close_tunneled() answers 502 or retries
+    return;
+  }
+
+  std::string response = upstream.read_buffer.substr(0, length);
+  upstream.read_buffer.erase(0, length);
+  size_t header_end = response.find("\r\n\r\n");
+  bool reusable = !eof && !until_close && upstream.read_buffer.empty() && wants_keep_alive(response, header_end);
+  int client_fd = upstream.upstream_client;
+  upstream.upstream_client = -1;
+  upstream.target->active.fetch_sub(1, std::memory_order_relaxed);
+  auto& idle = loop.idle[upstream.target];
+  if (reusable && (int)idle.size() < upstream.target->max_idle) {
+    idle.push_back(fd);
+  } else {
+    upstream.closed = true;
+  }
+
+  auto it = loop.clients.find(client_fd);
+  if (it == loop.clients.end() || it->second.upstream_fd != fd) return; // timed out or gone
+  ClientState& state = it->second;
+  state.upstream_fd = -1;
+  state.forwarded.clear();
+  state.trace.mark(tracing::replied);
+  if (until_close) state.keep_alive = false; // the client can't find the end either
+  queue_packet(state, std::move(response), timers);
+  write_client(client_fd, state, timers);
+  watch_tunneled(loop, client_fd, state);
+}
+
+void ApiProxy::upstream_failed(TunnelLoop& loop, int client_fd, const std::string& reason, timer_wheel& timers) {
+  ClientState& state = loop.clients[client_fd];
+  state.upstream_fd = -1;
+  state.forwarded.clear();
+  state.finish_request(); // not a queueing delay sample
+  http_pck response(502);
+  response.set_content("Content-Type", "text/plain");
+  response.set_body(reason);
+  queue_response(state, response, timers);
+  write_client(client_fd, state, timers);
+  watch_tunneled(loop, client_fd, state);
+}
+
+// TCP connect probe of every upstream of the group, see upstream_group
+void ApiProxy::probe_upstreams(TunnelLoop& loop, upstream_group& group, timer_wheel& timers) {
+  for (const auto& target : group.targets()) {
+    if (target->probing.exchange(true, std::memory_order_relaxed)) continue;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || (connect(fd, (const struct sockaddr*)&target->addr, sizeof(target->addr)) < 0 && errno != EINPROGRESS)) {
+      target->mark(false);
+      target->probing.store(false, std::memory_order_relaxed);
+      if (fd >= 0) close(fd);
+      continue;
+    }
+    ClientState& probe = loop.clients.try_emplace(fd).first->second;
+    probe.target = target.get();
+    probe.probe = true;
+    probe.connecting = true;
+    probe.events = EPOLLOUT;
+    probe.deadline.on_expire = [&loop, &probe, fd]() {
+      probe.target->mark(false);
+      probe.closed = true;
+      loop.closing.push_back(fd);
+    };
+    probe.arm(timers, ClientState::Phase::idle, group.config().connect_timeout_ms);
+    struct epoll_event event = {};
+    event.events = EPOLLOUT;
+    event.data.fd = fd;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &event);
   }
-  close(port_info.sfd);
 }
 
 void ApiProxy::handle_client(int client_fd, int listen_port) {
@@ -154,6 +2229,13 @@ void ApiProxy::handle_client(int client_fd, int listen_port) {
   }
 }
 
+http_pck ApiProxy::tunnel_response(const std::string& reply) {
+  http_pck response(200);
+  response.set_content("Content-Type", "text/plain");
+  response.set_body(reply);
+  return response;
+}
+
 http_pck ApiProxy::process_data(const std::string& request, int client_fd) {
   http_pck response;
   response.set_status(200);
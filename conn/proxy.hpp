@@ -1,6 +1,18 @@
 #pragma once
 
 #include "../util/pck.h"
+#include "../util/uring.h"
+#include "../util/tls.h"
+#include "../util/admission.h"
+#include "../util/upstream.h"
+#include "../util/capture.h"
+#include "../util/trace.h"
+#include "../util/h2.h"
+#include "../util/compress.h"
+#include "../util/fair_queue.h"
+#include "../util/router.h"
+#include "../util/socket_profile.h"
+#include "../util/unix_socket.h"
 
 #include <vector>
 #include <string>
@@ -12,16 +24,91 @@
 #include <sys/socket.h>
 #include <poll.h>
 #include <atomic>
+#include <memory>
+
+class timer_wheel;
+class WebSocketServer;
 
 class ApiProxy {
 public:
   using DataHandler = std::function<http_pck(const std::string&, int)>;
 
+  // Milliseconds, 0 disables the timeout
+  struct Timeouts {
+    int header_ms = 10000;  // accept (or first byte) -> end of headers
+    int body_ms = 30000;    // end of headers -> end of body
+    int idle_ms = 60000;    // keep-alive connection waiting for its next request
+    int tunnel_ms = 10000;  // request forwarded -> agent reply (set_tunnel() only)
+  };
+
   explicit ApiProxy(const std::vector<int>& ports);
   ~ApiProxy();
 
   void run();
   void set_data_handler(DataHandler handler);
+  // Before run(): requests matching a route of Table (a router::table<...>) are
+  // answered by it in the loop, after admission and before the data handler,
+  // the tunnel or the upstreams, which get everything else
+  template <typename Table>
+  void set_routes() { routes_ = &Table::dispatch; }
+  void set_timeouts(const Timeouts& timeouts);
+  void set_io_backend(io_backend backend); // Before run(), falls back to poll if io_uring is unusable
+  bool set_tls(int port, const tls_config& config); // Before run(), TLS listeners always use poll
+  bool set_socket_profile(int port, const socket_profile& profile); // Before run(), also applied to every shard's copy
+  // Before run(): plain HTTP on an AF_UNIX stream socket at path ("@name" =
+  // abstract namespace), served by the same loops as the ports (a thread of
+  // its own, or every shard accepting from this one socket). Port settings
+  // (TLS, passthrough, upstreams) don't apply; admission keys clients by uid
+  bool add_unix_listener(const std::string& path, const socket_profile& profile = {});
+  // Before run(): one pinned thread per shard, each with its own SO_REUSEPORT
+  // copy of every listener and its own connections. 0 = one shard per usable CPU.
+  void set_shards(int count = 0, bool pin_threads = true);
+  static int current_shard(); // Shard of the calling thread, -1 outside sharded mode
+  int shard_count() const { return shards_; }
+  // Before run(): integrated mode. Agents connect to tunnel's port (its handshake
+  // validator, TLS config and framing are used) and every proxy loop accepts them
+  // next to its HTTP clients, so a request is forwarded to an agent and its reply
+  // written back from the same thread. tunnel.run() must not be called; the data
+  // handler is bypassed, replies go through tunnel_response().
+  void set_tunnel(WebSocketServer& tunnel);
+  // Before run(): in-flight limits, per client IP token buckets (429) and
+  // CoDel-style shedding (503) once requests queue for longer than the target
+  void set_admission(const admission_config& config);
+  // Before run(): port relays raw TCP (L4) instead of parsing HTTP. With an
+  // upstream ("host:port") each connection is spliced to it through kernel pipes
+  // (no copy into user space); without one it becomes a stream multiplexed over
+  // the tunnel agents as binary frames [kind:1][stream:4][data], kind 1 = open
+  // (data: 2 byte listener port), 2 = data, 3 = end of that side's data.
+  // Needs set_tunnel() first; binary agent frames are then stream frames.
+  bool set_passthrough(int port, const std::string& upstream = "");
+  // Before run(): requests on port go straight to these upstreams ("host:port")
+  // over keep-alive connections pooled by each event loop, without blocking it.
+  // The data handler is bypassed, upstream responses are passed through as is.
+  bool set_upstreams(int port, const std::vector<std::string>& targets, const upstream_config& config = {});
+  // Before run(): every parsed request is appended to path with its arrival
+  // time and connection (util/capture.h), replay it with bench/replay
+  bool set_capture(const std::string& path);
+  // Before run(): per-request stage timestamps (util/trace.h), process wide so
+  // the tunnel's stages are included. Sampled requests are kept for
+  // export_trace(), any request with a stage over slow_ms is logged
+  void set_tracing(const trace_config& config);
+  static bool export_trace(const std::string& path); // Chrome / Perfetto JSON
+  // Before run(): plain listeners of the poll loop also speak HTTP/2 cleartext,
+  // by prior knowledge or "Upgrade: h2c". Each stream goes to the data handler
+  // like an HTTP/1.1 request (the io_uring and integrated loops stay HTTP/1.1)
+  void set_h2c(const h2_config& config = {});
+  // Before run(): handler and agent replies are gzip / brotli encoded when the
+  // client's Accept-Encoding, their Content-Type and size allow it (util/compress.h).
+  // A body is encoded on a shared thread pool while its connection waits, a repeated
+  // one comes from the cache inline. The io_uring loop only uses cached variants,
+  // HTTP/2 streams and upstream responses are left as they are
+  void set_compression(const compression_config& config = {});
+  // Before run(), with set_tunnel(): requests wait in per client (or per Host)
+  // queues and are forwarded by weighted deficit round robin whenever an agent
+  // has fewer than inflight_per_agent unanswered, so a burst from one client
+  // doesn't delay the others. Per flow wait and latency go to export_fair_queues()
+  void set_fair_queueing(const fair_queue_config& config = {});
+  bool export_fair_queues(const std::string& path);
 
   std::string response_get_host(std::string request);
   std::string response_get_path(std::string request);
@@ -31,10 +118,20 @@ protected:
     int port;
     int sfd;
     struct sockaddr_in addr;
+    std::shared_ptr<tls_context> tls;
+    std::shared_ptr<admission_gate> gate; // shared by every shard, see set_admission()
+    bool raw = false;                     // set_passthrough()
+    std::string upstream;                 // "host:port", empty = through the tunnel
+    struct sockaddr_in upstream_addr = {};
+    std::shared_ptr<upstream_group> upstreams; // set_upstreams()
+    socket_profile profile;                    // set_socket_profile(), applied by listen
+    std::string unix_path;                     // add_unix_listener(), port is 0
     PortInfo(int p, int fd, struct sockaddr_in a) : port(p), sfd(fd), addr(a) {}
+    std::string name() const { return unix_path.empty() ? "port " + std::to_string(port) : unix_path; }
   };
 
   virtual http_pck process_data(const std::string& request, int client_fd);
+  virtual http_pck tunnel_response(const std::string& reply); // 200 text/plain by default
 
 private:
   std::vector<PortInfo> ports_;
@@ -42,8 +139,77 @@ private:
   std::mutex ports_mutex_;
   std::atomic<bool> running_{true};
   DataHandler custom_handler_;
+  bool (*routes_)(const std::string& request, int client_fd, http_pck& response) = nullptr; // set_routes()
+  Timeouts timeouts_;
+  io_backend io_backend_ = io_backend::readiness;
+  bool sharded_ = false;
+  int shards_ = 0;
+  bool pin_shards_ = true;
+  WebSocketServer* tunnel_ = nullptr;
+  admission_config admission_;
+  std::unique_ptr<token_buckets> buckets_;
+  std::unique_ptr<capture_writer> capture_;
+  bool h2c_ = false;
+  h2_config h2c_config_;
+  std::unique_ptr<compression::compressor> compressor_;
+  fair_queue_config fair_config_;
+  std::unique_ptr<fair_queue_stats> fair_stats_; // set_fair_queueing()
+
+  struct ClientState;
+  struct TunnelLoop;
+  static thread_local TunnelLoop* local_tunnel_;
+  static thread_local std::shared_ptr<compression::completions> local_compressed_; // loops that wait for the pool
 
   PortInfo setup_port(int port);
-  void listen_on_port(PortInfo port_info);
+  void run_shards();
+  void listen_on_port(std::vector<PortInfo> listeners);
+  void read_client(int client_fd, ClientState& state, timer_wheel& timers);
+  void write_client(int client_fd, ClientState& state, timer_wheel& timers);
+  bool listen_on_port_uring(const std::vector<PortInfo>& listeners); // false when the ring can't be set up or its accept fails, listeners stay open
+  bool dispatch_request(ClientState& state, int client_fd, timer_wheel& timers); // true once a response is queued
+  void queue_response(ClientState& state, http_pck& response, timer_wheel& timers);
+  void queue_packet(ClientState& state, std::string packet, timer_wheel& timers); // already serialized
+  void start_response(ClientState& state, timer_wheel& timers); // admission sample, writing phase
+  void track_client(ClientState& state, const PortInfo& port_info, int client_fd); // admission state of a new connection
+  bool admit(ClientState& state, timer_wheel& timers); // false once a 429/503 is queued instead
+  short admission_status(ClientState& state);
+  bool response_sent(ClientState& state, int client_fd, timer_wheel& timers); // true if a pipelined response is queued
   void handle_client(int client_fd, int listen_port);
+
+  // Response compression (see set_compression())
+  bool compress_response(ClientState& state, int client_fd, http_pck& response, timer_wheel& timers); // true once the body is on the pool
+  void take_compressed(std::unordered_map<int, ClientState>& clients, std::vector<int>& ready, timer_wheel& timers); // queues finished responses
+
+  // HTTP/2 cleartext (see set_h2c()), poll loop only
+  bool h2_preface(int client_fd, ClientState& state, timer_wheel& timers); // true while the connection is (becoming) HTTP/2
+  bool h2_upgrade(ClientState& state, int client_fd, size_t header_end, timer_wheel& timers);
+  void h2_io(int client_fd, ClientState& state, timer_wheel& timers);
+  void h2_respond(ClientState& state, int client_fd, uint32_t stream, bool head);
+
+  // Integrated tunnel mode (see set_tunnel())
+  void listen_tunneled(const std::vector<PortInfo>& listeners, const std::string& name);
+  bool forward_request(TunnelLoop& loop, ClientState& state, int client_fd, const std::string& request, timer_wheel& timers);
+  int pick_agent(TunnelLoop& loop, size_t limit); // least loaded agent under limit, -1 if none
+  void send_to_agent(TunnelLoop& loop, int agent_fd, int client_fd, ClientState& state); // state.request, as state.tunnel_request
+  void schedule_requests(TunnelLoop& loop, timer_wheel& timers); // fair queueing: forwards while agents have room
+  void agent_io(TunnelLoop& loop, int agent_fd, ClientState& agent, timer_wheel& timers);
+  void flush_agent(int agent_fd, ClientState& agent);
+  uint64_t flush_batches(TunnelLoop& loop); // writes due request batches, microseconds until the next one
+  void watch_tunneled(TunnelLoop& loop, int fd, ClientState& state); // epoll interest from the state, queues closed ones
+  void agent_reply(TunnelLoop& loop, ClientState& agent, const std::string& reply, timer_wheel& timers);
+  void close_tunneled(TunnelLoop& loop, int fd, timer_wheel& timers);
+  void open_stream(TunnelLoop& loop, int client_fd, ClientState& state, int port);
+  void stream_io(TunnelLoop& loop, int client_fd, ClientState& state);
+  void agent_stream(TunnelLoop& loop, int agent_fd, const std::string& payload);
+  void stream_frame(ClientState& agent, uint8_t kind, uint32_t stream, const char* data = nullptr, size_t len = 0);
+
+  // Direct upstreams (see set_upstreams()), in the same loop as the tunnel
+  bool proxy_request(TunnelLoop& loop, ClientState& state, int client_fd, const std::string& request, timer_wheel& timers);
+  bool send_upstream(TunnelLoop& loop, int client_fd, ClientState& state, upstream_target* target, bool reuse, timer_wheel& timers);
+  void upstream_io(TunnelLoop& loop, int fd, ClientState& upstream, timer_wheel& timers);
+  void upstream_failed(TunnelLoop& loop, int client_fd, const std::string& reason, timer_wheel& timers);
+  void probe_upstreams(TunnelLoop& loop, upstream_group& group, timer_wheel& timers);
+
+  // Spliced passthrough (relay.cpp)
+  void relay_loop(std::vector<PortInfo> listeners);
 };
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include "proxy.hpp"
+#include "../util/logger.h"
+
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+namespace {
+  constexpr int pipe_size = 1 << 20;
+
+  /*
+  #### One spliced connection: client <-> upstream through two pipes
+  - Bytes go socket -> pipe -> socket with splice(), they never reach user space
+  - Each direction half-closes on its own: EOF from one side is passed on with
+    shutdown(SHUT_WR) once its pipe is drained
+  */
+  struct Relay {
+    struct Direction {
+      int from = -1;
+      int to = -1;
+      int pipe[2] = {-1, -1};
+      size_t pending = 0; // bytes sitting in the pipe
+      size_t capacity = 0; // of the pipe, F_SETPIPE_SZ may have been refused
+      bool eof = false;
+      bool done = false;  // EOF passed on
+    };
+
+    Direction up;   // client -> upstream
+    Direction down; // upstream -> client
+    bool connected = false;
+    bool failed = false;
+
+    ~Relay() {
+      for (Direction* d : {&up, &down}) {
+        if (d->pipe[0] >= 0) close(d->pipe[0]);
+        if (d->pipe[1] >= 0) close(d->pipe[1]);
+      }
+    }
+
+    bool open_pipes() {
+      for (Direction* d : {&up, &down}) {
+        if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) return false;
+        fcntl(d->pipe[1], F_SETPIPE_SZ, pipe_size); // best effort, above fs.pipe-max-size it fails
+        int size = fcntl(d->pipe[1], F_GETPIPE_SZ);
+        d->capacity = size > 0 ? (size_t)size : 65536;
+      }
+      return true;
+    }
+
+    // Moves what it can, false on a hard error
+    static bool pump(Direction& d) {
+      while (!d.done) {
+        if (!d.eof && d.pending < d.capacity) { // a 0 byte splice() would read as EOF
+          ssize_t n = splice(d.from, nullptr, d.pipe[1], nullptr, d.capacity - d.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (n > 0) {
+            d.pending += n;
+          } else if (n == 0) {
+            d.eof = true;
+          } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+          }
+        }
+        if (d.pending > 0) {
+          ssize_t n = splice(d.pipe[0], nullptr, d.to, nullptr, d.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (n > 0) {
+            d.pending -= n;
+            continue;
+          }
+          if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return false;
+          return true; // destination full
+        }
+        if (d.eof) {
+          shutdown(d.to, SHUT_WR);
+          d.done = true;
+        }
+        return true; // source drained
+      }
+      return true;
+    }
+
+    // Read while the pipe has room, write while it holds data
+    uint32_t events_for(int fd) const {
+      if (!connected) return fd == up.to ? EPOLLOUT : 0;
+      uint32_t events = 0;
+      for (const Direction* d : {&up, &down}) {
+        if (d->from == fd && !d->eof && d->pending < d->capacity) events |= EPOLLIN;
+        if (d->to == fd && d->pending > 0) events |= EPOLLOUT;
+      }
+      return events;
+    }
+
+    bool finished() const { return failed || (up.done && down.done); }
+  };
+}
+
+// Spliced passthrough ports: accept, connect to the upstream, then only splice().
+// Own epoll loop, one per port in thread-per-port mode, one per shard otherwise.
+void ApiProxy::relay_loop(std::vector<PortInfo> listeners) {
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    logger::error("Failed to create epoll instance for passthrough", __func__);
+    return;
+  }
+  std::unordered_map<int, const PortInfo*> accepting;
+  for (const auto& listener : listeners) {
+    if (!listener.profile.listen_on(listener.sfd)) {
+      logger::error("Listen failed on port " + std::to_string(listener.port), __func__);
+      continue;
+    }
+    accepting[listener.sfd] = &listener;
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = listener.sfd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener.sfd, &event);
+    logger::info("Port " + std::to_string(listener.port) + " spliced to " + listener.upstream, __func__);
+  }
+
+  std::unordered_map<int, std::shared_ptr<Relay>> relays; // both fds of a relay
+  std::unordered_map<int, uint32_t> registered;
+
+  auto watch = [&](int fd, const Relay& relay) {
+    uint32_t events = relay.events_for(fd);
+    auto it = registered.find(fd);
+    if (it != registered.end() && it->second == events) return;
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, it == registered.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+    registered[fd] = events;
+  };
+
+  auto drop = [&](std::shared_ptr<Relay> relay) {
+    for (int fd : {relay->up.from, relay->up.to}) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+      registered.erase(fd);
+      relays.erase(fd);
+      close(fd);
+    }
+  };
+
+  auto accept_on = [&](const PortInfo& port_info) {
+    while (true) {
+      int client_fd = accept4(port_info.sfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_fd < 0) break;
+      int upstream_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      auto relay = std::make_shared<Relay>();
+      if (upstream_fd < 0 || !relay->open_pipes()) {
+        logger::error("Passthrough setup failed: " + std::string(strerror(errno)), __func__);
+        if (upstream_fd >= 0) close(upstream_fd);
+        close(client_fd);
+        continue;
+      }
+      int one = 1;
+      setsockopt(upstream_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (connect(upstream_fd, (const struct sockaddr*)&port_info.upstream_addr, sizeof(port_info.upstream_addr)) < 0 &&
+          errno != EINPROGRESS) {
+        logger::warn("Upstream " + port_info.upstream + " unreachable: " + strerror(errno), __func__);
+        close(upstream_fd);
+        close(client_fd);
+        continue;
+      }
+      relay->up.from = relay->down.to = client_fd;
+      relay->up.to = relay->down.from = upstream_fd;
+      relays[client_fd] = relays[upstream_fd] = relay;
+      watch(client_fd, *relay);
+      watch(upstream_fd, *relay);
+    }
+  };
+
+  struct epoll_event events[64];
+  while (running_) {
+    int n = epoll_wait(epoll_fd, events, 64, 1000);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      logger::error("epoll_wait failed: " + std::string(strerror(errno)), __func__);
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      auto listener = accepting.find(fd);
+      if (listener != accepting.end()) {
+        accept_on(*listener->second);
+        continue;
+      }
+      auto it = relays.find(fd);
+      if (it == relays.end()) continue;
+      std::shared_ptr<Relay> relay = it->second;
+
+      if (!relay->connected && fd == relay->up.to) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(relay->up.to, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error == 0 && (events[i].events & EPOLLOUT)) {
+          relay->connected = true;
+        } else if (error != 0) {
+          logger::warn("Upstream connect failed: " + std::string(strerror(error)), __func__);
+          relay->failed = true;
+        }
+      }
+      if (relay->connected && !relay->failed)
+        relay->failed = !Relay::pump(relay->up) || !Relay::pump(relay->down);
+      // Hang up with nothing left to read: the peer is gone both ways
+      if ((events[i].events & EPOLLERR) || (events[i].events & (EPOLLHUP | EPOLLIN)) == EPOLLHUP)
+        relay->failed = true;
+
+      if (relay->finished()) {
+        drop(relay);
+        continue;
+      }
+      watch(relay->up.from, *relay);
+      watch(relay->up.to, *relay);
+    }
+  }
+
+  while (!relays.empty()) drop(relays.begin()->second);
+  for (const auto& listener : listeners) close(listener.sfd);
+  close(epoll_fd);
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+# Self-signed certificate for local TLS testing:
+#   SYMM_TLS_CERT=./certs/server.crt SYMM_TLS_KEY=./certs/server.key ./symm
+#   curl -k https://localhost:3000/
+
+CERT_DIR=${CERT_DIR:-./certs}
+mkdir -p "$CERT_DIR"
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 \
+  -keyout "$CERT_DIR/server.key" -out "$CERT_DIR/server.crt" \
+  -subj "/CN=localhost" -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" 2>/dev/null
+
+echo "[✓] Certificate written to $CERT_DIR/server.crt ($CERT_DIR/server.key)"
@@ -21,7 +21,7 @@ int main() {
     logger::info("Client socket: " + std::to_string(client_fd), "lambda");
 
     // Wait for a response from any WebSocket client (simple synchronous example)
-    std::string ws_response = ws_server.receive_response(); // You need to implement receive_response() in WebSocketServer
+    std::string ws_response = ws_server.receive_response(10000); // Empty after 10 s without an answer
     if (ws_response.empty()) {
       logger::warn("No response from WebSocket client", "lambda");
     } else {
@@ -57,8 +57,53 @@ int main() {
 
 #include "conn/proxy.hpp"
 
+#include <cstdlib>
+
+static constexpr char health_path[] = "/health";
+
+static http_pck health(const router::request&) {
+  http_pck response(200);
+  response.set_content("Content-Type", "text/plain");
+  response.set_body("ok");
+  return response;
+}
+
+// Answered by symm itself, everything else goes to the data handler
+using local_routes = router::table<
+  router::route<router::method::get, health_path, health>>;
+
 int main() {
-  ApiProxy proxy({3000, 5000});
+  std::vector<listener_config> listeners = {{3000, {}}, {5000, {}}};
+  const char* listener_file = std::getenv("SYMM_LISTENERS"); // "<port> [preset] [key=value ...]" per line
+  if (listener_file && !load_listeners(listener_file, listeners)) return 1;
+  std::vector<int> ports;
+  for (const auto& listener : listeners) {
+    if (listener.path.empty()) ports.push_back(listener.port);
+  }
+  ApiProxy proxy(ports);
+  for (const auto& listener : listeners) {
+    if (listener.path.empty()) proxy.set_socket_profile(listener.port, listener.profile);
+    else proxy.add_unix_listener(listener.path, listener.profile);
+  }
+  const char* backend = std::getenv("SYMM_IO_BACKEND");
+  if (backend && std::string(backend) == "io_uring") {
+    proxy.set_io_backend(io_backend::uring);
+  }
+  const char* cert = std::getenv("SYMM_TLS_CERT");
+  const char* key = std::getenv("SYMM_TLS_KEY");
+  if (cert && key) {
+    tls_config tls;
+    tls.cert_file = cert;
+    tls.key_file = key;
+    if (!ports.empty()) proxy.set_tls(ports.front(), tls);
+  }
+  const char* capture = std::getenv("SYMM_CAPTURE");
+  if (capture) proxy.set_capture(capture); // replay with bench/replay
+  if (std::getenv("SYMM_H2C")) proxy.set_h2c(); // HTTP/2 cleartext on the plain ports
+  if (std::getenv("SYMM_COMPRESS")) proxy.set_compression(); // gzip / br per Accept-Encoding
+  const char* shards = std::getenv("SYMM_SHARDS");
+  if (shards) proxy.set_shards(std::atoi(shards)); // 0 = one per usable CPU
+  proxy.set_routes<local_routes>();
   proxy.set_data_handler([](const std::string& request, int client_fd) -> http_pck {
     http_pck response;
     response.set_status(200);
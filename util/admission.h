@@ -0,0 +1,194 @@
+#pragma once
+
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct admission_config {
+  int max_inflight_per_listener = 0; // requests between parse and end of response, 0 = unlimited
+  int max_inflight_per_agent = 0;    // requests waiting on one tunnel agent (set_tunnel() mode), 0 = unlimited
+  double ip_rate = 0;                // requests/s per client IP, 0 disables the buckets
+  double ip_burst = 20;
+  int target_delay_ms = 0;           // CoDel target queueing delay, 0 disables shedding
+  int interval_ms = 100;             // how long the delay must stay above target
+};
+
+/*
+#### Lock-free token buckets keyed by client address
+- Fixed open addressing table, a slot is claimed with one CAS and never freed:
+  a bucket left alone refills to its burst, so a stale slot costs nothing
+- Each bucket is a single 64-bit word (refill time << 24 | milli-tokens) updated
+  with CAS, any thread may call take() concurrently
+- When the probe window is full the key shares its home slot's bucket
+*/
+class token_buckets {
+public:
+  token_buckets(double rate, double burst, size_t slots = 65536)
+    : rate_(rate), burst_milli_(std::min<uint64_t>((uint64_t)(burst * 1000), token_mask)),
+      mask_(round_up(slots) - 1), slots_(new slot[mask_ + 1]),
+      origin_ms_(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() - 1) {}
+
+  token_buckets(const token_buckets&) = delete;
+  token_buckets& operator=(const token_buckets&) = delete;
+
+  // Takes one token for key, false if its bucket is empty.
+  // now_ms on the steady clock, like timer_wheel::now_ms()
+  bool take(uint64_t key, uint64_t now_ms) {
+    slot& s = find(key);
+    uint64_t now = now_ms > origin_ms_ ? now_ms - origin_ms_ : 1;
+
+    uint64_t old = s.state.load(std::memory_order_relaxed);
+    while (true) {
+      uint64_t last = old >> token_bits;
+      uint64_t tokens = old ? old & token_mask : burst_milli_;
+      if (now > last) tokens = std::min<uint64_t>(burst_milli_, tokens + (uint64_t)((now - last) * rate_));
+      if (tokens < 1000) return false;
+      uint64_t next = (now << token_bits) | (tokens - 1000);
+      if (s.state.compare_exchange_weak(old, next, std::memory_order_relaxed)) return true;
+    }
+  }
+
+private:
+  static constexpr int token_bits = 24;
+  static constexpr uint64_t token_mask = (1ULL << token_bits) - 1;
+  static constexpr size_t probes = 16;
+
+  struct alignas(16) slot {
+    std::atomic<uint64_t> key{0};
+    std::atomic<uint64_t> state{0}; // 0 = never used, full bucket
+  };
+
+  double rate_; // milli-tokens per ms == tokens per second
+  uint64_t burst_milli_;
+  size_t mask_;
+  std::unique_ptr<slot[]> slots_;
+  uint64_t origin_ms_;
+
+  static size_t round_up(size_t n) {
+    size_t size = 1;
+    while (size < n) size <<= 1;
+    return size;
+  }
+
+  slot& find(uint64_t key) {
+    uint64_t tagged = key | (1ULL << 63); // 0 marks a free slot
+    size_t home = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+    for (size_t i = 0; i < probes; ++i) {
+      slot& s = slots_[(home + i) & mask_];
+      uint64_t current = s.key.load(std::memory_order_acquire);
+      if (current == tagged) return s;
+      if (current == 0 && (s.key.compare_exchange_strong(current, tagged, std::memory_order_acq_rel) || current == tagged))
+        return s;
+    }
+    return slots_[home];
+  }
+};
+
+/*
+#### In-flight limit and CoDel-style shedding for one listener
+- try_enter() admits a request while the listener is under its in-flight limit;
+  leave() once its response is written (or the client is gone)
+- observe() feeds the time a request spent inside the proxy before its response
+  was ready. Like CoDel, a delay that stays above target for a whole interval is
+  a standing queue: the gate then caps in-flight requests at half of what was in
+  flight, cuts again while the queue persists (sooner each time, CoDel's
+  interval / sqrt(count)), and raises the cap by one per `cap` requests done
+  under target until it is twice the concurrency that built the queue (AIMD)
+- Refused requests get a fast 503 instead of joining the queue, so the admitted
+  ones keep a flat latency; shared by every shard serving the listener, relaxed atomics only
+*/
+class admission_gate {
+public:
+  admission_gate(const std::string& name, int max_inflight, int target_ms, int interval_ms)
+    : name_(name), max_inflight_(max_inflight), target_ms_(target_ms), interval_ms_(interval_ms) {}
+
+  bool try_enter() {
+    int cap = cap_.load(std::memory_order_relaxed);
+    int inflight = inflight_.fetch_add(1, std::memory_order_relaxed);
+    bool over_cap = cap > 0 && inflight >= cap;
+    if (over_cap || (max_inflight_ > 0 && inflight >= max_inflight_)) {
+      inflight_.fetch_sub(1, std::memory_order_relaxed);
+      (over_cap ? shed_delay_ : shed_limit_).fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    admitted_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void observe(uint64_t delay_ms, uint64_t now_ms) {
+    if (target_ms_ <= 0) return;
+    if (delay_ms < (uint64_t)target_ms_) {
+      first_above_ms_.store(0, std::memory_order_relaxed);
+      int cap = cap_.load(std::memory_order_relaxed);
+      if (cap == 0) return;
+      // Well past the concurrency that built the queue: capacity is back
+      if (cap > 2 * entry_inflight_.load(std::memory_order_relaxed)) {
+        cuts_ = 0;
+        if (cap_.exchange(0, std::memory_order_relaxed))
+          logger::info("Queueing delay back under target on " + name_ + ", admitting again", __func__);
+      } else if (good_.fetch_add(1, std::memory_order_relaxed) + 1 >= cap) {
+        // Additive increase: one more per `cap` requests done under target
+        good_.store(0, std::memory_order_relaxed);
+        cap_.compare_exchange_strong(cap, cap + 1, std::memory_order_relaxed);
+      }
+      return;
+    }
+    int cap = cap_.load(std::memory_order_relaxed);
+    if (cap > 0) {
+      // Standing queue while capped: cut again, sooner each time (CoDel's interval / sqrt(count))
+      uint64_t next = next_cut_ms_.load(std::memory_order_relaxed);
+      if (now_ms < next || !next_cut_ms_.compare_exchange_strong(next, now_ms + cut_spacing(++cuts_), std::memory_order_relaxed))
+        return;
+      cap_.store(std::max(1, std::min(cap, inflight()) / 2), std::memory_order_relaxed);
+      return;
+    }
+    uint64_t first_above = first_above_ms_.load(std::memory_order_relaxed);
+    if (first_above == 0) {
+      first_above_ms_.compare_exchange_strong(first_above, now_ms + interval_ms_, std::memory_order_relaxed);
+    } else if (now_ms >= first_above && first_above_ms_.compare_exchange_strong(first_above, 0, std::memory_order_relaxed)) {
+      int next = std::max(1, inflight() / 2);
+      entry_inflight_.store(inflight(), std::memory_order_relaxed);
+      cuts_ = 1;
+      next_cut_ms_.store(now_ms + cut_spacing(1), std::memory_order_relaxed);
+      cap_.store(next, std::memory_order_relaxed);
+      logger::warn("Queueing delay " + std::to_string(delay_ms) + " ms above target on " + name_ +
+        ", shedding load (in flight capped at " + std::to_string(next) + ")", __func__);
+    }
+  }
+
+  void leave() { inflight_.fetch_sub(1, std::memory_order_relaxed); }
+
+  int inflight() const { return inflight_.load(std::memory_order_relaxed); }
+  bool shedding() const { return cap_.load(std::memory_order_relaxed) > 0; }
+  uint64_t admitted() const { return admitted_.load(std::memory_order_relaxed); }
+  uint64_t shed_limit() const { return shed_limit_.load(std::memory_order_relaxed); }
+  uint64_t shed_delay() const { return shed_delay_.load(std::memory_order_relaxed); }
+
+private:
+  std::string name_;
+  int max_inflight_;
+  int target_ms_;
+  int interval_ms_;
+  std::atomic<int> inflight_{0};
+  std::atomic<int> cap_{0}; // 0 = not shedding
+  std::atomic<int> good_{0};
+  std::atomic<uint64_t> next_cut_ms_{0};
+  std::atomic<int> cuts_{0};
+  std::atomic<int> entry_inflight_{0};
+
+  uint64_t cut_spacing(int cuts) const {
+    return std::max<uint64_t>(target_ms_, (uint64_t)(interval_ms_ / std::sqrt((double)cuts)));
+  }
+  std::atomic<uint64_t> first_above_ms_{0};
+  std::atomic<uint64_t> admitted_{0};
+  std::atomic<uint64_t> shed_limit_{0};
+  std::atomic<uint64_t> shed_delay_{0};
+};
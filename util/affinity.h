@@ -0,0 +1,41 @@
+#pragma once
+
+#include "logger.h"
+
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+#### CPU placement helpers for the sharded runtime
+*/
+namespace affinity {
+
+  // CPUs this process may run on (respects taskset / cgroup cpusets)
+  inline std::vector<int> usable_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+    if (cpus.empty()) cpus.push_back(0);
+    return cpus;
+  }
+
+  inline bool pin_thread(std::thread& thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if (error != 0) {
+      logger::warn("Failed to pin thread to CPU " + std::to_string(cpu) + ": " + strerror(error), __func__);
+      return false;
+    }
+    return true;
+  }
+
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+#### Capture file of proxied requests
+- "SYMMCAP1", then one record per request, little endian:
+  [u64 µs since capture start][u32 connection][u16 port][u32 length][request]
+- Connection ids are unique within a file, requests of one connection are in
+  order; records of different event loops are not sorted by time
+*/
+namespace capture_format {
+  constexpr char magic[8] = {'S', 'Y', 'M', 'M', 'C', 'A', 'P', '1'};
+  constexpr size_t header_size = 8 + 4 + 2 + 4;
+}
+
+/*
+#### Capture writer
+- record() appends to a buffer owned by the calling thread (its lock is only
+  ever contended by the writer swapping it out), one writer thread moves full
+  buffers (or every 200 ms) to the file: the event loop never waits on the disk
+- A thread whose buffer reaches max_backlog because the disk can't keep up
+  drops records instead of growing, dropped() counts them
+*/
+class capture_writer {
+public:
+  static std::unique_ptr<capture_writer> open(const std::string& path, size_t max_backlog = 16 << 20) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, capture_format::magic, sizeof(capture_format::magic)) != (ssize_t)sizeof(capture_format::magic)) {
+      logger::error("Can't create capture file " + path, __func__);
+      if (fd >= 0) close(fd);
+      return nullptr;
+    }
+    return std::unique_ptr<capture_writer>(new capture_writer(fd, max_backlog));
+  }
+
+  ~capture_writer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    close(fd_);
+    if (dropped_) logger::warn("Capture dropped " + std::to_string(dropped_.load()) + " requests", __func__);
+  }
+
+  capture_writer(const capture_writer&) = delete;
+  capture_writer& operator=(const capture_writer&) = delete;
+
+  uint32_t next_connection() { return connections_.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+  void record(uint32_t connection, uint16_t port, const std::string& request) {
+    uint64_t time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start_).count();
+    uint32_t length = (uint32_t)request.size();
+    char header[capture_format::header_size];
+    memcpy(header, &time_us, 8); // x86 and arm64 are little endian
+    memcpy(header + 8, &connection, 4);
+    memcpy(header + 12, &port, 2);
+    memcpy(header + 14, &length, 4);
+
+    local_buffer& buffer = local();
+    bool full;
+    {
+      std::lock_guard<std::mutex> lock(buffer.mutex);
+      if (buffer.data.size() + sizeof(header) + length > max_backlog_) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      buffer.data.append(header, sizeof(header));
+      buffer.data.append(request);
+      full = buffer.data.size() >= flush_size;
+    }
+    if (full) wake_.notify_one();
+  }
+
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t flush_size = 64 << 10;
+
+  struct local_buffer {
+    std::mutex mutex;
+    std::string data;
+  };
+
+  int fd_;
+  size_t max_backlog_;
+  uint64_t id_ = next_id(); // tells a thread's cached buffer from a previous writer's
+  std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+  std::atomic<uint32_t> connections_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::mutex mutex_; // buffers_ and stopping_
+  std::condition_variable wake_;
+  std::vector<std::unique_ptr<local_buffer>> buffers_;
+  bool stopping_ = false;
+  std::thread writer_;
+
+  capture_writer(int fd, size_t max_backlog) : fd_(fd), max_backlog_(max_backlog) {
+    writer_ = std::thread(&capture_writer::write_loop, this);
+  }
+
+  local_buffer& local() {
+    thread_local uint64_t owner = 0;
+    thread_local local_buffer* buffer = nullptr;
+    if (owner != id_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.push_back(std::make_unique<local_buffer>());
+      buffer = buffers_.back().get();
+      owner = id_;
+    }
+    return *buffer;
+  }
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> ids{0};
+    return ids.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  void write_loop() {
+    std::string out;
+    bool stopping = false;
+    while (!stopping) {
+      std::vector<local_buffer*> buffers;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait_for(lock, std::chrono::milliseconds(200));
+        stopping = stopping_;
+        for (auto& buffer : buffers_) buffers.push_back(buffer.get());
+      }
+      for (local_buffer* buffer : buffers) {
+        {
+          std::lock_guard<std::mutex> lock(buffer->mutex);
+          out.swap(buffer->data);
+        }
+        size_t written = 0;
+        while (written < out.size()) {
+          ssize_t n = write(fd_, out.data() + written, out.size() - written);
+          if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            logger::error("Capture write failed: " + std::string(strerror(errno)), __func__);
+            break;
+          }
+          written += n;
+        }
+        out.clear();
+      }
+    }
+  }
+};
+
+// Reads a capture file through one read-only mapping, records point into it
+class capture_reader {
+public:
+  struct record {
+    uint64_t time_us;
+    uint32_t connection;
+    uint16_t port;
+    std::string_view request;
+  };
+
+  capture_reader() = default;
+  capture_reader(const capture_reader&) = delete;
+  capture_reader& operator=(const capture_reader&) = delete;
+  ~capture_reader() {
+    if (data_) munmap((void*)data_, size_);
+  }
+
+  bool open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st = {};
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(capture_format::magic)) {
+      logger::error("Can't read capture file " + path, __func__);
+      if (fd >= 0) close(fd);
+      return false;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      logger::error("Can't map capture file " + path, __func__);
+      return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    data_ = (const char*)data;
+    size_ = st.st_size;
+    if (memcmp(data_, capture_format::magic, sizeof(capture_format::magic)) != 0) {
+      logger::error(path + " is not a capture file", __func__);
+      offset_ = size_;
+      return false;
+    }
+    offset_ = sizeof(capture_format::magic);
+    return true;
+  }
+
+  // false at the end (a record cut short by a crash ends the file)
+  bool next(record& out) {
+    if (!data_ || offset_ + capture_format::header_size > size_) return false;
+    const char* at = data_ + offset_;
+    uint32_t length;
+    memcpy(&out.time_us, at, 8);
+    memcpy(&out.connection, at + 8, 4);
+    memcpy(&out.port, at + 12, 2);
+    memcpy(&length, at + 14, 4);
+    if (offset_ + capture_format::header_size + length > size_) return false;
+    out.request = std::string_view(at + capture_format::header_size, length);
+    offset_ += capture_format::header_size + length;
+    return true;
+  }
+
+private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t offset_ = 0;
+};
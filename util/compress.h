@@ -0,0 +1,357 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+#ifdef SYMM_BROTLI
+#include <brotli/encode.h>
+#endif
+
+struct compression_config {
+  size_t min_size = 1024;     // smaller bodies go out as they are
+  size_t max_size = 8 << 20;  // and so do larger ones, they would hold a pool thread too long
+  std::vector<std::string> types = { // Content-Type prefixes worth compressing
+    "text/", "application/json", "application/javascript", "application/xml", "image/svg+xml"};
+  int gzip_level = 6;
+  int brotli_quality = 5;     // 0-11, only with brotli built in (SYMM_BROTLI)
+  int threads = 2;
+  size_t max_queued = 256;    // bodies waiting for a thread, past that they go out uncompressed
+  size_t cache_bytes = 32 << 20; // compressed variants kept, 0 = no cache
+};
+
+/*
+#### Response compression
+- negotiate() picks the encoding from Accept-Encoding (q-values honoured, br
+  before gzip on a tie) once the Content-Type and size qualify
+- Encoding runs on a fixed pool of threads with a bounded queue: the event loop
+  hands a body over and gets it back through a completions queue, whose
+  eventfd it polls next to its sockets
+- Variants are cached by content: looked up by 64 bit hash, size and
+  encoding, then the body is compared with the one the variant was made from
+  (kept alongside, and counted in cache_bytes): a colliding body is a miss,
+  never another body's variant. LRU within cache_bytes. A body that doesn't
+  shrink is cached as such (empty variant) and sent unencoded from then on
+*/
+namespace compression {
+  enum class coding : uint8_t { identity, gzip, br };
+
+  inline std::string_view name(coding c) {
+    return c == coding::gzip ? "gzip" : c == coding::br ? "br" : "identity";
+  }
+
+  constexpr bool brotli_available() {
+#ifdef SYMM_BROTLI
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  inline bool equals_nocase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+      if ((a[i] | 0x20) != (b[i] | 0x20)) return false;
+    }
+    return true;
+  }
+
+  inline std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+  }
+
+  // Best encoding the client accepts, identity when none (or only q=0 ones)
+  inline coding negotiate(std::string_view accept_encoding) {
+    double gzip_q = 0, br_q = 0, any_q = -1;
+    bool gzip_seen = false, br_seen = false;
+    while (!accept_encoding.empty()) {
+      size_t comma = accept_encoding.find(',');
+      std::string_view item = accept_encoding.substr(0, comma);
+      accept_encoding = comma == std::string_view::npos ? std::string_view() : accept_encoding.substr(comma + 1);
+
+      size_t semicolon = item.find(';');
+      std::string_view token = trim(item.substr(0, semicolon));
+      double q = 1;
+      if (semicolon != std::string_view::npos) {
+        std::string_view param = trim(item.substr(semicolon + 1));
+        if (param.size() > 2 && (param[0] | 0x20) == 'q' && param[1] == '=') {
+          q = std::strtod(std::string(param.substr(2)).c_str(), nullptr);
+        }
+      }
+      if (equals_nocase(token, "gzip") || equals_nocase(token, "x-gzip")) {
+        gzip_q = q;
+        gzip_seen = true;
+      } else if (equals_nocase(token, "br")) {
+        br_q = q;
+        br_seen = true;
+      } else if (token == "*") {
+        any_q = q;
+      }
+    }
+    if (!gzip_seen && any_q >= 0) gzip_q = any_q;
+    if (!br_seen && any_q >= 0) br_q = any_q;
+    if (!brotli_available()) br_q = 0;
+    if (br_q > 0 && br_q >= gzip_q) return coding::br;
+    return gzip_q > 0 ? coding::gzip : coding::identity;
+  }
+
+  // content_type is the header value ("text/html; charset=utf-8")
+  inline bool compressible(std::string_view content_type, const compression_config& config) {
+    for (const auto& prefix : config.types) {
+      if (content_type.size() >= prefix.size() && equals_nocase(content_type.substr(0, prefix.size()), prefix)) return true;
+    }
+    return false;
+  }
+
+  // false if the library failed, out is left empty then
+  inline bool encode(coding c, std::string_view in, std::string& out, const compression_config& config) {
+    out.clear();
+    if (c == coding::gzip) {
+      z_stream stream = {};
+      if (deflateInit2(&stream, config.gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+      out.resize(deflateBound(&stream, in.size()));
+      stream.next_in = (Bytef*)in.data();
+      stream.avail_in = (uInt)in.size();
+      stream.next_out = (Bytef*)out.data();
+      stream.avail_out = (uInt)out.size();
+      int result = deflate(&stream, Z_FINISH);
+      out.resize(stream.total_out);
+      deflateEnd(&stream);
+      if (result != Z_STREAM_END) out.clear();
+      return result == Z_STREAM_END;
+    }
+#ifdef SYMM_BROTLI
+    if (c == coding::br) {
+      size_t size = BrotliEncoderMaxCompressedSize(in.size());
+      out.resize(size ? size : in.size() + 1024);
+      size = out.size();
+      bool ok = BrotliEncoderCompress(config.brotli_quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+        in.size(), (const uint8_t*)in.data(), &size, (uint8_t*)out.data());
+      out.resize(ok ? size : 0);
+      return ok;
+    }
+#endif
+    return false;
+  }
+
+  // A body on its way to (and back from) the pool
+  struct job {
+    int fd = -1;          // client, owned by the loop the job goes back to
+    uint64_t ticket = 0;  // matched against the client, the fd may have been reused meanwhile
+    coding encoding = coding::identity; // identity on the way back if it didn't pay off
+    std::string body;
+  };
+
+  // Finished jobs of one event loop, the eventfd is readable while any are waiting
+  class completions {
+  public:
+    completions() : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+    ~completions() {
+      if (fd_ >= 0) close(fd_);
+    }
+    completions(const completions&) = delete;
+    completions& operator=(const completions&) = delete;
+
+    int fd() const { return fd_; }
+
+    void push(job done) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(done));
+      uint64_t one = 1;
+      ssize_t ignored = write(fd_, &one, sizeof(one));
+      (void)ignored;
+    }
+
+    // Loop thread, on readiness
+    void take(std::vector<job>& out) {
+      uint64_t count;
+      ssize_t ignored = read(fd_, &count, sizeof(count));
+      (void)ignored;
+      std::lock_guard<std::mutex> lock(mutex_);
+      out.swap(jobs_);
+    }
+
+  private:
+    int fd_;
+    std::mutex mutex_;
+    std::vector<job> jobs_;
+  };
+
+  class cache {
+  public:
+    explicit cache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+    struct key {
+      uint64_t hash;
+      size_t size;
+      coding encoding;
+      bool operator==(const key& other) const {
+        return hash == other.hash && size == other.size && encoding == other.encoding;
+      }
+    };
+
+    static key key_of(std::string_view body, coding encoding) {
+      return {std::hash<std::string_view>()(body), body.size(), encoding};
+    }
+
+    struct variant {
+      std::string source; // the body it was made from
+      std::string encoded; // empty: the body is sent unencoded
+    };
+
+    std::shared_ptr<const variant> get(const key& k, std::string_view body) {
+      if (!max_bytes_) return nullptr;
+      std::shared_ptr<const variant> found;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(k);
+        if (it == index_.end()) return nullptr;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        found = it->second->second;
+      }
+      return found->source == body ? found : nullptr;
+    }
+
+    void put(const key& k, std::string source, std::string encoded) {
+      if (!max_bytes_ || source.size() + encoded.size() > max_bytes_) return;
+      auto shared = std::make_shared<const variant>(variant{std::move(source), std::move(encoded)});
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (index_.count(k)) return; // another thread got there first
+      lru_.emplace_front(k, shared);
+      index_[k] = lru_.begin();
+      bytes_ += entry_size(*shared);
+      while (bytes_ > max_bytes_ && !lru_.empty()) {
+        bytes_ -= entry_size(*lru_.back().second);
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+      }
+    }
+
+  private:
+    struct key_hash {
+      size_t operator()(const key& k) const { return k.hash ^ (size_t)k.encoding; }
+    };
+    using entry = std::pair<key, std::shared_ptr<const variant>>;
+
+    static size_t entry_size(const variant& v) { return v.source.size() + v.encoded.size() + sizeof(entry) + 64; }
+
+    size_t max_bytes_;
+    size_t bytes_ = 0;
+    std::mutex mutex_;
+    std::list<entry> lru_;
+    std::unordered_map<key, std::list<entry>::iterator, key_hash> index_;
+  };
+
+  // Fixed threads, bounded queue: submit() refuses rather than letting bodies pile up
+  class pool {
+  public:
+    pool(int threads, size_t max_queued) : max_queued_(max_queued) {
+      for (int i = 0; i < (threads > 0 ? threads : 1); ++i) workers_.emplace_back(&pool::work, this);
+    }
+    ~pool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      cv_.notify_all();
+      for (auto& worker : workers_) worker.join();
+    }
+    pool(const pool&) = delete;
+    pool& operator=(const pool&) = delete;
+
+    bool submit(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || tasks_.size() >= max_queued_) return false;
+        tasks_.push_back(std::move(task));
+      }
+      cv_.notify_one();
+      return true;
+    }
+
+  private:
+    size_t max_queued_;
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> workers_;
+
+    void work() {
+      while (true) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+          if (tasks_.empty()) return;
+          task = std::move(tasks_.front());
+          tasks_.pop_front();
+        }
+        task();
+      }
+    }
+  };
+
+  // Config, cache and pool shared by every event loop of a proxy
+  class compressor {
+  public:
+    explicit compressor(const compression_config& config)
+      : config_(config), cache_(config.cache_bytes), pool_(config.threads, config.max_queued) {}
+
+    const compression_config& config() const { return config_; }
+
+    // Body worth compressing (whether this client takes it or not, see negotiate())
+    bool qualifies(std::string_view content_type, size_t size) const {
+      return size >= config_.min_size && size <= config_.max_size && compressible(content_type, config_);
+    }
+
+    // Cached variant: true with body replaced (encoding set back to identity
+    // if it never paid off), false on a miss
+    bool cached(coding& encoding, std::string& body) {
+      auto variant = cache_.get(cache::key_of(body, encoding), body);
+      if (!variant) return false;
+      if (variant->encoded.empty()) encoding = coding::identity;
+      else body.assign(variant->encoded);
+      return true;
+    }
+
+    // Encodes on the pool, the job then goes to done (null: only the cache is
+    // filled). false when the queue is full, the job is left untouched then
+    bool submit(job& pending, std::shared_ptr<completions> done) {
+      auto shared = std::make_shared<job>(std::move(pending));
+      bool queued = pool_.submit([this, shared, done]() {
+        job& work = *shared;
+        std::string encoded;
+        cache::key k = cache::key_of(work.body, work.encoding);
+        bool shrunk = encode(work.encoding, work.body, encoded, config_) && encoded.size() < work.body.size();
+        cache_.put(k, work.body, shrunk ? encoded : std::string());
+        if (!done) return;
+        if (shrunk) work.body = std::move(encoded);
+        else work.encoding = coding::identity;
+        done->push(std::move(work));
+      });
+      if (!queued) pending = std::move(*shared);
+      return queued;
+    }
+
+  private:
+    compression_config config_;
+    cache cache_;
+    pool pool_; // last: its threads are joined before the cache goes away
+  };
+}
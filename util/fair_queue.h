@@ -0,0 +1,174 @@
+#pragma once
+
+#include "lock_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct fair_queue_config {
+  bool by_host = false;           // flows keyed by the Host header instead of the client address
+  std::unordered_map<std::string, int> weights; // flow key ("10.0.0.7", "api.example.com") -> weight
+  int default_weight = 1;
+  size_t cost_bytes = 0;          // 0 = every request costs 1, else one per cost_bytes of request (rounded up)
+  size_t inflight_per_agent = 8;  // forwarded and unanswered per agent, the rest wait in their flow
+  size_t max_queued = 1024;       // per flow, past it a request is answered 503
+};
+
+/*
+#### Per flow statistics, shared by every loop of a proxy
+- wait: queued to forwarded to an agent, latency: queued to the agent's reply
+  (answered requests only), both in microseconds; rejected: flow queue full
+- Records are created under a mutex once per flow key and updated with relaxed
+  atomics. Past max_flows distinct keys flows share one "(other)" record
+*/
+class fair_queue_stats {
+public:
+  struct flow {
+    std::string key;
+    int weight = 1;
+    std::atomic<uint64_t> rejected{0};
+    lock_stats::histogram wait_us;
+    lock_stats::histogram latency_us;
+  };
+
+  explicit fair_queue_stats(size_t max_flows = 1024) : max_flows_(max_flows) {}
+
+  flow* get(const std::string& key, int weight) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = flows_.find(key);
+    if (it != flows_.end()) return it->second.get();
+    const std::string& name = flows_.size() < max_flows_ ? key : other;
+    auto& record = flows_[name];
+    if (!record) {
+      record = std::make_unique<flow>();
+      record->key = name;
+      record->weight = weight;
+    }
+    return record.get();
+  }
+
+  std::string report() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    for (const auto& entry : flows_) {
+      const flow& f = *entry.second;
+      out += "flow " + f.key + " (weight " + std::to_string(f.weight) + "): rejected=" +
+        std::to_string(f.rejected.load(std::memory_order_relaxed)) + "\n";
+      out += "  wait " + f.wait_us.summary("us") + "\n";
+      out += "  latency " + f.latency_us.summary("us") + "\n";
+    }
+    return out;
+  }
+
+  bool dump(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) return false;
+    std::string text = report();
+    bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+    return fclose(file) == 0 && ok;
+  }
+
+private:
+  static constexpr const char* other = "(other)";
+  size_t max_flows_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<flow>> flows_;
+};
+
+/*
+#### Deficit round robin over per flow request queues
+- Each backlogged flow gets weight credits when its turn comes and sends
+  requests while they cover the head request's cost, then goes to the back of
+  the round: a flow with a burst sends weight requests per round like everyone
+  else instead of everything at once
+- A flow exists while it has queued requests, its deficit is dropped when it
+  empties (no credit saved up while idle)
+- One per event loop, not thread safe
+*/
+class fair_queue {
+public:
+  struct entry {
+    int fd;
+    uint64_t ticket;
+    size_t cost;
+    fair_queue_stats::flow* stats;
+  };
+
+  fair_queue(const fair_queue_config& config, fair_queue_stats& stats) : config_(config), stats_(stats) {}
+
+  // false when the flow already has max_queued requests waiting
+  bool push(const std::string& key, int fd, uint64_t ticket, size_t request_size, fair_queue_stats::flow*& stats) {
+    auto it = flows_.find(key);
+    if (it == flows_.end()) {
+      auto weight = config_.weights.find(key);
+      auto f = std::make_unique<flow>();
+      f->key = key;
+      f->weight = std::max(1, weight == config_.weights.end() ? config_.default_weight : weight->second);
+      f->stats = stats_.get(key, f->weight);
+      it = flows_.emplace(key, std::move(f)).first;
+    }
+    flow& f = *it->second;
+    stats = f.stats;
+    if (f.queue.size() >= config_.max_queued) {
+      f.stats->rejected.fetch_add(1, std::memory_order_relaxed);
+      if (f.queue.empty()) flows_.erase(it);
+      return false;
+    }
+    size_t cost = config_.cost_bytes ? (request_size + config_.cost_bytes - 1) / config_.cost_bytes : 1;
+    f.queue.push_back({fd, ticket, std::max<size_t>(cost, 1), f.stats});
+    if (f.queue.size() == 1) active_.push_back(&f);
+    ++size_;
+    return true;
+  }
+
+  bool pop(entry& out) {
+    while (!active_.empty()) {
+      flow& f = *active_.front();
+      if (!f.granted) {
+        f.deficit += f.weight;
+        f.granted = true;
+      }
+      if (f.deficit >= f.queue.front().cost) {
+        out = f.queue.front();
+        f.queue.pop_front();
+        f.deficit -= out.cost;
+        --size_;
+        if (f.queue.empty()) {
+          active_.pop_front();
+          flows_.erase(flows_.find(f.key)); // f is gone from here on
+        }
+        return true;
+      }
+      f.granted = false;
+      active_.pop_front();
+      active_.push_back(&f);
+    }
+    return false;
+  }
+
+  size_t size() const { return size_; }
+
+private:
+  struct flow {
+    std::string key;
+    int weight = 1;
+    size_t deficit = 0;
+    bool granted = false; // credited for the current turn
+    std::deque<entry> queue;
+    fair_queue_stats::flow* stats = nullptr;
+  };
+
+  const fair_queue_config& config_;
+  fair_queue_stats& stats_;
+  std::unordered_map<std::string, std::unique_ptr<flow>> flows_;
+  std::deque<flow*> active_; // flows with queued requests, in round order
+  size_t size_ = 0;
+};
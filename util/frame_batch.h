@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// How long outgoing tunnel frames may wait for company before they are written
+struct batch_config {
+  size_t max_bytes = 64 << 10; // written as soon as this much is pending, 0 = every frame on its own
+  int max_delay_us = 0;        // longest a frame waits, 0 = until the end of the loop iteration
+};
+
+// epoll_wait() for a batch due before the next millisecond tick. Without
+// epoll_pwait2() (Linux < 5.11, ENOSYS) the timeout is rounded up to whole
+// milliseconds: the batch waits at most 1 ms past max_delay_us
+inline int epoll_wait_us(int epoll_fd, epoll_event* events, int max_events, uint64_t timeout_us) {
+  static std::atomic<bool> no_pwait2{false};
+  if (!no_pwait2.load(std::memory_order_relaxed)) {
+    struct timespec timeout = {(time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000) * 1000};
+    int n = epoll_pwait2(epoll_fd, events, max_events, &timeout, nullptr);
+    if (n >= 0 || errno != ENOSYS) return n;
+    no_pwait2.store(true, std::memory_order_relaxed);
+  }
+  return epoll_wait(epoll_fd, events, max_events, (int)((timeout_us + 999) / 1000));
+}
+
+/*
+#### Frames waiting for one writev()
+- Headers are kept inline and payloads are moved in, nothing is copied into a
+  frame buffer; flush() hands up to IOV_MAX pieces to the kernel at once
+- A partial write leaves the rest queued (offset into the front frame), so the
+  next flush() continues exactly where the socket stopped
+- Not thread safe, the owner (event loop or locked outbox) serializes access
+*/
+class frame_batch {
+public:
+  static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void push(const uint8_t* header, size_t header_len, std::string payload) {
+    if (frames_.empty()) since_us_ = now_us();
+    frame& f = frames_.emplace_back();
+    if (header_len) std::memcpy(f.header, header, header_len);
+    f.header_len = (uint8_t)header_len;
+    f.payload = std::move(payload);
+    bytes_ += header_len + f.payload.size();
+  }
+
+  bool empty() const { return frames_.empty(); }
+  size_t bytes() const { return bytes_ - sent_; }
+  size_t frames() const { return frames_.size(); }
+
+  // Full or old enough to go out under config
+  bool due(const batch_config& config, uint64_t now) const {
+    if (frames_.empty()) return false;
+    return config.max_delay_us <= 0 || bytes() >= config.max_bytes || now - since_us_ >= (uint64_t)config.max_delay_us;
+  }
+
+  // Microseconds until due() turns true by age alone, 0 if it already is
+  uint64_t wait_us(const batch_config& config, uint64_t now) const {
+    if (frames_.empty() || due(config, now)) return 0;
+    return since_us_ + config.max_delay_us - now;
+  }
+
+  // Writes until the batch is empty or the socket is full. false on an error
+  // other than EAGAIN (errno is kept)
+  bool flush(int fd) {
+    while (!frames_.empty()) {
+      struct iovec iov[IOV_MAX];
+      int count = 0;
+      size_t skip = sent_;
+      for (auto it = frames_.begin(); it != frames_.end() && count + 2 <= IOV_MAX; ++it) {
+        add(iov, count, skip, it->header, it->header_len);
+        add(iov, count, skip, it->payload.data(), it->payload.size());
+      }
+      struct msghdr msg = {};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+      consume((size_t)n);
+    }
+    return true;
+  }
+
+  // Everything still queued, contiguous (for SSL_write), the batch is left empty
+  void drain_to(std::string& out) {
+    out.reserve(out.size() + bytes());
+    size_t skip = sent_;
+    for (const frame& f : frames_) {
+      size_t total = f.header_len + f.payload.size();
+      if (skip >= total) {
+        skip -= total;
+        continue;
+      }
+      if (skip < f.header_len) out.append((const char*)f.header + skip, f.header_len - skip);
+      size_t from = skip > f.header_len ? skip - f.header_len : 0;
+      out.append(f.payload, from, std::string::npos);
+      skip = 0;
+    }
+    clear();
+  }
+
+  void clear() {
+    frames_.clear();
+    bytes_ = 0;
+    sent_ = 0;
+  }
+
+private:
+  struct frame {
+    uint8_t header[10];
+    uint8_t header_len = 0;
+    std::string payload;
+  };
+  std::deque<frame> frames_;
+  size_t bytes_ = 0;     // queued, headers included
+  size_t sent_ = 0;      // already written from the front frame
+  uint64_t since_us_ = 0; // when the oldest queued frame arrived
+
+  static void add(struct iovec* iov, int& count, size_t& skip, const void* data, size_t len) {
+    if (skip >= len) {
+      skip -= len;
+      return;
+    }
+    iov[count].iov_base = (char*)data + skip;
+    iov[count].iov_len = len - skip;
+    ++count;
+    skip = 0;
+  }
+
+  void consume(size_t n) {
+    n += sent_;
+    while (!frames_.empty()) {
+      size_t total = frames_.front().header_len + frames_.front().payload.size();
+      if (n < total) break;
+      n -= total;
+      bytes_ -= total;
+      frames_.pop_front();
+    }
+    sent_ = frames_.empty() ? 0 : n;
+    if (frames_.empty()) bytes_ = 0;
+  }
+};
@@ -0,0 +1,475 @@
+#pragma once
+
+#include "hpack.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct h2_config {
+  uint32_t max_concurrent_streams = 100;
+  uint32_t initial_window = 1 << 20;  // receive window advertised per stream and for the connection
+  size_t max_request_size = 16 << 20; // headers + body of one stream, a larger one is reset
+  uint32_t max_header_list_size = 64 << 10; // one decoded header block, name + value + 32 per field
+};
+
+namespace h2 {
+  constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  constexpr size_t frame_header_size = 9;
+  constexpr uint32_t default_window = 65535;
+  constexpr uint32_t default_frame_size = 16384; // the largest we accept, never raised
+  constexpr int64_t max_window = 0x7FFFFFFF;
+
+  enum frame_type : uint8_t {
+    data, headers, priority, rst_stream, settings, push_promise, ping, goaway, window_update, continuation
+  };
+  enum frame_flag : uint8_t { end_stream = 0x1, ack = 0x1, end_headers = 0x4, padded = 0x8, priority_flag = 0x20 };
+  enum error_code : uint32_t {
+    no_error, protocol_error, internal_error, flow_control_error, settings_timeout, stream_closed,
+    frame_size_error, refused_stream, cancel, compression_error
+  };
+
+  inline void append_frame(std::string& out, uint8_t type, uint8_t flags, uint32_t stream,
+                           const char* payload = nullptr, size_t length = 0) {
+    char header[frame_header_size] = {
+      (char)(length >> 16), (char)(length >> 8), (char)length, (char)type, (char)flags,
+      (char)(stream >> 24 & 0x7F), (char)(stream >> 16), (char)(stream >> 8), (char)stream,
+    };
+    out.append(header, sizeof(header));
+    if (length) out.append(payload, length);
+  }
+
+  // HTTP2-Settings header value (base64url, no padding) to the SETTINGS payload, false if malformed
+  inline bool decode_settings_header(std::string_view value, std::string& payload) {
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : value) {
+      int digit;
+      if (c >= 'A' && c <= 'Z') digit = c - 'A';
+      else if (c >= 'a' && c <= 'z') digit = c - 'a' + 26;
+      else if (c >= '0' && c <= '9') digit = c - '0' + 52;
+      else if (c == '-' || c == '+') digit = 62;
+      else if (c == '_' || c == '/') digit = 63;
+      else if (c == '=') break;
+      else return false;
+      bits = bits << 6 | digit;
+      count += 6;
+      if (count >= 8) {
+        count -= 8;
+        payload += (char)(bits >> count);
+      }
+    }
+    return true;
+  }
+
+  inline uint32_t read_u32(const char* at) {
+    const unsigned char* p = (const unsigned char*)at;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+  }
+}
+
+/*
+#### HTTP/2 connection state (RFC 9113), server side, transport agnostic
+- receive() takes every complete frame off the front of the read buffer and
+  hands back the streams whose request is complete (END_STREAM seen); the
+  caller answers each with respond(), in any order
+- flush() moves control frames and HEADERS out first, then DATA of every
+  stream with a body left, round robin, as far as the peer's connection and
+  stream windows allow: a blocked stream never holds up the others
+- Received DATA is acknowledged (WINDOW_UPDATE) as it arrives, requests are
+  buffered whole and bounded by max_request_size instead
+- A header block is bounded once decoded as well, by the max_header_list_size
+  we advertise: past it the connection fails with COMPRESSION_ERROR
+- A connection error queues GOAWAY and closing() turns true, the caller closes
+  once the output is written
+- A malformed request (RFC 9113 8.2, 8.3) is reset with PROTOCOL_ERROR before
+  it is handed back: a CR, LF or NUL in a field, an uppercase name, a
+  pseudo-header after regular ones, a connection-specific header, or a
+  content-length its DATA doesn't match. Requests are rewritten as HTTP/1.1,
+  where any of these could smuggle a second request in
+*/
+class h2_session {
+public:
+  struct request {
+    uint32_t stream = 0;
+    std::vector<hpack::header> headers; // pseudo-headers included, as received
+    std::string body;
+  };
+
+  // upgraded: the HTTP/1.1 request of an "Upgrade: h2c" became stream 1 (half
+  // closed, answered with respond(1, ...)). Either way the client preface comes next.
+  h2_session(const h2_config& config, bool upgraded) : config_(config) {
+    std::string settings;
+    put_setting(settings, 3, config.max_concurrent_streams);
+    put_setting(settings, 4, config.initial_window);
+    put_setting(settings, 6, config.max_header_list_size);
+    h2::append_frame(out_, h2::settings, 0, 0, settings.data(), settings.size());
+    if (config.initial_window > h2::default_window) window_update(0, config.initial_window - h2::default_window);
+    if (upgraded) {
+      streams_[1].send_window = peer_window_;
+      streams_[1].remote_closed = true;
+      last_stream_ = 1;
+    }
+  }
+
+  // HTTP2-Settings of an Upgrade request: a SETTINGS payload, base64url decoded
+  bool apply_settings(std::string_view payload) {
+    return apply(payload);
+  }
+
+  void receive(std::string& buffer, std::vector<request>& ready) {
+    size_t at = 0;
+    if (!preface_seen_) {
+      size_t have = std::min(buffer.size(), h2::preface.size());
+      if (buffer.compare(0, have, h2::preface.data(), have) != 0) return fail(h2::protocol_error);
+      if (have < h2::preface.size()) return;
+      preface_seen_ = true;
+      at = h2::preface.size();
+    }
+    while (!closing_ && buffer.size() - at >= h2::frame_header_size) {
+      const unsigned char* header = (const unsigned char*)buffer.data() + at;
+      size_t length = (size_t)header[0] << 16 | header[1] << 8 | header[2];
+      if (length > h2::default_frame_size) {
+        fail(h2::frame_size_error);
+        break;
+      }
+      if (buffer.size() - at < h2::frame_header_size + length) break;
+      uint32_t stream = h2::read_u32((const char*)header + 5) & 0x7FFFFFFF;
+      frame(header[3], header[4], stream,
+        std::string_view(buffer.data() + at + h2::frame_header_size, length), ready);
+      at += h2::frame_header_size + length;
+    }
+    buffer.erase(0, at);
+  }
+
+  // Headers are lowercase names without connection-specific fields
+  void respond(uint32_t id, int status, const std::vector<hpack::header>& headers, std::string body) {
+    auto it = streams_.find(id);
+    if (it == streams_.end() || closing_) return; // reset by the client meanwhile
+    std::string block;
+    hpack::encode_status(block, status);
+    for (const auto& field : headers) hpack::encode(block, field.first, field.second);
+
+    uint8_t flags = body.empty() ? h2::end_stream : 0;
+    size_t at = 0;
+    do {
+      size_t chunk = std::min(block.size() - at, (size_t)peer_frame_size_);
+      bool last = at + chunk == block.size();
+      h2::append_frame(out_, at ? h2::continuation : h2::headers, (last ? h2::end_headers : 0) | (at ? 0 : flags),
+        id, block.data() + at, chunk);
+      at += chunk;
+    } while (at < block.size());
+
+    if (body.empty()) {
+      streams_.erase(it);
+      return;
+    }
+    it->second.pending = std::move(body);
+    it->second.responded = true;
+  }
+
+  // Appends to out until it holds about limit bytes
+  void flush(std::string& out, size_t limit) {
+    out.append(out_);
+    out_.clear();
+    bool progress = !closing_;
+    while (progress && out.size() < limit && send_window_ > 0) {
+      progress = false;
+      for (auto it = streams_.begin(); it != streams_.end() && out.size() < limit && send_window_ > 0;) {
+        stream_state& stream = it->second;
+        size_t left = stream.pending.size() - stream.sent;
+        if (!stream.responded || !left || stream.send_window <= 0) {
+          ++it;
+          continue;
+        }
+        size_t chunk = std::min({left, (size_t)peer_frame_size_, (size_t)stream.send_window, (size_t)send_window_});
+        bool last = chunk == left;
+        h2::append_frame(out, h2::data, last ? h2::end_stream : 0, it->first, stream.pending.data() + stream.sent, chunk);
+        stream.sent += chunk;
+        stream.send_window -= chunk;
+        send_window_ -= chunk;
+        progress = true;
+        if (last) it = streams_.erase(it);
+        else ++it;
+      }
+    }
+    if (peer_goaway_ && streams_.empty()) closing_ = true;
+  }
+
+  bool closing() const { return closing_; } // close once the output is written
+  bool pending() const { return !out_.empty(); } // frames not yet flushed
+  size_t streams() const { return streams_.size(); }
+
+private:
+  struct stream_state {
+    int64_t send_window = h2::default_window;
+    bool remote_closed = false; // END_STREAM received, the request is complete
+    bool responded = false;
+    bool refused = false;       // over max_concurrent_streams, reset once its headers are decoded
+    bool trailers = false;      // this header block ends the request
+    bool end_stream = false;    // flag of the HEADERS frame whose block is being collected
+    std::string block;          // header block across CONTINUATION frames
+    size_t size = 0;            // request bytes so far
+    int64_t content_length = -1; // declared by the request, -1 if it has none
+    std::vector<hpack::header> headers;
+    std::string body;
+    std::string pending;        // response body
+    size_t sent = 0;
+  };
+
+  h2_config config_;
+  hpack::decoder decoder_;
+  std::map<uint32_t, stream_state> streams_;
+  std::string out_;
+  uint32_t last_stream_ = 0;
+  uint32_t continuation_ = 0;   // stream whose header block isn't complete
+  int64_t send_window_ = h2::default_window;
+  int64_t peer_window_ = h2::default_window; // SETTINGS_INITIAL_WINDOW_SIZE
+  uint32_t peer_frame_size_ = h2::default_frame_size;
+  bool preface_seen_ = false;
+  bool settings_seen_ = false;
+  bool peer_goaway_ = false;
+  bool closing_ = false;
+
+  static void put_setting(std::string& out, uint16_t id, uint32_t value) {
+    char setting[6] = {(char)(id >> 8), (char)id, (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+    out.append(setting, sizeof(setting));
+  }
+
+  void window_update(uint32_t stream, uint32_t increment) {
+    char payload[4] = {(char)(increment >> 24 & 0x7F), (char)(increment >> 16), (char)(increment >> 8), (char)increment};
+    h2::append_frame(out_, h2::window_update, 0, stream, payload, sizeof(payload));
+  }
+
+  void reset(uint32_t stream, h2::error_code code) {
+    char payload[4] = {(char)(code >> 24), (char)(code >> 16), (char)(code >> 8), (char)code};
+    h2::append_frame(out_, h2::rst_stream, 0, stream, payload, sizeof(payload));
+    streams_.erase(stream);
+  }
+
+  // Connection error: GOAWAY, nothing else is sent or read
+  void fail(h2::error_code code) {
+    if (closing_) return;
+    char payload[8] = {
+      (char)(last_stream_ >> 24), (char)(last_stream_ >> 16), (char)(last_stream_ >> 8), (char)last_stream_,
+      (char)(code >> 24), (char)(code >> 16), (char)(code >> 8), (char)code,
+    };
+    h2::append_frame(out_, h2::goaway, 0, 0, payload, sizeof(payload));
+    closing_ = true;
+  }
+
+  // Payload without its padding, false when the padding doesn't fit
+  static bool unpad(uint8_t flags, std::string_view& payload) {
+    if (!(flags & h2::padded)) return true;
+    if (payload.empty()) return false;
+    size_t padding = (unsigned char)payload[0];
+    if (padding + 1 > payload.size()) return false;
+    payload = payload.substr(1, payload.size() - 1 - padding);
+    return true;
+  }
+
+  bool apply(std::string_view payload) {
+    if (payload.size() % 6) {
+      fail(h2::frame_size_error);
+      return false;
+    }
+    for (size_t at = 0; at < payload.size(); at += 6) {
+      uint16_t id = (uint16_t)((unsigned char)payload[at] << 8 | (unsigned char)payload[at + 1]);
+      uint32_t value = h2::read_u32(payload.data() + at + 2);
+      if (id == 4) {
+        if (value > h2::max_window) {
+          fail(h2::flow_control_error);
+          return false;
+        }
+        // Applies to every open stream, windows may go negative
+        for (auto& stream : streams_) stream.second.send_window += (int64_t)value - peer_window_;
+        peer_window_ = value;
+      } else if (id == 5) {
+        if (value < h2::default_frame_size || value > 0xFFFFFF) {
+          fail(h2::protocol_error);
+          return false;
+        }
+        peer_frame_size_ = value;
+      }
+      // Table size (our encoder never indexes), push, concurrency (we never push)
+      // and header list size don't change what we send
+    }
+    return true;
+  }
+
+  void frame(uint8_t type, uint8_t flags, uint32_t id, std::string_view payload, std::vector<request>& ready) {
+    if (!settings_seen_ && type != h2::settings) return fail(h2::protocol_error); // preface is a SETTINGS frame
+    if (continuation_ && (type != h2::continuation || id != continuation_)) return fail(h2::protocol_error);
+
+    switch (type) {
+      case h2::data: {
+        if (!id) return fail(h2::protocol_error);
+        if (payload.size()) window_update(0, payload.size()); // whole frame, padding included
+        auto it = streams_.find(id);
+        if (!unpad(flags, payload)) return fail(h2::protocol_error);
+        if (it == streams_.end() || it->second.remote_closed) {
+          if (id > last_stream_) return fail(h2::protocol_error); // idle stream
+          return reset(id, h2::stream_closed);
+        }
+        stream_state& stream = it->second;
+        stream.size += payload.size();
+        if (stream.size > config_.max_request_size) return reset(id, h2::refused_stream);
+        stream.body.append(payload);
+        if (stream.content_length >= 0 && stream.body.size() > (size_t)stream.content_length)
+          return reset(id, h2::protocol_error);
+        if (flags & h2::end_stream) return complete(id, stream, ready);
+        if (payload.size()) window_update(id, payload.size());
+        return;
+      }
+      case h2::headers: {
+        if (!id || !(id & 1)) return fail(h2::protocol_error);
+        if (!unpad(flags, payload)) return fail(h2::protocol_error);
+        if (flags & h2::priority_flag) {
+          if (payload.size() < 5) return fail(h2::frame_size_error);
+          payload.remove_prefix(5);
+        }
+        auto it = streams_.find(id);
+        if (it == streams_.end()) {
+          if (id <= last_stream_) return fail(h2::protocol_error); // closed stream, or not ascending
+          last_stream_ = id;
+          it = streams_.emplace(id, stream_state()).first;
+          it->second.send_window = peer_window_;
+          it->second.refused = streams_.size() > config_.max_concurrent_streams || peer_goaway_;
+        } else if (it->second.remote_closed || !(flags & h2::end_stream)) {
+          return fail(h2::protocol_error); // trailers must end the stream
+        } else {
+          it->second.trailers = true;
+        }
+        it->second.end_stream = flags & h2::end_stream;
+        it->second.block.assign(payload);
+        if (!(flags & h2::end_headers)) {
+          continuation_ = id;
+          return;
+        }
+        return header_block(id, ready);
+      }
+      case h2::continuation: {
+        if (!continuation_) return fail(h2::protocol_error);
+        auto it = streams_.find(id);
+        if (it == streams_.end()) return fail(h2::internal_error);
+        it->second.block.append(payload);
+        if (it->second.block.size() > config_.max_request_size) return fail(h2::protocol_error);
+        if (!(flags & h2::end_headers)) return;
+        continuation_ = 0;
+        return header_block(id, ready);
+      }
+      case h2::priority:
+        if (!id) return fail(h2::protocol_error);
+        return;
+      case h2::rst_stream:
+        if (!id || payload.size() != 4) return fail(!id ? h2::protocol_error : h2::frame_size_error);
+        if (id > last_stream_) return fail(h2::protocol_error);
+        streams_.erase(id);
+        return;
+      case h2::settings:
+        if (id) return fail(h2::protocol_error);
+        if (flags & h2::ack) {
+          if (payload.size()) fail(h2::frame_size_error);
+          return;
+        }
+        settings_seen_ = true;
+        if (apply(payload)) h2::append_frame(out_, h2::settings, h2::ack, 0);
+        return;
+      case h2::ping:
+        if (id) return fail(h2::protocol_error);
+        if (payload.size() != 8) return fail(h2::frame_size_error);
+        if (!(flags & h2::ack)) h2::append_frame(out_, h2::ping, h2::ack, 0, payload.data(), payload.size());
+        return;
+      case h2::goaway:
+        if (id) return fail(h2::protocol_error);
+        peer_goaway_ = true; // streams already open are still answered
+        return;
+      case h2::window_update: {
+        if (payload.size() != 4) return fail(h2::frame_size_error);
+        uint32_t increment = h2::read_u32(payload.data()) & 0x7FFFFFFF;
+        if (!id) {
+          if (!increment) return fail(h2::protocol_error);
+          send_window_ += increment;
+          if (send_window_ > h2::max_window) fail(h2::flow_control_error);
+          return;
+        }
+        auto it = streams_.find(id);
+        if (it == streams_.end()) return; // closed meanwhile
+        if (!increment) return reset(id, h2::protocol_error);
+        it->second.send_window += increment;
+        if (it->second.send_window > h2::max_window) reset(id, h2::flow_control_error);
+        return;
+      }
+      case h2::push_promise:
+        return fail(h2::protocol_error); // clients can't push
+      default:
+        return; // unknown frame types are ignored
+    }
+  }
+
+  // Decoded even for a refused stream or trailers: the HPACK state is per connection
+  void header_block(uint32_t id, std::vector<request>& ready) {
+    stream_state& stream = streams_[id];
+    std::vector<hpack::header> fields;
+    // Past the limit the rest of the block is never decoded, so the HPACK state is lost too
+    if (!decoder_.decode(stream.block, fields, config_.max_header_list_size)) return fail(h2::compression_error);
+    stream.size += stream.block.size();
+    stream.block.clear();
+    stream.block.shrink_to_fit();
+    if (stream.refused) return reset(id, h2::refused_stream);
+    if (stream.size > config_.max_request_size) return reset(id, h2::refused_stream);
+    int64_t content_length = -1;
+    if (!well_formed(fields, stream.trailers, content_length)) return reset(id, h2::protocol_error);
+    if (!stream.trailers) {
+      stream.headers = std::move(fields);
+      stream.content_length = content_length;
+    }
+    if (stream.end_stream) complete(id, stream, ready);
+  }
+
+  // content_length gets the request's, if it declares one
+  static bool well_formed(const std::vector<hpack::header>& fields, bool trailers, int64_t& content_length) {
+    bool regular = false;
+    uint8_t pseudo = 0; // bit per pseudo-header seen
+    for (const auto& [name, value] : fields) {
+      if (name.empty() || value.find_first_of(std::string_view("\0\r\n", 3)) != std::string::npos) return false;
+      if (!value.empty() && (value.front() == ' ' || value.front() == '\t' || value.back() == ' ' || value.back() == '\t'))
+        return false;
+      for (size_t i = name[0] == ':'; i < name.size(); ++i) {
+        unsigned char c = name[i];
+        if (c <= 0x20 || c >= 0x7F || (c >= 'A' && c <= 'Z') || c == ':') return false;
+      }
+      if (name[0] == ':') {
+        uint8_t bit = name == ":method" ? 1 : name == ":scheme" ? 2 : name == ":authority" ? 4 : name == ":path" ? 8 : 0;
+        if (!bit || regular || trailers || (pseudo & bit)) return false;
+        pseudo |= bit;
+        continue;
+      }
+      regular = true;
+      if (name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" ||
+          name == "upgrade" || (name == "te" && value != "trailers"))
+        return false;
+      if (name == "content-length") {
+        if (value.empty() || value.size() > 15 || value.find_first_not_of("0123456789") != std::string::npos) return false;
+        int64_t length = std::stoll(value);
+        if (content_length >= 0 && content_length != length) return false;
+        content_length = length;
+      }
+    }
+    return true;
+  }
+
+  void complete(uint32_t id, stream_state& stream, std::vector<request>& ready) {
+    if (stream.content_length >= 0 && stream.body.size() != (size_t)stream.content_length)
+      return reset(id, h2::protocol_error);
+    stream.remote_closed = true;
+    request done;
+    done.stream = id;
+    done.headers = std::move(stream.headers);
+    done.body = std::move(stream.body);
+    ready.push_back(std::move(done));
+  }
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+#### HPACK header compression (RFC 7541), as needed by an HTTP/2 server
+- decoder: static and dynamic table, Huffman coded strings, table size updates
+  bounded by the size we advertised
+- encoder: every field as a literal without indexing (names from the static
+  table when they are in it), strings sent raw. Nothing is added to the peer's
+  dynamic table, so the encoder keeps no state
+*/
+namespace hpack {
+  using header = std::pair<std::string, std::string>;
+
+  struct static_entry {
+    const char* name;
+    const char* value;
+  };
+
+  constexpr static_entry static_table[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+  };
+  constexpr size_t static_count = sizeof(static_table) / sizeof(static_table[0]);
+
+  // Code length of every symbol (256 = EOS). The code is canonical: codes of
+  // one length are consecutive, in symbol order, so the lengths are all it takes
+  constexpr uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+  };
+
+  // Canonical decoding tables: codes of length l are [first[l], first[l] + count[l])
+  struct huffman_table {
+    uint32_t first[31] = {};
+    uint16_t count[31] = {};
+    uint16_t offset[31] = {};
+    uint16_t symbols[257] = {};
+
+    huffman_table() {
+      uint16_t at = 0;
+      uint32_t code = 0;
+      for (int length = 1; length <= 30; ++length) {
+        first[length] = code;
+        offset[length] = at;
+        for (int symbol = 0; symbol < 257; ++symbol) {
+          if (huffman_lengths[symbol] == length) symbols[at++] = (uint16_t)symbol;
+        }
+        count[length] = at - offset[length];
+        code = (code + count[length]) << 1;
+      }
+    }
+  };
+
+  inline bool huffman_decode(std::string_view in, std::string& out) {
+    static const huffman_table table;
+    uint32_t code = 0;
+    int length = 0;
+    for (unsigned char byte : in) {
+      for (int bit = 7; bit >= 0; --bit) {
+        code = code << 1 | ((byte >> bit) & 1);
+        if (++length > 30) return false;
+        if (code - table.first[length] >= table.count[length]) continue;
+        uint16_t symbol = table.symbols[table.offset[length] + code - table.first[length]];
+        if (symbol == 256) return false; // EOS in a string is an error
+        out += (char)symbol;
+        code = 0;
+        length = 0;
+      }
+    }
+    // Padding: the most significant bits of EOS (all ones), shorter than a byte
+    return length < 8 && code == (1u << length) - 1;
+  }
+
+  // Prefix integer: the low prefix_bits of the first byte, then 7 bits per byte
+  inline bool decode_integer(std::string_view in, size_t& pos, int prefix_bits, uint64_t& value) {
+    if (pos >= in.size()) return false;
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = (unsigned char)in[pos++] & max_prefix;
+    if (value < max_prefix) return true;
+    for (int shift = 0; shift <= 28; shift += 7) {
+      if (pos >= in.size()) return false;
+      unsigned char byte = in[pos++];
+      value += (uint64_t)(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) return true;
+    }
+    return false; // longer than any sane length or index
+  }
+
+  inline void encode_integer(std::string& out, uint8_t flags, int prefix_bits, uint64_t value) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+      out += (char)(flags | value);
+      return;
+    }
+    out += (char)(flags | max_prefix);
+    value -= max_prefix;
+    while (value >= 0x80) {
+      out += (char)(0x80 | (value & 0x7F));
+      value >>= 7;
+    }
+    out += (char)value;
+  }
+
+  class decoder {
+  public:
+    explicit decoder(size_t max_table_size = 4096) : max_size_(max_table_size), size_limit_(max_table_size) {}
+
+    // One complete header block, false on a compression error (the connection is
+    // then unusable) or once the fields add up to more than max_list_size, counted
+    // as name + value + 32 each: indexed fields expand a small block a lot
+    bool decode(std::string_view block, std::vector<header>& headers, size_t max_list_size = SIZE_MAX) {
+      size_t pos = 0;
+      size_t list_size = 0;
+      bool fields = false;
+      auto fits = [&]() {
+        list_size += headers.back().first.size() + headers.back().second.size() + 32;
+        return list_size <= max_list_size;
+      };
+      while (pos < block.size()) {
+        unsigned char first = block[pos];
+        uint64_t index;
+        if (first & 0x80) {
+          // Indexed field
+          if (!decode_integer(block, pos, 7, index) || index == 0 || !lookup(index, headers) || !fits()) return false;
+          fields = true;
+        } else if ((first & 0xE0) == 0x20) {
+          // Table size update, only before the first field
+          if (fields || !decode_integer(block, pos, 5, index) || index > size_limit_) return false;
+          max_size_ = index;
+          evict(0);
+        } else {
+          // Literal: with incremental indexing (01), without (0000) or never indexed (0001)
+          bool indexing = (first & 0xC0) == 0x40;
+          if (!decode_integer(block, pos, indexing ? 6 : 4, index)) return false;
+          header field;
+          if (index) {
+            std::vector<header> named;
+            if (!lookup(index, named)) return false;
+            field.first = std::move(named.back().first);
+          } else if (!decode_string(block, pos, field.first)) {
+            return false;
+          }
+          if (!decode_string(block, pos, field.second)) return false;
+          if (indexing) insert(field);
+          headers.push_back(std::move(field));
+          if (!fits()) return false;
+          fields = true;
+        }
+      }
+      return true;
+    }
+
+  private:
+    std::deque<header> dynamic_; // newest first
+    size_t size_ = 0;            // name + value + 32 per entry
+    size_t max_size_;
+    size_t size_limit_;          // SETTINGS_HEADER_TABLE_SIZE we advertised
+
+    bool lookup(uint64_t index, std::vector<header>& headers) const {
+      if (index <= static_count) {
+        headers.emplace_back(static_table[index - 1].name, static_table[index - 1].value);
+        return true;
+      }
+      index -= static_count + 1;
+      if (index >= dynamic_.size()) return false;
+      headers.push_back(dynamic_[index]);
+      return true;
+    }
+
+    bool decode_string(std::string_view block, size_t& pos, std::string& out) {
+      if (pos >= block.size()) return false;
+      bool huffman = block[pos] & 0x80;
+      uint64_t length;
+      if (!decode_integer(block, pos, 7, length) || length > block.size() - pos) return false;
+      std::string_view raw = block.substr(pos, length);
+      pos += length;
+      if (!huffman) {
+        out.assign(raw);
+        return true;
+      }
+      out.reserve(length * 8 / 5);
+      return huffman_decode(raw, out);
+    }
+
+    void insert(const header& field) {
+      size_t entry = field.first.size() + field.second.size() + 32;
+      evict(entry);
+      if (entry > max_size_) return; // empties the table, as the RFC says
+      dynamic_.push_front(field);
+      size_ += entry;
+    }
+
+    void evict(size_t room) {
+      while (!dynamic_.empty() && size_ + room > max_size_) {
+        size_ -= dynamic_.back().first.size() + dynamic_.back().second.size() + 32;
+        dynamic_.pop_back();
+      }
+    }
+  };
+
+  // Appends one field, literal without indexing
+  inline void encode(std::string& out, std::string_view name, std::string_view value) {
+    size_t index = 0;
+    for (size_t i = 0; i < static_count; ++i) {
+      if (name == static_table[i].name) {
+        index = i + 1;
+        break;
+      }
+    }
+    encode_integer(out, 0x00, 4, index);
+    if (!index) {
+      encode_integer(out, 0x00, 7, name.size());
+      out.append(name);
+    }
+    encode_integer(out, 0x00, 7, value.size());
+    out.append(value);
+  }
+
+  // :status, fully indexed for the ones in the static table
+  inline void encode_status(std::string& out, int status) {
+    std::string code = std::to_string(status);
+    for (size_t i = 7; i < 14; ++i) {
+      if (code == static_table[i].value) {
+        encode_integer(out, 0x80, 7, i + 1);
+        return;
+      }
+    }
+    encode(out, ":status", code);
+  }
+}
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+#### Lock contention and queue depth statistics
+- Build time switch: with -DSYMM_LOCK_STATS (make LOCK_STATS=1) lock_stats::mutex
+  and lock_stats::condition_variable are the instrumented types below, without
+  it they are plain std::mutex / std::condition_variable and name() and
+  queue::record() compile to nothing
+- Per named lock: acquisitions, contended acquisitions (try_lock failed),
+  wait and hold time histograms. Per condition variable: waits, notifies and
+  the time spent waiting. Per queue: depth histogram, maximum and a depth over
+  time series (one sample per 10 ms, the largest depth seen in that slot)
+- Histograms are power-of-two buckets of nanoseconds, updated with relaxed
+  atomics; report() can run at any time from any thread
+*/
+namespace lock_stats {
+  inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  struct histogram {
+    static constexpr int bucket_count = 40; // 2^39 ns is over 9 minutes
+    std::atomic<uint64_t> buckets[bucket_count] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+
+    void add(uint64_t value) {
+      int bucket = value ? 64 - __builtin_clzll(value) : 0;
+      buckets[bucket < bucket_count ? bucket : bucket_count - 1].fetch_add(1, std::memory_order_relaxed);
+      count.fetch_add(1, std::memory_order_relaxed);
+      sum.fetch_add(value, std::memory_order_relaxed);
+      uint64_t seen = max.load(std::memory_order_relaxed);
+      while (value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+    }
+
+    // Upper bound of the bucket holding the p-th percentile
+    uint64_t percentile(double p) const {
+      uint64_t total = count.load(std::memory_order_relaxed);
+      if (!total) return 0;
+      uint64_t rank = (uint64_t)(p / 100.0 * total), seen = 0;
+      for (int i = 0; i < bucket_count; ++i) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank) return i ? std::min(1ULL << i, (unsigned long long)max.load(std::memory_order_relaxed)) : 0;
+      }
+      return max.load(std::memory_order_relaxed);
+    }
+
+    std::string summary(const char* unit) const {
+      uint64_t total = count.load(std::memory_order_relaxed);
+      char line[192];
+      snprintf(line, sizeof(line), "n=%llu avg=%.1f p50<=%llu p99<=%llu max=%llu %s",
+        (unsigned long long)total, total ? (double)sum.load(std::memory_order_relaxed) / total : 0.0,
+        (unsigned long long)percentile(50), (unsigned long long)percentile(99),
+        (unsigned long long)max.load(std::memory_order_relaxed), unit);
+      return line;
+    }
+  };
+
+  struct lock_record {
+    std::string name;
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};
+    histogram wait_ns; // contended acquisitions only
+    histogram hold_ns;
+  };
+
+  struct condvar_record {
+    std::string name;
+    std::atomic<uint64_t> notifies{0};
+    histogram wait_ns;
+  };
+
+  struct queue_record {
+    static constexpr uint64_t slot_ns = 10000000;
+    static constexpr size_t series_size = 1024; // last ~10 s
+    std::string name;
+    histogram depth;
+    std::atomic<uint64_t> series[series_size] = {}; // slot << 24 | max depth in the slot
+  };
+
+  struct registry {
+    std::mutex mutex;
+    std::vector<lock_record*> locks;
+    std::vector<condvar_record*> condvars;
+    std::vector<queue_record*> queues;
+    uint64_t start_ns = now_ns();
+  };
+
+  inline registry& global() {
+    static registry instance;
+    return instance;
+  }
+
+  // Records live as long as the process, a report never sees a dangling one
+  template <typename T>
+  T* make_record(std::vector<T*>& list, const char* name) {
+    registry& r = global();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    T* record = new T();
+    record->name = name;
+    list.push_back(record);
+    return record;
+  }
+
+  class instrumented_mutex {
+  public:
+    instrumented_mutex() = default;
+    instrumented_mutex(const instrumented_mutex&) = delete;
+    instrumented_mutex& operator=(const instrumented_mutex&) = delete;
+
+    void set_name(const char* name) { record_ = make_record(global().locks, name); }
+
+    void lock() {
+      if (!mutex_.try_lock()) {
+        uint64_t start = now_ns();
+        mutex_.lock();
+        held_since_ = now_ns();
+        if (record_) {
+          record_->contended.fetch_add(1, std::memory_order_relaxed);
+          record_->wait_ns.add(held_since_ - start);
+        }
+      } else {
+        held_since_ = now_ns();
+      }
+      if (record_) record_->acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool try_lock() {
+      if (!mutex_.try_lock()) return false;
+      held_since_ = now_ns();
+      if (record_) record_->acquisitions.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    void unlock() {
+      if (record_) record_->hold_ns.add(now_ns() - held_since_);
+      mutex_.unlock();
+    }
+
+  private:
+    std::mutex mutex_;
+    uint64_t held_since_ = 0; // written by the owner only
+    lock_record* record_ = nullptr;
+  };
+
+  // Waits release the instrumented mutex through unlock()/lock(), so the
+  // time asleep is not counted as hold time and the reacquisition is a lock()
+  class instrumented_condvar {
+  public:
+    void set_name(const char* name) { record_ = make_record(global().condvars, name); }
+
+    void notify_one() {
+      if (record_) record_->notifies.fetch_add(1, std::memory_order_relaxed);
+      cv_.notify_one();
+    }
+
+    void notify_all() {
+      if (record_) record_->notifies.fetch_add(1, std::memory_order_relaxed);
+      cv_.notify_all();
+    }
+
+    template <typename Lock, typename Predicate>
+    void wait(Lock& lock, Predicate ready) {
+      uint64_t start = now_ns();
+      cv_.wait(lock, ready);
+      if (record_) record_->wait_ns.add(now_ns() - start);
+    }
+
+    template <typename Lock, typename Duration, typename Predicate>
+    bool wait_for(Lock& lock, const Duration& timeout, Predicate ready) {
+      uint64_t start = now_ns();
+      bool result = cv_.wait_for(lock, timeout, ready);
+      if (record_) record_->wait_ns.add(now_ns() - start);
+      return result;
+    }
+
+  private:
+    std::condition_variable_any cv_;
+    condvar_record* record_ = nullptr;
+  };
+
+  class queue {
+  public:
+    void set_name(const char* name) {
+#ifdef SYMM_LOCK_STATS
+      record_ = make_record(global().queues, name);
+#else
+      (void)name;
+#endif
+    }
+
+    void record(size_t depth) {
+#ifdef SYMM_LOCK_STATS
+      if (!record_) return;
+      record_->depth.add(depth);
+      uint64_t slot = (now_ns() - global().start_ns) / queue_record::slot_ns;
+      std::atomic<uint64_t>& entry = record_->series[slot % queue_record::series_size];
+      uint64_t depth_bits = std::min<uint64_t>(depth, 0xFFFFFF);
+      uint64_t seen = entry.load(std::memory_order_relaxed);
+      while (true) {
+        // Keep a newer slot that wrapped onto this entry, or a deeper sample of ours
+        if (seen >> 24 > slot || (seen >> 24 == slot && (seen & 0xFFFFFF) >= depth_bits)) break;
+        if (entry.compare_exchange_weak(seen, slot << 24 | depth_bits, std::memory_order_relaxed)) break;
+      }
+#else
+      (void)depth;
+#endif
+    }
+
+  private:
+#ifdef SYMM_LOCK_STATS
+    queue_record* record_ = nullptr;
+#endif
+  };
+
+#ifdef SYMM_LOCK_STATS
+  constexpr bool enabled = true;
+  using mutex = instrumented_mutex;
+  using condition_variable = instrumented_condvar;
+#else
+  constexpr bool enabled = false;
+  using mutex = std::mutex;
+  using condition_variable = std::condition_variable;
+#endif
+
+  template <typename T>
+  void name(T& primitive, const char* label) {
+    if constexpr (enabled) {
+      primitive.set_name(label);
+    } else {
+      (void)primitive;
+      (void)label;
+    }
+  }
+
+  // Text dump of everything recorded so far, one block per lock / queue
+  inline std::string report() {
+    if (!enabled) return "lock statistics not built in (make LOCK_STATS=1)\n";
+    registry& r = global();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::string out;
+    for (const lock_record* record : r.locks) {
+      uint64_t acquisitions = record->acquisitions.load(std::memory_order_relaxed);
+      uint64_t contended = record->contended.load(std::memory_order_relaxed);
+      char line[160];
+      snprintf(line, sizeof(line), "lock %s: acquisitions=%llu contended=%llu (%.2f%%)\n", record->name.c_str(),
+        (unsigned long long)acquisitions, (unsigned long long)contended, acquisitions ? 100.0 * contended / acquisitions : 0.0);
+      out += line;
+      out += "  wait " + record->wait_ns.summary("ns") + "\n";
+      out += "  hold " + record->hold_ns.summary("ns") + "\n";
+    }
+    for (const condvar_record* record : r.condvars) {
+      out += "condvar " + record->name + ": notifies=" +
+        std::to_string(record->notifies.load(std::memory_order_relaxed)) + "\n";
+      out += "  wait " + record->wait_ns.summary("ns") + "\n";
+    }
+    uint64_t now_slot = (now_ns() - r.start_ns) / queue_record::slot_ns;
+    for (const queue_record* record : r.queues) {
+      out += "queue " + record->name + ": depth " + record->depth.summary("entries") + "\n";
+      out += "  depth over time (ms since start: max depth):";
+      uint64_t first = now_slot >= queue_record::series_size ? now_slot - queue_record::series_size + 1 : 0;
+      for (uint64_t slot = first; slot <= now_slot; ++slot) {
+        uint64_t entry = record->series[slot % queue_record::series_size].load(std::memory_order_relaxed);
+        if (entry >> 24 != slot || !entry) continue;
+        out += " " + std::to_string(slot * queue_record::slot_ns / 1000000) + ":" + std::to_string(entry & 0xFFFFFF);
+      }
+      out += "\n";
+    }
+    return out;
+  }
+
+  inline bool dump(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) return false;
+    std::string text = report();
+    bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+    return fclose(file) == 0 && ok;
+  }
+}
@@ -2,8 +2,8 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <ctime>
-#include <sstream>
 
 #define outputfunc std::cout
 #define outputfucerr std::cerr
@@ -15,10 +15,11 @@ public:
   logger() = default;
   ~logger() = default;
 
+  // One line built in a single buffer: logging sits on the request path
   static void log(
-    const std::string& log_name,
-    const std::string& message,
-    const std::string& function_name) 
+    std::string_view log_name,
+    std::string_view message,
+    std::string_view function_name) 
   {
     auto t = std::time(nullptr);
     std::tm tm;
@@ -28,32 +29,33 @@ public:
     }
     char time_buffer[20];
     std::strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", &tm);
-    std::ostringstream log_stream;
-    log_stream << time_buffer << " [" << log_name << "][" << function_name << "] " << message;
-    outputfunc << log_stream.str() << d_endl;
+    std::string line;
+    line.reserve(sizeof(time_buffer) + log_name.size() + function_name.size() + message.size() + 6);
+    line.append(time_buffer).append(" [").append(log_name).append("][").append(function_name).append("] ").append(message);
+    outputfunc << line << d_endl;
   }
 
   static void debug(
-    const std::string& message,
-    const std::string& function_name) 
+    std::string_view message,
+    std::string_view function_name) 
   {
     log(__func__, message, function_name);
   }
   static void info(
-    const std::string& message,
-    const std::string& function_name)
+    std::string_view message,
+    std::string_view function_name)
   {
     log(__func__, message, function_name);
   }
   static void warn(
-    const std::string& message,
-    const std::string& function_name)
+    std::string_view message,
+    std::string_view function_name)
   {
     log(__func__, message, function_name);
   }
   static void error(
-    const std::string& message,
-    const std::string& function_name)
+    std::string_view message,
+    std::string_view function_name)
   {
     log(__func__, message, function_name);
   }
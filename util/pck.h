@@ -2,28 +2,39 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
+/*
+#### Response packet
+- Header lines are appended to one block (headers) rather than kept as one
+  string each, export_packet() sizes the output once: a response costs a
+  handful of allocations whatever its header count
+- Copy and move are the implicit ones, so a packet returned by a handler is
+  moved (or elided) all the way to the connection's write buffer
+*/
 class PckParent {
 public:
   std::string status_line;
   std::string content_type;
   std::string content_data;
-  std::vector<std::string> headers;
+  std::string headers; // "Name: value\r\n" lines
 
   explicit PckParent() {};
 
   // Break line added
-  void add_header(std::string header) {
-    headers.push_back(header + breakline);
+  void add_header(std::string_view header) {
+    headers.append(header);
+    headers.append(breakline);
   }
   // Break line added
-  void add_header(std::string header, std::string value) {
-    headers.push_back(header_format(header, value));
+  void add_header(std::string_view header, std::string_view value) {
+    append_header(headers, header, value);
   }
   // Break line added
-  void set_content(std::string header = "Content-Type", std::string value = "text/html") {
-    content_type = header_format(header, value);
+  void set_content(std::string_view header = "Content-Type", std::string_view value = "text/html") {
+    content_type.clear();
+    append_header(content_type, header, value);
   }
 
   void set_status(short int status_code) {
@@ -31,42 +42,45 @@ public:
   }
   // Break line added
   void set_status(std::string status) {
-    status_line = status + breakline;
+    status_line = std::move(status);
+    status_line.append(breakline);
   }
   void set_body(std::string body) {
-    content_data = body;
+    content_data = std::move(body);
   }
 
-  std::string export_headers() {
-    std::string headers_str;
-    for (const auto& header : headers)
-      headers_str += header;
-    return headers_str;
+  const std::string& export_headers() const {
+    return headers;
   }
 
   std::string export_packet() {
-    add_header("Content-Length", std::to_string(content_data.size()));
-    std::string response = status_line + content_type + export_headers() + breakline + content_data;
-    if (response.back() != '\n')
-      response += breakline;
-    return response;
+    std::string packet;
+    export_packet(packet);
+    return packet;
   }
 
-  PckParent& operator=(const PckParent& other) {
-    if (this != &other) {
-      status_line = other.status_line;
-      content_type = other.content_type;
-      content_data = other.content_data;
-      headers = other.headers;
-    }
-    return *this;
+  // Appends the serialized packet to out (a reused buffer keeps its capacity).
+  // head: the answer to a HEAD request, Content-Length of the body but no body
+  void export_packet(std::string& out, bool head = false) {
+    add_header("Content-Length", std::to_string(content_data.size()));
+    // Nothing after the body: on a keep-alive connection any extra byte would be
+    // read as the start of the next response
+    size_t body = head ? 0 : content_data.size();
+    out.reserve(out.size() + status_line.size() + content_type.size() + headers.size() + 2 + body);
+    out.append(status_line).append(content_type).append(headers).append(breakline).append(content_data, 0, body);
   }
 
 protected:
-  const std::string breakline = "\r\n";
+  static constexpr std::string_view breakline = "\r\n";
   virtual std::string format_status(short int status_code) const { return ""; };
-  std::string header_format(std::string id, std::string value) const {
-    return id + ": " + value + breakline;
+  std::string header_format(std::string_view id, std::string_view value) const {
+    std::string line;
+    append_header(line, id, value);
+    return line;
+  }
+  static void append_header(std::string& out, std::string_view id, std::string_view value) {
+    out.reserve(out.size() + id.size() + value.size() + 4);
+    out.append(id).append(": ").append(value).append(breakline);
   }
 };
 
@@ -112,6 +126,18 @@ public:
   std::string format_status(short int status_code) const override {
     if (status_code == 200)
       return "HTTP/1.1 200 OK\r\n";
+    else if (status_code == 204)
+      return "HTTP/1.1 204 No Content\r\n";
+    else if (status_code == 301)
+      return "HTTP/1.1 301 Moved Permanently\r\n";
+    else if (status_code == 302)
+      return "HTTP/1.1 302 Found\r\n";
+    else if (status_code == 304)
+      return "HTTP/1.1 304 Not Modified\r\n";
+    else if (status_code == 307)
+      return "HTTP/1.1 307 Temporary Redirect\r\n";
+    else if (status_code == 308)
+      return "HTTP/1.1 308 Permanent Redirect\r\n";
     else if (status_code == 400)
       return "HTTP/1.1 400 Bad Request\r\n";
     else if (status_code == 401)
@@ -120,8 +146,18 @@ public:
       return "HTTP/1.1 403 Forbidden\r\n";
     else if (status_code == 404)
       return "HTTP/1.1 404 Not Found\r\n";
+    else if (status_code == 429)
+      return "HTTP/1.1 429 Too Many Requests\r\n";
     else if (status_code == 500)
       return "HTTP/1.1 500 Internal Server Error\r\n";
+    else if (status_code == 501)
+      return "HTTP/1.1 501 Not Implemented\r\n";
+    else if (status_code == 502)
+      return "HTTP/1.1 502 Bad Gateway\r\n";
+    else if (status_code == 503)
+      return "HTTP/1.1 503 Service Unavailable\r\n";
+    else if (status_code == 504)
+      return "HTTP/1.1 504 Gateway Timeout\r\n";
     return "HTTP/1.1 500 Internal Server Error\r\n";
   }
 };
\ No newline at end of file
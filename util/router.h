@@ -0,0 +1,285 @@
+#pragma once
+
+#include "pck.h"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+/*
+#### Compile time routes for endpoints answered by symm itself
+- A route is a type: method, path (a static constexpr char array), handler
+  function and middleware types. router::table<Routes...> builds a perfect
+  hash over the exact paths at compile time (seed searched by the compiler,
+  no two paths share a slot), so a lookup is one FNV-1a pass over the path,
+  one slot and one compare; a path ending in '*' is a prefix route, tried in
+  declaration order after the exact ones
+- Handlers and middleware are template arguments: calls are direct and
+  inlined, the only indirection left is ApiProxy's pointer to
+  table::dispatch (see ApiProxy::set_routes())
+- Middleware: before() runs in declaration order and may answer instead of
+  the handler (returning false), after() runs in reverse for every
+  middleware whose before() ran. One instance per route and thread
+- Nothing matched (path, then method): dispatch() returns false and the
+  request goes on to the data handler or the tunnel
+*/
+namespace router {
+  enum class method : uint8_t { any, get, head, post, put, del, patch, options };
+
+  inline method parse_method(std::string_view name) {
+    if (name == "GET") return method::get;
+    if (name == "HEAD") return method::head;
+    if (name == "POST") return method::post;
+    if (name == "PUT") return method::put;
+    if (name == "DELETE") return method::del;
+    if (name == "PATCH") return method::patch;
+    if (name == "OPTIONS") return method::options;
+    return method::any; // unknown, only matches method::any routes
+  }
+
+  // Views into the raw request, valid while it is
+  struct request {
+    std::string_view raw;
+    method verb = method::any;
+    std::string_view path;
+    std::string_view query; // after '?', without it
+    int client_fd = -1;
+
+    // Splits the request line, false if there isn't one
+    bool parse(std::string_view text, int fd) {
+      raw = text;
+      client_fd = fd;
+      size_t space = text.find(' ');
+      size_t eol = text.find("\r\n");
+      if (space == std::string_view::npos || eol == std::string_view::npos || space > eol) return false;
+      verb = parse_method(text.substr(0, space));
+      size_t end = text.find(' ', space + 1);
+      if (end == std::string_view::npos || end > eol) end = eol;
+      std::string_view target = text.substr(space + 1, end - space - 1);
+      size_t mark = target.find('?');
+      path = target.substr(0, mark);
+      query = mark == std::string_view::npos ? std::string_view() : target.substr(mark + 1);
+      return !path.empty();
+    }
+
+    // Case insensitive name, empty if absent
+    std::string_view header(std::string_view name) const {
+      size_t header_end = raw.find("\r\n\r\n");
+      size_t pos = raw.find("\r\n");
+      while (pos != std::string_view::npos && pos < header_end) {
+        pos += 2;
+        size_t eol = raw.find("\r\n", pos);
+        if (eol == std::string_view::npos || eol > header_end) eol = header_end;
+        if (eol - pos > name.size() && raw[pos + name.size()] == ':' && same_name(raw.substr(pos, name.size()), name)) {
+          size_t start = raw.find_first_not_of(" \t", pos + name.size() + 1);
+          return start == std::string_view::npos || start >= eol ? std::string_view() : raw.substr(start, eol - start);
+        }
+        pos = eol;
+      }
+      return {};
+    }
+
+  private:
+    static bool same_name(std::string_view a, std::string_view b) {
+      for (size_t i = 0; i < a.size(); ++i) {
+        if ((a[i] | 0x20) != (b[i] | 0x20)) return false;
+      }
+      return true;
+    }
+  };
+
+  using handler = http_pck (*)(const request&);
+
+  constexpr uint32_t hash(uint32_t seed, std::string_view s) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : s) {
+      h ^= (uint8_t)c;
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+  // Middleware base: no-ops, a middleware hides the ones it needs
+  struct middleware {
+    bool before(const request&, http_pck&) { return true; }
+    void after(const request&, http_pck&) {}
+  };
+
+  // 401 unless "Authorization: Bearer <Token>"
+  template <const char* Token>
+  struct bearer_auth : middleware {
+    bool before(const request& req, http_pck& out) {
+      std::string_view value = req.header("Authorization");
+      if (value.size() > 7 && value.substr(0, 7) == "Bearer " && value.substr(7) == Token) return true;
+      out = http_pck(401);
+      out.set_content("Content-Type", "text/plain");
+      out.add_header("WWW-Authenticate", "Bearer");
+      out.set_body("Unauthorized");
+      return false;
+    }
+  };
+
+  template <const char* Name, const char* Value>
+  struct add_header : middleware {
+    void after(const request&, http_pck& out) { out.add_header(Name, Value); }
+  };
+
+  template <int Seconds>
+  struct cache_control : middleware {
+    void after(const request&, http_pck& out) { out.add_header("Cache-Control", "max-age=" + std::to_string(Seconds)); }
+  };
+
+  // Keeps the response of the middleware behind it for Ms and answers with a
+  // copy meanwhile (per thread: every event loop has its own)
+  template <int Ms>
+  struct memoize : middleware {
+    http_pck kept;
+    uint64_t until_ms = 0;
+    bool hit = false;
+
+    bool before(const request&, http_pck& out) {
+      hit = until_ms > now_ms();
+      if (hit) out = kept;
+      return !hit;
+    }
+    void after(const request&, http_pck& out) {
+      if (hit) return;
+      kept = out;
+      until_ms = now_ms() + Ms;
+    }
+
+    static uint64_t now_ms() {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+  };
+
+  template <const char* Location, short Status = 302>
+  http_pck redirect(const request&) {
+    http_pck response(Status);
+    response.add_header("Location", Location);
+    return response;
+  }
+
+  template <method Method, const char* Path, handler Handler, typename... Middleware>
+  struct route {
+    static constexpr std::string_view pattern() { return Path; }
+    static constexpr bool prefix() { return !pattern().empty() && pattern().back() == '*'; }
+    static constexpr std::string_view path() { return prefix() ? pattern().substr(0, pattern().size() - 1) : pattern(); }
+
+    static bool matches_path(std::string_view p) {
+      return prefix() ? p.substr(0, path().size()) == path() : p == path();
+    }
+
+    // false if the method doesn't match
+    static bool serve(const request& req, http_pck& out) {
+      if (Method != method::any && req.verb != Method && !(Method == method::get && req.verb == method::head)) return false;
+      run<0>(req, out);
+      return true;
+    }
+
+  private:
+    static inline thread_local std::tuple<Middleware...> middleware_;
+
+    template <size_t K>
+    static void run(const request& req, http_pck& out) {
+      if constexpr (K == sizeof...(Middleware)) {
+        out = Handler(req);
+      } else {
+        auto& m = std::get<K>(middleware_);
+        if (m.before(req, out)) run<K + 1>(req, out);
+        m.after(req, out);
+      }
+    }
+  };
+
+  template <typename... Routes>
+  class table {
+  public:
+    static constexpr size_t count = sizeof...(Routes);
+
+    // Raw request to a response, false when no route takes it
+    static bool dispatch(const std::string& raw, int client_fd, http_pck& out) {
+      request req;
+      if (!req.parse(raw, client_fd)) return false;
+      if constexpr (count > 0) {
+        uint32_t slot = hash(layout.seed, req.path) & (slot_count - 1);
+        for (int i = layout.slots[slot]; i >= 0; i = layout.next[i]) {
+          if (serve_at(i, req, out, std::index_sequence_for<Routes...>())) return true;
+        }
+        return serve_prefixed(req, out, std::index_sequence_for<Routes...>());
+      }
+      return false;
+    }
+
+  private:
+    static constexpr std::array<std::string_view, count> paths = {Routes::path()...};
+    static constexpr std::array<bool, count> prefixed = {Routes::prefix()...};
+
+    static constexpr size_t slot_count = [] {
+      size_t slots = 1;
+      while (slots < 2 * count) slots <<= 1;
+      return slots;
+    }();
+
+    struct index {
+      uint32_t seed = 0;
+      std::array<int, slot_count> slots = {};
+      std::array<int, count> next = {}; // following route with the same exact path
+    };
+
+    static constexpr bool same(std::string_view a, std::string_view b) {
+      if (a.size() != b.size()) return false;
+      for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i] != b[i]) return false;
+      }
+      return true;
+    }
+
+    // Smallest seed that puts every distinct exact path in its own slot
+    static constexpr index build() {
+      for (uint32_t seed = 0; seed < 100000; ++seed) {
+        index result;
+        result.seed = seed;
+        for (auto& slot : result.slots) slot = -1;
+        for (auto& next : result.next) next = -1;
+        bool collided = false;
+        for (size_t i = 0; i < count && !collided; ++i) {
+          if (prefixed[i]) continue;
+          size_t slot = hash(seed, paths[i]) & (slot_count - 1);
+          int at = result.slots[slot];
+          if (at < 0) {
+            result.slots[slot] = (int)i;
+          } else if (same(paths[at], paths[i])) {
+            while (result.next[at] >= 0) at = result.next[at];
+            result.next[at] = (int)i;
+          } else {
+            collided = true;
+          }
+        }
+        if (!collided) return result;
+      }
+      return index{~0u};
+    }
+
+    static constexpr index layout = build();
+    static_assert(layout.seed != ~0u, "no perfect hash seed for these routes");
+
+    template <size_t... I>
+    static bool serve_at(int i, const request& req, http_pck& out, std::index_sequence<I...>) {
+      bool served = false;
+      (void)((i == (int)I && (served = Routes::matches_path(req.path) && Routes::serve(req, out), true)) || ...);
+      return served;
+    }
+
+    template <size_t... I>
+    static bool serve_prefixed(const request& req, http_pck& out, std::index_sequence<I...>) {
+      return ((Routes::prefix() && Routes::matches_path(req.path) && Routes::serve(req, out)) || ...);
+    }
+  };
+}
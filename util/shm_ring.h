@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+#### Shared memory transport for agents on the same host
+- One memfd holds two byte rings (server -> agent, agent -> server), each
+  paired with an eventfd. A message is a 4 byte length and its bytes, copied
+  in and out with wrap-around; no framing, masking or TCP on the way
+- One producer and one consumer per ring, no locks: head and tail live on
+  their own cache lines. A consumer about to sleep sets `armed` and checks the
+  ring once more, the producer writes the eventfd only when it finds it set,
+  so messages to a busy peer cost no syscall at all. A producer facing a full
+  ring sets `blocked` the same way and the consumer wakes it once it drained
+  the ring and arms
+- Negotiated over an AF_UNIX stream socket: the agent sends shm::hello, any
+  header lines and a blank line (all of it goes to the handshake validator),
+  the server answers "OK\r\n" with the memfd and both eventfds attached
+  (SCM_RIGHTS). The socket stays open, closing it ends the session
+*/
+namespace shm {
+  constexpr std::string_view hello = "SYMM-SHM/1\r\n";
+  constexpr size_t default_capacity = 1 << 20; // per direction
+
+  struct ring_header {
+    alignas(64) std::atomic<uint64_t> head;  // consumer
+    alignas(64) std::atomic<uint64_t> tail;  // producer
+    alignas(64) std::atomic<uint32_t> armed; // consumer sleeps until the eventfd is written
+    alignas(64) std::atomic<uint32_t> blocked; // producer waits for room, the consumer wakes it after a pop
+  };
+
+  // View over one ring in the mapping: the header, then capacity data bytes.
+  // The capacity is never read from shared memory, a peer can't widen it
+  class ring {
+  public:
+    ring() = default;
+    ring(void* base, size_t capacity)
+      : header_((ring_header*)base), data_((char*)base + sizeof(ring_header)), capacity_(capacity) {}
+
+    static size_t footprint(size_t capacity) { return sizeof(ring_header) + capacity; }
+
+    // false when there isn't room for the whole message (or it never fits)
+    bool push(std::string_view message) {
+      uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+      if (!fits(tail, message.size())) return false;
+      uint32_t length = (uint32_t)message.size();
+      copy_in(tail, &length, 4);
+      copy_in(tail + 4, message.data(), message.size());
+      header_->tail.store(tail + 4 + message.size(), std::memory_order_release);
+      return true;
+    }
+
+    // Producer, after a failed push: true if room for size bytes appeared
+    // meanwhile, otherwise the consumer's next pop finds `blocked` set
+    bool block(size_t size) {
+      header_->blocked.store(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return fits(header_->tail.load(std::memory_order_relaxed), size);
+    }
+
+    // Consumer, after arm(): true if the producer waits for room
+    bool unblocks() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return header_->blocked.load(std::memory_order_relaxed) && header_->blocked.exchange(0, std::memory_order_seq_cst);
+    }
+
+    bool pop(std::string& out) {
+      uint64_t head = header_->head.load(std::memory_order_relaxed);
+      uint64_t tail = header_->tail.load(std::memory_order_acquire);
+      if (head == tail || tail - head > capacity_ || tail - head < 4) return false; // empty, or a peer writing garbage
+      uint32_t length;
+      copy_out(head, &length, 4);
+      if (length > tail - head - 4) return false;
+      out.resize(length);
+      copy_out(head + 4, out.data(), length);
+      header_->head.store(head + 4 + length, std::memory_order_release);
+      return true;
+    }
+
+    bool empty() const {
+      return header_->head.load(std::memory_order_relaxed) == header_->tail.load(std::memory_order_acquire);
+    }
+
+    // Consumer, before sleeping on the eventfd: false if a message slipped in
+    bool arm() {
+      header_->armed.store(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return empty();
+    }
+
+    // Producer, after a push: true if the consumer is (about to be) asleep
+    bool wants_wake() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      return header_->armed.load(std::memory_order_relaxed) && header_->armed.exchange(0, std::memory_order_seq_cst);
+    }
+
+  private:
+    ring_header* header_ = nullptr;
+    char* data_ = nullptr;
+    size_t capacity_ = 0;
+
+    bool fits(uint64_t tail, size_t size) const {
+      uint64_t used = tail - header_->head.load(std::memory_order_acquire);
+      return used <= capacity_ && 4 + size <= capacity_ - used;
+    }
+
+    void copy_in(uint64_t at, const void* from, size_t len) {
+      size_t offset = at % capacity_, first = std::min(len, capacity_ - offset);
+      std::memcpy(data_ + offset, from, first);
+      std::memcpy(data_, (const char*)from + first, len - first);
+    }
+
+    void copy_out(uint64_t at, void* to, size_t len) const {
+      size_t offset = at % capacity_, first = std::min(len, capacity_ - offset);
+      std::memcpy(to, data_ + offset, first);
+      std::memcpy((char*)to + first, data_, len - first);
+    }
+  };
+
+  // One side of a session: the mapping, its two rings and both eventfds
+  class channel {
+  public:
+    ~channel() {
+      if (base_) munmap(base_, size_);
+      for (int fd : {memfd_, wake_in_, wake_out_}) if (fd >= 0) ::close(fd);
+    }
+
+    // Server side: fresh memfd and eventfds
+    static std::unique_ptr<channel> create(size_t capacity) {
+      int memfd = memfd_create("symm-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      int to_agent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      int to_server = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      size_t size = 2 * ring::footprint(capacity);
+      // Sealed at its size: an agent truncating it would SIGBUS the server
+      if (memfd < 0 || to_agent < 0 || to_server < 0 || ftruncate(memfd, size) < 0 ||
+          fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        for (int fd : {memfd, to_agent, to_server}) if (fd >= 0) ::close(fd);
+        return nullptr;
+      }
+      return attach(memfd, to_agent, to_server, false); // headers start zeroed
+    }
+
+    // Takes ownership of the fds. Ring 0 carries server -> agent, ring 1 the replies
+    static std::unique_ptr<channel> attach(int memfd, int to_agent, int to_server, bool agent_side) {
+      std::unique_ptr<channel> side(new channel());
+      side->memfd_ = memfd;
+      side->wake_in_ = agent_side ? to_agent : to_server;
+      side->wake_out_ = agent_side ? to_server : to_agent;
+      off_t size = lseek(memfd, 0, SEEK_END);
+      if (size <= 0 || size % 2 || (size_t)size / 2 <= sizeof(ring_header)) return nullptr;
+      side->size_ = size;
+      side->base_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+      if (side->base_ == MAP_FAILED) {
+        side->base_ = nullptr;
+        return nullptr;
+      }
+      size_t capacity = size / 2 - sizeof(ring_header);
+      ring to_agent_ring(side->base_, capacity), to_server_ring((char*)side->base_ + size / 2, capacity);
+      side->in_ = agent_side ? to_agent_ring : to_server_ring;
+      side->out_ = agent_side ? to_server_ring : to_agent_ring;
+      return side;
+    }
+
+    bool send(std::string_view message) {
+      if (!out_.push(message)) return false;
+      if (out_.wants_wake()) wake_peer();
+      return true;
+    }
+
+    // After a failed send(): true if size bytes fit now, otherwise wake_fd()
+    // turns readable once the peer drained the ring
+    bool wait_room(size_t size) { return out_.block(size); }
+
+    bool receive(std::string& out) { return in_.pop(out); }
+
+    // Readable once a message arrived after arm() returned true
+    int wake_fd() const { return wake_in_; }
+    // Before sleeping, false if a message slipped in. A producer blocked on
+    // this (now drained) ring is woken here, not on every receive()
+    bool arm() {
+      bool empty = in_.arm();
+      if (in_.unblocks()) wake_peer();
+      return empty;
+    }
+
+    void drain_wake() {
+      uint64_t count;
+      ssize_t ignored = read(wake_in_, &count, sizeof(count));
+      (void)ignored;
+    }
+
+    int memfd() const { return memfd_; }
+    int peer_wake_in() const { return wake_out_; } // the eventfd the peer reads
+    int peer_wake_out() const { return wake_in_; }
+
+  private:
+    channel() = default;
+    int memfd_ = -1;
+    int wake_in_ = -1;
+    int wake_out_ = -1;
+    void* base_ = nullptr;
+    size_t size_ = 0;
+    ring in_;
+    ring out_;
+
+    void wake_peer() {
+      uint64_t one = 1;
+      ssize_t ignored = write(wake_out_, &one, sizeof(one));
+      (void)ignored;
+    }
+  };
+
+  // Sends data with the fds attached, all or nothing
+  inline bool send_fds(int socket_fd, std::string_view data, const int* fds, int count) {
+    char control[CMSG_SPACE(3 * sizeof(int))] = {};
+    struct iovec iov = {(void*)data.data(), data.size()};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(socket_fd, &msg, MSG_NOSIGNAL) == (ssize_t)data.size();
+  }
+
+  // Agent side of a session
+  class agent {
+  public:
+    ~agent() { close(); }
+
+    // Blocking, headers are extra "Name: value\r\n" lines for the validator
+    bool connect(const std::string& path, const std::string& headers = "") {
+      close();
+      socket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      struct sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      if (socket_ < 0 || path.size() >= sizeof(addr.sun_path)) return false;
+      std::memcpy(addr.sun_path, path.c_str(), path.size());
+      if (::connect(socket_, (struct sockaddr*)&addr, sizeof(addr)) < 0) return false;
+      std::string request = std::string(hello) + headers + "\r\n";
+      if (::send(socket_, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) return false;
+
+      char reply[4];
+      char control[CMSG_SPACE(3 * sizeof(int))] = {};
+      struct iovec iov = {reply, sizeof(reply)};
+      struct msghdr msg = {};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t n = recvmsg(socket_, &msg, MSG_CMSG_CLOEXEC);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      if (n != 4 || std::memcmp(reply, "OK\r\n", 4) != 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+          cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        return false;
+      }
+      int fds[3];
+      std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+      channel_ = channel::attach(fds[0], fds[1], fds[2], true);
+      return channel_ != nullptr;
+    }
+
+    bool send(std::string_view message) { return channel_ && channel_->send(message); }
+
+    // false on timeout (-1 waits forever) or once the server closed the session
+    bool receive(std::string& out, int timeout_ms = -1) {
+      while (channel_) {
+        if (channel_->receive(out)) return true;
+        if (!channel_->arm()) continue;
+        struct pollfd fds[2] = {{channel_->wake_fd(), POLLIN, 0}, {socket_, POLLIN, 0}};
+        int ready = poll(fds, 2, timeout_ms);
+        if (ready <= 0) return false;
+        if (fds[1].revents) return false; // the server never writes after the handshake
+        channel_->drain_wake();
+      }
+      return false;
+    }
+
+    void close() {
+      channel_.reset();
+      if (socket_ >= 0) ::close(socket_);
+      socket_ = -1;
+    }
+
+  private:
+    int socket_ = -1;
+    std::unique_ptr<channel> channel_;
+  };
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "logger.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*
+#### Socket options of one listener
+- Set on the listening socket before listen(); on Linux accepted connections
+  inherit all of them (TCP_NODELAY, TCP_NOTSENT_LOWAT, SO_BUSY_POLL and the
+  buffer sizes included), so accept paths need no extra calls
+- 0 leaves an option at the kernel's default. TCP_FASTOPEN only takes effect
+  with server support on in net.ipv4.tcp_fastopen (bit 2), SO_BUSY_POLL above
+  net.core.busy_poll needs CAP_NET_ADMIN: a refused option is logged and the
+  listener goes on without it
+- On an AF_UNIX listener only the buffer sizes and the backlog apply
+- Presets: "default" (nothing set), "latency" (no Nagle, deferred accept, busy
+  polling, small unsent queue) and "bulk" (large buffers and backlog)
+*/
+struct socket_profile {
+  std::string name = "default";
+  bool nodelay = false;    // TCP_NODELAY
+  int defer_accept_s = 0;  // TCP_DEFER_ACCEPT: accept() once the first data arrived, up to this long
+  int fastopen_queue = 0;  // TCP_FASTOPEN: pending Fast Open requests
+  int busy_poll_us = 0;    // SO_BUSY_POLL
+  int rcvbuf = 0;          // SO_RCVBUF bytes, disables receive autotuning
+  int sndbuf = 0;          // SO_SNDBUF bytes
+  int notsent_lowat = 0;   // TCP_NOTSENT_LOWAT bytes: writable while less than this is unsent
+  int backlog = SOMAXCONN; // listen()
+
+  // false for an unknown name, profile is left as it was
+  static bool preset(const std::string& name, socket_profile& profile) {
+    socket_profile result;
+    result.name = name;
+    if (name == "latency") {
+      result.nodelay = true;
+      result.defer_accept_s = 1;
+      result.busy_poll_us = 50;
+      result.notsent_lowat = 16384;
+    } else if (name == "bulk") {
+      result.rcvbuf = 4 << 20;
+      result.sndbuf = 4 << 20;
+      result.notsent_lowat = 1 << 20;
+      result.backlog = 4096;
+    } else if (name != "default") {
+      return false;
+    }
+    profile = result;
+    return true;
+  }
+
+  // One option by its configuration name ("nodelay", "rcvbuf", ...)
+  bool set(const std::string& key, const std::string& value) {
+    char* end = nullptr;
+    long number = std::strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || number < 0) return false;
+    if (key == "nodelay") nodelay = number != 0;
+    else if (key == "defer_accept") defer_accept_s = (int)number;
+    else if (key == "fastopen") fastopen_queue = (int)number;
+    else if (key == "busy_poll") busy_poll_us = (int)number;
+    else if (key == "rcvbuf") rcvbuf = (int)number;
+    else if (key == "sndbuf") sndbuf = (int)number;
+    else if (key == "notsent_lowat") notsent_lowat = (int)number;
+    else if (key == "backlog") backlog = number > 0 ? (int)number : SOMAXCONN;
+    else return false;
+    return true;
+  }
+
+  // "[preset] [key=value ...]", e.g. "latency busy_poll=0" or "rcvbuf=262144"
+  static bool parse(const std::string& spec, socket_profile& profile) {
+    std::istringstream words(spec);
+    std::string word;
+    socket_profile result;
+    bool first = true;
+    while (words >> word) {
+      size_t eq = word.find('=');
+      if (eq == std::string::npos) {
+        if (!first || !preset(word, result)) return false;
+      } else if (!result.set(word.substr(0, eq), word.substr(eq + 1))) {
+        return false;
+      }
+      first = false;
+    }
+    result.name = spec.empty() ? "default" : spec;
+    profile = result;
+    return true;
+  }
+
+  // Options on a bound socket, then listen(); false only if listen() fails
+  bool listen_on(int fd) const {
+    int domain = AF_INET;
+    socklen_t len = sizeof(domain);
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    if (rcvbuf) option(fd, SOL_SOCKET, SO_RCVBUF, rcvbuf, "SO_RCVBUF");
+    if (sndbuf) option(fd, SOL_SOCKET, SO_SNDBUF, sndbuf, "SO_SNDBUF");
+    if (domain == AF_UNIX) return ::listen(fd, backlog) == 0;
+    if (nodelay) option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (defer_accept_s) option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept_s, "TCP_DEFER_ACCEPT");
+    if (fastopen_queue) option(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen_queue, "TCP_FASTOPEN");
+    if (busy_poll_us) option(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll_us, "SO_BUSY_POLL");
+    if (notsent_lowat) option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notsent_lowat, "TCP_NOTSENT_LOWAT");
+    return ::listen(fd, backlog) == 0;
+  }
+
+private:
+  void option(int fd, int level, int option_name, int value, const char* label) const {
+    if (setsockopt(fd, level, option_name, &value, sizeof(value)) < 0)
+      logger::warn(std::string(label) + " refused on profile " + name + ": " + strerror(errno), "socket_profile");
+  }
+};
+
+// A proxy port (or AF_UNIX path, port 0) and the options of its listener
+struct listener_config {
+  int port = 0;
+  socket_profile profile{};
+  std::string path{}; // ApiProxy::add_unix_listener()
+};
+
+/*
+#### Listener configuration file
+- One listener per line: "<port> [preset] [key=value ...]", '#' starts a
+  comment. Keys are socket_profile::set()'s: nodelay, defer_accept, fastopen,
+  busy_poll, rcvbuf, sndbuf, notsent_lowat, backlog
+- An AF_UNIX listener has its path (or "@name") in place of the port
+
+    3000 latency
+    5000 bulk rcvbuf=8388608
+    /run/symm/http.sock
+- On any error nothing is returned and the offending line is logged
+*/
+inline bool load_listeners(const std::string& path, std::vector<listener_config>& listeners) {
+  std::ifstream file(path);
+  if (!file) {
+    logger::error("Cannot open listener configuration " + path, __func__);
+    return false;
+  }
+  std::vector<listener_config> result;
+  std::string line;
+  for (int number = 1; std::getline(file, line); ++number) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string port;
+    if (!(words >> port)) continue;
+    bool unix_path = port[0] == '/' || port[0] == '@';
+    std::string spec;
+    std::getline(words, spec);
+    spec.erase(0, spec.find_first_not_of(" \t"));
+    spec.erase(spec.find_last_not_of(" \t\r") + 1);
+
+    char* end = nullptr;
+    long value = std::strtol(port.c_str(), &end, 10);
+    listener_config listener{unix_path ? 0 : (int)value, {}, unix_path ? port : ""};
+    bool bad_port = !unix_path && (*end != '\0' || value <= 0 || value > 65535);
+    if (bad_port || !socket_profile::parse(spec, listener.profile)) {
+      logger::error(path + ":" + std::to_string(number) + ": bad listener \"" + line + "\"", __func__);
+      return false;
+    }
+    result.push_back(listener);
+  }
+  if (result.empty()) {
+    logger::error("No listeners in " + path, __func__);
+    return false;
+  }
+  listeners = result;
+  return true;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/*
+#### Lock-free single producer / single consumer ring
+- Exactly one thread pushes and one thread pops, no locks, no allocation after construction
+- Head and tail live on their own cache lines, each side caches the other's index
+- push() fails when full: the producer decides whether to retry, drop or shed
+*/
+template <typename T>
+class spsc_queue {
+public:
+  explicit spsc_queue(size_t capacity = 1024)
+    : mask_(round_up(capacity) - 1), slots_(mask_ + 1) {}
+
+  spsc_queue(const spsc_queue&) = delete;
+  spsc_queue& operator=(const spsc_queue&) = delete;
+
+  bool push(T value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ > mask_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ > mask_) return false;
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& out) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) return false;
+    }
+    out = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate from any thread, exact from either endpoint
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+private:
+  static size_t round_up(size_t n) {
+    size_t p = 2;
+    while (p < n) p <<= 1;
+    return p;
+  }
+
+  const size_t mask_;
+  std::vector<T> slots_;
+
+  alignas(64) std::atomic<size_t> head_{0}; // consumer
+  size_t tail_cache_ = 0;
+  alignas(64) std::atomic<size_t> tail_{0}; // producer
+  size_t head_cache_ = 0;
+};
+
+/*
+#### eventfd used to wake the consumer of one or more spsc_queues
+- Any number of producers may notify(), the owner polls fd() and drain()s
+*/
+class wake_fd {
+public:
+  wake_fd() : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+  ~wake_fd() { if (fd_ >= 0) close(fd_); }
+
+  wake_fd(const wake_fd&) = delete;
+  wake_fd& operator=(const wake_fd&) = delete;
+
+  int fd() const { return fd_; }
+
+  void notify() {
+    uint64_t one = 1;
+    ssize_t ignored = write(fd_, &one, sizeof(one));
+    (void)ignored;
+  }
+
+  void drain() {
+    uint64_t count;
+    ssize_t ignored = read(fd_, &count, sizeof(count));
+    (void)ignored;
+  }
+
+private:
+  int fd_;
+};
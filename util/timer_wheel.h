@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <functional>
+
+/*
+#### Hierarchical timing wheel
+- 4 levels of 64 slots, so one wheel covers 2^24 ticks
+- arm / cancel are O(1), advance() only touches the slot of the current tick
+  (plus the timers cascading down from an upper level)
+- Not thread safe: owned by a single event loop (lock it from outside if needed)
+*/
+class timer_wheel {
+  struct node {
+    node* prev = nullptr;
+    node* next = nullptr;
+
+    void unlink() {
+      if (!prev) return;
+      prev->next = next;
+      next->prev = prev;
+      prev = next = nullptr;
+    }
+  };
+
+public:
+  static constexpr int levels = 4;
+  static constexpr int slot_bits = 6;
+  static constexpr uint64_t slots = 1ULL << slot_bits;
+  static constexpr uint64_t slot_mask = slots - 1;
+  static constexpr uint64_t max_ticks = (1ULL << (slot_bits * levels)) - 1;
+
+  // Intrusive timer, embed it where the state it guards lives.
+  // Destroying an armed timer cancels it.
+  class timer : private node {
+  public:
+    std::function<void()> on_expire;
+
+    timer() = default;
+    explicit timer(std::function<void()> callback): on_expire(std::move(callback)) {}
+    ~timer() { if (armed()) owner_->cancel(*this); }
+
+    timer(const timer&) = delete;
+    timer& operator=(const timer&) = delete;
+
+    bool armed() const { return prev != nullptr; }
+
+  private:
+    friend class timer_wheel;
+    uint64_t expires_ = 0;
+    timer_wheel* owner_ = nullptr; // wheel it is armed on, so destruction keeps size() right
+  };
+
+  explicit timer_wheel(uint32_t tick_ms = 100)
+    : tick_ms_(tick_ms ? tick_ms : 1), start_ms_(now_ms()) {
+    for (auto& level : wheel_)
+      for (auto& slot : level)
+        slot.prev = slot.next = &slot;
+  }
+
+  timer_wheel(const timer_wheel&) = delete;
+  timer_wheel& operator=(const timer_wheel&) = delete;
+
+  ~timer_wheel() {
+    // Leave every still armed timer in a clean, unlinked state
+    for (auto& level : wheel_)
+      for (auto& slot : level)
+        while (slot.next != &slot) slot.next->unlink();
+  }
+
+  static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  uint32_t tick_ms() const { return tick_ms_; }
+  size_t size() const { return armed_; }
+
+  // (Re)arms the timer to fire after delay_ms, rounded up to a whole tick.
+  // Counted from the wall clock, the wheel may lag behind if not advanced lately.
+  void arm(timer& t, uint64_t delay_ms) {
+    cancel(t);
+    uint64_t ticks = (delay_ms + tick_ms_ - 1) / tick_ms_;
+    if (ticks == 0) ticks = 1;
+    uint64_t now_tick = std::max(current_tick_, elapsed_ticks(now_ms()));
+    if (now_tick - current_tick_ + ticks > max_ticks) ticks = max_ticks - (now_tick - current_tick_);
+    t.expires_ = now_tick + ticks;
+    t.owner_ = this;
+    insert(t);
+    ++armed_;
+  }
+
+  void cancel(timer& t) {
+    if (!t.armed()) return;
+    t.unlink();
+    --t.owner_->armed_;
+  }
+
+  // Runs every timer due up to now, returns how many fired
+  size_t advance() { return advance_to(now_ms()); }
+
+  size_t advance_to(uint64_t now) {
+    uint64_t target = elapsed_ticks(now);
+    size_t fired = 0;
+    while (current_tick_ < target) {
+      ++current_tick_;
+      cascade();
+      fired += expire(wheel_[0][current_tick_ & slot_mask]);
+    }
+    return fired;
+  }
+
+private:
+  uint32_t tick_ms_;
+  uint64_t start_ms_;
+  uint64_t current_tick_ = 0;
+  size_t armed_ = 0;
+  node wheel_[levels][slots];
+
+  uint64_t elapsed_ticks(uint64_t now) const {
+    return now > start_ms_ ? (now - start_ms_) / tick_ms_ : 0;
+  }
+
+  static void push_back(node& list, node& n) {
+    n.prev = list.prev;
+    n.next = &list;
+    list.prev->next = &n;
+    list.prev = &n;
+  }
+
+  void insert(timer& t) {
+    uint64_t delta = t.expires_ - current_tick_;
+    int level = 0;
+    while (level < levels - 1 && delta >= (1ULL << (slot_bits * (level + 1))))
+      ++level;
+    push_back(wheel_[level][(t.expires_ >> (slot_bits * level)) & slot_mask], t);
+  }
+
+  // Every time a lower level wraps, the matching upper slot moves down.
+  // Upper levels go first so their timers can land in the lower slot being emptied.
+  void cascade() {
+    int top = 0;
+    while (top < levels - 1 && ((current_tick_ >> (slot_bits * top)) & slot_mask) == 0)
+      ++top;
+    for (int level = top; level >= 1; --level) {
+      node& slot = wheel_[level][(current_tick_ >> (slot_bits * level)) & slot_mask];
+      node pending;
+      splice(slot, pending);
+      while (pending.next != &pending) {
+        timer& t = *static_cast<timer*>(pending.next);
+        t.unlink();
+        insert(t);
+      }
+    }
+  }
+
+  // Callbacks may arm, cancel or destroy any timer, including their own
+  size_t expire(node& slot) {
+    node pending;
+    splice(slot, pending);
+    size_t fired = 0;
+    while (pending.next != &pending) {
+      timer& t = *static_cast<timer*>(pending.next);
+      t.unlink();
+      --armed_;
+      ++fired;
+      if (t.on_expire) t.on_expire();
+    }
+    return fired;
+  }
+
+  static void splice(node& from, node& to) {
+    if (from.next == &from) {
+      to.prev = to.next = &to;
+      return;
+    }
+    to.next = from.next;
+    to.prev = from.prev;
+    to.next->prev = &to;
+    to.prev->next = &to;
+    from.prev = from.next = &from;
+  }
+};
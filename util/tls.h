@@ -0,0 +1,103 @@
+#pragma once
+
+#include "logger.h"
+
+#include <memory>
+#include <string>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/bio.h>
+
+struct tls_config {
+  std::string cert_file;             // PEM, full chain
+  std::string key_file;              // PEM
+  bool session_tickets = true;       // stateless resumption (TLS 1.2 tickets, TLS 1.3 PSK)
+  long session_cache_size = 20480;   // stateful resumption, 0 disables the server cache
+  long session_timeout_s = 7200;
+  bool ktls = true;                  // offload record encryption to the kernel when available
+};
+
+/*
+#### Server side TLS context shared by every connection of a listener
+- Resumption through tickets and the server session cache keeps handshakes cheap
+- With kTLS the socket carries plaintext on our side once the handshake is done,
+  so writes can go through plain send() without an extra copy into OpenSSL
+*/
+class tls_context {
+public:
+  ~tls_context() { SSL_CTX_free(ctx_); }
+
+  tls_context(const tls_context&) = delete;
+  tls_context& operator=(const tls_context&) = delete;
+
+  // nullptr (and an error log) if the certificate or key can't be loaded
+  static std::shared_ptr<tls_context> create(const tls_config& config) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+      logger::error("SSL_CTX_new failed: " + last_error(), __func__);
+      return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, config.cert_file.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, config.key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+      logger::error("Failed to load certificate " + config.cert_file + ": " + last_error(), __func__);
+      SSL_CTX_free(ctx);
+      return nullptr;
+    }
+
+    static const unsigned char session_id_context[] = "symm";
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    if (config.session_cache_size > 0) {
+      SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+      SSL_CTX_sess_set_cache_size(ctx, config.session_cache_size);
+    } else {
+      SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(ctx, config.session_timeout_s);
+    if (!config.session_tickets) {
+      SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+      SSL_CTX_set_num_tickets(ctx, 0);
+    } else {
+      SSL_CTX_set_num_tickets(ctx, 1);
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config.ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    return std::shared_ptr<tls_context>(new tls_context(ctx));
+  }
+
+  // Server side session on an accepted, non-blocking socket
+  SSL* accept(int fd) const {
+    SSL* ssl = SSL_new(ctx_);
+    if (!ssl) return nullptr;
+    SSL_set_fd(ssl, fd);
+    SSL_set_accept_state(ssl);
+    return ssl;
+  }
+
+  static bool ktls_send(SSL* ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+  }
+
+  static std::string last_error() {
+    unsigned long code = ERR_get_error();
+    if (!code) return "unknown error";
+    char buffer[256];
+    ERR_error_string_n(code, buffer, sizeof(buffer));
+    ERR_clear_error();
+    return buffer;
+  }
+
+private:
+  SSL_CTX* ctx_;
+
+  explicit tls_context(SSL_CTX* ctx): ctx_(ctx) {}
+};
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+struct trace_config {
+  double sample_rate = 0;  // fraction of requests kept for export_chrome(), 0 = none
+  int slow_ms = 0;         // log a request when one of its stages takes longer, 0 = off
+  size_t ring_size = 4096; // sampled requests kept per thread, oldest overwritten
+};
+
+/*
+#### Per-request stage tracing
+- A request_trace lives in the connection state; mark() stores the TSC (the
+  monotonic clock where there is none) when a stage is reached, a stage never
+  reached stays 0 and is folded into the next one. Stamps taken on different
+  threads can land out of order (a reply read before broadcast() returned),
+  such a span counts as 0
+- finish() once the response is written: the slow log checks every stage,
+  sampled requests go to the calling thread's ring. Only sampled requests ever
+  lock, and only their own ring
+- Spans: read (accept or first byte -> request parsed), admit, send (to the
+  tunnel / upstream), agent (until the reply is back), receive (reply handed to
+  the handler), respond (response built), write (last byte written)
+*/
+namespace tracing {
+  enum stage : int { start, parsed, dispatched, sent, replied, received, queued, written, stage_count };
+  constexpr const char* span_names[stage_count] = {"", "read", "admit", "send", "agent", "receive", "respond", "write"};
+
+  struct ring;
+
+  struct clock_state {
+    uint64_t tsc0 = 0;
+    uint64_t ns0 = 0;
+    double ns_per_tick = 1;
+  };
+
+  inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+  }
+
+  struct state {
+    std::atomic<bool> enabled{false};
+    trace_config config;
+    uint32_t sample_threshold = 0; // of a 32-bit random draw
+    clock_state clock;
+    std::atomic<uint64_t> next_id{1};
+    std::mutex mutex; // rings
+    std::vector<std::shared_ptr<ring>> rings;
+  };
+
+  inline state& global() {
+    static state instance;
+    return instance;
+  }
+
+  inline bool enabled() { return global().enabled.load(std::memory_order_relaxed); }
+
+  inline double to_us(uint64_t tick) {
+    const clock_state& clock = global().clock;
+    return (double)(int64_t)(tick - clock.tsc0) * clock.ns_per_tick / 1000.0;
+  }
+}
+
+struct request_trace {
+  uint64_t stamps[tracing::stage_count] = {};
+  uint64_t id = 0;
+  uint16_t port = 0;
+  bool active = false;
+  bool sampled = false;
+
+  // Start of a request (accept, or first byte on a keep-alive connection)
+  void begin(uint16_t listener_port) {
+    tracing::state& global = tracing::global();
+    active = global.enabled.load(std::memory_order_relaxed);
+    if (!active) return;
+    for (auto& stamp : stamps) stamp = 0;
+    port = listener_port;
+    sampled = global.sample_threshold > 0 && draw() < global.sample_threshold;
+    id = sampled ? global.next_id.fetch_add(1, std::memory_order_relaxed) : 0;
+    stamps[tracing::start] = tracing::ticks();
+  }
+
+  void mark(tracing::stage stage) {
+    if (active) stamps[stage] = tracing::ticks();
+  }
+
+  void mark_at(tracing::stage stage, uint64_t tick) {
+    if (active && tick) stamps[stage] = tick;
+  }
+
+  inline void finish();
+
+private:
+  static uint32_t draw() {
+    thread_local uint32_t x = 2463534242u ^ (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+  }
+};
+
+namespace tracing {
+  struct ring {
+    std::mutex mutex;
+    std::vector<request_trace> entries;
+    size_t next = 0;
+    int thread = 0;
+  };
+
+  // Before any traffic: calibrates the TSC against the monotonic clock (~20 ms)
+  inline void configure(const trace_config& config) {
+    state& global = tracing::global();
+    global.config = config;
+    global.sample_threshold = config.sample_rate >= 1 ? UINT32_MAX : (uint32_t)(config.sample_rate * 4294967296.0);
+    uint64_t ns0 = monotonic_ns(), tsc0 = ticks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t ns1 = monotonic_ns(), tsc1 = ticks();
+    global.clock.ns0 = ns0;
+    global.clock.tsc0 = tsc0;
+    global.clock.ns_per_tick = tsc1 > tsc0 ? (double)(ns1 - ns0) / (double)(tsc1 - tsc0) : 1;
+    global.enabled = config.sample_rate > 0 || config.slow_ms > 0;
+  }
+
+  // Request being handled synchronously on this thread, lets the blocking tunnel
+  // calls (WebSocketServer::broadcast() / receive_response()) mark their stages
+  inline request_trace*& current() {
+    thread_local request_trace* trace = nullptr;
+    return trace;
+  }
+
+  inline ring& local_ring() {
+    thread_local std::shared_ptr<ring> local;
+    if (!local) {
+      state& global = tracing::global();
+      local = std::make_shared<ring>();
+      local->entries.resize(global.config.ring_size ? global.config.ring_size : 1);
+      std::lock_guard<std::mutex> lock(global.mutex);
+      local->thread = (int)global.rings.size() + 1;
+      global.rings.push_back(local);
+    }
+    return *local;
+  }
+
+  // Chrome / Perfetto trace event JSON: one complete ("X") event per span,
+  // pid = listener port, tid = recording thread
+  inline bool export_chrome(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+      logger::error("Can't write trace to " + path, __func__);
+      return false;
+    }
+    state& global = tracing::global();
+    std::vector<std::shared_ptr<ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(global.mutex);
+      rings = global.rings;
+    }
+    fputs("{\"traceEvents\":[", file);
+    bool first = true;
+    size_t requests = 0;
+    for (const auto& ring : rings) {
+      std::vector<request_trace> entries;
+      {
+        std::lock_guard<std::mutex> lock(ring->mutex);
+        entries = ring->entries;
+      }
+      for (const auto& trace : entries) {
+        if (!trace.id) continue;
+        ++requests;
+        uint64_t from = trace.stamps[start];
+        for (int s = parsed; s < stage_count; ++s) {
+          if (!trace.stamps[s]) continue;
+          uint64_t at = std::max(trace.stamps[s], from);
+          fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%u,\"tid\":%d,\"args\":{\"request\":%llu}}",
+            first ? "" : ",", span_names[s], to_us(from), to_us(at) - to_us(from),
+            trace.port, ring->thread, (unsigned long long)trace.id);
+          first = false;
+          from = at;
+        }
+      }
+    }
+    fputs("],\"displayTimeUnit\":\"ms\"}\n", file);
+    bool ok = fclose(file) == 0;
+    logger::info("Exported " + std::to_string(requests) + " traced requests to " + path, __func__);
+    return ok;
+  }
+}
+
+inline void request_trace::finish() {
+  if (!active) return;
+  active = false;
+  tracing::state& global = tracing::global();
+  if (global.config.slow_ms > 0) {
+    double limit_us = global.config.slow_ms * 1000.0;
+    std::string spans;
+    bool slow = false;
+    uint64_t from = stamps[tracing::start];
+    for (int s = tracing::parsed; s < tracing::stage_count; ++s) {
+      if (!stamps[s]) continue;
+      uint64_t at = std::max(stamps[s], from);
+      double us = tracing::to_us(at) - tracing::to_us(from);
+      slow = slow || us > limit_us;
+      char span[48];
+      snprintf(span, sizeof(span), " %s=%.3fms", tracing::span_names[s], us / 1000.0);
+      spans += span;
+      from = at;
+    }
+    if (slow) logger::warn("Slow request on port " + std::to_string(port) + ":" + spans, "request_trace");
+  }
+  if (!sampled) return;
+  tracing::ring& ring = tracing::local_ring();
+  std::lock_guard<std::mutex> lock(ring.mutex);
+  ring.entries[ring.next] = *this;
+  ring.next = (ring.next + 1) % ring.entries.size();
+}
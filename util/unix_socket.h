@@ -0,0 +1,76 @@
+#pragma once
+
+#include "logger.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+#### AF_UNIX stream sockets for same host clients and agents
+- A path names a socket file, "@name" the abstract namespace: no file, no
+  permissions, gone with the last socket that refers to it
+- Listeners are created non-blocking, so one can be shared by several event
+  loops (there is no SO_REUSEPORT for AF_UNIX); whoever loses an accept race
+  gets EAGAIN
+*/
+namespace unix_socket {
+  inline bool abstract(const std::string& path) { return !path.empty() && path[0] == '@'; }
+
+  // false if path doesn't fit in sun_path
+  inline bool address(const std::string& path, struct sockaddr_un& addr, socklen_t& len) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    if (abstract(path)) addr.sun_path[0] = '\0'; // the name is the bytes after it, not NUL terminated
+    len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path.size() + (abstract(path) ? 0 : 1));
+    return true;
+  }
+
+  // A socket file nobody listens on any more: left by a previous run, safe to
+  // replace. Anything else at path (a regular file, a live server) is kept
+  inline bool stale(const std::string& path, const struct sockaddr_un& addr, socklen_t len) {
+    struct stat info;
+    if (lstat(path.c_str(), &info) < 0 || !S_ISSOCK(info.st_mode)) return false;
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) return false;
+    bool refused = connect(probe, (const struct sockaddr*)&addr, len) < 0 && errno == ECONNREFUSED;
+    close(probe);
+    return refused;
+  }
+
+  // Bound, not yet listening; -1 on failure (logged). A stale socket file is
+  // replaced, bind() fails with EADDRINUSE on anything else at path
+  inline int bind_to(const std::string& path) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    if (!address(path, addr, len)) {
+      logger::error("Bad AF_UNIX socket path: " + path, "unix_socket");
+      return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      logger::error("AF_UNIX socket creation failed for " + path, "unix_socket");
+      return -1;
+    }
+    if (!abstract(path) && stale(path, addr, len)) unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, len) < 0) {
+      logger::error("Bind failed on " + path + ": " + strerror(errno), "unix_socket");
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Removes the socket file, nothing to do for abstract names
+  inline void remove(const std::string& path) {
+    if (!path.empty() && !abstract(path)) unlink(path.c_str());
+  }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "logger.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+
+struct upstream_config {
+  enum class balance { round_robin, least_connections };
+  balance policy = balance::round_robin;
+  int max_idle = 32;              // keep-alive connections kept per upstream, per event loop
+  int connect_timeout_ms = 1000;  // health probe connect, a slower upstream is marked down
+  int health_interval_ms = 2000;  // TCP connect probe of every upstream, 0 disables probing
+};
+
+// One upstream server, shared by every loop forwarding to it
+struct upstream_target {
+  std::string name; // "host:port"
+  struct sockaddr_in addr = {};
+  int max_idle = 32; // upstream_config::max_idle
+  std::atomic<bool> healthy{true};
+  std::atomic<int> active{0};   // requests in flight on it, all loops
+  std::atomic<bool> probing{false};
+
+  void mark(bool up) {
+    if (healthy.exchange(up, std::memory_order_relaxed) != up)
+      logger::warn("Upstream " + name + (up ? " is back up" : " is down"), "upstream_target");
+  }
+};
+
+/*
+#### Upstreams of one listener and how a request picks one
+- round robin skips the ones marked down; least connections takes the lowest
+  in-flight count (ties rotate), counts are shared by every loop
+- Health: a failed connect marks an upstream down right away, a TCP connect
+  probe every health_interval_ms marks it up (or down) again. The first loop
+  whose timer fires after next_check() runs the round, the others skip it
+*/
+class upstream_group {
+public:
+  upstream_group(const upstream_config& config) : config_(config) {}
+
+  upstream_group(const upstream_group&) = delete;
+  upstream_group& operator=(const upstream_group&) = delete;
+
+  // "host:port", resolved once (IPv4)
+  bool add(const std::string& target) {
+    size_t colon = target.rfind(':');
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = nullptr;
+    if (colon == std::string::npos ||
+        getaddrinfo(target.substr(0, colon).c_str(), target.substr(colon + 1).c_str(), &hints, &result) != 0) {
+      logger::error("Can't resolve upstream " + target, __func__);
+      return false;
+    }
+    auto upstream = std::make_unique<upstream_target>();
+    upstream->name = target;
+    upstream->addr = *(struct sockaddr_in*)result->ai_addr;
+    upstream->max_idle = config_.max_idle;
+    freeaddrinfo(result);
+    targets_.push_back(std::move(upstream));
+    return true;
+  }
+
+  // nullptr when every upstream is down
+  upstream_target* pick() {
+    size_t count = targets_.size();
+    size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+    upstream_target* best = nullptr;
+    for (size_t i = 0; i < count; ++i) {
+      upstream_target* target = targets_[(start + i) % count].get();
+      if (!target->healthy.load(std::memory_order_relaxed)) continue;
+      if (config_.policy == upstream_config::balance::round_robin) return target;
+      if (!best || target->active.load(std::memory_order_relaxed) < best->active.load(std::memory_order_relaxed))
+        best = target;
+    }
+    return best;
+  }
+
+  // True for the one caller that should probe now
+  bool health_round(uint64_t now_ms) {
+    if (config_.health_interval_ms <= 0) return false;
+    uint64_t next = next_check_ms_.load(std::memory_order_relaxed);
+    return now_ms >= next &&
+      next_check_ms_.compare_exchange_strong(next, now_ms + config_.health_interval_ms, std::memory_order_relaxed);
+  }
+
+  const upstream_config& config() const { return config_; }
+  const std::vector<std::unique_ptr<upstream_target>>& targets() const { return targets_; }
+
+private:
+  upstream_config config_;
+  std::vector<std::unique_ptr<upstream_target>> targets_;
+  std::atomic<size_t> next_{0};
+  std::atomic<uint64_t> next_check_ms_{0};
+};
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <vector>
+#include <initializer_list>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+// Backend for the accept/recv/send paths of ApiProxy and WebSocketServer.
+// readiness: the poll()/epoll loops, always available and the fallback.
+enum class io_backend { readiness, uring };
+
+/*
+#### Minimal io_uring wrapper (raw syscalls, no liburing)
+- SQEs are queued with the prep helpers and only reach the kernel on submit(),
+  so one io_uring_enter covers a whole event loop iteration
+- One provided buffer ring (multishot recv) and a set of registered buffers
+- Owned by a single thread, like timer_wheel
+*/
+class io_ring {
+public:
+  explicit io_ring(unsigned entries = 256) {
+    io_uring_params params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 8; // multishot ops post many CQEs per SQE
+    fd_ = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) return;
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    single_mmap_ = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap_ && cq_ring_size_ > sq_ring_size_) sq_ring_size_ = cq_ring_size_;
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) { sq_ring_ = nullptr; return; }
+    cq_ring_ = single_mmap_ ? sq_ring_
+      : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) { cq_ring_ = nullptr; return; }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) { sqes_ = nullptr; return; }
+
+    auto sq = (uint8_t*)sq_ring_;
+    sq_head_ = (unsigned*)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) array[i] = i; // identity, SQEs are used in order
+
+    auto cq = (uint8_t*)cq_ring_;
+    cq_head_ = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    sqe_tail_ = *sq_tail_;
+    ok_ = true;
+  }
+
+  ~io_ring() {
+    if (buf_ring_) {
+      io_uring_buf_reg reg = {};
+      reg.bgid = buf_group_;
+      reg_call(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+      free(buf_ring_);
+      free(buf_memory_);
+    }
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ring_ && !single_mmap_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  io_ring(const io_ring&) = delete;
+  io_ring& operator=(const io_ring&) = delete;
+
+  bool ok() const { return ok_; }
+
+  // Multishot accept/recv need 6.0, provided buffer rings 5.19
+  static bool supported() {
+    struct utsname name;
+    if (uname(&name) != 0) return false;
+    int major = 0, minor = 0;
+    if (sscanf(name.release, "%d.%d", &major, &minor) != 2) return false;
+    if (major < 6) return false;
+    io_ring probe(4);
+    return probe.ok() && probe.setup_buf_ring(0, 8, 64) &&
+      probe.has_opcodes({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_WRITE_FIXED, IORING_OP_ASYNC_CANCEL});
+  }
+
+  // Every opcode known to this kernel (IORING_REGISTER_PROBE). Multishot
+  // support can't be probed, a multishot accept may still fail with -EINVAL
+  bool has_opcodes(std::initializer_list<uint8_t> opcodes) {
+    std::vector<uint8_t> memory(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = (io_uring_probe*)memory.data();
+    if (reg_call(IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+    for (uint8_t op : opcodes)
+      if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+    return true;
+  }
+
+  // Never returns null: flushes the pending batch when the SQ is full
+  io_uring_sqe* get_sqe() {
+    if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) submit(0, -1);
+    io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqe_tail_;
+    return sqe;
+  }
+
+  void prep_accept_multishot(int fd, uint64_t user_data) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+  }
+
+  // Data lands in the provided buffer ring, see buffer() / recycle()
+  void prep_recv_multishot(int fd, uint64_t user_data) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buf_group_;
+    sqe->user_data = user_data;
+  }
+
+  void prep_send(int fd, const void* data, size_t len, uint64_t user_data) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+  }
+
+  // data must lie inside registered buffer `index`
+  void prep_write_fixed(int fd, const void* data, size_t len, uint16_t index, uint64_t user_data) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (unsigned)len;
+    sqe->off = 0;
+    sqe->buf_index = index;
+    sqe->user_data = user_data;
+  }
+
+  void prep_cancel(uint64_t target, uint64_t user_data) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+  }
+
+  // One io_uring_enter for every SQE queued since the last call, then waits for
+  // wait_nr completions (timeout_ms < 0 waits forever). -errno on failure.
+  int submit(unsigned wait_nr, int timeout_ms) {
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (!to_submit && !wait_nr) return 0;
+
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    __kernel_timespec ts = {};
+    io_uring_getevents_arg arg = {};
+    void* argp = nullptr;
+    size_t argsz = 0;
+    if (wait_nr && timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+      arg.sigmask_sz = _NSIG / 8;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+      argp = &arg;
+      argsz = sizeof(arg);
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+    int ret = (int)syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr, flags, argp, argsz);
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) return -errno;
+    return ret < 0 ? 0 : ret;
+  }
+
+  // Calls f(const io_uring_cqe&) for every ready completion
+  template <typename F>
+  unsigned for_each_cqe(F f) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned seen = 0;
+    for (; head != tail; ++head, ++seen) {
+      f(cqes_[head & cq_mask_]);
+      // Handlers may queue SQEs, publish progress so the CQ never overflows
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    }
+    return seen;
+  }
+
+  // Provided buffers for multishot recv: count (power of 2) buffers of size bytes
+  bool setup_buf_ring(uint16_t group, unsigned count, unsigned size) {
+    void* ring = nullptr;
+    if (posix_memalign(&ring, 4096, count * sizeof(io_uring_buf))) return false;
+    memset(ring, 0, count * sizeof(io_uring_buf));
+
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (reg_call(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      free(ring);
+      return false;
+    }
+
+    buf_ring_ = (io_uring_buf_ring*)ring;
+    buf_memory_ = (uint8_t*)malloc((size_t)count * size);
+    buf_count_ = count;
+    buf_size_ = size;
+    buf_group_ = group;
+    for (unsigned i = 0; i < count; ++i) add_buf((uint16_t)i, i);
+    __atomic_store_n(&buf_ring_->tail, (uint16_t)count, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  uint8_t* buffer(uint16_t id) { return buf_memory_ + (size_t)id * buf_size_; }
+
+  // Hands a provided buffer back to the kernel once its data was consumed
+  void recycle(uint16_t id) {
+    uint16_t tail = buf_ring_->tail;
+    add_buf(id, tail);
+    __atomic_store_n(&buf_ring_->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+  }
+
+  static uint16_t buffer_id(const io_uring_cqe& cqe) { return (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT); }
+  static bool has_buffer(const io_uring_cqe& cqe) { return cqe.flags & IORING_CQE_F_BUFFER; }
+  static bool has_more(const io_uring_cqe& cqe) { return cqe.flags & IORING_CQE_F_MORE; }
+
+  bool register_buffers(const std::vector<iovec>& buffers) {
+    return reg_call(IORING_REGISTER_BUFFERS, buffers.data(), (unsigned)buffers.size()) == 0;
+  }
+
+private:
+  int fd_ = -1;
+  bool ok_ = false;
+  bool single_mmap_ = false;
+  void* sq_ring_ = nullptr;
+  void* cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sqe_tail_ = 0;
+
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+
+  io_uring_buf_ring* buf_ring_ = nullptr;
+  uint8_t* buf_memory_ = nullptr;
+  unsigned buf_count_ = 0;
+  unsigned buf_size_ = 0;
+  uint16_t buf_group_ = 0;
+
+  int reg_call(unsigned opcode, const void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd_, opcode, arg, nr_args);
+  }
+
+  void add_buf(uint16_t id, unsigned slot) {
+    io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(buf_ring_);
+    io_uring_buf& buf = bufs[slot & (buf_count_ - 1)];
+    buf.addr = (uint64_t)(uintptr_t)buffer(id);
+    buf.len = buf_size_;
+    buf.bid = id;
+  }
+};
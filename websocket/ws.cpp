@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <openssl/sha.h>
 #include <openssl/bio.h>
 #include <openssl/buffer.h>
@@ -19,9 +20,24 @@
 
 WebSocketServer::WebSocketServer(int port, int max_threads)
   : port_(port), server_fd_(-1), epoll_fd_(-1), running_(true) {
-  for (int i = 0; i < max_threads; ++i) {
-    thread_pool_.emplace_back(&WebSocketServer::worker_thread, this);
-  }
+  // Every server registers its own records under the same names
+  lock_stats::name(connected_clients_mutex_, "connected_clients_mutex_");
+  lock_stats::name(close_sockets_mutex_, "close_sockets_mutex_");
+  lock_stats::name(client_mutex_, "client_mutex_");
+  lock_stats::name(queue_mutex_, "queue_mutex_");
+  lock_stats::name(response_mutex_, "response_mutex_");
+  lock_stats::name(timers_mutex_, "timers_mutex_");
+  lock_stats::name(tls_mutex_, "tls_mutex_");
+  lock_stats::name(outbox_mutex_, "outbox_mutex_");
+  lock_stats::name(read_buffers_mutex_, "read_buffers_mutex_");
+  lock_stats::name(task_cv_, "task_cv_");
+  lock_stats::name(response_cv_, "response_cv_");
+  lock_stats::name(task_depth_, "task_queue_");
+  lock_stats::name(response_depth_, "response_queue_");
+  lock_stats::name(pool_mutex_, "pool_mutex_");
+  pool_config_.min_threads = pool_config_.max_threads = max_threads;
+  std::lock_guard<lock_stats::mutex> lock(pool_mutex_);
+  for (int i = 0; i < max_threads; ++i) start_worker();
 }
 
 WebSocketServer::~WebSocketServer() {
@@ -39,9 +55,74 @@ void WebSocketServer::set_handshake_validator(HandshakeValidator validator) {
   custom_handshake_validator_ = validator;
 }
 
+void WebSocketServer::set_response_queue_limit(size_t limit) {
+  std::lock_guard<lock_stats::mutex> lock(response_mutex_);
+  max_pending_responses_ = limit;
+}
+
+void WebSocketServer::set_socket_profile(const socket_profile& profile) {
+  socket_profile_ = profile;
+}
+
+bool WebSocketServer::set_unix_listener(const std::string& path) {
+  int fd = unix_socket::bind_to(path);
+  if (fd < 0) return false;
+  if (unix_fd_ >= 0) close(unix_fd_);
+  unix_fd_ = fd;
+  unix_path_ = path;
+  logger::info("Agents also on " + path, __func__);
+  return true;
+}
+
+void WebSocketServer::set_ping_interval(int interval_ms) {
+  ping_interval_ms_ = interval_ms;
+}
+
+bool WebSocketServer::set_tls(const tls_config& config) {
+  tls_ = tls_context::create(config);
+  return tls_ != nullptr;
+}
+
+void WebSocketServer::set_io_backend(io_backend backend) {
+  if (backend == io_backend::uring && !io_ring::supported()) {
+    logger::warn("io_uring multishot accept/recv not supported by this kernel, using epoll", __func__);
+    backend = io_backend::readiness;
+  }
+  io_backend_ = backend;
+}
+
+bool WebSocketServer::dump_lock_stats(const std::string& path) {
+  if (!lock_stats::enabled) logger::warn("Built without LOCK_STATS=1, nothing was recorded", __func__);
+  return lock_stats::dump(path);
+}
+
+void WebSocketServer::set_write_batching(const batch_config& config) {
+  batch_ = config;
+}
+
+// Frames are coalesced by the writers themselves, Nagle would only add a delay
+void WebSocketServer::set_nodelay(int client_socket) {
+  int one = 1;
+  setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
 void WebSocketServer::run() {
+  if (!shards_.empty()) {
+    if (!local_path_.empty()) logger::warn("Local agents are not served in sharded mode", __func__);
+    run_shards();
+    return;
+  }
   if (!setup_server_socket()) return;
 
+  if (io_backend_ == io_backend::uring && (tls_ || !local_path_.empty() || unix_fd_ >= 0)) {
+    logger::info(tls_ ? "TLS enabled, using epoll" : unix_fd_ >= 0 ? "AF_UNIX listener enabled, using epoll"
+      : "Local agents enabled, using epoll", __func__);
+  } else if (io_backend_ == io_backend::uring) {
+    logger::info("WebSocket server is running (io_uring)", __func__);
+    if (handle_events_uring()) return;
+    logger::warn("io_uring unavailable, using epoll", __func__);
+  }
+
   epoll_fd_ = epoll_create1(0);
   if (epoll_fd_ < 0) {
     logger::error("Failed to create epoll instance", __func__);
@@ -57,6 +138,18 @@ void WebSocketServer::run() {
     stop();
     return;
   }
+  if (unix_fd_ >= 0) {
+    event.data.fd = unix_fd_;
+    if (!socket_profile_.listen_on(unix_fd_) || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, unix_fd_, &event) < 0) {
+      logger::error("Failed to listen on " + unix_path_, __func__);
+      stop();
+      return;
+    }
+  }
+  if (!local_path_.empty() && !setup_local_listener()) {
+    stop();
+    return;
+  }
 
   logger::info("WebSocket server is running", __func__);
   handle_events();
@@ -66,14 +159,30 @@ void WebSocketServer::stop() {
   running_ = false;
   close(server_fd_);
   close(epoll_fd_);
+  if (local_fd_ >= 0) {
+    close(local_fd_);
+    unix_socket::remove(local_path_);
+    local_fd_ = -1;
+  }
+  if (unix_fd_ >= 0) {
+    close(unix_fd_);
+    unix_socket::remove(unix_path_);
+    unix_fd_ = -1;
+  }
 
   {
-    std::lock_guard<std::mutex> lock(close_sockets_mutex_);
+    std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
     closed_sockets_.clear();  // Limpiar al detener el servidor
   }
 
   task_cv_.notify_all();
-  for (auto& thread : thread_pool_) {
+  std::vector<std::thread> workers;
+  {
+    std::lock_guard<lock_stats::mutex> lock(pool_mutex_);
+    workers.swap(thread_pool_);
+    retired_workers_.clear();
+  }
+  for (auto& thread : workers) {
     if (thread.joinable()) {
       thread.join();
     }
@@ -81,17 +190,25 @@ void WebSocketServer::stop() {
 }
 
 bool WebSocketServer::setup_server_socket() {
-  server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd_ < 0) {
+  server_fd_ = create_listener();
+  if (server_fd_ < 0) return false;
+  logger::info("Server socket setup successfully", __func__);
+  return true;
+}
+
+int WebSocketServer::create_listener() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
     logger::error("Failed to create server socket", __func__);
-    return false;
+    return -1;
   }
 
   int opt = 1;
-  if (setsockopt(server_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
     logger::error("Failed to set socket options", __func__);
-    close(server_fd_);
-    return false;
+    close(fd);
+    return -1;
   }
 
   struct sockaddr_in address = {};
@@ -99,26 +216,24 @@ bool WebSocketServer::setup_server_socket() {
   address.sin_addr.s_addr = INADDR_ANY;
   address.sin_port = htons(port_);
 
-  if (bind(server_fd_, (struct sockaddr*)&address, sizeof(address)) < 0) {
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
     logger::error("Failed to bind server socket", __func__);
-    close(server_fd_);
-    return false;
+    close(fd);
+    return -1;
   }
 
-  if (listen(server_fd_, SOMAXCONN) < 0) {
+  if (!socket_profile_.listen_on(fd)) {
     logger::error("Failed to listen on server socket", __func__);
-    close(server_fd_);
-    return false;
+    close(fd);
+    return -1;
   }
-
-  logger::info("Server socket setup successfully", __func__);
-  return true;
+  return fd;
 }
 
 void WebSocketServer::handle_events() {
   struct epoll_event events[10];
   while (running_) {
-    int num_events = epoll_wait(epoll_fd_, events, 10, -1);
+    int num_events = epoll_wait(epoll_fd_, events, 10, timers_.tick_ms());
     if (num_events < 0) {
       if (errno == EINTR) continue;  // Señal interrumpida, continuar
       logger::error("epoll_wait failed: " + std::string(strerror(errno)), __func__);
@@ -127,40 +242,196 @@ void WebSocketServer::handle_events() {
 
     for (int i = 0; i < num_events; ++i) {
       int fd = events[i].data.fd;
-      if (fd == server_fd_) {
-        int client_socket = accept(server_fd_, nullptr, nullptr);
+      if (fd == server_fd_ || fd == unix_fd_) {
+        int client_socket = accept(fd, nullptr, nullptr);
         if (client_socket >= 0) {
           fcntl(client_socket, F_SETFL, O_NONBLOCK);
+          set_nodelay(client_socket);
 
           // Remove from closed_sockets_ in case FD is reused
           {
-            std::lock_guard<std::mutex> lock(close_sockets_mutex_);
+            std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
             closed_sockets_.erase(client_socket);
           }
-  
-          if (perform_handshake(client_socket)) {
-            struct epoll_event client_event;
-            client_event.events = EPOLLIN;
-            client_event.data.fd = client_socket;
-            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_socket, &client_event);
-
-            // Add to connected clients
-            {
-              std::lock_guard<std::mutex> lock(connected_clients_mutex_);
-              connected_clients_.insert(client_socket);
-            }
-          } else {
-            close(client_socket);
-          }
+          if (hello_begin(epoll_fd_, agent_hellos_, client_socket) == 1) add_agent(client_socket);
         }
+      } else if (!agent_hellos_.empty() && agent_hellos_.count(fd)) {
+        if (hello_step(epoll_fd_, agent_hellos_, fd) == 1) add_agent(fd);
+      } else if (fd == local_fd_) {
+        local_accept();
+      } else if (local_fd_ >= 0 && (local_wake(fd) || local_hello(fd))) {
+        continue;
       } else {
+        size_t depth;
         {
-          std::lock_guard<std::mutex> lock(queue_mutex_);
+          std::lock_guard<lock_stats::mutex> lock(queue_mutex_);
           task_queue_.push(fd);
+          depth = task_queue_.size();
+          task_depth_.record(depth);
         }
         task_cv_.notify_one();  // Despierta un hilo para procesar el socket
+        scale_workers(depth);
       }
     }
+
+    run_timers();
+    if (!agent_hellos_.empty()) hello_expire(epoll_fd_, agent_hellos_);
+    if (!local_hellos_.empty()) local_expire();
+  }
+  while (!agent_hellos_.empty()) hello_close(epoll_fd_, agent_hellos_, agent_hellos_.begin()->first);
+  for (const auto& hello : local_hellos_) close(hello.first);
+  local_hellos_.clear();
+}
+
+void WebSocketServer::add_agent(int client_socket) {
+  // One shot from now on: a readable client sits in task_queue_ at most once,
+  // the worker re-arms it after reading
+  struct epoll_event client_event;
+  client_event.events = EPOLLIN | EPOLLONESHOT;
+  client_event.data.fd = client_socket;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client_socket, &client_event);
+
+  {
+    std::lock_guard<lock_stats::mutex> lock(connected_clients_mutex_);
+    connected_clients_.insert(client_socket);
+  }
+  add_client_timers(client_socket);
+}
+
+namespace {
+  enum : uint64_t { op_accept = 1, op_recv };
+
+  // fd in the low 24 bits, a per-connection generation above it: a socket
+  // closed by another thread can be reused by accept() before its last CQE.
+  uint64_t ring_data(uint64_t op, uint32_t generation, int fd) {
+    return op << 56 | (uint64_t)generation << 24 | ((uint32_t)fd & 0xFFFFFF);
+  }
+}
+
+// Accept and read on io_uring (multishot accept, multishot recv into a provided
+// buffer ring). Frames are decoded on this thread instead of the worker pool, so
+// handlers must not block. Writes still go through handle_client_write().
+bool WebSocketServer::handle_events_uring() {
+  io_ring ring(256);
+  if (!ring.ok() || !ring.setup_buf_ring(0, 1024, 4096)) return false;
+
+  std::unordered_map<int, uint32_t> generations;
+  uint32_t next_generation = 0;
+  bool accept_failed = false;
+
+  auto on_completion = [&](const io_uring_cqe& cqe) {
+    uint64_t op = cqe.user_data >> 56;
+    if (op == op_accept) {
+      int client_socket = cqe.res;
+      if (client_socket >= 0) {
+        set_nodelay(client_socket);
+        {
+          std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
+          closed_sockets_.erase(client_socket);
+        }
+        if (perform_handshake(client_socket)) {
+          {
+            std::lock_guard<lock_stats::mutex> lock(connected_clients_mutex_);
+            connected_clients_.insert(client_socket);
+          }
+          add_client_timers(client_socket);
+          uint32_t generation = ++next_generation;
+          generations[client_socket] = generation;
+          ring.prep_recv_multishot(client_socket, ring_data(op_recv, generation, client_socket));
+        } else {
+          close(client_socket);
+        }
+      } else if (cqe.res != -ECANCELED && !io_ring::has_more(cqe)) {
+        // The multishot accept is gone (-EINVAL before 6.0): re-arming it would fail forever
+        logger::error("Accept failed: " + std::string(strerror(-cqe.res)), "handle_events_uring");
+        accept_failed = true;
+        return;
+      }
+      if (!io_ring::has_more(cqe) && running_) ring.prep_accept_multishot(server_fd_, ring_data(op_accept, 0, server_fd_));
+      return;
+    }
+
+    int client_socket = (int)(cqe.user_data & 0xFFFFFF);
+    uint32_t generation = (uint32_t)(cqe.user_data >> 24);
+    auto it = generations.find(client_socket);
+    bool current = it != generations.end() && it->second == generation;
+
+    if (io_ring::has_buffer(cqe)) {
+      uint16_t id = io_ring::buffer_id(cqe);
+      if (current && cqe.res > 0 && !is_socket_closed(client_socket)) {
+        handle_client_frame(client_socket, ring.buffer(id), cqe.res);
+      }
+      ring.recycle(id);
+    }
+    if (!current || io_ring::has_more(cqe)) return;
+
+    if ((cqe.res > 0 || cqe.res == -ENOBUFS) && !is_socket_closed(client_socket)) {
+      ring.prep_recv_multishot(client_socket, cqe.user_data);
+      return;
+    }
+    generations.erase(it);
+    if (!is_socket_closed(client_socket)) {
+      if (cqe.res < 0) logger::error("Failed to read from client socket (fd: " + std::to_string(client_socket) + "): " + strerror(-cqe.res), __func__);
+      close_connection(client_socket);
+    }
+  };
+
+  ring.prep_accept_multishot(server_fd_, ring_data(op_accept, 0, server_fd_));
+  while (running_ && !accept_failed) {
+    int ret = ring.submit(1, timers_.tick_ms());
+    if (ret < 0) {
+      logger::error("io_uring_enter failed: " + std::string(strerror(-ret)), __func__);
+      break;
+    }
+    ring.for_each_cqe(on_completion);
+    run_timers();
+  }
+  if (!accept_failed) return true;
+  // Clients read by this ring go, server_fd_ is served by the epoll loop
+  for (const auto& client : generations) close_connection(client.first);
+  return false;
+}
+
+void WebSocketServer::add_client_timers(int client_socket) {
+  auto state = std::make_unique<ClientTimers>();
+  std::lock_guard<lock_stats::mutex> lock(timers_mutex_);
+  arm_ping(timers_, *state, client_socket, expired_clients_);
+  client_timers_[client_socket] = std::move(state);
+}
+
+// Runs on whichever loop owns `timers`, closes go through `expired`
+void WebSocketServer::arm_ping(timer_wheel& timers, ClientTimers& state, int client_socket, std::vector<int>& expired) {
+  state.last_seen_ms = timer_wheel::now_ms();
+  state.ping.on_expire = [this, &timers, &state, &expired, client_socket]() {
+    // Anything read from the client (pongs included) refreshes last_seen_ms
+    if (timer_wheel::now_ms() - state.last_seen_ms > 2 * (uint64_t)ping_interval_ms_) {
+      expired.push_back(client_socket);
+      return;
+    }
+    send_ping(client_socket);
+    timers.arm(state.ping, ping_interval_ms_);
+  };
+  if (ping_interval_ms_ > 0) timers.arm(state.ping, ping_interval_ms_);
+}
+
+void WebSocketServer::run_timers() {
+  std::vector<int> expired;
+  {
+    std::lock_guard<lock_stats::mutex> lock(timers_mutex_);
+    timers_.advance();
+    expired.swap(expired_clients_);
+  }
+  // Closed outside the lock, close_connection() takes timers_mutex_ itself
+  for (int client_socket : expired) {
+    logger::warn("Ping timeout (fd: " + std::to_string(client_socket) + ")", __func__);
+    close_connection(client_socket);
+  }
+}
+
+void WebSocketServer::send_ping(int client_socket) {
+  // Through the outbox, a ping must not land in the middle of a partly written frame
+  if (!write_frame(client_socket, 0x89, std::string())) {
+    logger::error("Failed to send ping (fd: " + std::to_string(client_socket) + "): " + std::string(strerror(errno)), __func__);
   }
 }
 
@@ -169,23 +440,127 @@ void WebSocketServer::worker_thread() {
     int client_fd = -1;
 
     {
-      std::unique_lock<std::mutex> lock(queue_mutex_);
-      task_cv_.wait(lock, [&]() { return !task_queue_.empty() || !running_; });
+      std::unique_lock<lock_stats::mutex> lock(queue_mutex_);
+      if (retire_worker()) {
+        --live_workers_;
+        ++workers_shrunk_;
+        lock.unlock();
+        std::lock_guard<lock_stats::mutex> pool_lock(pool_mutex_);
+        retired_workers_.push_back(std::this_thread::get_id());
+        logger::info("Idle worker retired, " + std::to_string(live_workers_.load()) + " left", __func__);
+        return;
+      }
+      // Wakes up after idle_ms at the latest, so a quiet pool still shrinks
+      task_cv_.wait_for(lock, std::chrono::milliseconds(pool_config_.idle_ms),
+        [&]() { return !task_queue_.empty() || !running_ || pool_closed_; });
+      if (pool_closed_) continue; // retire_worker() lets it go
 
       if (!running_) break;
+      if (task_queue_.empty()) continue;
 
       client_fd = task_queue_.front();
       task_queue_.pop();
+      task_depth_.record(task_queue_.size());
+      busy_high_ = std::max(busy_high_, ++busy_workers_);
     }
 
     handle_client_read(client_fd);
+    if (!is_socket_closed(client_fd)) {
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.fd = client_fd;
+      epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client_fd, &event);
+    }
+    --busy_workers_;
+  }
+  --live_workers_;
+}
+
+// Tasks go to whichever parked worker task_cv_ wakes, so no single worker
+// stays idle for long; instead the pool keeps as many workers as were busy at
+// once over the last idle_ms and the others leave as they come by here
+bool WebSocketServer::retire_worker() {
+  if (pool_closed_) return true;
+  uint64_t now = timer_wheel::now_ms();
+  if (!idle_window_ms_) idle_window_ms_ = now;
+  if (now - idle_window_ms_ >= (uint64_t)pool_config_.idle_ms) {
+    surplus_workers_ = live_workers_ - std::max(busy_high_, pool_config_.min_threads);
+    busy_high_ = busy_workers_;
+    idle_window_ms_ = now;
+  }
+  if (surplus_workers_ <= 0 || live_workers_ <= pool_config_.min_threads || !task_queue_.empty()) return false;
+  --surplus_workers_;
+  return true;
+}
+
+void WebSocketServer::set_worker_pool(const WorkerPool& config) {
+  std::lock_guard<lock_stats::mutex> pool_lock(pool_mutex_);
+  {
+    std::lock_guard<lock_stats::mutex> lock(queue_mutex_);
+    pool_config_ = config;
+    pool_config_.min_threads = std::max(config.min_threads, 1);
+    pool_config_.max_threads = std::max(config.max_threads, pool_config_.min_threads);
+    pool_config_.idle_ms = std::max(config.idle_ms, 1);
   }
+  task_cv_.notify_all(); // parked workers pick up the new idle_ms
+  reap_workers();
+  if (!shards_.empty()) return;
+  while (live_workers_ < pool_config_.min_threads) start_worker();
+}
+
+WebSocketServer::WorkerPoolStats WebSocketServer::worker_pool_stats() {
+  WorkerPoolStats stats;
+  stats.threads = live_workers_.load();
+  stats.busy = busy_workers_.load();
+  stats.peak = peak_workers_.load();
+  stats.grown = workers_grown_.load();
+  stats.shrunk = workers_shrunk_.load();
+  std::lock_guard<lock_stats::mutex> lock(queue_mutex_);
+  stats.queued = task_queue_.size();
+  return stats;
+}
+
+void WebSocketServer::start_worker() {
+  thread_pool_.emplace_back(&WebSocketServer::worker_thread, this);
+  int live = ++live_workers_;
+  int peak = peak_workers_.load();
+  while (live > peak && !peak_workers_.compare_exchange_weak(peak, live)) {}
+}
+
+void WebSocketServer::reap_workers() {
+  for (auto id : retired_workers_) {
+    auto it = std::find_if(thread_pool_.begin(), thread_pool_.end(),
+      [id](const std::thread& thread) { return thread.get_id() == id; });
+    if (it == thread_pool_.end()) continue;
+    it->join(); // already on its way out
+    thread_pool_.erase(it);
+  }
+  retired_workers_.clear();
+}
+
+// Adds a worker once sockets have been queuing behind busy workers for
+// grow_after_ms, then waits as long again before the next one
+void WebSocketServer::scale_workers(size_t depth) {
+  std::lock_guard<lock_stats::mutex> lock(pool_mutex_);
+  int live = live_workers_.load();
+  if (depth < pool_config_.grow_queue_depth || busy_workers_.load() < live || live >= pool_config_.max_threads) {
+    backlog_since_ms_ = 0;
+    return;
+  }
+  uint64_t now = timer_wheel::now_ms();
+  if (!backlog_since_ms_) backlog_since_ms_ = now;
+  if (now - backlog_since_ms_ < (uint64_t)pool_config_.grow_after_ms) return;
+  reap_workers();
+  start_worker();
+  ++workers_grown_;
+  backlog_since_ms_ = now;
+  logger::info("Worker added, " + std::to_string(live + 1) + " running, " + std::to_string(depth) + " sockets queued", __func__);
 }
 
 void WebSocketServer::handle_client_read(int client_socket) {
   // Only lock for the check, then unlock!
   {
-    std::lock_guard<std::mutex> lock(close_sockets_mutex_);
+    std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
     if (closed_sockets_.find(client_socket) != closed_sockets_.end()) {
       logger::warn("Skipping reading from closed socket (fd: " + std::to_string(client_socket) + ")", __func__);
       return;
@@ -193,7 +568,7 @@ void WebSocketServer::handle_client_read(int client_socket) {
   }
 
   std::vector<uint8_t> buffer(4096);
-  ssize_t bytes_read = recv(client_socket, buffer.data(), buffer.size(), 0);
+  ssize_t bytes_read = socket_recv(client_socket, buffer.data(), buffer.size());
   if (bytes_read <= 0) {
     if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
       return;
@@ -203,20 +578,54 @@ void WebSocketServer::handle_client_read(int client_socket) {
     return;
   }
 
-  buffer.resize(bytes_read);
-  std::string payload;
-  bool frame_ok = decode_frame(buffer, payload);
+  handle_client_frame(client_socket, buffer.data(), bytes_read);
+}
 
-  if (!frame_ok) {
-    logger::info("Closing connection after failed frame decode (fd: " + std::to_string(client_socket) + ")", __func__);
-    close_connection(client_socket);
-    return;
+// A read may end anywhere: it can hold several frames (a pong and a reply),
+// and its last one may be cut short. Every complete frame is dispatched in
+// order and the rest waits for the next read. Every text frame reaches the
+// handler, empty ones too: replies are matched to requests by their order.
+void WebSocketServer::handle_client_frame(int client_socket, const uint8_t* data, size_t len) {
+  std::vector<uint8_t>* pending;
+  std::shared_ptr<std::vector<uint8_t>> held;
+  if (local_shard_) {
+    auto it = local_shard_->client_timers.find(client_socket);
+    if (it != local_shard_->client_timers.end()) it->second->last_seen_ms = timer_wheel::now_ms();
+    pending = &local_shard_->read_buffers[client_socket];
+  } else {
+    {
+      std::lock_guard<lock_stats::mutex> lock(timers_mutex_);
+      auto it = client_timers_.find(client_socket);
+      if (it != client_timers_.end()) it->second->last_seen_ms = timer_wheel::now_ms();
+    }
+    std::lock_guard<lock_stats::mutex> lock(read_buffers_mutex_);
+    auto& slot = read_buffers_[client_socket];
+    if (!slot) slot = std::make_shared<std::vector<uint8_t>>();
+    held = slot;
+    pending = held.get();
   }
-
-  if (payload.empty()) {
-    return;
+  pending->insert(pending->end(), data, data + len);
+
+  size_t at = 0;
+  while (true) {
+    uint8_t opcode = 0;
+    std::string payload;
+    ssize_t taken = decode_frame(pending->data() + at, pending->size() - at, opcode, payload);
+    if (taken == 0) break;
+    if (taken < 0 || opcode == 0x8) {
+      logger::info("Closing connection after " + std::string(taken < 0 ? "failed frame decode" : "close frame") +
+        " (fd: " + std::to_string(client_socket) + ")", __func__);
+      close_connection(client_socket);
+      return;
+    }
+    at += taken;
+    if (opcode == 0x1) deliver_message(client_socket, payload);
+    if (local_shard_ ? !local_shard_->clients.count(client_socket) : is_socket_closed(client_socket)) return;
   }
+  pending->erase(pending->begin(), pending->begin() + at);
+}
 
+void WebSocketServer::deliver_message(int client_socket, std::string& payload) {
   if (!is_valid_utf8(payload)) {
     payload = sanitize_utf8(payload);
   }
@@ -237,7 +646,7 @@ void WebSocketServer::handle_client_write(int client_socket, const std::string&
   }
 
   {
-    std::lock_guard<std::mutex> lock(close_sockets_mutex_);
+    std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
     if (closed_sockets_.find(client_socket) != closed_sockets_.end()) {
       logger::warn("Attempted to write to closed socket (fd: " + std::to_string(client_socket) + ")", __func__);
       return;
@@ -250,92 +659,92 @@ void WebSocketServer::handle_client_write(int client_socket, const std::string&
   }
 
   std::string processed_message = process_data(message);
-  std::vector<uint8_t> frame = encode_frame(processed_message);
-  if (frame.empty()) {
-    logger::error("Failed to encode WebSocket frame", __func__);
-    return;
+  if (local_fd_ >= 0) {
+    if (auto local = local_agent(client_socket)) {
+      if (4 + processed_message.size() > local_capacity_) {
+        logger::error("Message larger than the local agent's ring, not sent (fd: " + std::to_string(client_socket) + ")", __func__);
+        return;
+      }
+      bool sent;
+      {
+        std::unique_lock<std::mutex> lock(local->send_mutex);
+        sent = local_send(*local, lock, std::move(processed_message));
+      }
+      if (!sent) {
+        logger::error("Local agent stuck with a full ring, closing (fd: " + std::to_string(client_socket) + ")", __func__);
+        close_connection(client_socket);
+      }
+      return;
+    }
   }
-
-  ssize_t sent = send(client_socket, frame.data(), frame.size(), 0);
-  if (sent < 0) {
+  logger::info("Sent WebSocket frame to client (fd: " + std::to_string(client_socket) + "): " + processed_message, __func__);
+  if (!write_frame(client_socket, 0x81, std::move(processed_message))) {
     logger::error("Failed to send WebSocket frame to client (fd: " + std::to_string(client_socket) + "): " + std::string(strerror(errno)), __func__);
     close_connection(client_socket);
-  } else {
-    logger::info("Sent WebSocket frame to client (fd: " + std::to_string(client_socket) + "): " + processed_message, __func__);
   }
 }
 
-bool WebSocketServer::decode_frame(const std::vector<uint8_t>& frame, std::string& payload) {
-  if (frame.size() < 2) {
-    logger::error("Frame too short to decode", __func__);
-    return false;
-  }
+ssize_t WebSocketServer::decode_frame(const uint8_t* frame, size_t len, uint8_t& opcode, std::string& payload) {
+  if (len < 2) return 0;
 
-  uint8_t opcode = frame[0] & 0x0F;
+  opcode = frame[0] & 0x0F;
   if (opcode == 0x8) { // Close frame
     logger::info("Received close frame", __func__);
-    return false;
   } else if (opcode == 0x9) { // Ping frame
     logger::info("Received ping frame", __func__);
-    return true;
   } else if (opcode == 0xA) { // Pong frame
     logger::info("Received pong frame", __func__);
-    return true;
   } else if (opcode != 0x1) {
     logger::error("Unsupported opcode: " + std::to_string(opcode), __func__);
-    return false;
+    return -1;
   }
 
   bool masked = frame[1] & 0x80;
-  size_t payload_len = frame[1] & 0x7F;
+  uint64_t payload_len = frame[1] & 0x7F;
   size_t offset = 2;
 
   if (payload_len == 126) {
-    if (frame.size() < 4) {
-      logger::error("Frame too short for extended payload length (126)", __func__);
-      return false;
-    }
+    if (len < 4) return 0;
     payload_len = (frame[2] << 8) | frame[3];
     offset += 2;
   } else if (payload_len == 127) {
-    if (frame.size() < 10) {
-      logger::error("Frame too short for extended payload length (127)", __func__);
-      return false;
-    }
+    if (len < 10) return 0;
     payload_len = 0;
     for (int i = 0; i < 8; ++i) {
       payload_len = (payload_len << 8) | frame[2 + i];
     }
     offset += 8;
   }
+  if (payload_len > max_frame_size) {
+    logger::error("Frame too large: " + std::to_string(payload_len) + " bytes", __func__);
+    return -1;
+  }
 
-  if (masked) {
-    if (frame.size() < offset + 4 + payload_len) {
-      logger::error("Frame too short for masked payload", __func__);
-      return false;
-    }
-    uint8_t mask[4] = {frame[offset], frame[offset + 1], frame[offset + 2], frame[offset + 3]};
-    offset += 4;
+  size_t mask_at = offset;
+  if (masked) offset += 4;
+  if (len < offset + payload_len) return 0;
 
-    payload.resize(payload_len);
+  payload.assign((const char*)frame + offset, payload_len);
+  if (masked) {
     for (size_t i = 0; i < payload_len; ++i) {
-      payload[i] = frame[offset + i] ^ mask[i % 4];
+      payload[i] ^= frame[mask_at + i % 4];
     }
-  } else {
-    if (frame.size() < offset + payload_len) {
-      logger::error("Frame too short for unmasked payload", __func__);
-      return false;
-    }
-    payload.assign(frame.begin() + offset, frame.begin() + offset + payload_len);
   }
 
+  if (opcode != 0x1) return offset + payload_len;
   logger::info("Decoded WebSocket frame: " + payload, __func__);
-  return is_valid_utf8(payload);
+  if (!is_valid_utf8(payload)) return -1;
+  return offset + payload_len;
 }
 
 void WebSocketServer::close_connection(int client_socket) {
+  if (local_shard_) {
+    shard_close(*local_shard_, client_socket);
+    return;
+  }
+
   {
-    std::lock_guard<std::mutex> lock(close_sockets_mutex_);
+    std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
     if (closed_sockets_.count(client_socket)) {
         logger::warn("Attempted to close already closed socket (fd: " + std::to_string(client_socket) + ")", __func__);
         return;
@@ -343,46 +752,178 @@ void WebSocketServer::close_connection(int client_socket) {
     closed_sockets_.insert(client_socket);
   }
 
+  {
+    std::lock_guard<lock_stats::mutex> lock(read_buffers_mutex_);
+    read_buffers_.erase(client_socket); // before close(), accept() may hand the fd out again
+  }
+
   logger::info("Closing connection (fd: " + std::to_string(client_socket) + ")", __func__);
 
   {
-    std::lock_guard<std::mutex> lock(client_mutex_);
-    if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, client_socket, nullptr) < 0) {
+    std::lock_guard<lock_stats::mutex> lock(client_mutex_);
+    if (epoll_fd_ >= 0 && epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, client_socket, nullptr) < 0) {
         logger::error("Failed to remove client fd from epoll: " + std::string(strerror(errno)), __func__);
     }
+    std::shared_ptr<TlsSession> session;
+    {
+      std::lock_guard<lock_stats::mutex> tls_lock(tls_mutex_);
+      auto it = tls_sessions_.find(client_socket);
+      if (it != tls_sessions_.end()) {
+        session = it->second;
+        tls_sessions_.erase(it);
+      }
+    }
+    if (session) {
+      std::lock_guard<std::mutex> session_lock(session->mutex);
+      SSL_shutdown(session->ssl); // best effort close_notify
+    }
+    // Ends a pending io_uring recv, which holds its own reference to the socket
+    shutdown(client_socket, SHUT_RDWR);
     close(client_socket);
     logger::info("Closed connection (fd: " + std::to_string(client_socket) + ")", __func__);
   }
 
   {
-    std::lock_guard<std::mutex> lock(connected_clients_mutex_);
+    std::lock_guard<lock_stats::mutex> lock(connected_clients_mutex_);
     connected_clients_.erase(client_socket);
   }
+
+  {
+    std::lock_guard<lock_stats::mutex> lock(response_mutex_);
+    awaiting_.erase(client_socket); // its requests time out, or another agent answers
+  }
+
+  {
+    std::lock_guard<lock_stats::mutex> lock(timers_mutex_);
+    client_timers_.erase(client_socket);
+  }
+
+  {
+    std::lock_guard<lock_stats::mutex> lock(outbox_mutex_);
+    outboxes_.erase(client_socket);
+  }
+  if (local_fd_ >= 0) remove_local_agent(client_socket);
 }
 
+bool WebSocketServer::is_socket_closed(int client_socket) {
+  std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
+  return closed_sockets_.count(client_socket) > 0;
+}
 
-std::vector<uint8_t> WebSocketServer::encode_frame(const std::string& payload) {
-  std::vector<uint8_t> frame;
-  frame.push_back(0x81); // FIN + text frame
-
-  size_t payload_len = payload.size();
-  if (payload_len <= 125) {
-    frame.push_back(static_cast<uint8_t>(payload_len));
-  } else if (payload_len <= 65535) {
-    frame.push_back(126);
-    frame.push_back((payload_len >> 8) & 0xFF);
-    frame.push_back(payload_len & 0xFF);
-  } else {
-    frame.push_back(127);
-    for (int i = 7; i >= 0; --i) {
-      frame.push_back((payload_len >> (i * 8)) & 0xFF);
+namespace {
+  // FIN + opcode (text by default) header for a payload of len bytes, returns its size
+  size_t frame_header(uint8_t* header, size_t len, uint8_t first_byte = 0x81) {
+    size_t at = 0;
+    header[at++] = first_byte;
+    if (len <= 125) {
+      header[at++] = static_cast<uint8_t>(len);
+    } else if (len <= 65535) {
+      header[at++] = 126;
+      header[at++] = (len >> 8) & 0xFF;
+      header[at++] = len & 0xFF;
+    } else {
+      header[at++] = 127;
+      for (int i = 7; i >= 0; --i) {
+        header[at++] = (len >> (i * 8)) & 0xFF;
+      }
     }
+    return at;
   }
+}
 
+std::vector<uint8_t> WebSocketServer::encode_frame(const std::string& payload) {
+  uint8_t header[10];
+  size_t header_len = frame_header(header, payload.size());
+  std::vector<uint8_t> frame;
+  frame.reserve(header_len + payload.size());
+  frame.insert(frame.end(), header, header + header_len);
   frame.insert(frame.end(), payload.begin(), payload.end());
   return frame;
 }
 
+void WebSocketServer::append_frame(std::string& out, const std::string& payload) {
+  uint8_t header[10];
+  size_t header_len = frame_header(header, payload.size());
+  out.reserve(out.size() + header_len + payload.size());
+  out.append((const char*)header, header_len);
+  out.append(payload);
+}
+
+bool WebSocketServer::write_frame(int client_socket, uint8_t first_byte, std::string payload) {
+  uint8_t header[10];
+  size_t header_len = frame_header(header, payload.size(), first_byte);
+  if (local_shard_) {
+    Shard::Outgoing& out = local_shard_->outbox[client_socket];
+    out.frames.push(header, header_len, std::move(payload));
+    // Unbatched: straight out, as long as nothing older is still queued
+    if (batch_.max_bytes == 0 && !out.blocked) return send_batch(client_socket, out.frames, false);
+    return true;
+  }
+
+  std::shared_ptr<Outbox> box;
+  {
+    std::lock_guard<lock_stats::mutex> lock(outbox_mutex_);
+    auto& slot = outboxes_[client_socket];
+    if (!slot) slot = std::make_shared<Outbox>();
+    box = slot;
+  }
+  std::unique_lock<std::mutex> lock(box->mutex);
+  box->frames.push(header, header_len, std::move(payload));
+  if (box->flushing) return true; // the thread writing now takes it along
+  box->flushing = true;
+  bool ok = true;
+  while (ok && !box->frames.empty()) {
+    frame_batch batch = std::move(box->frames);
+    box->frames.clear();
+    lock.unlock();
+    ok = send_batch(client_socket, batch, true);
+    lock.lock();
+  }
+  if (!ok) box->frames.clear();
+  box->flushing = false;
+  return ok;
+}
+
+bool WebSocketServer::send_batch(int client_socket, frame_batch& batch, bool wait) {
+  auto wait_writable = [&]() {
+    struct pollfd pfd = {client_socket, POLLOUT, 0};
+    return wait && poll(&pfd, 1, 5000) > 0;
+  };
+
+  auto session = tls_session(client_socket);
+  if (session && !session->ktls_send) {
+    // SSL_write() takes one buffer, the contexts accept it moving between retries
+    std::string out;
+    batch.drain_to(out);
+    size_t at = 0;
+    while (at < out.size()) {
+      ssize_t n = socket_send(client_socket, out.data() + at, out.size() - at);
+      if (n > 0) {
+        at += n;
+        continue;
+      }
+      if (n < 0 && errno == EAGAIN && !wait) {
+        batch.push(nullptr, 0, out.substr(at));
+        return true;
+      }
+      if (n < 0 && errno == EAGAIN && wait_writable()) continue;
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lock;
+  if (session) lock = std::unique_lock<std::mutex>(session->mutex); // kTLS records must not interleave
+  while (true) {
+    if (!batch.flush(client_socket)) return false;
+    if (batch.empty() || !wait) return true;
+    if (!wait_writable()) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+  }
+}
+
 bool WebSocketServer::is_valid_utf8(const std::string& str) {
   int bytes = 0;
   for (unsigned char c : str) {
@@ -417,14 +958,39 @@ std::string WebSocketServer::process_data(const std::string& data) {
 }
 
 void WebSocketServer::on_message(int client_socket, const std::string& message) {
+  if (local_shard_ && shard_route_response(*local_shard_, client_socket, message)) return;
+
   //logger::info("on_message called for fd: " + std::to_string(client_socket) + " with message: " + message, __func__);
   /*
   std::string response = "Echo: " + message;
   handle_client_write(client_socket, response);
   */
   {
-    std::lock_guard<std::mutex> lock(response_mutex_);
+    std::lock_guard<lock_stats::mutex> lock(response_mutex_);
+    uint64_t arrived = tracing::enabled() ? tracing::ticks() : 0;
+    auto it = awaiting_.find(client_socket);
+    if (it != awaiting_.end() && !it->second.empty()) {
+      uint64_t request = it->second.front();
+      it->second.pop_front();
+      if (!open_requests_.erase(request)) return; // timed out, or another agent was first
+      answered_[request] = {message, arrived};
+      if (max_pending_responses_ > 0 && answered_.size() > max_pending_responses_) {
+        logger::warn("Too many unclaimed responses, dropping the oldest", __func__);
+        answered_.erase(answered_.begin());
+      }
+      auto waiter = request_waiters_.find(request);
+      if (waiter != request_waiters_.end()) waiter->second->notify_one();
+      return;
+    }
+    // Replies nobody asked for must not pile up
+    if (max_pending_responses_ > 0 && response_queue_.size() >= max_pending_responses_) {
+      logger::warn("Response queue full, dropping the oldest response", __func__);
+      response_queue_.pop();
+      response_ticks_.pop();
+    }
     response_queue_.push(message);
+    response_ticks_.push(arrived);
+    response_depth_.record(response_queue_.size());
   }
   response_cv_.notify_one();
 }
@@ -434,12 +1000,160 @@ bool WebSocketServer::validate_handshake(const std::string& request) {
   return true;
 }
 
+int WebSocketServer::hello_begin(int epoll_fd, AgentHellos& hellos, int client_socket) {
+  AgentHello& hello = hellos[client_socket];
+  hello.deadline_ms = timer_wheel::now_ms() + 5000;
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = client_socket;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+    logger::error("Failed to add client fd to epoll: " + std::string(strerror(errno)), __func__);
+    hello_close(epoll_fd, hellos, client_socket);
+    return -1;
+  }
+  if (tls_) {
+    hello.tls = std::make_shared<TlsSession>();
+    hello.tls->ssl = tls_->accept(client_socket);
+    if (!hello.tls->ssl) {
+      logger::error("SSL_new failed: " + tls_context::last_error(), __func__);
+      hello_close(epoll_fd, hellos, client_socket);
+      return -1;
+    }
+  }
+  return hello_step(epoll_fd, hellos, client_socket); // the first bytes may be here already
+}
+
+int WebSocketServer::hello_step(int epoll_fd, AgentHellos& hellos, int client_socket) {
+  AgentHello& hello = hellos[client_socket];
+  auto watch = [&](uint32_t events) {
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.fd = client_socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_socket, &event);
+  };
+
+  if (hello.tls) {
+    int result = SSL_do_handshake(hello.tls->ssl);
+    if (result != 1) {
+      int error = SSL_get_error(hello.tls->ssl, result);
+      if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        logger::error("TLS handshake failed: " + tls_context::last_error(), __func__);
+        hello_close(epoll_fd, hellos, client_socket);
+        return -1;
+      }
+      watch(error == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT);
+      return 0;
+    }
+    hello.tls->ktls_send = tls_context::ktls_send(hello.tls->ssl);
+    logger::info(std::string("TLS handshake completed") + (SSL_session_reused(hello.tls->ssl) ? " (resumed)" : "") +
+      (hello.tls->ktls_send ? " (kTLS)" : ""), __func__);
+    {
+      std::lock_guard<lock_stats::mutex> lock(tls_mutex_);
+      tls_sessions_[client_socket] = std::move(hello.tls);
+    }
+    watch(EPOLLIN);
+  }
+
+  // The upgrade request, through socket_recv() once TLS is up
+  char buffer[2048];
+  while (hello.request.find("\r\n\r\n") == std::string::npos) {
+    if (hello.request.size() >= sizeof(buffer)) {
+      logger::error("Handshake request too long", __func__);
+      hello_close(epoll_fd, hellos, client_socket);
+      return -1;
+    }
+    ssize_t len = socket_recv(client_socket, buffer, sizeof(buffer) - hello.request.size());
+    if (len > 0) {
+      hello.request.append(buffer, len);
+      continue;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    logger::error("Error receiving handshake request: " + std::string(len == 0 ? "connection closed" : strerror(errno)), __func__);
+    hello_close(epoll_fd, hellos, client_socket);
+    return -1;
+  }
+
+  std::string request = std::move(hello.request);
+  if (!answer_handshake(client_socket, request)) {
+    hello_close(epoll_fd, hellos, client_socket);
+    return -1;
+  }
+  hellos.erase(client_socket);
+  return 1;
+}
+
+void WebSocketServer::hello_close(int epoll_fd, AgentHellos& hellos, int client_socket) {
+  hellos.erase(client_socket);
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_socket, nullptr);
+  {
+    std::lock_guard<lock_stats::mutex> lock(tls_mutex_);
+    tls_sessions_.erase(client_socket);
+  }
+  close(client_socket);
+}
+
+void WebSocketServer::hello_expire(int epoll_fd, AgentHellos& hellos) {
+  uint64_t now = timer_wheel::now_ms();
+  std::vector<int> expired;
+  for (const auto& hello : hellos) {
+    if (now >= hello.second.deadline_ms) expired.push_back(hello.first);
+  }
+  for (int client_socket : expired) {
+    logger::error("Timeout waiting for agent handshake (fd: " + std::to_string(client_socket) + ")", __func__);
+    hello_close(epoll_fd, hellos, client_socket);
+  }
+}
+
+std::shared_ptr<WebSocketServer::TlsSession> WebSocketServer::tls_session(int client_socket) {
+  if (!tls_) return nullptr;
+  std::lock_guard<lock_stats::mutex> lock(tls_mutex_);
+  auto it = tls_sessions_.find(client_socket);
+  return it == tls_sessions_.end() ? nullptr : it->second;
+}
+
+ssize_t WebSocketServer::socket_recv(int client_socket, void* buffer, size_t len) {
+  auto session = tls_session(client_socket);
+  if (!session) return recv(client_socket, buffer, len, 0);
+
+  // Drain what OpenSSL already decrypted, epoll won't report it again
+  std::lock_guard<std::mutex> lock(session->mutex);
+  size_t total = 0;
+  while (total < len) {
+    int n = SSL_read(session->ssl, (char*)buffer + total, (int)(len - total));
+    if (n > 0) {
+      total += n;
+      if (SSL_pending(session->ssl) > 0) continue;
+      break;
+    }
+    if (total > 0) break;
+    int error = SSL_get_error(session->ssl, n);
+    if (error == SSL_ERROR_ZERO_RETURN) return 0;
+    errno = (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) ? EAGAIN : EPROTO;
+    return -1;
+  }
+  return total;
+}
+
+ssize_t WebSocketServer::socket_send(int client_socket, const void* data, size_t len) {
+  auto session = tls_session(client_socket);
+  if (!session) return send(client_socket, data, len, MSG_NOSIGNAL);
+
+  std::lock_guard<std::mutex> lock(session->mutex);
+  if (session->ktls_send) return send(client_socket, data, len, MSG_NOSIGNAL);
+  int n = SSL_write(session->ssl, data, (int)len);
+  if (n > 0) return n;
+  int error = SSL_get_error(session->ssl, n);
+  errno = (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) ? EAGAIN : EPROTO;
+  return -1;
+}
+
 bool WebSocketServer::perform_handshake(int client_socket) {
   struct pollfd pfd;
   pfd.fd = client_socket;
   pfd.events = POLLIN;
 
-  int poll_result = poll(&pfd, 1, 5000);
+  auto session = tls_session(client_socket);
+  int poll_result = session && SSL_pending(session->ssl) > 0 ? 1 : poll(&pfd, 1, 5000);
   if (poll_result <= 0) {
     if (poll_result == 0) {
       logger::error("Timeout waiting ", __func__);
@@ -454,7 +1168,7 @@ bool WebSocketServer::perform_handshake(int client_socket) {
   ssize_t len;
   size_t total = 0;
   while (request.find("\r\n\r\n") == std::string::npos && total < sizeof(buffer) - 1) {
-    len = recv(client_socket, buffer, sizeof(buffer) - 1 - total, 0);
+    len = socket_recv(client_socket, buffer, sizeof(buffer) - 1 - total);
     if (len <= 0) {
       logger::error("Error receiving handshake request: " + std::string(strerror(errno)), __func__);
       return false;
@@ -463,6 +1177,10 @@ bool WebSocketServer::perform_handshake(int client_socket) {
     request.append(buffer, len);
     total += len;
   }
+  return answer_handshake(client_socket, request);
+}
+
+bool WebSocketServer::answer_handshake(int client_socket, const std::string& request) {
   logger::info("Received handshake request:\n" + request, __func__);
 
   if (custom_handshake_validator_ && !custom_handshake_validator_(request)) {
@@ -483,7 +1201,7 @@ bool WebSocketServer::perform_handshake(int client_socket) {
                          "Connection: Upgrade\r\n"
                          "Sec-WebSocket-Accept: " + sec_websocket_accept + "\r\n\r\n";
 
-  if (send(client_socket, response.c_str(), response.size(), 0) < 0) {
+  if (socket_send(client_socket, response.c_str(), response.size()) < 0) {
     logger::error("Failed to send handshake response: " + std::string(strerror(errno)), __func__);
     return false;
   }
@@ -535,25 +1253,106 @@ std::string WebSocketServer::compute_accept_key(const std::string& sec_websocket
   return sec_websocket_accept;
 }
 
+namespace {
+  // Request of this thread's last broadcast(), claimed by its next receive_response()
+  thread_local const WebSocketServer* broadcast_server = nullptr;
+  thread_local uint64_t broadcast_request = 0;
+}
+
 void WebSocketServer::broadcast(const std::string& message) {
+  if (!shards_.empty()) {
+    // The shards own every agent
+    if (bound_producer_ < 0) {
+      logger::error("No producer bound to this thread in sharded mode, see bind_producer()", __func__);
+    } else if (!shard_send(bound_producer_, message)) {
+      logger::warn("No shard took the request", __func__);
+    }
+    return;
+  }
   logger::info("Broadcasting message to all clients", __func__);
   std::unordered_set<int> clients_copy;
   {
-    std::lock_guard<std::mutex> lock(connected_clients_mutex_);
+    std::lock_guard<lock_stats::mutex> lock(connected_clients_mutex_);
     clients_copy = connected_clients_;
   }
   logger::info("Number of clients to broadcast: " + std::to_string(clients_copy.size()), __func__);
+  {
+    std::lock_guard<lock_stats::mutex> lock(response_mutex_);
+    uint64_t request = ++next_request_;
+    open_requests_.insert(request);
+    if (max_pending_responses_ > 0 && open_requests_.size() > max_pending_responses_)
+      open_requests_.erase(open_requests_.begin()); // never received, its reply is dropped
+    for (int client_socket : clients_copy) awaiting_[client_socket].push_back(request);
+    broadcast_server = this;
+    broadcast_request = request;
+  }
   for (int client_socket : clients_copy) {
     logger::info("Broadcasting message to client socket: " + std::to_string(client_socket), __func__);
     handle_client_write(client_socket, message);
   }
+  if (request_trace* trace = tracing::current()) trace->mark(tracing::sent);
 }
 
-std::string WebSocketServer::receive_response() {
+std::string WebSocketServer::receive_response(int timeout_ms) {
   logger::info("Waiting for response from WebSocket client", __func__);
-  std::unique_lock<std::mutex> lock(response_mutex_);
-  response_cv_.wait(lock, [&]{ return !response_queue_.empty(); });
-  std::string msg = response_queue_.front();
-  response_queue_.pop();
+  if (!shards_.empty()) return bound_producer_ < 0 ? std::string() : shard_receive(bound_producer_, timeout_ms);
+
+  uint64_t request = 0;
+  if (broadcast_server == this) {
+    request = broadcast_request;
+    broadcast_server = nullptr;
+  }
+
+  // The deadline fires on the event loop thread, never hold response_mutex_
+  // while taking timers_mutex_ here.
+  bool expired = false;
+  lock_stats::condition_variable request_cv; // only this request's reply wakes it
+  lock_stats::condition_variable& cv = request ? request_cv : response_cv_;
+  timer_wheel::timer deadline([&]() {
+    std::lock_guard<lock_stats::mutex> lock(response_mutex_);
+    expired = true;
+    cv.notify_all();
+  });
+  if (timeout_ms >= 0) {
+    std::lock_guard<lock_stats::mutex> lock(timers_mutex_);
+    timers_.arm(deadline, timeout_ms);
+  }
+
+  std::string msg;
+  uint64_t arrived = 0;
+  {
+    std::unique_lock<lock_stats::mutex> lock(response_mutex_);
+    if (request) request_waiters_[request] = &request_cv;
+    cv.wait(lock, [&]{ return (request ? answered_.count(request) > 0 : !response_queue_.empty()) || expired; });
+    if (request) {
+      request_waiters_.erase(request);
+      auto it = answered_.find(request);
+      if (it != answered_.end()) {
+        msg = std::move(it->second.first);
+        arrived = it->second.second;
+        answered_.erase(it);
+      } else {
+        open_requests_.erase(request); // its reply, if it still comes, is dropped
+      }
+    } else if (!response_queue_.empty()) {
+      msg = response_queue_.front();
+      response_queue_.pop();
+      arrived = response_ticks_.front();
+      response_ticks_.pop();
+      response_depth_.record(response_queue_.size());
+    }
+  }
+  if (request_trace* trace = tracing::current()) {
+    trace->mark_at(tracing::replied, arrived); // the worker read the frame
+    trace->mark(tracing::received);             // this thread got it
+  }
+
+  {
+    std::lock_guard<lock_stats::mutex> lock(timers_mutex_);
+    timers_.cancel(deadline);
+  }
+  if (msg.empty()) {
+    logger::warn("Timed out waiting for response from WebSocket client", __func__);
+  }
   return msg;
 }
\ No newline at end of file
@@ -7,57 +7,139 @@
 #include <mutex>
 #include <functional>
 #include <queue> // Added for std::queue
+#include <deque>
+#include <map>
+#include <set>
 #include <sys/epoll.h>
 #include <condition_variable>
 #include <thread>
 #include <atomic>
+#include <memory>
 #include "../util/logger.h"
 #include "../util/pck.h"
+#include "../util/timer_wheel.h"
+#include "../util/uring.h"
+#include "../util/tls.h"
+#include "../util/trace.h"
+#include "../util/spsc.h"
+#include "../util/frame_batch.h"
+#include "../util/lock_stats.h"
+#include "../util/shm_ring.h"
+#include "../util/socket_profile.h"
+#include "../util/unix_socket.h"
 
 class WebSocketServer {
 public:
   using MessageHandler = std::function<void(int, const std::string&)>;
   using HandshakeValidator = std::function<bool(const std::string&)>;
 
-  WebSocketServer(int port = -1, int max_threads = 4);
+  // Worker pool bounds and scaling (see set_worker_pool())
+  struct WorkerPool {
+    int min_threads = 4;
+    int max_threads = 4;
+    size_t grow_queue_depth = 2; // readable sockets waiting while every worker is busy
+    int grow_after_ms = 20;      // how long that must last before a worker is added, and between additions
+    int idle_ms = 5000;          // window over which unused workers are counted, then retired
+  };
+  struct WorkerPoolStats {
+    int threads = 0;
+    int busy = 0;
+    int peak = 0;
+    uint64_t grown = 0;  // workers added past the constructor's
+    uint64_t shrunk = 0; // workers retired while idle
+    size_t queued = 0;   // task_queue_ length
+  };
+
+  WebSocketServer(int port = -1, int max_threads = 4); // max_threads workers, a fixed pool until set_worker_pool()
   virtual ~WebSocketServer();
 
   std::unordered_set<int> connected_clients_;
-  std::mutex connected_clients_mutex_;
+  lock_stats::mutex connected_clients_mutex_;
 
   void run(); // Start the server
   void stop(); // Stop the server
   void set_message_handler(MessageHandler handler); // Set custom message handler
   void set_handshake_validator(HandshakeValidator validator); // Set custom handshake validator
+  void set_ping_interval(int interval_ms); // 0 disables pings
+  void set_response_queue_limit(size_t limit); // Oldest unclaimed responses are dropped past it, 0 = unbounded
+  void set_io_backend(io_backend backend); // Before run(), falls back to epoll if io_uring is unusable
+  bool set_tls(const tls_config& config); // Before run(), TLS forces the epoll backend
+  void set_write_batching(const batch_config& config); // Before run(), also read by ApiProxy's integrated loop
+  void set_socket_profile(const socket_profile& profile); // Before run(), agent listener options, also ApiProxy's integrated loop
+  // Before run(): agents may also connect over AF_UNIX on path ("@name" =
+  // abstract namespace), same handshake and framing as on port_. Epoll backend
+  // (io_uring falls back to it), shards and ApiProxy's integrated loop, which
+  // all accept from this one socket
+  bool set_unix_listener(const std::string& path);
+  // Any time: the pool grows while task_queue_ stays at grow_queue_depth or more
+  // with every worker busy, one worker per grow_after_ms, up to max_threads.
+  // Every idle_ms the workers above the most that were busy at once in that
+  // window leave (not below min_threads). Epoll backend: the io_uring loop and
+  // shards read on their own threads
+  void set_worker_pool(const WorkerPool& config);
+  WorkerPoolStats worker_pool_stats();
 
   void close_connection(int client_socket);
 
   bool is_socket_closed(int client_socket); // Check if a socket is closed
 
+  // In sharded mode both go through shard_send() / shard_receive() with the
+  // calling thread's bind_producer() index: one agent gets the request
   void broadcast(const std::string& message);
-  std::string receive_response();
+  std::string receive_response(int timeout_ms = -1); // Reply to this thread's last broadcast(), empty string on timeout
+  static bool dump_lock_stats(const std::string& path); // Wait/hold times of the locks below and queue depths, needs make LOCK_STATS=1
 
   int port_;
   int server_fd_;
   int epoll_fd_;
   std::atomic<bool> running_;
-  std::mutex client_mutex_;
+  lock_stats::mutex client_mutex_;
   MessageHandler custom_message_handler_;
   HandshakeValidator custom_handshake_validator_;
   std::vector<std::thread> thread_pool_;
   std::queue<int> task_queue_;
-  std::mutex queue_mutex_;
-  std::condition_variable task_cv_;
+  lock_stats::mutex queue_mutex_;
+  lock_stats::condition_variable task_cv_;
+  lock_stats::queue task_depth_; // task_queue_ length, recorded in LOCK_STATS builds only
+
+  // Pool scaling: thread_pool_ and retired_workers_ under pool_mutex_, the
+  // bounds are read by workers holding queue_mutex_
+  WorkerPool pool_config_;
+  lock_stats::mutex pool_mutex_;
+  std::vector<std::thread::id> retired_workers_; // exited, waiting to be joined
+  std::atomic<int> live_workers_{0};
+  std::atomic<int> busy_workers_{0};
+  std::atomic<int> peak_workers_{0};
+  std::atomic<uint64_t> workers_grown_{0};
+  std::atomic<uint64_t> workers_shrunk_{0};
+  uint64_t backlog_since_ms_ = 0; // event loop only: task_queue_ deep with every worker busy since
+  uint64_t idle_window_ms_ = 0;   // queue_mutex_: start of the current shrink window
+  int busy_high_ = 0;             // queue_mutex_: most workers busy at once in it
+  int surplus_workers_ = 0;       // queue_mutex_: still to retire from the last window
+  bool pool_closed_ = false;      // queue_mutex_: set_shards(), every worker leaves and none starts
+
+  void start_worker(); // pool_mutex_ held
+  void reap_workers(); // pool_mutex_ held, joins retired ones
+  bool retire_worker(); // queue_mutex_ held, true when the calling worker should leave
+  void scale_workers(size_t depth); // event loop, after a task was queued
 
   bool setup_server_socket(); // Setup the server socket
+  int create_listener(); // Bound, listening SO_REUSEPORT socket on port_, -1 on failure
   void handle_events(); // Handle incoming events
+  bool handle_events_uring(); // Same loop on io_uring, false when the ring can't be set up or its accept fails
   void worker_thread(); // Worker thread for handling events
   void handle_client_read(int client_socket); // Handle client read events
+  void handle_client_frame(int client_socket, const uint8_t* data, size_t len); // Buffer received bytes, dispatch every complete frame
   void handle_client_write(int client_socket, const std::string& message); // Handle client write events
-  bool perform_handshake(int client_socket); // Perform WebSocket handshake
+  bool write_frame(int client_socket, uint8_t first_byte, std::string payload); // Queue one frame, false if the socket failed
+  bool perform_handshake(int client_socket); // Blocking with a 5 s deadline, the io_uring loop's
+  bool answer_handshake(int client_socket, const std::string& request); // Validate the upgrade request, send the 101
 
-  bool decode_frame(const std::vector<uint8_t>& frame, std::string& payload); // Decode WebSocket frame
+  // Decode the frame at the front of frame: its size, 0 while incomplete, -1 if invalid
+  ssize_t decode_frame(const uint8_t* frame, size_t len, uint8_t& opcode, std::string& payload);
+  static constexpr uint64_t max_frame_size = 64u << 20;
   std::vector<uint8_t> encode_frame(const std::string& payload); // Encode WebSocket frame
+  void append_frame(std::string& out, const std::string& payload); // Same frame, appended to out
   bool is_valid_utf8(const std::string& str); // Validate UTF-8 encoding
   std::string sanitize_utf8(const std::string& str); // Sanitize UTF-8 strings
   std::string compute_accept_key(const std::string& sec_websocket_key);
@@ -67,11 +149,198 @@ public:
   virtual void on_message(int client_socket, const std::string& message); // Override for custom message handling
   virtual std::string process_data(const std::string& data); // Process data before sending
   std::unordered_set<int> closed_sockets_; 
-  std::mutex close_sockets_mutex_;
+  lock_stats::mutex close_sockets_mutex_;
 
-  std::mutex response_mutex_;
-  std::condition_variable response_cv_;
+  lock_stats::mutex response_mutex_;
+  lock_stats::condition_variable response_cv_;
   std::queue<std::string> response_queue_;
+  std::queue<uint64_t> response_ticks_; // arrival of each queued response (tracing::ticks()), 0 when not tracing
+  size_t max_pending_responses_ = 1024;
+  lock_stats::queue response_depth_;
+  // Every broadcast() is a request with an id, each agent answers its requests
+  // in order. A reply to a request whose receive_response() timed out (or that
+  // another agent answered first) is dropped instead of reaching the next
+  // caller; replies to no request at all go to response_queue_.
+  uint64_t next_request_ = 0;
+  std::unordered_map<int, std::deque<uint64_t>> awaiting_; // agent -> requests sent to it, oldest first
+  std::set<uint64_t> open_requests_;                        // waited for, not answered yet
+  std::map<uint64_t, std::pair<std::string, uint64_t>> answered_; // request -> (reply, arrival ticks)
+  std::unordered_map<uint64_t, lock_stats::condition_variable*> request_waiters_; // receive_response() in progress
+
+  // Ping interval and tunnel response deadlines, driven by handle_events()
+  struct ClientTimers {
+    timer_wheel::timer ping;
+    uint64_t last_seen_ms = 0;
+  };
+  timer_wheel timers_{100};
+  lock_stats::mutex timers_mutex_;
+  std::unordered_map<int, std::unique_ptr<ClientTimers>> client_timers_;
+  std::vector<int> expired_clients_;
+  int ping_interval_ms_ = 30000;
+  io_backend io_backend_ = io_backend::readiness;
+
+  // TLS sessions by socket. SSL objects are not thread safe, workers read while
+  // broadcast() writes, so every session has its own lock.
+  struct TlsSession {
+    SSL* ssl = nullptr;
+    bool ktls_send = false;
+    std::mutex mutex;
+    ~TlsSession() { if (ssl) SSL_free(ssl); }
+  };
+  std::shared_ptr<tls_context> tls_;
+  std::unordered_map<int, std::shared_ptr<TlsSession>> tls_sessions_;
+  lock_stats::mutex tls_mutex_;
+
+  // Agents between accept() and their upgrade, on the loop that accepted them
+  // (handle_events() or a shard): the TLS handshake if set_tls(), then the
+  // upgrade request, each step driven by the socket's readiness so a slow
+  // client never holds up the loop. 5 s for both, then it is closed.
+  struct AgentHello {
+    std::shared_ptr<TlsSession> tls; // until the TLS handshake is done
+    std::string request;             // upgrade request bytes so far
+    uint64_t deadline_ms = 0;
+  };
+  using AgentHellos = std::unordered_map<int, AgentHello>;
+  AgentHellos agent_hellos_; // handle_events() only
+
+  int hello_begin(int epoll_fd, AgentHellos& hellos, int client_socket); // Adds it to epoll_fd, then hello_step()
+  int hello_step(int epoll_fd, AgentHellos& hellos, int client_socket); // 1 upgraded, 0 not yet, -1 failed and closed
+  void hello_close(int epoll_fd, AgentHellos& hellos, int client_socket);
+  void hello_expire(int epoll_fd, AgentHellos& hellos); // closes the ones past their deadline
+  void add_agent(int client_socket); // upgraded on handle_events()'s loop
+  std::shared_ptr<TlsSession> tls_session(int client_socket);
+  ssize_t socket_recv(int client_socket, void* buffer, size_t len); // recv() or SSL_read()
+  ssize_t socket_send(int client_socket, const void* data, size_t len); // send() or SSL_write()
+
+  // Outgoing frames. Off the shards, every writer queues into the client's
+  // outbox and whoever finds it idle writes the whole queue with one writev(),
+  // frames queued meanwhile by other threads go out with the next one.
+  // Shards own their sockets and write once per loop iteration under batch_.
+  struct Outbox {
+    std::mutex mutex;
+    frame_batch frames;
+    bool flushing = false;
+  };
+  batch_config batch_;
+  socket_profile socket_profile_; // set_socket_profile(), every agent listener
+  std::string unix_path_;
+  int unix_fd_ = -1;              // set_unix_listener(), shared by every loop
+  std::unordered_map<int, std::shared_ptr<Outbox>> outboxes_;
+  lock_stats::mutex outbox_mutex_;
+
+  // Bytes of a frame not complete yet, per client. A socket has one reader at
+  // a time (the worker EPOLLONESHOT gave it to, or the io_uring thread), only
+  // the map is shared
+  std::unordered_map<int, std::shared_ptr<std::vector<uint8_t>>> read_buffers_;
+  lock_stats::mutex read_buffers_mutex_;
+
+  bool send_batch(int client_socket, frame_batch& batch, bool wait); // wait: poll for room instead of leaving a rest queued
+  static void set_nodelay(int client_socket);
+
+  // Sharded mode (ws_shards.cpp): one pinned thread per shard with its own
+  // SO_REUSEPORT listener, epoll loop, agents and timers; the worker pool is
+  // stopped. Requests enter and responses leave a shard through lock-free SPSC
+  // queues, one per (producer, tunnel shard) pair, so `from` must always be
+  // used by the same single thread and be below producer_count(): size
+  // producers to the proxy's shard count (its port count when not sharded).
+  // ApiProxy binds each of its loop threads, so a data handler calling
+  // broadcast() / receive_response() takes this path.
+  void set_shards(int count = 0, bool pin_threads = true, int producers = 0); // Before run(), 0 = one per usable CPU / per shard
+  int shard_count() const { return (int)shards_.size(); }
+  int producer_count() const { return (int)producers_.size(); }
+  bool shard_send(int from, const std::string& message); // false if no agent is connected, queues are full or from is out of range
+  std::string shard_receive(int from, int timeout_ms = -1); // Reply to from's last shard_send(), empty string on timeout
+  static void bind_producer(int from); // The calling thread's `from` for broadcast(), -1 = none
+  static thread_local int bound_producer_;
+
+  // A request and its reply carry the same id, numbered per producer
+  struct ShardMessage {
+    uint64_t request = 0;
+    std::string data;
+  };
+  struct Shard {
+    int index = 0;
+    int server_fd = -1;
+    int epoll_fd = -1;
+    std::unordered_set<int> clients;
+    std::vector<int> agents; // round robin order of clients
+    size_t next_agent = 0;
+    std::atomic<int> client_count{0};
+    timer_wheel timers{100};
+    std::unordered_map<int, std::unique_ptr<ClientTimers>> client_timers;
+    std::vector<int> expired;
+    struct Outgoing {
+      frame_batch frames;
+      bool blocked = false;  // socket full, waiting for EPOLLOUT
+      bool watching = false; // EPOLLOUT registered
+    };
+    std::unordered_map<int, Outgoing> outbox;
+    std::unordered_map<int, std::vector<uint8_t>> read_buffers; // see read_buffers_
+    AgentHellos hellos;
+    std::unordered_map<int, std::deque<std::pair<int, uint64_t>>> waiting; // agent -> (producer, request), oldest first
+    std::vector<std::unique_ptr<spsc_queue<ShardMessage>>> inbox; // [producer] -> this shard
+    wake_fd inbox_wake;
+  };
+  struct Producer {
+    std::vector<std::unique_ptr<spsc_queue<ShardMessage>>> responses; // [shard] -> this producer
+    wake_fd wake;
+    uint64_t last_request = 0; // owner thread only, older replies timed out
+  };
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<std::unique_ptr<Producer>> producers_;
+  bool pin_shards_ = true;
+  static thread_local Shard* local_shard_;
+
+  void run_shards();
+  void run_shard(Shard& shard);
+  void shard_accept(Shard& shard, int listen_fd);
+  void shard_add_agent(Shard& shard, int client_socket); // upgraded
+  void shard_close(Shard& shard, int client_socket);
+  void shard_write(Shard& shard, int client_socket, const std::string& message);
+  uint64_t shard_flush(Shard& shard); // Writes due outboxes, microseconds until the next one is due (0 = none waiting)
+  bool shard_route_response(Shard& shard, int client_socket, const std::string& message);
+
+  // Same-host agents over shared memory (ws_local.cpp, util/shm_ring.h). A
+  // local agent is a client like any other: its session socket is its id in
+  // connected_clients_, broadcast() and the message handlers, only the bytes
+  // travel through the rings. Epoll backend, not in sharded mode
+  void set_local_agents(const std::string& path, size_t ring_capacity = shm::default_capacity); // Before run()
+
+  struct LocalAgent {
+    std::unique_ptr<shm::channel> channel;
+    std::mutex send_mutex; // one producer per ring, writers take turns
+    std::deque<std::string> backlog; // under send_mutex: messages the ring had no room for, oldest first
+    std::atomic<size_t> backlog_bytes{0}; // written under send_mutex
+    std::condition_variable room;    // the backlog shrank
+  };
+  struct LocalHello {
+    std::string request; // handshake bytes so far
+    uint64_t deadline_ms;
+  };
+  std::string local_path_;
+  size_t local_capacity_ = shm::default_capacity;
+  int local_fd_ = -1;
+  std::unordered_map<int, std::shared_ptr<LocalAgent>> local_agents_; // by session socket
+  std::unordered_map<int, int> local_wakes_; // wake eventfd -> session socket
+  std::unordered_map<int, LocalHello> local_hellos_; // event loop only: session sockets still in the handshake
+  lock_stats::mutex local_mutex_;
+
+  bool setup_local_listener(); // AF_UNIX listener on local_path_, added to epoll_fd_
+  void local_accept();
+  bool local_hello(int fd); // false if fd is no session socket in the handshake
+  void local_expire(); // closes handshakes past their deadline
+  bool local_handshake(int session_socket, const std::string& request);
+  bool local_send(LocalAgent& local, std::unique_lock<std::mutex>& lock, std::string message); // lock holds send_mutex
+  void local_flush(LocalAgent& local); // under send_mutex
+  bool local_wake(int fd); // false if fd is no local agent's eventfd
+  std::shared_ptr<LocalAgent> local_agent(int client_socket);
+  void remove_local_agent(int client_socket);
+  void deliver_message(int client_socket, std::string& payload); // UTF-8 check, then the message handler
+
+  void add_client_timers(int client_socket);
+  void arm_ping(timer_wheel& timers, ClientTimers& state, int client_socket, std::vector<int>& expired);
+  void run_timers(); // Fire due timers, close clients that missed their pongs
+  void send_ping(int client_socket);
 
 protected:
 
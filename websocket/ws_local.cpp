@@ -0,0 +1,219 @@
+#include "ws.hpp"
+#include "../util/logger.h"
+
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+void WebSocketServer::set_local_agents(const std::string& path, size_t ring_capacity) {
+  local_path_ = path;
+  local_capacity_ = ring_capacity;
+}
+
+bool WebSocketServer::setup_local_listener() {
+  int fd = unix_socket::bind_to(local_path_);
+  if (fd < 0) return false;
+  if (listen(fd, SOMAXCONN) < 0) {
+    logger::error("Failed to listen on " + local_path_ + ": " + strerror(errno), __func__);
+    close(fd);
+    return false;
+  }
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+    logger::error("Failed to add local agent socket to epoll", __func__);
+    close(fd);
+    return false;
+  }
+  local_fd_ = fd;
+  logger::info("Local agents on " + local_path_, __func__);
+  return true;
+}
+
+// The handshake is read by the event loop as it arrives (local_hello()), a
+// slow or silent agent holds up nobody
+void WebSocketServer::local_accept() {
+  int session_socket = accept4(local_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (session_socket < 0) return;
+  {
+    std::lock_guard<lock_stats::mutex> lock(close_sockets_mutex_);
+    closed_sockets_.erase(session_socket);
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = session_socket;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, session_socket, &event) < 0) {
+    close(session_socket);
+    return;
+  }
+  local_hellos_[session_socket] = {std::string(), timer_wheel::now_ms() + 5000};
+}
+
+bool WebSocketServer::local_hello(int fd) {
+  auto it = local_hellos_.find(fd);
+  if (it == local_hellos_.end()) return false;
+  std::string& request = it->second.request;
+  char buffer[2048];
+  ssize_t len = 0;
+  while (request.size() < sizeof(buffer) && (len = recv(fd, buffer, sizeof(buffer), 0)) > 0) request.append(buffer, len);
+  bool done = request.find("\r\n\r\n") != std::string::npos;
+  if (!done && request.size() < sizeof(buffer) && len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+
+  std::string hello = std::move(request);
+  local_hellos_.erase(it);
+  if (!done) {
+    logger::error(hello.size() >= sizeof(buffer) ? "Local agent handshake too long" : "Local agent left during the handshake", __func__);
+  } else if (local_handshake(fd, hello)) {
+    return true;
+  }
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  return true;
+}
+
+void WebSocketServer::local_expire() {
+  uint64_t now = timer_wheel::now_ms();
+  for (auto it = local_hellos_.begin(); it != local_hellos_.end();) {
+    if (now < it->second.deadline_ms) {
+      ++it;
+      continue;
+    }
+    logger::error("Timeout waiting for local agent handshake", __func__);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->first, nullptr);
+    close(it->first);
+    it = local_hellos_.erase(it);
+  }
+}
+
+// A complete handshake: the rings are set up and handed over
+bool WebSocketServer::local_handshake(int session_socket, const std::string& request) {
+  if (request.compare(0, shm::hello.size(), shm::hello) != 0) {
+    logger::error("Not a local agent handshake", __func__);
+    return false;
+  }
+  if (custom_handshake_validator_ && !custom_handshake_validator_(request)) {
+    logger::error("Custom handshake validation failed", __func__);
+    return false;
+  }
+
+  auto local = std::make_shared<LocalAgent>();
+  local->channel = shm::channel::create(local_capacity_);
+  if (!local->channel) {
+    logger::error("Failed to set up shared memory for a local agent: " + std::string(strerror(errno)), __func__);
+    return false;
+  }
+  int fds[3] = {local->channel->memfd(), local->channel->peer_wake_in(), local->channel->peer_wake_out()};
+  if (!shm::send_fds(session_socket, "OK\r\n", fds, 3)) {
+    logger::error("Failed to hand shared memory to local agent: " + std::string(strerror(errno)), __func__);
+    return false;
+  }
+
+  int wake = local->channel->wake_fd();
+  {
+    std::lock_guard<lock_stats::mutex> lock(local_mutex_);
+    local_agents_[session_socket] = local;
+    local_wakes_[wake] = session_socket;
+  }
+  // The session socket only reports the agent going away (a read of 0 closes it)
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.fd = session_socket;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, session_socket, &event);
+  event.events = EPOLLIN;
+  event.data.fd = wake;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake, &event);
+  local->channel->arm();
+
+  {
+    std::lock_guard<lock_stats::mutex> lock(connected_clients_mutex_);
+    connected_clients_.insert(session_socket);
+  }
+  logger::info("Local agent connected (fd: " + std::to_string(session_socket) + ")", __func__);
+  return true;
+}
+
+// A full ring queues the message, local_wake() sends it once the agent made
+// room. Past a ring's worth of backlog the writer waits for the agent, as
+// send_batch() does for a socket, flushing itself in case it is the event loop;
+// false after 5 s of that
+bool WebSocketServer::local_send(LocalAgent& local, std::unique_lock<std::mutex>& lock, std::string message) {
+  if (local.backlog.empty() && local.channel->send(message)) return true;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (local.backlog_bytes && local.backlog_bytes + message.size() > local_capacity_) {
+    local_flush(local);
+    if (local.backlog_bytes + message.size() <= local_capacity_) break;
+    if (std::chrono::steady_clock::now() >= deadline) return false;
+    local.room.wait_for(lock, std::chrono::milliseconds(1));
+  }
+  local.backlog_bytes += message.size();
+  local.backlog.push_back(std::move(message));
+  local_flush(local);
+  return true;
+}
+
+void WebSocketServer::local_flush(LocalAgent& local) {
+  shm::channel& channel = *local.channel;
+  while (!local.backlog.empty()) {
+    const std::string& message = local.backlog.front();
+    if (!channel.send(message) && !(channel.wait_room(message.size()) && channel.send(message))) return;
+    local.backlog_bytes -= message.size();
+    local.backlog.pop_front();
+    local.room.notify_all();
+  }
+}
+
+// Drains the agent's ring on the event loop thread, so handlers must not block
+// (as with the io_uring backend)
+bool WebSocketServer::local_wake(int fd) {
+  int session_socket;
+  std::shared_ptr<LocalAgent> local;
+  {
+    std::lock_guard<lock_stats::mutex> lock(local_mutex_);
+    auto wake = local_wakes_.find(fd);
+    if (wake == local_wakes_.end()) return false;
+    session_socket = wake->second;
+    auto it = local_agents_.find(session_socket);
+    if (it == local_agents_.end()) return true;
+    local = it->second;
+  }
+
+  shm::channel& channel = *local->channel;
+  channel.drain_wake();
+  if (local->backlog_bytes.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(local->send_mutex);
+    local_flush(*local);
+  }
+  std::string payload;
+  do {
+    while (channel.receive(payload)) {
+      if (!payload.empty()) deliver_message(session_socket, payload);
+    }
+  } while (!channel.arm());
+  return true;
+}
+
+std::shared_ptr<WebSocketServer::LocalAgent> WebSocketServer::local_agent(int client_socket) {
+  std::lock_guard<lock_stats::mutex> lock(local_mutex_);
+  auto it = local_agents_.find(client_socket);
+  return it == local_agents_.end() ? nullptr : it->second;
+}
+
+void WebSocketServer::remove_local_agent(int client_socket) {
+  std::shared_ptr<LocalAgent> local;
+  {
+    std::lock_guard<lock_stats::mutex> lock(local_mutex_);
+    auto it = local_agents_.find(client_socket);
+    if (it == local_agents_.end()) return;
+    local = it->second;
+    local_wakes_.erase(local->channel->wake_fd());
+    local_agents_.erase(it);
+  }
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, local->channel->wake_fd(), nullptr);
+  logger::info("Local agent disconnected (fd: " + std::to_string(client_socket) + ")", __func__);
+}
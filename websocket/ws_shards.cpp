@@ -0,0 +1,327 @@
+#include "ws.hpp"
+#include "../util/logger.h"
+#include "../util/affinity.h"
+
+#include <poll.h>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+thread_local WebSocketServer::Shard* WebSocketServer::local_shard_ = nullptr;
+thread_local int WebSocketServer::bound_producer_ = -1;
+
+void WebSocketServer::bind_producer(int from) {
+  bound_producer_ = from;
+}
+
+void WebSocketServer::set_shards(int count, bool pin_threads, int producers) {
+  if (count <= 0) count = (int)affinity::usable_cpus().size();
+  if (producers <= 0) producers = count;
+  pin_shards_ = pin_threads;
+
+  shards_.clear();
+  producers_.clear();
+  for (int i = 0; i < count; ++i) {
+    auto shard = std::make_unique<Shard>();
+    shard->index = i;
+    for (int j = 0; j < producers; ++j)
+      shard->inbox.push_back(std::make_unique<spsc_queue<ShardMessage>>(4096));
+    shards_.push_back(std::move(shard));
+  }
+  for (int j = 0; j < producers; ++j) {
+    auto producer = std::make_unique<Producer>();
+    for (int i = 0; i < count; ++i)
+      producer->responses.push_back(std::make_unique<spsc_queue<ShardMessage>>(4096));
+    producers_.push_back(std::move(producer));
+  }
+
+  // The shards read their own agents: the worker pool leaves
+  {
+    std::lock_guard<lock_stats::mutex> lock(queue_mutex_);
+    pool_closed_ = true;
+  }
+  task_cv_.notify_all();
+  std::vector<std::thread> workers;
+  {
+    std::lock_guard<lock_stats::mutex> lock(pool_mutex_);
+    workers.swap(thread_pool_);
+  }
+  for (auto& worker : workers) worker.join();
+  std::lock_guard<lock_stats::mutex> lock(pool_mutex_);
+  retired_workers_.clear();
+}
+
+void WebSocketServer::run_shards() {
+  std::vector<int> cpus = affinity::usable_cpus();
+  std::vector<std::thread> threads;
+  if (unix_fd_ >= 0 && !socket_profile_.listen_on(unix_fd_)) {
+    logger::error("Failed to listen on " + unix_path_, __func__);
+    close(unix_fd_);
+    unix_fd_ = -1;
+  }
+  for (auto& shard : shards_) {
+    shard->server_fd = create_listener();
+    if (shard->server_fd < 0) continue;
+    threads.emplace_back(&WebSocketServer::run_shard, this, std::ref(*shard));
+    if (pin_shards_) affinity::pin_thread(threads.back(), cpus[shard->index % cpus.size()]);
+  }
+  logger::info("WebSocket server is running with " + std::to_string(threads.size()) + " shards", __func__);
+  for (auto& thread : threads) thread.join();
+}
+
+void WebSocketServer::run_shard(Shard& shard) {
+  local_shard_ = &shard;
+  shard.epoll_fd = epoll_create1(0);
+  if (shard.epoll_fd < 0) {
+    logger::error("Failed to create epoll instance for shard " + std::to_string(shard.index), __func__);
+    return;
+  }
+  fcntl(shard.server_fd, F_SETFL, O_NONBLOCK);
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = shard.server_fd;
+  epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, shard.server_fd, &event);
+  event.data.fd = shard.inbox_wake.fd();
+  epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, shard.inbox_wake.fd(), &event);
+  if (unix_fd_ >= 0) { // one socket for all shards, non-blocking
+    event.data.fd = unix_fd_;
+    epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, unix_fd_, &event);
+  }
+
+  struct epoll_event events[64];
+  uint64_t batch_wait_us = 0;
+  while (running_) {
+    // A batch held back for company wakes the loop when it is due
+    int num_events;
+    if (batch_wait_us > 0 && batch_wait_us < (uint64_t)shard.timers.tick_ms() * 1000)
+      num_events = epoll_wait_us(shard.epoll_fd, events, 64, batch_wait_us);
+    else
+      num_events = epoll_wait(shard.epoll_fd, events, 64, shard.timers.tick_ms());
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      logger::error("epoll_wait failed: " + std::string(strerror(errno)), __func__);
+      break;
+    }
+
+    for (int i = 0; i < num_events; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == shard.server_fd || fd == unix_fd_) {
+        shard_accept(shard, fd);
+      } else if (!shard.hellos.empty() && shard.hellos.count(fd)) {
+        if (hello_step(shard.epoll_fd, shard.hellos, fd) == 1) shard_add_agent(shard, fd);
+      } else if (fd == shard.inbox_wake.fd()) {
+        shard.inbox_wake.drain();
+        for (size_t from = 0; from < shard.inbox.size(); ++from) {
+          ShardMessage message;
+          while (shard.inbox[from]->pop(message)) {
+            if (shard.agents.empty()) {
+              logger::warn("Dropping request, no agent left on shard " + std::to_string(shard.index), __func__);
+              continue;
+            }
+            int agent = shard.agents[shard.next_agent++ % shard.agents.size()];
+            shard.waiting[agent].emplace_back((int)from, message.request);
+            shard_write(shard, agent, message.data);
+          }
+        }
+      } else if (shard.clients.count(fd)) {
+        if (events[i].events & EPOLLOUT) {
+          auto out = shard.outbox.find(fd);
+          if (out != shard.outbox.end()) out->second.blocked = false; // written below with the rest
+        }
+        if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) continue;
+        std::vector<uint8_t> buffer(4096);
+        ssize_t bytes_read = socket_recv(fd, buffer.data(), buffer.size());
+        if (bytes_read <= 0) {
+          if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+          shard_close(shard, fd);
+          continue;
+        }
+        handle_client_frame(fd, buffer.data(), bytes_read);
+      }
+    }
+
+    shard.timers.advance();
+    if (!shard.hellos.empty()) hello_expire(shard.epoll_fd, shard.hellos);
+    batch_wait_us = shard_flush(shard);
+    std::vector<int> expired;
+    expired.swap(shard.expired);
+    for (int client_socket : expired) {
+      logger::warn("Ping timeout (fd: " + std::to_string(client_socket) + ")", __func__);
+      shard_close(shard, client_socket);
+    }
+  }
+
+  std::vector<int> remaining(shard.clients.begin(), shard.clients.end());
+  for (int client_socket : remaining) shard_close(shard, client_socket);
+  while (!shard.hellos.empty()) hello_close(shard.epoll_fd, shard.hellos, shard.hellos.begin()->first);
+  close(shard.epoll_fd);
+  close(shard.server_fd);
+  local_shard_ = nullptr;
+}
+
+void WebSocketServer::shard_accept(Shard& shard, int listen_fd) {
+  int client_socket = accept(listen_fd, nullptr, nullptr);
+  if (client_socket < 0) return;
+  fcntl(client_socket, F_SETFL, O_NONBLOCK);
+  set_nodelay(client_socket);
+
+  if (hello_begin(shard.epoll_fd, shard.hellos, client_socket) == 1) shard_add_agent(shard, client_socket);
+}
+
+// Already in shard.epoll_fd for EPOLLIN since hello_begin()
+void WebSocketServer::shard_add_agent(Shard& shard, int client_socket) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = client_socket;
+  epoll_ctl(shard.epoll_fd, EPOLL_CTL_MOD, client_socket, &event);
+  shard.clients.insert(client_socket);
+  shard.agents.push_back(client_socket);
+  shard.client_count.store((int)shard.clients.size(), std::memory_order_release);
+
+  auto state = std::make_unique<ClientTimers>();
+  arm_ping(shard.timers, *state, client_socket, shard.expired);
+  shard.client_timers[client_socket] = std::move(state);
+  logger::info("Agent connected to shard " + std::to_string(shard.index) + " (fd: " + std::to_string(client_socket) + ")", __func__);
+}
+
+void WebSocketServer::shard_close(Shard& shard, int client_socket) {
+  if (!shard.clients.erase(client_socket)) return;
+  shard.agents.erase(std::remove(shard.agents.begin(), shard.agents.end(), client_socket), shard.agents.end());
+  shard.client_count.store((int)shard.clients.size(), std::memory_order_release);
+  shard.client_timers.erase(client_socket);
+  shard.outbox.erase(client_socket);
+  shard.read_buffers.erase(client_socket);
+  // Requests still waiting on this agent time out in shard_receive()
+  shard.waiting.erase(client_socket);
+
+  epoll_ctl(shard.epoll_fd, EPOLL_CTL_DEL, client_socket, nullptr);
+  std::shared_ptr<TlsSession> session;
+  {
+    std::lock_guard<lock_stats::mutex> lock(tls_mutex_);
+    auto it = tls_sessions_.find(client_socket);
+    if (it != tls_sessions_.end()) {
+      session = it->second;
+      tls_sessions_.erase(it);
+    }
+  }
+  if (session) SSL_shutdown(session->ssl);
+  shutdown(client_socket, SHUT_RDWR);
+  close(client_socket);
+  logger::info("Closed connection (fd: " + std::to_string(client_socket) + ")", __func__);
+}
+
+void WebSocketServer::shard_write(Shard& shard, int client_socket, const std::string& message) {
+  if (!write_frame(client_socket, 0x81, process_data(message))) {
+    logger::error("Failed to send WebSocket frame to client (fd: " + std::to_string(client_socket) + "): " + std::string(strerror(errno)), __func__);
+    shard_close(shard, client_socket);
+  }
+}
+
+/*
+#### Batched writes
+- Frames queued during an iteration (requests from the inbox, pings) go out
+  together at its end, one writev() per agent instead of one send() per frame
+- With batch_.max_delay_us a batch may wait across iterations for more frames,
+  until it reaches batch_.max_bytes or its oldest frame has waited that long
+- A full socket keeps the rest queued and the agent on EPOLLOUT until it drains
+*/
+uint64_t WebSocketServer::shard_flush(Shard& shard) {
+  uint64_t now = frame_batch::now_us(), wait_us = 0;
+  std::vector<int> failed;
+  for (auto& entry : shard.outbox) {
+    Shard::Outgoing& out = entry.second;
+    if (out.blocked || out.frames.empty()) continue;
+    if (!out.frames.due(batch_, now)) {
+      uint64_t due_in = out.frames.wait_us(batch_, now);
+      if (wait_us == 0 || due_in < wait_us) wait_us = due_in;
+      continue;
+    }
+    if (!send_batch(entry.first, out.frames, false)) {
+      failed.push_back(entry.first);
+      continue;
+    }
+    out.blocked = !out.frames.empty();
+    if (out.blocked == out.watching) continue;
+    struct epoll_event event = {};
+    event.events = EPOLLIN | (out.blocked ? EPOLLOUT : 0);
+    event.data.fd = entry.first;
+    epoll_ctl(shard.epoll_fd, EPOLL_CTL_MOD, entry.first, &event);
+    out.watching = out.blocked;
+  }
+  for (int client_socket : failed) {
+    logger::error("Failed to send WebSocket frames to client (fd: " + std::to_string(client_socket) + "): " + std::string(strerror(errno)), __func__);
+    shard_close(shard, client_socket);
+  }
+  return wait_us;
+}
+
+// Hands an agent's message back to the oldest producer waiting on that agent
+bool WebSocketServer::shard_route_response(Shard& shard, int client_socket, const std::string& message) {
+  auto it = shard.waiting.find(client_socket);
+  if (it == shard.waiting.end() || it->second.empty()) return false;
+  auto [from, request] = it->second.front();
+  it->second.pop_front();
+
+  Producer& producer = *producers_[from];
+  if (!producer.responses[shard.index]->push({request, message})) {
+    logger::warn("Response queue full for producer " + std::to_string(from), __func__);
+    return true;
+  }
+  producer.wake.notify();
+  return true;
+}
+
+bool WebSocketServer::shard_send(int from, const std::string& message) {
+  if (shards_.empty()) return false;
+  if (from < 0 || from >= (int)producers_.size()) {
+    logger::error("Producer " + std::to_string(from) + " out of range, set_shards() has " +
+      std::to_string(producers_.size()), __func__);
+    return false;
+  }
+  Producer& producer = *producers_[from];
+  size_t count = shards_.size();
+
+  // Same core first, then the next shard that has an agent
+  for (size_t k = 0; k < count; ++k) {
+    Shard& shard = *shards_[(from + k) % count];
+    if (shard.client_count.load(std::memory_order_acquire) == 0) continue;
+    if (!shard.inbox[from]->push({producer.last_request + 1, message})) return false;
+    ++producer.last_request;
+    shard.inbox_wake.notify();
+    if (request_trace* trace = tracing::current()) trace->mark(tracing::sent);
+    return true;
+  }
+  return false;
+}
+
+std::string WebSocketServer::shard_receive(int from, int timeout_ms) {
+  if (from < 0 || from >= (int)producers_.size()) return "";
+  Producer& producer = *producers_[from];
+  uint64_t deadline = timer_wheel::now_ms() + (timeout_ms < 0 ? 0 : timeout_ms);
+
+  while (true) {
+    ShardMessage reply;
+    for (auto& queue : producer.responses) {
+      while (queue->pop(reply)) {
+        if (reply.request != producer.last_request) continue; // its request timed out earlier
+        if (request_trace* trace = tracing::current()) trace->mark(tracing::received);
+        return std::move(reply.data);
+      }
+    }
+
+    int wait_ms = -1;
+    if (timeout_ms >= 0) {
+      uint64_t now = timer_wheel::now_ms();
+      if (now >= deadline) break;
+      wait_ms = (int)(deadline - now);
+    }
+    struct pollfd pfd = {producer.wake.fd(), POLLIN, 0};
+    if (poll(&pfd, 1, wait_ms) > 0) producer.wake.drain();
+  }
+
+  logger::warn("Timed out waiting for response from WebSocket client", __func__);
+  return "";
+}